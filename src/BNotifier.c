@@ -312,14 +312,19 @@ main(int argc, char *argv[])
 int
 PollDB()
 {
-        FILE *fd;
+        job_registry_recnum_t cursor;
         job_registry_entry *en;
+        const job_registry_entry *men;
 	job_registry_handle *rha;
-	job_registry_handle *rhc;
 	char *buffer=NULL;
 	char *finalbuffer=NULL;
         char *cdate=NULL;
 	time_t now;
+	time_t oldest_notif;
+	job_registry_changes_cursor changes_cursor;
+	int changes_ok=FALSE;
+	int use_changes;
+	time_t polled_notiftime[MAX_CONNECTIONS];
         int  maxtok,i,maxtokl,j;
         char **tbuf;
         char **lbuf;
@@ -331,11 +336,22 @@ PollDB()
 	int to_sleep=FALSE;
 	int skip_reg_open=FALSE;
 	
+	memset(&changes_cursor, 0, sizeof(changes_cursor));
+	for(i=0; i<MAX_CONNECTIONS; i++) polled_notiftime[i]=-1;
+
 	rha=job_registry_init(registry_file, BY_BATCH_ID);
 	if (rha == NULL){
 		do_log(debuglogfile, debug, 1, "%s: Error initialising job registry %s\n",argv0,registry_file);
 		fprintf(stderr,"%s: Error initialising job registry %s :",argv0,registry_file);
 		perror("");
+	}else if(job_registry_watch(rha)){
+		do_log(debuglogfile, debug, 2, "%s: Waiting for registry changes with inotify\n",argv0);
+	}else{
+		do_log(debuglogfile, debug, 2, "%s: Polling registry for changes every %d ms\n",argv0,JOB_REGISTRY_WATCH_POLL_MS);
+	}
+	/* Job list requests look jobs up by user prefix: index that as well */
+	if (rha != NULL && job_registry_persist_index(rha, BY_USER_PREFIX) < 0){
+		do_log(debuglogfile, debug, 1, "%s: Error indexing job registry %s by user prefix\n",argv0,registry_file);
 	}
 	
 	for(;;){
@@ -353,16 +369,10 @@ PollDB()
 			
 			if(connections[i].startnotifyjob){
 				to_sleep=FALSE;
-				rhc=job_registry_init(registry_file, BY_USER_PREFIX);
-				if (rhc == NULL){
-					do_log(debuglogfile, debug, 1, "%s: Error initialising job registry %s\n",argv0,registry_file);
-					fprintf(stderr,"%s: Error initialising job registry %s :",argv0,registry_file);
-		 	   	  	perror("");
-		 	   	}
 		 	   	do_log(debuglogfile, debug, 2, "%s:Job list for notification:%s\n",argv0,connections[i].joblist_string);
 		 	   	maxtok=strtoken(connections[i].joblist_string,',',&tbuf);
    		 	   	for(j=0;j<maxtok;j++){
-        	 	   	  	if ((en=job_registry_get(rhc, tbuf[j])) != NULL){
+        	 	   	  	if ((en=job_registry_get_by(rha, BY_USER_PREFIX, tbuf[j])) != NULL){
 						buffer=ComposeClassad(en);
 		 	   	  	}else{
 		 	   	  		cdate=iepoch2str(now);
@@ -407,7 +417,6 @@ PollDB()
 		 	   	  	free(connections[i].finalbuffer);
 		 	   	  	connections[i].finalbuffer=NULL;
 		 	   	}
-		 	   	job_registry_destroy(rhc);
 			}
 			if(connections[i].firstnotify && connections[i].sentendonce){
 				to_sleep=FALSE;
@@ -439,37 +448,51 @@ PollDB()
 		}
 		if(skip_reg_open){
 			do_log(debuglogfile, debug, 3, "Skip registry opening: mtime:%d lastn:%d\n",sbuf.st_mtime,connections[i].lastnotiftime);
-			sleep(loop_interval);
+			WaitRegistryChange(rha);
 			continue;
 		}
 		
 		do_log(debuglogfile, debug, 3, "Normal registry opening\n");
 
-		fd = job_registry_open(rha, "r");
-		if (fd == NULL)
+		if (job_registry_persist(rha) < 0)
 		{
-			do_log(debuglogfile, debug, 1, "%s: Error opening job registry %s\n",argv0,registry_file);
-			fprintf(stderr,"%s: Error opening job registry %s :",argv0,registry_file);
+			do_log(debuglogfile, debug, 1, "%s: Error mapping job registry %s\n",argv0,registry_file);
+			fprintf(stderr,"%s: Error mapping job registry %s :",argv0,registry_file);
 			perror("");
 			sleep(loop_interval);
 			continue;
 		}
-		if (job_registry_rdlock(rha, fd) < 0)
-		{
-			do_log(debuglogfile, debug, 1, "%s: Error read locking registry %s\n",argv0,registry_file);
-			fprintf(stderr,"%s: Error read locking registry %s :",argv0,registry_file);
-			perror("");
-			sleep(loop_interval);
-			continue;
+		/* Segments with no changes since the oldest notification are skipped */
+		oldest_notif=now;
+		for(i=0; i<MAX_CONNECTIONS; i++){
+			if(connections[i].creamfilter==NULL) continue;
+			if(connections[i].lastnotiftime<oldest_notif) oldest_notif=connections[i].lastnotiftime;
+		}
+
+		/* The change journal lists the records written since the previous */
+		/* poll. Only those need checking, unless a connection was started */
+		/* or failed to get its notifications since then. */
+		rc=job_registry_changes_since(rha, &changes_cursor, now);
+		use_changes=(rc>=0 && changes_ok);
+		for(i=0; i<MAX_CONNECTIONS; i++){
+			if(connections[i].creamfilter==NULL){
+				polled_notiftime[i]=-1;
+				continue;
+			}
+			if(polled_notiftime[i]!=connections[i].lastnotiftime) use_changes=FALSE;
 		}
-		while ((en = job_registry_get_next(rha, fd)) != NULL)
+		changes_ok=(rc>=0 || rc==JOB_REGISTRY_CHANGES_RESET);
+		do_log(debuglogfile, debug, 3, "Registry changes since last poll: %d (%s)\n",rc,use_changes?"used":"full scan");
+
+		cursor = 0;
+		while ((men = (use_changes ? job_registry_get_next_changed(rha, &cursor) : job_registry_get_next_mapped_since(rha, &cursor, oldest_notif))) != NULL)
 		{
 		
 			for(i=0; i<MAX_CONNECTIONS; i++){
 				if(connections[i].creamfilter==NULL) continue;
-				if(en->mdate >= connections[i].lastnotiftime && en->mdate < now && en->user_prefix && strstr(en->user_prefix,connections[i].creamfilter)!=NULL && strlen(en->updater_info)>0)
+				if(men->mdate >= connections[i].lastnotiftime && men->mdate < now && men->user_prefix && strstr(men->user_prefix,connections[i].creamfilter)!=NULL && strlen(men->updater_info)>0)
 				{
-					buffer=ComposeClassad(en);
+					buffer=ComposeClassad(men);
 					len=strlen(buffer);
 					if(connections[i].finalbuffer != NULL){
 						flen=strlen(connections[i].finalbuffer);
@@ -487,7 +510,6 @@ PollDB()
 					free(buffer);
 				}
 			}
-			free(en);
 		}
 
 		for(i=0; i<MAX_CONNECTIONS; i++){
@@ -495,15 +517,19 @@ PollDB()
 				if(NotifyCream(connections[i].finalbuffer,&connections[i])!=-1){
 	        			/* change last notification time */
 					connections[i].lastnotiftime=now;
+					polled_notiftime[i]=now;
+				}else{
+					/* Resend with a full scan next time */
+					polled_notiftime[i]=-1;
 				}
 				free(connections[i].finalbuffer);
 				connections[i].finalbuffer=NULL;
+			}else if(connections[i].creamfilter!=NULL){
+				polled_notiftime[i]=connections[i].lastnotiftime;
 			}
 		}
 		
-		fclose(fd);
-		
-		sleep(loop_interval);
+		WaitRegistryChange(rha);
 	}
                 
 	job_registry_destroy(rha);
@@ -511,8 +537,28 @@ PollDB()
 	return 0;
 }
 
+void
+WaitRegistryChange(job_registry_handle *rha)
+{
+/*
+Wait for the registry to change, for at most loop_interval seconds.
+Records are notified when their mdate is in the past, so after a
+change the current second is let to end.
+*/
+	struct timeval tv;
+
+	if(rha == NULL){
+		sleep(loop_interval);
+		return;
+	}
+	if(job_registry_wait_change(rha, JOB_REGISTRY_WATCH_UPDATE|JOB_REGISTRY_WATCH_APPEND|JOB_REGISTRY_WATCH_REPLACE, loop_interval*1000) > 0){
+		gettimeofday(&tv, NULL);
+		usleep(1000000-tv.tv_usec);
+	}
+}
+
 char *
-ComposeClassad(job_registry_entry *en)
+ComposeClassad(const job_registry_entry *en)
 {
 
 	char *strudate=NULL;
@@ -24,6 +24,8 @@
 
 #include "acconfig.h"
 
+#include <sys/time.h>
+
 #include "job_registry.h"
 #include "Bfunctions.h"
 #include "config.h"
@@ -57,7 +59,8 @@ typedef struct creamConnection {
 /*  Function declarations  */
 
 int PollDB();
-char *ComposeClassad(job_registry_entry *en);
+void WaitRegistryChange(job_registry_handle *rha);
+char *ComposeClassad(const job_registry_entry *en);
 int NotifyStart(char *buffer, time_t *lastnotiftime);
 int GetVersion(const int conn_c);
 int GetFilter(char *buffer, const int conn_c, char **creamfilter);
@@ -26,10 +26,11 @@
 
 int main(int argc, char *argv[]){
 
-	FILE *fd;
-	job_registry_entry *en;
+	job_registry_recnum_t cursor;
+	const job_registry_entry *en;
 	time_t now;
 	time_t purge_time=0;
+	job_registry_purge_stats purge_stats;
 	time_t last_consistency_check=0;
 	char *constraint=NULL;
 	char *tconstraint=NULL;
@@ -327,12 +328,13 @@ int main(int argc, char *argv[]){
 		/* Purge old entries from registry */
 		now=time(0);
 		if(now - purge_time > 86400){
-			if(job_registry_purge(registry_file, now-purge_interval,0)<0){
+			if(job_registry_purge_online(registry_file, now-purge_interval,&purge_stats)<0){
 				do_log(debuglogfile, debug, 1, "%s: Error purging job registry %s\n",argv0,registry_file);
                         	fprintf(stderr,"%s: Error purging job registry %s :",argv0,registry_file);
                         	perror("");
 
 			}else{
+				do_log(debuglogfile, debug, 2, "%s: Purged %u of %u registry entries in %g s, write lock held for %g s\n",argv0,purge_stats.n_purged,purge_stats.n_scanned,purge_stats.copy_seconds,purge_stats.pause_seconds);
 				purge_time=time(0);
 			}
 		}	       
@@ -350,29 +352,19 @@ int main(int argc, char *argv[]){
 
 		IntStateQuery();
 		
-		fd = job_registry_open(rha, "r");
-		if (fd == NULL)
+		if (job_registry_persist(rha) < 0)
 		{
-			do_log(debuglogfile, debug, 1, "%s: Error opening job registry %s\n",argv0,registry_file);
-			fprintf(stderr,"%s: Error opening job registry %s :",argv0,registry_file);
+			do_log(debuglogfile, debug, 1, "%s: Error mapping job registry %s\n",argv0,registry_file);
+			fprintf(stderr,"%s: Error mapping job registry %s :",argv0,registry_file);
 			perror("");
 			sleep(loop_interval);
 			continue;
 		}
-		if (job_registry_rdlock(rha, fd) < 0)
-		{
-			do_log(debuglogfile, debug, 1, "%s: Error read locking job registry %s\n",argv0,registry_file);
-			fprintf(stderr,"%s: Error read locking job registry %s :",argv0,registry_file);
-			perror("");
-			sleep(loop_interval);
-			continue;
-		}
-		job_registry_firstrec(rha,fd);
-		fseek(fd,0L,SEEK_SET);
+		cursor = 0;
 
 		first=TRUE;
 		
-		while ((en = job_registry_get_next(rha, fd)) != NULL){
+		while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL){
 
 			if(en->status!=REMOVED && en->status!=COMPLETED){
 			
@@ -384,7 +376,6 @@ int main(int argc, char *argv[]){
 				/* Assign Status=4 and ExitStatus=999 to all entries that after alldone_interval are still not in a final state(3 or 4)*/
 				if(now-confirm_time>alldone_interval){
 					AssignFinalState(en->batch_id);	
-					free(en);
 					continue;
 				}
 				
@@ -427,7 +418,6 @@ int main(int argc, char *argv[]){
 					runfinal=TRUE;
 				}
 			}
-			free(en);
 		}
 		
 		if(runfinal){
@@ -438,8 +428,11 @@ int main(int argc, char *argv[]){
 			free(query);
 			query = NULL;
 		}
-		fclose(fd);		
-		sleep(loop_interval);
+		/* Wake up early when new jobs are registered, querying */
+		/* the batch system at most once a second. */
+		if(job_registry_wait_change(rha, JOB_REGISTRY_WATCH_APPEND|JOB_REGISTRY_WATCH_NPU, loop_interval*1000) > 0){
+			sleep(1);
+		}
 	}
 	
 	job_registry_destroy(rha);
@@ -586,25 +579,10 @@ IntStateQuery()
 			}
 				
 			if(en.status!=UNDEFINED && ren && ren->status!=REMOVED && ren->status!=COMPLETED){
-
-				if ((ret=job_registry_update_recn(rha, &en, ren->recnum)) < 0){
-					if(ret != JOB_REGISTRY_NOT_FOUND){
-						fprintf(stderr,"Update of record returns %d: ",ret);
-						perror("");
-					}
-				} else {
-					if(ret==JOB_REGISTRY_SUCCESS){
-						if (en.status == REMOVED || en.status == COMPLETED){
-							job_registry_unlink_proxy(rha, &en);
-						}else{
-							do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQuery for: jobid=%s creamjobid=%s wn=%s status=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status);
-						}
-						if (remupd_conf != NULL){
-							if (ret=job_registry_send_update(remupd_head_send,&en,NULL,NULL)<=0){
-								do_log(debuglogfile, debug, 2, "%s: Error creating endpoint in IntStateQuery\n",argv0);
-							}
-						}
-					}
+				/* Updates are committed together at the end of the sweep */
+				if (job_registry_batch_push(&isq_batch, &en, ren->recnum, JOB_REGISTRY_UPDATE_ALL) < 0){
+					fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
+					perror("");
 				}
 			}
 		
@@ -616,6 +594,8 @@ IntStateQuery()
 		pclose(fp);
 	}
 
+	CommitIntStateUpdates(rha, &isq_batch, (remupd_conf != NULL) ? remupd_head_send : NULL, "IntStateQuery", debuglogfile, debug);
+
 	free(command_string);
 	return 0;
 }
@@ -722,7 +702,7 @@ FinalStateQuery(char *query)
 	return 0;
 }
 
-int AssignFinalState(char *batchid){
+int AssignFinalState(const char *batchid){
 
 	job_registry_entry en;
 	int ret,i;
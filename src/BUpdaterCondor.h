@@ -38,7 +38,7 @@
 int ReceiveUpdateFromNetwork();
 int IntStateQuery();
 int FinalStateQuery(char *query);
-int AssignFinalState(char *batchid);
+int AssignFinalState(const char *batchid);
 int GetCondorVersion();
 void sighup();
 int usage();
@@ -61,6 +61,7 @@ FILE *debuglogfile;
 char *debuglogname=NULL;
 
 job_registry_handle *rha;
+job_registry_batch isq_batch;
 config_handle *cha;
 config_entry *ret;
 char *progname="BUpdaterCondor";
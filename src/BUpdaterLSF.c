@@ -26,10 +26,11 @@
 
 int main(int argc, char *argv[]){
 
-	FILE *fd;
-	job_registry_entry *en;
+	job_registry_recnum_t cursor;
+	const job_registry_entry *en;
 	time_t now;
 	time_t purge_time=0;
+	job_registry_purge_stats purge_stats;
 	time_t last_consistency_check=0;
 	char *pidfile=NULL;
 	char *first_duplicate=NULL;
@@ -416,12 +417,13 @@ int main(int argc, char *argv[]){
 		/* Purge old entries from registry */
 		now=time(0);
 		if(now - purge_time > 86400){
-			if((rc=job_registry_purge(registry_file, now-purge_interval,0))<0){
+			if((rc=job_registry_purge_online(registry_file, now-purge_interval,&purge_stats))<0){
 				do_log(debuglogfile, debug, 1, "%s: Error purging job registry %s:%d\n",argv0,registry_file,rc);
                 	        fprintf(stderr,"%s: Error purging job registry %s :",argv0,registry_file);
                 	        perror("");
 
 			}else{
+				do_log(debuglogfile, debug, 2, "%s: Purged %u of %u registry entries in %g s, write lock held for %g s\n",argv0,purge_stats.n_purged,purge_stats.n_scanned,purge_stats.copy_seconds,purge_stats.pause_seconds);
 				purge_time=time(0);
 			}
 		}
@@ -446,28 +448,19 @@ int main(int argc, char *argv[]){
 			IntStateQueryShort();
 		}
 		
-		fd = job_registry_open(rha, "r");
-		if (fd == NULL){
-			do_log(debuglogfile, debug, 1, "%s: Error opening job registry %s\n",argv0,registry_file);
-			fprintf(stderr,"%s: Error opening job registry %s :",argv0,registry_file);
+		if (job_registry_persist(rha) < 0){
+			do_log(debuglogfile, debug, 1, "%s: Error mapping job registry %s\n",argv0,registry_file);
+			fprintf(stderr,"%s: Error mapping job registry %s :",argv0,registry_file);
 			perror("");
 			sleep(loop_interval);
 			continue;
 		}
-		if (job_registry_rdlock(rha, fd) < 0){
-			do_log(debuglogfile, debug, 1, "%s: Error read locking job registry %s\n",argv0,registry_file);
-			fprintf(stderr,"%s: Error read locking job registry %s :",argv0,registry_file);
-			perror("");
-			sleep(loop_interval);
-			continue;
-		}
-		job_registry_firstrec(rha,fd);
-		fseek(fd,0L,SEEK_SET);
+		cursor = 0;
 		
 		first=TRUE;
 		finalquery_start_date = time(0);
 		
-		while ((en = job_registry_get_next(rha, fd)) != NULL){
+		while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL){
 
 			if((bupdater_lookup_active_jobs(&bact,en->batch_id) != BUPDATER_ACTIVE_JOBS_SUCCESS) && en->status!=REMOVED && en->status!=COMPLETED){
 
@@ -479,7 +472,6 @@ int main(int argc, char *argv[]){
 				/* Assign Status=4 and ExitStatus=999 to all entries that after alldone_interval are still not in a final state(3 or 4)*/
 				if(now-confirm_time>alldone_interval){
 					AssignFinalState(en->batch_id);
-					free(en);
 					continue;
 				}
 				
@@ -487,7 +479,6 @@ int main(int argc, char *argv[]){
                                 if(now-confirm_time>bhist_finalstate_interval && use_bhist_for_idle && strcmp(use_bhist_for_idle,"yes")==0){
                                         do_log(debuglogfile, debug, 2, "%s: FinalStateQuery needed for jobid=%s with status=%d from old logs\n",argv0,en->batch_id,en->status);
                                         runfinal_oldlogs=TRUE;
-                                        free(en);
                                         continue;
                                 }
 	
@@ -507,7 +498,6 @@ int main(int argc, char *argv[]){
 				
 			
 			}
-			free(en);
 		}
 		
 		if(runfinal_oldlogs){
@@ -518,8 +508,11 @@ int main(int argc, char *argv[]){
 			FinalStateQuery(finalquery_start_date,1);
 			runfinal=FALSE;
 		}
-		fclose(fd);		
-		sleep(loop_interval);
+		/* Wake up early when new jobs are registered, querying */
+		/* the batch system at most once a second. */
+		if(job_registry_wait_change(rha, JOB_REGISTRY_WATCH_APPEND|JOB_REGISTRY_WATCH_NPU, loop_interval*1000) > 0){
+			sleep(1);
+		}
 	}
 	
 	job_registry_destroy(rha);
@@ -654,31 +647,16 @@ IntStateQueryCustom()
 			now=time(0);
 			string_now=make_message("%d",now);
 			if(!first && en.status!=UNDEFINED && ren && ren->status!=REMOVED && ren->status!=COMPLETED){
-				if ((ret=job_registry_update_recn_select(rha, &en, ren->recnum,
+				/* Updates are committed together at the end of the sweep */
+				if (job_registry_batch_push(&isq_batch, &en, ren->recnum,
 				JOB_REGISTRY_UPDATE_WN_ADDR|
 				JOB_REGISTRY_UPDATE_STATUS|
 				JOB_REGISTRY_UPDATE_UDATE|
 				JOB_REGISTRY_UPDATE_UPDATER_INFO|
 				JOB_REGISTRY_UPDATE_EXITCODE|
-				JOB_REGISTRY_UPDATE_EXITREASON)) < 0){
-					if(ret != JOB_REGISTRY_NOT_FOUND){
-						fprintf(stderr,"Update of record returns %d: ",ret);
-						perror("");
-					}
-				} else {
-					if(ret==JOB_REGISTRY_SUCCESS){
-						if (en.status == REMOVED || en.status == COMPLETED) {
-							do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQueryCustom for: jobid=%s creamjobid=%s wn=%s status=%d exitcode=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status,en.exitcode);
-							job_registry_unlink_proxy(rha, &en);
-						}else{
-							do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQueryCustom for: jobid=%s creamjobid=%s wn=%s status=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status);
-						}
-						if (remupd_conf != NULL){
-							if (ret=job_registry_send_update(remupd_head_send,&en,NULL,NULL)<=0){
-								do_log(debuglogfile, debug, 2, "%s: Error creating endpoint in IntStateQueryCustom\n",argv0);
-							}
-						}
-					}
+				JOB_REGISTRY_UPDATE_EXITREASON) < 0){
+					fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
+					perror("");
 				}
 				en.status = UNDEFINED;
 				JOB_REGISTRY_ASSIGN_ENTRY(en.wn_addr,"\0");
@@ -757,35 +735,21 @@ IntStateQueryCustom()
 	}
 	
 	if(en.status!=UNDEFINED && ren && ren->status!=REMOVED && ren->status!=COMPLETED){
-		if ((ret=job_registry_update_recn_select(rha, &en, ren->recnum,
+		/* Updates are committed together at the end of the sweep */
+		if (job_registry_batch_push(&isq_batch, &en, ren->recnum,
 		JOB_REGISTRY_UPDATE_WN_ADDR|
 		JOB_REGISTRY_UPDATE_STATUS|
 		JOB_REGISTRY_UPDATE_UDATE|
 		JOB_REGISTRY_UPDATE_UPDATER_INFO|
 		JOB_REGISTRY_UPDATE_EXITCODE|
-		JOB_REGISTRY_UPDATE_EXITREASON)) < 0){
-			if(ret != JOB_REGISTRY_NOT_FOUND){
-				fprintf(stderr,"Update of record returns %d: ",ret);
-				perror("");
-			}
-			
-		} else {
-			if(ret==JOB_REGISTRY_SUCCESS){
-				if (en.status == REMOVED || en.status == COMPLETED) {
-					do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQueryCustom for: jobid=%s creamjobid=%s wn=%s status=%d exitcode=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status,en.exitcode);
-					job_registry_unlink_proxy(rha, &en);
-				}else{
-					do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQueryCustom for: jobid=%s creamjobid=%s wn=%s status=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status);
-				}
-				if (remupd_conf != NULL){
-					if (ret=job_registry_send_update(remupd_head_send,&en,NULL,NULL)<=0){
-						do_log(debuglogfile, debug, 2, "%s: Error creating endpoint in IntStateQueryCustom\n",argv0);
-					}
-				}
-			}
+		JOB_REGISTRY_UPDATE_EXITREASON) < 0){
+			fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
+			perror("");
 		}
 	}				
 
+	CommitIntStateUpdates(rha, &isq_batch, (remupd_conf != NULL) ? remupd_head_send : NULL, "IntStateQueryCustom", debuglogfile, debug);
+
 	free(ren);
 	free(command_string);
 	return 0;
@@ -857,31 +821,16 @@ IntStateQueryShort()
 			now=time(0);
 			string_now=make_message("%d",now);
 			if(!first && en.status!=UNDEFINED && ren && ren->status!=REMOVED && ren->status!=COMPLETED){
-				if ((ret=job_registry_update_recn_select(rha, &en, ren->recnum,
+				/* Updates are committed together at the end of the sweep */
+				if (job_registry_batch_push(&isq_batch, &en, ren->recnum,
 				JOB_REGISTRY_UPDATE_WN_ADDR|
 				JOB_REGISTRY_UPDATE_STATUS|
 				JOB_REGISTRY_UPDATE_UDATE|
 				JOB_REGISTRY_UPDATE_UPDATER_INFO|
 				JOB_REGISTRY_UPDATE_EXITCODE|
-				JOB_REGISTRY_UPDATE_EXITREASON)) < 0){
-					if(ret != JOB_REGISTRY_NOT_FOUND){
-						fprintf(stderr,"Update of record returns %d: ",ret);
-						perror("");
-					}
-				} else {
-					if(ret==JOB_REGISTRY_SUCCESS){
-						if (en.status == REMOVED || en.status == COMPLETED) {
-							do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQueryShort for: jobid=%s creamjobid=%s wn=%s status=%d exitcode=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status,en.exitcode);
-							job_registry_unlink_proxy(rha, &en);
-						}else{
-							do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQueryShort for: jobid=%s creamjobid=%s wn=%s status=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status);
-						}
-						if (remupd_conf != NULL){
-							if (ret=job_registry_send_update(remupd_head_send,&en,NULL,NULL)<=0){
-								do_log(debuglogfile, debug, 2, "%s: Error creating endpoint in IntStateQueryShort\n",argv0);
-							}
-						}
-					}
+				JOB_REGISTRY_UPDATE_EXITREASON) < 0){
+					fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
+					perror("");
 				}
 				en.status = UNDEFINED;
 				JOB_REGISTRY_ASSIGN_ENTRY(en.wn_addr,"\0");
@@ -942,35 +891,21 @@ IntStateQueryShort()
 	}
 	
 	if(en.status!=UNDEFINED && ren && ren->status!=REMOVED && ren->status!=COMPLETED){
-		if ((ret=job_registry_update_recn_select(rha, &en, ren->recnum,
+		/* Updates are committed together at the end of the sweep */
+		if (job_registry_batch_push(&isq_batch, &en, ren->recnum,
 		JOB_REGISTRY_UPDATE_WN_ADDR|
 		JOB_REGISTRY_UPDATE_STATUS|
 		JOB_REGISTRY_UPDATE_UDATE|
 		JOB_REGISTRY_UPDATE_UPDATER_INFO|
 		JOB_REGISTRY_UPDATE_EXITCODE|
-		JOB_REGISTRY_UPDATE_EXITREASON)) < 0){
-			if(ret != JOB_REGISTRY_NOT_FOUND){
-				fprintf(stderr,"Update of record returns %d: ",ret);
-				perror("");
-			}
-			
-		} else {
-			if(ret==JOB_REGISTRY_SUCCESS){
-				if (en.status == REMOVED || en.status == COMPLETED) {
-					do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQueryShort for: jobid=%s creamjobid=%s wn=%s status=%d exitcode=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status,en.exitcode);
-					job_registry_unlink_proxy(rha, &en);
-				}else{
-					do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQueryShort for: jobid=%s creamjobid=%s wn=%s status=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status);
-				}
-				if (remupd_conf != NULL){
-					if (ret=job_registry_send_update(remupd_head_send,&en,NULL,NULL)<=0){
-						do_log(debuglogfile, debug, 2, "%s: Error creating endpoint in IntStateQueryShort\n",argv0);
-					}
-				}
-			}
+		JOB_REGISTRY_UPDATE_EXITREASON) < 0){
+			fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
+			perror("");
 		}
 	}				
 
+	CommitIntStateUpdates(rha, &isq_batch, (remupd_conf != NULL) ? remupd_head_send : NULL, "IntStateQueryShort", debuglogfile, debug);
+
 	free(ren);
 	free(command_string);
 	return 0;
@@ -1041,31 +976,16 @@ IntStateQuery()
 			if(line && strstr(line,"Job <")){
 				isresumed=FALSE;
 				if(!first && en.status!=UNDEFINED && ren && ren->status!=REMOVED && ren->status!=COMPLETED){	
-					if ((ret=job_registry_update_recn_select(rha, &en, ren->recnum,
+					/* Updates are committed together at the end of the sweep */
+					if (job_registry_batch_push(&isq_batch, &en, ren->recnum,
 					JOB_REGISTRY_UPDATE_WN_ADDR|
 					JOB_REGISTRY_UPDATE_STATUS|
 					JOB_REGISTRY_UPDATE_UDATE|
 					JOB_REGISTRY_UPDATE_UPDATER_INFO|
 					JOB_REGISTRY_UPDATE_EXITCODE|
-					JOB_REGISTRY_UPDATE_EXITREASON)) < 0){
-						if(ret != JOB_REGISTRY_NOT_FOUND){
-							fprintf(stderr,"Update of record returns %d: ",ret);
-							perror("");
-						}
-					} else {
-						if(ret==JOB_REGISTRY_SUCCESS){
-							if (en.status == REMOVED || en.status == COMPLETED) {
-								do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQuery for: jobid=%s creamjobid=%s wn=%s status=%d exitcode=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status,en.exitcode);
-								job_registry_unlink_proxy(rha, &en);
-							}else{
-								do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQuery for: jobid=%s creamjobid=%s wn=%s status=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status);
-							}
-							if (remupd_conf != NULL){
-								if (ret=job_registry_send_update(remupd_head_send,&en,NULL,NULL)<=0){
-									do_log(debuglogfile, debug, 2, "%s: Error creating endpoint in IntStateQuery\n",argv0);
-								}
-							}
-						}
+					JOB_REGISTRY_UPDATE_EXITREASON) < 0){
+						fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
+						perror("");
 					}
 					en.status = UNDEFINED;
 					JOB_REGISTRY_ASSIGN_ENTRY(en.exitreason,"\0");
@@ -1225,34 +1145,21 @@ IntStateQuery()
 	}
 		
 	if(en.status!=UNDEFINED && ren && ren->status!=REMOVED && ren->status!=COMPLETED){	
-		if ((ret=job_registry_update_recn_select(rha, &en, ren->recnum,
+		/* Updates are committed together at the end of the sweep */
+		if (job_registry_batch_push(&isq_batch, &en, ren->recnum,
 		JOB_REGISTRY_UPDATE_WN_ADDR|
 		JOB_REGISTRY_UPDATE_STATUS|
 		JOB_REGISTRY_UPDATE_UDATE|
 		JOB_REGISTRY_UPDATE_UPDATER_INFO|
 		JOB_REGISTRY_UPDATE_EXITCODE|
-		JOB_REGISTRY_UPDATE_EXITREASON)) < 0){
-			if(ret != JOB_REGISTRY_NOT_FOUND){
-				fprintf(stderr,"Update of record returns %d: ",ret);
-				perror("");
-			}
-		} else {
-			if(ret==JOB_REGISTRY_SUCCESS){
-				if (en.status == REMOVED || en.status == COMPLETED) {
-					do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQuery for: jobid=%s creamjobid=%s wn=%s status=%d exitcode=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status,en.exitcode);
-					job_registry_unlink_proxy(rha, &en);
-				}else{
-					do_log(debuglogfile, debug, 2, "%s: registry update in IntStateQuery for: jobid=%s creamjobid=%s wn=%s status=%d\n",argv0,en.batch_id,en.user_prefix,en.wn_addr,en.status);
-				}
-				if (remupd_conf != NULL){
-					if (ret=job_registry_send_update(remupd_head_send,&en,NULL,NULL)<=0){
-						do_log(debuglogfile, debug, 2, "%s: Error creating endpoint in IntStateQuery\n",argv0);
-					}
-				}
-			}
+		JOB_REGISTRY_UPDATE_EXITREASON) < 0){
+			fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
+			perror("");
 		}
 	}				
 
+	CommitIntStateUpdates(rha, &isq_batch, (remupd_conf != NULL) ? remupd_head_send : NULL, "IntStateQuery", debuglogfile, debug);
+
 	free(ren);
 	free(command_string);
 	return 0;
@@ -1623,7 +1530,7 @@ get_pend_timestamp(char *jobid)
 	return tmstampepoch;
 }
 
-int AssignFinalState(char *batchid){
+int AssignFinalState(const char *batchid){
 
 	job_registry_entry en;
 	int ret,i;
@@ -40,7 +40,7 @@ int IntStateQueryShort();
 int IntStateQueryCustom();
 int IntStateQuery();
 int FinalStateQuery(time_t start_date, int logs_to_read);
-int AssignFinalState(char *batchid);
+int AssignFinalState(const char *batchid);
 time_t get_susp_timestamp(char *jobid);
 time_t get_resume_timestamp(char *jobid);
 time_t get_pend_timestamp(char *jobid);
@@ -78,6 +78,7 @@ FILE *debuglogfile;
 char *debuglogname=NULL;
 
 job_registry_handle *rha;
+job_registry_batch isq_batch;
 config_handle *cha;
 config_entry *ret;
 char *progname="BUpdaterLSF";
@@ -38,7 +38,7 @@
 int ReceiveUpdateFromNetwork();
 int IntStateQuery();
 int FinalStateQuery(char *input_string, int logs_to_read);
-int AssignFinalState(char *batchid);
+int AssignFinalState(const char *batchid);
 void sighup();
 int usage();
 int short_usage();
@@ -66,6 +66,7 @@ FILE *debuglogfile;
 char *debuglogname=NULL;
 
 job_registry_handle *rha;
+job_registry_batch isq_batch;
 config_handle *cha;
 config_entry *ret;
 char *progname="BUpdaterPBS";
@@ -24,10 +24,11 @@ extern int bfunctions_poll_timeout;
 
 int main(int argc, char *argv[]){
     
-    FILE *fd;
-    job_registry_entry *en;
+    job_registry_recnum_t cursor;
+    const job_registry_entry *en;
     time_t now;
     time_t purge_time=0;
+    job_registry_purge_stats purge_stats;
     char *constraint[11];
     char *constraint2[5];
     char *query=NULL;
@@ -324,33 +325,25 @@ int main(int argc, char *argv[]){
 	/* Purge old entries from registry */
 	now=time(0);
 	if(now - purge_time > 86400){
-	    if(job_registry_purge(reg_file, now-purge_interval,0)<0){
+	    if(job_registry_purge_online(reg_file, now-purge_interval,&purge_stats)<0){
 		do_log(debuglogfile, debug, 1, "%s: Error purging job registry %s\n",argv0,reg_file);
 		fprintf(stderr,"%s: Error purging job registry %s :",argv0,reg_file);
 		perror("");
 	    }else{
+		do_log(debuglogfile, debug, 2, "%s: Purged %u of %u registry entries in %g s, write lock held for %g s\n",argv0,purge_stats.n_purged,purge_stats.n_scanned,purge_stats.copy_seconds,purge_stats.pause_seconds);
 		purge_time=time(0);
 	    }
 	}
 	
 	//IntStateQuery();
-	fd = job_registry_open(rha, "r");
-	if (fd == NULL)
+	if (job_registry_persist(rha) < 0)
 	{
-	    do_log(debuglogfile, debug, 1, "%s: Error opening job registry %s\n",argv0,reg_file);
-	    fprintf(stderr,"%s: Error opening job registry %s :",argv0,reg_file);
+	    do_log(debuglogfile, debug, 1, "%s: Error mapping job registry %s\n",argv0,reg_file);
+	    fprintf(stderr,"%s: Error mapping job registry %s :",argv0,reg_file);
 	    perror("");
 	    sleep(loop_interval);
 	}
-	if (job_registry_rdlock(rha, fd) < 0)
-	{
-	    do_log(debuglogfile, debug, 1, "%s: Error read locking job registry %s\n",argv0,reg_file);
-	    fprintf(stderr,"%s: Error read locking job registry %s :",argv0,reg_file);
-	    perror("");
-	    sleep(loop_interval);
-	}
-	job_registry_firstrec(rha,fd);
-	fseek(fd,0L,SEEK_SET);
+	cursor = 0;
 
 	if((query=calloc(STR_CHARS*2,1)) == 0){
 	    sysfatal("can't malloc query %r");
@@ -361,7 +354,7 @@ int main(int argc, char *argv[]){
 	
 	query[0]=' ';
 	queryStates[0]=' ';
-	while ((en = job_registry_get_next(rha, fd)) != NULL)
+	while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL)
 	{
 	    if(((now - en->mdate) > finalstate_query_interval) && en->status!=3 && en->status!=4)
 	    {
@@ -386,7 +379,6 @@ int main(int argc, char *argv[]){
 		AssignState(en->batch_id,"4" ,"-1","\0","\0",string_now);
 		free(string_now);
 	    }
-	   free(en);
 	}
 	if(runfinal){
 	    if((query_err=calloc((int)strlen(query),1)) == 0)
@@ -396,7 +388,6 @@ int main(int argc, char *argv[]){
 	}
 	free(query);
 	free(queryStates);
-	fclose(fd);
 	if (runfinal){
 	    runfinal=FALSE;
 	    sleep (5);
@@ -445,8 +436,8 @@ int FinalStateQuery(char *query,char *queryStates, char *query_err){
 			    JOB_REGISTRY_ASSIGN_ENTRY(en.exitreason,"0");
 			    JOB_REGISTRY_ASSIGN_ENTRY(en.updater_info,string_now)
 			    en.udate=now;
-			    if ((ret=job_registry_update(rha, &en)) < 0){
-				fprintf(stderr,"Update of record returns %d: \nJobId: %d", ret,en.batch_id);
+			    if (job_registry_batch_push(&isq_batch, &en, 0, JOB_REGISTRY_UPDATE_ALL) < 0){
+				fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
 				perror("");
 			    }
 			}
@@ -458,8 +449,8 @@ int FinalStateQuery(char *query,char *queryStates, char *query_err){
 			    JOB_REGISTRY_ASSIGN_ENTRY(en.exitreason,"0");
 			    JOB_REGISTRY_ASSIGN_ENTRY(en.updater_info,string_now)
 			    en.udate=now;
-			    if ((ret=job_registry_update(rha, &en)) < 0){
-				fprintf(stderr,"Update of record returns %d: \nJobId: %d", ret,en.batch_id);
+			    if (job_registry_batch_push(&isq_batch, &en, 0, JOB_REGISTRY_UPDATE_ALL) < 0){
+				fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
 				perror("");
 			    }
 			}
@@ -472,8 +463,8 @@ int FinalStateQuery(char *query,char *queryStates, char *query_err){
 			    JOB_REGISTRY_ASSIGN_ENTRY(en.exitreason,"0");
 			    JOB_REGISTRY_ASSIGN_ENTRY(en.updater_info,string_now)
 			    en.udate=now;
-			    if ((ret=job_registry_update(rha, &en)) < 0){
-				fprintf(stderr,"Update of record returns %d: \nJobId: %d", ret,en.batch_id);
+			    if (job_registry_batch_push(&isq_batch, &en, 0, JOB_REGISTRY_UPDATE_ALL) < 0){
+				fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
 				perror("");
 			    }
 			    freetoken(&saveptr2,cont2);
@@ -486,8 +477,8 @@ int FinalStateQuery(char *query,char *queryStates, char *query_err){
 			    JOB_REGISTRY_ASSIGN_ENTRY(en.exitreason,"0");
 			    JOB_REGISTRY_ASSIGN_ENTRY(en.updater_info,string_now)
 			    en.udate=now;
-			    if ((ret=job_registry_update(rha, &en)) < 0){
-				fprintf(stderr,"Update of record returns %d: \nJobId: %d", ret,en.batch_id);
+			    if (job_registry_batch_push(&isq_batch, &en, 0, JOB_REGISTRY_UPDATE_ALL) < 0){
+				fprintf(stderr,"%s: Cannot queue update for %s: ",argv0,en.batch_id);
 				perror("");
 			    }
 			}
@@ -506,6 +497,16 @@ int FinalStateQuery(char *query,char *queryStates, char *query_err){
 	freetoken(&saveptr1,cont);
     }
     pclose( file_output );
+    //commit the state changes found by qstat under a single registry lock
+    if (job_registry_update_batch(rha, &isq_batch) < 0){
+	fprintf(stderr,"%s: Update of %d records fails: ",argv0,isq_batch.n_items);
+	perror("");
+    }
+    for (j=0; j<isq_batch.n_items; j++){
+	if (isq_batch.items[j].result < 0)
+	    fprintf(stderr,"Update of record returns %d: JobId: %s\n",isq_batch.items[j].result,isq_batch.items[j].entry.batch_id);
+    }
+    job_registry_batch_clear(&isq_batch);
     sprintf(query_err,"\0");
     //now we have check in list_query only states that not change status 
     //because they're not in qstat result
@@ -646,7 +647,7 @@ int FinalStateQuery(char *query,char *queryStates, char *query_err){
     return 0;
 }
 
-int AssignState (char *element, char *status, char *exit, char *reason, char *wn, char *udate){
+int AssignState (const char *element, char *status, char *exit, char *reason, char *wn, char *udate){
     char **id_element;
     job_registry_entry en;
     time_t now;
@@ -32,7 +32,7 @@
 int StateQuery(char *command_string);
 int FinalStateQuery(char *query,char *queryStates,char *query_err);
 // int AssignFinalState(char *batchid);
-int AssignState (char *element, char *status, char *exit, char *reason, char *wn, char *udate);
+int AssignState (const char *element, char *status, char *exit, char *reason, char *wn, char *udate);
 void sighup();
 int usage();
 int short_usage();
@@ -58,6 +58,7 @@ FILE *debuglogfile;
 char *debuglogname=NULL;
 
 job_registry_handle *rha;
+job_registry_batch isq_batch;
 config_handle *cha;
 config_entry *ret;
 char *progname="BUpdaterSGE";
@@ -1018,3 +1018,47 @@ char *GetPBSSpoolPath(char *binpath)
 	return pbs_spool;
 
 }
+
+int
+CommitIntStateUpdates(job_registry_handle *rha, job_registry_batch *batch,
+                      const job_registry_updater_endpoint *remupd_head_send,
+                      const char *query_name, FILE *debuglogfile, int debug)
+{
+/*
+ Apply the updates queued in batch by the status query query_name,
+ then log, unlink the proxy of finished jobs and forward to
+ remupd_head_send (if not NULL) each entry that changed.
+*/
+	job_registry_entry *en;
+	int i;
+	int ret;
+
+	if (job_registry_update_batch(rha, batch) < 0){
+		fprintf(stderr,"%s: Update of %d records fails: ",argv0,batch->n_items);
+		perror("");
+	}
+
+	for (i=0; i<batch->n_items; i++){
+		en = &(batch->items[i].entry);
+		ret = batch->items[i].result;
+		if (ret < 0){
+			if(ret != JOB_REGISTRY_NOT_FOUND){
+				fprintf(stderr,"Update of record %s returns %d\n",en->batch_id,ret);
+			}
+		} else if(ret==JOB_REGISTRY_SUCCESS){
+			if (en->status == REMOVED || en->status == COMPLETED) {
+				do_log(debuglogfile, debug, 2, "%s: registry update in %s for: jobid=%s creamjobid=%s wn=%s status=%d exitcode=%d\n",argv0,query_name,en->batch_id,en->user_prefix,en->wn_addr,en->status,en->exitcode);
+				job_registry_unlink_proxy(rha, en);
+			}else{
+				do_log(debuglogfile, debug, 2, "%s: registry update in %s for: jobid=%s creamjobid=%s wn=%s status=%d\n",argv0,query_name,en->batch_id,en->user_prefix,en->wn_addr,en->status);
+			}
+			if (remupd_head_send != NULL){
+				if (job_registry_send_update(remupd_head_send,en,NULL,NULL)<=0){
+					do_log(debuglogfile, debug, 2, "%s: Error creating endpoint in %s\n",argv0,query_name);
+				}
+			}
+		}
+	}
+	job_registry_batch_clear(batch);
+	return 0;
+}
@@ -51,6 +51,8 @@
 
 #include "blahpd.h"
 #include "blah_utils.h"
+#include "job_registry.h"
+#include "job_registry_updater.h"
 
 #define STR_CHARS          50000
 #define NUM_CHARS          300
@@ -95,6 +97,9 @@ void bupdater_free_active_jobs(bupdater_active_jobs *bact);
 int do_log(FILE *debuglogfile, int debuglevel, int dbgthresh, const char *fmt, ...);
 int check_config_file(char *logdev);
 char *GetPBSSpoolPath(char *binpath);
+int CommitIntStateUpdates(job_registry_handle *rha, job_registry_batch *batch,
+                          const job_registry_updater_endpoint *remupd_head_send,
+                          const char *query_name, FILE *debuglogfile, int debug);
 
 extern int bfunctions_poll_timeout; 
 
@@ -6,6 +6,8 @@
  *
  *  Revision history :
  *   5-May-2009 Original release
+ *  17-Oct-2026 Scan the per-subject record lists of a persistent
+ *              registry handle instead of the whole registry file.
  *
  *  Description:
  *   Executable to look up for entries in the BLAH job registry
@@ -310,13 +312,14 @@ main(int argc, char *argv[])
   int need_to_free_registry_file = FALSE;
   const char *default_registry_file = "blah_job_registry.bjr";
   char *my_home;
-  job_registry_entry hen, *ren;
+  job_registry_entry hen;
+  const job_registry_entry *ren;
+  job_registry_recnum_t cursor = 0;
   char *cad;
   classad_context pcad;
   config_handle *cha;
   config_entry *rge;
   job_registry_handle *rha;
-  FILE *fd;
   char *arg = "";
   int iarg;
   char *looked_up_subject = NULL;
@@ -446,6 +449,15 @@ main(int argc, char *argv[])
   if (cha != NULL) config_free(cha);
   if (need_to_free_registry_file) free(registry_file);
 
+  /* Cache the subject list and the records of each subject. */
+  if (job_registry_persist_subjects(rha) < 0)
+   {
+    fprintf(stderr,"ERROR %s: error mapping job registry: %s\n",argv[0],
+            strerror(errno));
+    job_registry_destroy(rha);
+    return 2;
+   }
+
   looked_up_subject = job_registry_lookup_subject_hash(rha, lookup_hash);
   if (looked_up_subject == NULL)
    {
@@ -462,30 +474,12 @@ main(int argc, char *argv[])
     free(looked_up_subject);
    }
 
-  fd = job_registry_open(rha, "r");
-  if (fd == NULL)
-   {
-    fprintf(stderr,"ERROR %s: error opening job registry: %s\n",argv[0],
-            strerror(errno));
-    job_registry_destroy(rha);
-    return 2;
-   }
-
-  if (job_registry_rdlock(rha, fd) < 0)
-   {
-    fprintf(stderr,"ERROR %s: error read-locking job registry: %s\n",argv[0],
-            strerror(errno));
-    fclose(fd);
-    job_registry_destroy(rha);
-    return 2;
-   }
-
   if (format_args > 0)
    {
     for (ifr = format_args; ifr < argc; ifr+=2) undo_escapes(argv[ifr]);
    }
 
-  while ((ren = job_registry_get_next_hash_match(rha, fd, lookup_hash)) != NULL)
+  while ((ren = job_registry_get_next_subject_match(rha, lookup_hash, &cursor)) != NULL)
    {
     /* Is the current entry in the requested job status ? */
     if ((select_by_job_status != 0) && 
@@ -507,7 +501,6 @@ main(int argc, char *argv[])
          {
           fprintf(stderr,"ERROR %s: Cannot parse classad %s.\n",argv[0],cad);
           free(cad);
-          free(ren);
           continue;
          }
         for (ifr = format_args; ifr < argc; ifr+=2)
@@ -550,14 +543,11 @@ main(int argc, char *argv[])
     else 
      {
       fprintf(stderr,"ERROR %s: Out of memory.\n",argv[0]);
-      free(ren);
       job_registry_destroy(rha);
       return 3;
      }
-    free(ren);
    }
 
-  fclose(fd);
 
   job_registry_destroy(rha);
   return 0;
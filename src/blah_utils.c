@@ -7,6 +7,7 @@
 #
 #  Revision history:
 #   30 Mar 2009 - Original release.
+#   17 Oct 2026 - Added escape_spaces_to, escaping into a caller buffer.
 #
 #  Description:
 #   Utility functions for blah protocol
@@ -34,6 +35,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include "blah_utils.h"
 
 const char *blah_omem_msg = "out\\ of\\ memory";
@@ -63,6 +65,29 @@ make_message(const char *fmt, ...)
 	return(result);
 }
 
+size_t
+escape_spaces_to(char *dest, const char *str)
+{
+	/* Same as escape_spaces, but writes into a caller-supplied
+	   buffer of at least strlen(str) * 2 + 1 bytes.
+	   Returns the length of the escaped string.
+	*/
+	char cur;
+	size_t j;
+
+	for (j = 0; (cur = *str) != '\0'; str++, j++)
+	{
+		if (cur == '\r') cur = '-';
+		else if (cur == '\n') cur = '-';
+		else if (cur == '\t') cur = ' ';
+
+		if (cur == ' ') dest[j++] = '\\';
+		dest[j] = cur;
+	}
+	dest[j] = '\0';
+	return(j);
+}
+
 char *
 escape_spaces(const char *str)
 {
@@ -71,23 +96,10 @@ escape_spaces(const char *str)
 	   replace tabs with spaces, CR and LF with '-'.
 	*/
 	char *result = NULL;
-	char cur;
-	int i, j;
 
 	result = (char *) malloc (strlen(str) * 2 + 1);
 	if (result)
-	{
-		for (i = 0, j = 0; i <= strlen(str); i++, j++)
-		{
-			cur = str[i];
-			if (cur == '\r') cur = '-';
-			else if (cur == '\n') cur = '-';
-			else if (cur == '\t') cur = ' ';
-
-			if (cur == ' ') result[j++] = '\\';
-			result[j] = cur;
-		}
-	}
+		escape_spaces_to(result, str);
 	else
 		result = (char *)blah_omem_msg;
 	return(result);
@@ -34,10 +34,13 @@
 #ifndef BLAHP_UTILS_INCLUDED
 #define BLAHP_UTILS_INCLUDED
 
+#include <stddef.h>
+
 extern const char *blah_omem_msg;
 
 char *make_message(const char *fmt, ...);
 char *escape_spaces(const char *str);
+size_t escape_spaces_to(char *dest, const char *str);
 
 #define BLAH_DYN_ALLOCATED(escstr) ((escstr) != blah_omem_msg && (escstr) != NULL)
 
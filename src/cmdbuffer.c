@@ -8,6 +8,12 @@
 #  Revision history:
 #   25 Aug 2011 - Original release
 #   31 Aug 2011 - Test code incorporated
+#   17 Oct 2026 - Added cmd_buffer_has_command()
+#   17 Oct 2026 - Commands can be split into arguments straight from
+#                 the buffer, into a single allocation
+#   17 Oct 2026 - Geometric growth of the buffer up to a configurable
+#                 size. Longer commands are spilled to a temporary file
+#                 up to a configurable limit, and discarded beyond it.
 #
 #  Description:
 #   Get commands from a file descriptor, buffering if needed
@@ -33,23 +39,36 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <poll.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "cmdbuffer.h"
 
 #define BUFF_INCR_STEP 1024
 #define BUFF_INCR_LIMIT (1024*BUFF_INCR_STEP)
+#define SPILL_LIMIT (64*BUFF_INCR_LIMIT)
 #define CMDBUF_IS_SEP(x) ((x=='\n')||(x=='\r')||(x=='\000'))
+#define CMDBUF_SEPARATORS "\r\n" /* '\000' is found by strcspn() anyway */
 
 static char *cmd_queue_start = NULL; /* Pointer to the allocated buffer */
 static size_t cmd_queue_size = 0;    /* Total amount of space in the buffer */
-static size_t cmd_queue_len = 0;     /* Length of valid data in the buffer */
+static size_t cmd_queue_len = 0;     /* Length of valid data in the buffer,
+                                        always followed by a '\000' */
 static size_t cmd_current = 0;       /* Beginning of the first unserved command
                                         in the buffer (offset)*/
 static struct pollfd cmd_fds[1];     /* File descriptor of the connected stream */
 static int cmd_timeout = -1;         /* poll() timeout */
+static size_t cmd_max_buffer = BUFF_INCR_LIMIT; /* Max size of the buffer */
+static size_t cmd_max_command = SPILL_LIMIT;    /* Max length of a command */
+static char *cmd_spill_dir = NULL;   /* Where longer commands are spilled */
+static int cmd_spill_fd = -1;        /* Temp file holding the beginning of
+                                        the command being received */
+static size_t cmd_spill_len = 0;     /* Amount of data in the temp file */
+static int cmd_discarding = 0;       /* The command being received is too long */
+static char *cmd_spill_map = NULL;   /* Mapping of the last spilled command */
 
 
 /* Initialise static data and structures
@@ -61,6 +80,7 @@ cmd_buffer_init(const int fd, const size_t bufsize, const int timeout)
 		return (CMDBUF_ERROR_NOMEM);
 	cmd_queue_size = bufsize;
 	cmd_queue_len = 0;
+	cmd_queue_start[0] = '\000';
 	cmd_current = 0;
 	cmd_fds[0].fd = fd;
 	cmd_fds[0].events = POLLIN;
@@ -70,46 +90,163 @@ cmd_buffer_init(const int fd, const size_t bufsize, const int timeout)
 }
 
 
-/* Get a command from the buffer
+/* Set the max size of the buffer and the max length of a command
+ * (0 keeps the current value). Commands not fitting in the buffer are
+ * spilled to a temporary file in spill_dir, if given, while commands
+ * longer than max_command are discarded
  * */
 int
-cmd_buffer_get_command(char **command)
+cmd_buffer_set_limits(const size_t max_buffer, const size_t max_command, const char *spill_dir)
+{
+	char *new_dir = NULL;
+
+	if (spill_dir != NULL && (new_dir = strdup(spill_dir)) == NULL)
+		return(CMDBUF_ERROR_NOMEM);
+	if (max_buffer > 0)
+		cmd_max_buffer = max_buffer > cmd_queue_size ? max_buffer : cmd_queue_size;
+	if (max_command > 0) cmd_max_command = max_command;
+	if (new_dir != NULL)
+	{
+		if (cmd_spill_dir) free(cmd_spill_dir);
+		cmd_spill_dir = new_dir;
+	}
+	return(CMDBUF_OK);
+}
+
+
+/* Release the temporary file of a spilled command
+ * */
+static void
+cmd_buffer_unspill(void)
+{
+	if (cmd_spill_map != NULL)
+	{
+		munmap(cmd_spill_map, cmd_spill_len);
+		cmd_spill_map = NULL;
+	}
+	if (cmd_spill_fd >= 0)
+	{
+		close(cmd_spill_fd);
+		cmd_spill_fd = -1;
+	}
+	cmd_spill_len = 0;
+}
+
+
+/* Move part of the command being received out of the buffer,
+ * appending it to the temporary file (created at the first call).
+ * If the command is too long, or cannot be spilled, the data is
+ * dropped and the command will be discarded
+ * */
+static void
+cmd_buffer_spill(const char *data, size_t len)
+{
+	char *spill_name;
+	ssize_t written;
+
+	if (cmd_spill_len + len > cmd_max_command) cmd_discarding = 1;
+
+	if (!cmd_discarding && cmd_spill_fd < 0)
+	{
+		spill_name = NULL;
+		if (cmd_spill_dir != NULL &&
+		    (spill_name = (char *)malloc(strlen(cmd_spill_dir) + sizeof("/blah_cmd_XXXXXX"))) != NULL)
+		{
+			sprintf(spill_name, "%s/blah_cmd_XXXXXX", cmd_spill_dir);
+			/* Nobody else needs to see the file */
+			if ((cmd_spill_fd = mkstemp(spill_name)) >= 0) unlink(spill_name);
+			free(spill_name);
+		}
+		if (cmd_spill_fd < 0) cmd_discarding = 1;
+	}
+
+	while (!cmd_discarding && len > 0)
+	{
+		if ((written = write(cmd_spill_fd, data, len)) < 0)
+		{
+			if (errno == EINTR) continue;
+			cmd_discarding = 1;
+			break;
+		}
+		data += written;
+		len -= written;
+		cmd_spill_len += written;
+	}
+
+	if (cmd_discarding) cmd_buffer_unspill();
+}
+
+
+/* Find the next command in the buffer, reading more data if needed
+ * On success, *command points to the command inside the buffer
+ * (or to the mapped temp file, for spilled commands), and stays
+ * valid until the next call
+ * */
+static int
+cmd_buffer_next(char **command, size_t *len)
 {
 	char *tmp_realloc;
-	size_t endcmd;
+	size_t endcmd, new_size;
 	ssize_t space_left;
 	ssize_t chunk_len; 
-	int pollret;
+	int pollret, res;
 
 	/* The queue must be initialised first */
 	if (cmd_queue_start == NULL) return (CMDBUF_ERROR_NOBUFFER);
 
+	/* The space of the last command returned can be reused now */
+	cmd_queue_start[cmd_queue_len] = '\000';
+	if (cmd_spill_map != NULL) cmd_buffer_unspill();
 	endcmd = cmd_current;
 	for (;;)
 	{
 		/* First, search for a command in the current queue */
-		while(endcmd < cmd_queue_len)
+		endcmd += strcspn(cmd_queue_start + endcmd, CMDBUF_SEPARATORS);
+		if (endcmd < cmd_queue_len)
 		{
-			if (CMDBUF_IS_SEP(cmd_queue_start[endcmd]))
+			/* We've found a command */
+			cmd_queue_start[endcmd] = '\000';
+			*command = cmd_queue_start + cmd_current;
+			*len = endcmd - cmd_current;
+			res = CMDBUF_OK;
+
+			/* Complete a spilled command and map it */
+			if (cmd_spill_fd >= 0 || cmd_discarding)
 			{
-				/* We've found a command, save it */
-				cmd_queue_start[endcmd] = '\000';
-				*command = strdup(cmd_queue_start + cmd_current);
-				if (*command == NULL) return (CMDBUF_ERROR_NOMEM);
-
-				/* Look for the beginning of the next command */
-				for(cmd_current = endcmd + 1; cmd_current < cmd_queue_len; cmd_current++)
-					if (! CMDBUF_IS_SEP(cmd_queue_start[cmd_current])) break;
-				if (cmd_current >= cmd_queue_len)
+				cmd_buffer_spill(*command, *len);
+				if (!cmd_discarding)
 				{
-					/* There are no more commands, we can reuse the space */
-					cmd_queue_len = 0;
-					cmd_current = 0;
-					endcmd = 0;
+					cmd_spill_map = (char *)mmap(NULL, cmd_spill_len, PROT_READ, MAP_PRIVATE, cmd_spill_fd, 0);
+					if (cmd_spill_map == MAP_FAILED)
+					{
+						cmd_spill_map = NULL;
+						cmd_buffer_unspill();
+						cmd_discarding = 1;
+					}
 				}
-				return (CMDBUF_OK);
+				if (cmd_discarding)
+				{
+					cmd_discarding = 0;
+					res = CMDBUF_ERROR_TOOLONG;
+				}
+				else
+				{
+					*command = cmd_spill_map;
+					*len = cmd_spill_len;
+				}
+			}
+
+			/* Look for the beginning of the next command */
+			for(cmd_current = endcmd + 1; cmd_current < cmd_queue_len; cmd_current++)
+				if (! CMDBUF_IS_SEP(cmd_queue_start[cmd_current])) break;
+			if (cmd_current >= cmd_queue_len)
+			{
+				/* There are no more commands, we can reuse the space */
+				/* (at the next call, the command is still returned) */
+				cmd_queue_len = 0;
+				cmd_current = 0;
 			}
-			endcmd++;
+			return (res);
 		}
 
 		/* No command was found, wait for some more data */
@@ -127,8 +264,11 @@ cmd_buffer_get_command(char **command)
 		}
 
 		/* Check the remaining space in the queue */
+		/* (one byte is kept for the trailing '\000') */
 		/* If it's lower than 50% of BUFF_INCR_STEP take some action */
-		space_left = cmd_queue_size - cmd_queue_len;
+		/* (the buffer is doubled, so long commands are copied only */
+		/* a few times, and spilled when they don't fit any more) */
+		space_left = cmd_queue_size - cmd_queue_len - 1;
 		if (space_left < BUFF_INCR_STEP/2)
 		{
 			/* Try to recycle the leading space */
@@ -140,16 +280,26 @@ cmd_buffer_get_command(char **command)
 				space_left += cmd_current;
 				cmd_current = 0;
 			}
-			else
+			else if (cmd_queue_size < cmd_max_buffer)
 			/* Realloc the buffer with more space */
 			{
-				if (cmd_queue_size + BUFF_INCR_STEP > BUFF_INCR_LIMIT)
-					return(CMDBUF_ERROR_NOMEM);
-				cmd_queue_size += BUFF_INCR_STEP;
-				tmp_realloc = (char *) realloc (cmd_queue_start, cmd_queue_size);
+				new_size = 2 * cmd_queue_size;
+				if (new_size < cmd_queue_size + BUFF_INCR_STEP) new_size = cmd_queue_size + BUFF_INCR_STEP;
+				if (new_size > cmd_max_buffer) new_size = cmd_max_buffer;
+				tmp_realloc = (char *) realloc (cmd_queue_start, new_size);
 				if (tmp_realloc == NULL) return(CMDBUF_ERROR_NOMEM);
 				cmd_queue_start = tmp_realloc;
-				space_left += BUFF_INCR_STEP;
+				space_left += new_size - cmd_queue_size;
+				cmd_queue_size = new_size;
+			}
+			else
+			/* The buffer is full with a single command */
+			{
+				cmd_buffer_spill(cmd_queue_start, cmd_queue_len);
+				cmd_queue_len = 0;
+				cmd_queue_start[0] = '\000';
+				endcmd = 0;
+				space_left = cmd_queue_size - 1;
 			}
 		}
 
@@ -159,6 +309,7 @@ cmd_buffer_get_command(char **command)
 		if (chunk_len > 0)
 		{
 			cmd_queue_len += chunk_len;
+			cmd_queue_start[cmd_queue_len] = '\000';
 		}
 		else
 		{
@@ -169,12 +320,152 @@ cmd_buffer_get_command(char **command)
 }
 
 
+/* Get a command from the buffer
+ * */
+int
+cmd_buffer_get_command(char **command)
+{
+	char *cmd;
+	size_t len;
+	int res;
+
+	if ((res = cmd_buffer_next(&cmd, &len)) != CMDBUF_OK) return(res);
+	if ((*command = strndup(cmd, len)) == NULL) return (CMDBUF_ERROR_NOMEM);
+	return (CMDBUF_OK);
+}
+
+
+/* Unescape the special characters of an argument, in place
+ * Return the new length
+ * */
+static size_t
+cmd_buffer_unescape(char *arg, size_t len)
+{
+	char *r, *w, *end = arg + len;
+
+	if ((r = memchr(arg, '\\', len)) == NULL) return(len);
+	for (w = r; r < end; r++)
+	{
+		if (r[0] == '\\' && (r[1] == '\\' || r[1] == '\r' || r[1] == '\n')) r++;
+		*(w++) = *r;
+	}
+	*w = '\000';
+	return(w - arg);
+}
+
+
+/* Split a command of len bytes into arguments, separated by spaces
+ * (but not by escaped spaces), and unescape them. The n_extra strings
+ * in extra are copied after the arguments. *argc is set to the number
+ * of arguments (not counting the extra ones), and *argv to the NULL
+ * terminated array of arguments, allocated together with the strings,
+ * to be freed with free(*argv)
+ * */
+int
+cmd_buffer_tokenize(const char *cmd, const size_t len, char * const *extra, const int n_extra, int *argc, char ***argv)
+{
+	char **args;
+	char *strings, *r, *w, *end, *sep, *arg;
+	size_t extra_len = 0, n_slots, arg_len;
+	int i, n_args = 0;
+
+	/* Upper bound for the number of arguments: the number of */
+	/* runs of spaces not following a backslash, plus one */
+	n_slots = 1;
+	for (r = (char *)cmd; (r = memchr(r, ' ', cmd + len - r)) != NULL; r++)
+		if (r > cmd && r[-1] != ' ' && r[-1] != '\\') n_slots++;
+	n_slots += n_extra + 1;
+	for (i = 0; i < n_extra; i++)
+		extra_len += (extra[i] != NULL ? strlen(extra[i]) : 0) + 1;
+
+	if ((args = (char **)malloc(n_slots * sizeof(char *) + len + 1 + extra_len)) == NULL)
+		return(CMDBUF_ERROR_NOMEM);
+	strings = (char *)(args + n_slots);
+	memcpy(strings, cmd, len);
+	strings[len] = '\000';
+
+	/* Compact the arguments in place */
+	r = w = strings;
+	end = strings + len;
+	for (;;)
+	{
+		while (r < end && *r == ' ') r++;
+		if (r >= end) break;
+		arg = w;
+		for (;;)
+		{
+			if ((sep = memchr(r, ' ', end - r)) == NULL) sep = end;
+			memmove(w, r, sep - r);
+			w += sep - r;
+			r = sep;
+			/* A trailing backslash escapes the space */
+			if (w[-1] != '\\') break;
+			while (r < end && *r == ' ') r++;
+			if (r >= end) break;
+			w[-1] = ' ';
+		}
+		if (r < end) r++;
+		*w = '\000';
+		arg_len = cmd_buffer_unescape(arg, w - arg);
+		w = arg + arg_len + 1;
+		args[n_args++] = arg;
+	}
+
+	/* Append the extra arguments */
+	w = end + 1;
+	for (i = 0; i < n_extra; i++)
+	{
+		arg_len = (extra[i] != NULL ? strlen(extra[i]) : 0);
+		memcpy(w, extra[i] != NULL ? extra[i] : "", arg_len);
+		w[arg_len] = '\000';
+		args[n_args + i] = w;
+		w += arg_len + 1;
+	}
+	args[n_args + n_extra] = NULL;
+
+	*argc = n_args;
+	*argv = args;
+	return(CMDBUF_OK);
+}
+
+
+/* Get a command from the buffer, already split into arguments
+ * by cmd_buffer_tokenize()
+ * */
+int
+cmd_buffer_get_args(int *argc, char ***argv, char * const *extra, const int n_extra)
+{
+	char *cmd;
+	size_t len;
+	int res;
+
+	if ((res = cmd_buffer_next(&cmd, &len)) != CMDBUF_OK) return(res);
+	return(cmd_buffer_tokenize(cmd, len, extra, n_extra, argc, argv));
+}
+
+
+/* Tell whether a complete command is already in the buffer,
+ * i.e. whether cmd_buffer_get_command() would return without reading
+ * */
+int
+cmd_buffer_has_command(void)
+{
+	if (cmd_queue_start == NULL || cmd_current >= cmd_queue_len) return(0);
+	return(cmd_current + strcspn(cmd_queue_start + cmd_current, CMDBUF_SEPARATORS) < cmd_queue_len);
+}
+
+
 /* Free the buffer
  * */
 int
 cmd_buffer_free(void)
 {
+	cmd_buffer_unspill();
+	cmd_discarding = 0;
 	if (cmd_queue_start) free (cmd_queue_start);
+	cmd_queue_start = NULL;
+	if (cmd_spill_dir) free (cmd_spill_dir);
+	cmd_spill_dir = NULL;
 	return (CMDBUF_OK);
 }
 
@@ -187,6 +478,12 @@ cmd_buffer_free(void)
 #   size with random intervals. String are splitted with a given
 #   frequency in order to test buffering of partial commands.
 #
+#   With -b, compare cmd_buffer_tokenize() with the previous
+#   strdup()/strtok_r() based parser, and measure the commands per
+#   second of both on a pipelined stream of commands. Then check that
+#   commands longer than the buffer are spilled to a temporary file,
+#   and that commands over the length limit are discarded.
+#
 #   Compile with -DCMDBUF_DEBUG option, e.g.
 #   $ gcc -o test_cmdbuffer -DCMDBUF_DEBUG cmdbuffer.c 
 #
@@ -199,6 +496,7 @@ cmd_buffer_free(void)
 #include <time.h>
 #include <string.h>
 #include <getopt.h>
+#include <sys/time.h>
 
 #define NUM_COMMANDS 8
 const char *commands[] = {
@@ -257,10 +555,314 @@ cmd_buffer_dump_internals(void)
 void
 usage(const char *cmd)
 {
-	printf("Usage: %s [-h] [-v <verb>] [-n <iter>]\n", cmd);
+	printf("Usage: %s [-h] [-v <verb>] [-n <iter>] [-b <cmds>]\n", cmd);
 	printf("  -h             print this help and exit\n");
 	printf("  -v <verb>      set verbosity to <verb> (from 0 to 2) (default = 1)\n");
-	printf("  -n <iter>      perform <iter> iterations of the tests (default = 100)\n\n");
+	printf("  -n <iter>      perform <iter> iterations of the tests (default = 100)\n");
+	printf("  -b <cmds>      check and benchmark the parsing of <cmds> commands\n\n");
+	return;
+}
+
+/* Previous parse_command() and free_args(), kept for comparison
+ * */
+static char *
+legacy_unescape(char *str)
+{
+	int i,j,slen;
+
+	slen = strlen(str);
+	for (i = 0,j = 0; j < slen; i++,j++)
+	{
+		if( (str[j]=='\\' && str[j+1]=='\\') ||
+		    (str[j]=='\\' && str[j+1]=='\r') ||
+		    (str[j]=='\\' && str[j+1]=='\n') )
+		{
+			j++;
+		}
+		if (i!=j) str[i]=str[j];
+	}
+	str[i]='\000';
+	return(str);
+}
+
+static int
+legacy_parse_command(const char *cmd, int *argc, char ***argv)
+{
+	char *pointer, *parsed, *next;
+	char **retval;
+	int my_argc, join_arg;
+
+	if (strlen(cmd) == 0) return(1);
+	retval = (char **)malloc(sizeof(char *));
+	parsed = strdup(cmd);
+	my_argc = 0;
+	next = strtok_r(parsed, " ", &pointer);
+	if (next == NULL)
+	{
+		free(retval);
+		free(parsed);
+		return(1);
+	}
+	retval[my_argc] = strdup(next);
+	while (next != NULL)
+	{
+		join_arg = (retval[my_argc][strlen(retval[my_argc]) - 1] != '\\') ? 0 : 1;
+		next = strtok_r(NULL, " ", &pointer);
+		if (next != NULL)
+		{
+			if (join_arg)
+			{
+				retval[my_argc][strlen(retval[my_argc]) - 1] = ' ';
+				retval[my_argc] = (char *) realloc (retval[my_argc], strlen(retval[my_argc]) + strlen(next) + 1);
+				strcat(retval[my_argc], next);
+			}
+			else
+			{
+				legacy_unescape(retval[my_argc]);
+				my_argc++;
+				retval = (char **) realloc (retval, (my_argc+1) * sizeof(char *));
+				retval[my_argc] = strdup(next);
+			}
+		}
+	}
+	legacy_unescape(retval[my_argc]);
+	my_argc++;
+	retval = (char **) realloc (retval, (my_argc+1) * sizeof(char *));
+	retval[my_argc] = NULL;
+	*argv = retval;
+	*argc = my_argc;
+	free(parsed);
+	return(0);
+}
+
+static void
+legacy_free_args(char **argv)
+{
+	char **arg_ptr;
+
+	for (arg_ptr = argv; (*arg_ptr) != NULL; arg_ptr++)
+		free(*arg_ptr);
+	free(argv);
+}
+
+#define NUM_PARSE_TESTS 10
+const char *parse_tests[] = {
+	"BLAH_JOB_STATUS 12 pbs/20261017/123.ce",
+	"  BLAH_JOB_CANCEL   13  lsf/20261017/456  ",
+	"BLAH_JOB_SUBMIT 14 [Cmd\\ =\\ \"/bin/sleep\";\\ Args\\ =\\ \"100\";\\ Out\\ =\\ \"/tmp/out\\\\\\\\log\";]",
+	"ESCAPED\\ \\ SPACES one\\  two\\",
+	"TRAILING\\",
+	"JOINED\\    AFTER\\  MANY\\   SPACES",
+	"X",
+	"\\\\ \\\\\\\\ \\",
+	"A B C D E F G H I J K L M N O P Q R S T U V W X Y Z",
+	/* Not sent on the stream, where '\r' and '\n' end the command */
+	"BACKSLASHES a\\\\\\\\b c\\\\\\\\ d e\\\\\r f\\\\\n"
+};
+#define NUM_STREAM_TESTS (NUM_PARSE_TESTS - 1)
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1000000.);
+}
+
+/* Send n pipelined commands to the pipe, then close it
+ * */
+static void
+send_pipelined(int wfd, int n)
+{
+	char buf[65536];
+	size_t len = 0, cmd_len;
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		cmd_len = strlen(parse_tests[i % NUM_STREAM_TESTS]);
+		if (len + cmd_len + 2 > sizeof(buf))
+		{
+			write(wfd, buf, len);
+			len = 0;
+		}
+		memcpy(buf + len, parse_tests[i % NUM_STREAM_TESTS], cmd_len);
+		memcpy(buf + len + cmd_len, "\r\n", 2);
+		len += cmd_len + 2;
+	}
+	write(wfd, buf, len);
+	close(wfd);
+}
+
+/* Get and parse the pipelined commands, return the elapsed time
+ * */
+static double
+receive_pipelined(int n, int legacy)
+{
+	char *command;
+	char **argv;
+	int argc, res, received = 0;
+	int pfd[2];
+	pid_t pid;
+	double start;
+
+	res = pipe(pfd);
+	assert(res == 0);
+	if ((pid = fork()) == 0)
+	{
+		close(pfd[0]);
+		send_pipelined(pfd[1], n);
+		_exit(0);
+	}
+	close(pfd[1]);
+	res = cmd_buffer_init(pfd[0], 4096, 0);
+	assert(res == CMDBUF_OK);
+
+	start = now();
+	for (;;)
+	{
+		if (legacy)
+		{
+			if (cmd_buffer_get_command(&command) != CMDBUF_OK) break;
+			if (legacy_parse_command(command, &argc, &argv) == 0)
+				legacy_free_args(argv);
+			free(command);
+		}
+		else
+		{
+			if (cmd_buffer_get_args(&argc, &argv, NULL, 0) != CMDBUF_OK) break;
+			free(argv);
+		}
+		received++;
+	}
+	start = now() - start;
+
+	assert(received == n);
+	close(pfd[0]);
+	cmd_buffer_free();
+	waitpid(pid, NULL, 0);
+	return(start);
+}
+
+/* Send a long command made of n_args arguments of arg_len bytes
+ * */
+static void
+send_long_command(int wfd, int n_args, size_t arg_len)
+{
+	char *arg;
+	int i;
+
+	arg = (char *)malloc(arg_len + 1);
+	assert(arg != NULL);
+	memset(arg, 'x', arg_len);
+	arg[arg_len] = ' ';
+	write(wfd, "LONG ", 5);
+	for (i = 0; i < n_args; i++) write(wfd, arg, arg_len + 1);
+	write(wfd, "\r\n", 2);
+	free(arg);
+}
+
+/* Receive commands longer than the buffer, and longer than the limit
+ * */
+static void
+check_long_commands(void)
+{
+	char **argv;
+	int argc, i, res;
+	int pfd[2];
+	pid_t pid;
+	double start;
+
+	res = pipe(pfd);
+	assert(res == 0);
+	if ((pid = fork()) == 0)
+	{
+		close(pfd[0]);
+		write(pfd[1], "SHORT 1\r\n", 9);
+		send_long_command(pfd[1], 1024, 1023);      /* 1 MB, spilled */
+		send_long_command(pfd[1], 4096, 1023);      /* 4 MB, discarded */
+		write(pfd[1], "SHORT 2\r\n", 9);
+		send_long_command(pfd[1], 1024, 1023);
+		close(pfd[1]);
+		_exit(0);
+	}
+	close(pfd[1]);
+	res = cmd_buffer_init(pfd[0], 4096, 0);
+	assert(res == CMDBUF_OK);
+	res = cmd_buffer_set_limits(65536, 2*BUFF_INCR_LIMIT, "/tmp");
+	assert(res == CMDBUF_OK);
+
+	res = cmd_buffer_get_args(&argc, &argv, NULL, 0);
+	assert(res == CMDBUF_OK);
+	assert(argc == 2 && strcmp(argv[1], "1") == 0);
+	free(argv);
+
+	start = now();
+	res = cmd_buffer_get_args(&argc, &argv, NULL, 0);
+	start = now() - start;
+	assert(res == CMDBUF_OK);
+	assert(argc == 1025 && strcmp(argv[0], "LONG") == 0);
+	for (i = 1; i < argc; i++)
+		assert(strlen(argv[i]) == 1023 && argv[i][0] == 'x' && argv[i][1022] == 'x');
+	free(argv);
+	printf("1 MB command with a 64 KB buffer: %g MB/s.\n", 1 / start);
+
+	res = cmd_buffer_get_args(&argc, &argv, NULL, 0);
+	assert(res == CMDBUF_ERROR_TOOLONG);
+	res = cmd_buffer_get_args(&argc, &argv, NULL, 0);
+	assert(res == CMDBUF_OK);
+	assert(argc == 2 && strcmp(argv[1], "2") == 0);
+	free(argv);
+	res = cmd_buffer_get_args(&argc, &argv, NULL, 0);
+	assert(res == CMDBUF_OK);
+	assert(argc == 1025);
+	free(argv);
+	res = cmd_buffer_get_args(&argc, &argv, NULL, 0);
+	assert(res == CMDBUF_ERROR_READ);
+
+	close(pfd[0]);
+	cmd_buffer_free();
+	cmd_buffer_set_limits(BUFF_INCR_LIMIT, SPILL_LIMIT, NULL);
+	waitpid(pid, NULL, 0);
+}
+
+/* Compare the parsers, then measure their speed
+ * */
+void
+benchmark(int n)
+{
+	char **argv, **legacy_argv;
+	char *extra[2] = { "EXTRA 1", "EXTRA\\ 2" };
+	int argc, legacy_argc, i, t, res;
+	double legacy_secs, new_secs;
+
+	for (t = 0; t < NUM_PARSE_TESTS; t++)
+	{
+		res = legacy_parse_command(parse_tests[t], &legacy_argc, &legacy_argv);
+		assert(res == 0);
+		res = cmd_buffer_tokenize(parse_tests[t], strlen(parse_tests[t]), extra, 2, &argc, &argv);
+		assert(res == CMDBUF_OK);
+		assert(argc == legacy_argc);
+		for (i = 0; i < argc; i++)
+			assert(strcmp(argv[i], legacy_argv[i]) == 0);
+		assert(strcmp(argv[argc], extra[0]) == 0);
+		assert(strcmp(argv[argc + 1], extra[1]) == 0);
+		assert(argv[argc + 2] == NULL);
+		legacy_free_args(legacy_argv);
+		free(argv);
+	}
+	res = cmd_buffer_tokenize("   ", 3, NULL, 0, &argc, &argv);
+	assert(res == CMDBUF_OK);
+	assert(argc == 0 && argv[0] == NULL);
+	free(argv);
+
+	legacy_secs = receive_pipelined(n, 1);
+	new_secs = receive_pipelined(n, 0);
+	printf("%d pipelined commands. strdup() and strtok_r(): %g commands/s.\n", n, n / legacy_secs);
+	printf("%d pipelined commands. In place, single allocation: %g commands/s.\n", n, n / new_secs);
+
+	check_long_commands();
 	return;
 }
 
@@ -354,9 +956,12 @@ main(int argc, char **argv)
 	int verb = 1, iter = 100;
 	char opt;
 
-	while((opt = getopt(argc, argv, "hn:v:")) != -1)
+	while((opt = getopt(argc, argv, "hn:v:b:")) != -1)
 	{
 		switch(opt) {
+		case 'b':
+			benchmark(atoi(optarg));
+			exit(0);
 		case 'h':
 			usage(argv[0]);
 			exit(0);
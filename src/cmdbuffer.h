@@ -7,6 +7,7 @@
 #
 #  Revision history:
 #   25 Aug 2011 - Original release
+#   17 Oct 2026 - Added cmd_buffer_set_limits() and CMDBUF_ERROR_TOOLONG
 #
 #  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
 #
@@ -33,8 +34,13 @@
 #define CMDBUF_ERROR_NOBUFFER   3
 #define CMDBUF_ERROR_POLL       4
 #define CMDBUF_ERROR_READ       5
+#define CMDBUF_ERROR_TOOLONG    6
 
 /* Exported functions */
 int cmd_buffer_init(const int fd, const size_t bufsize, const int timeout);
+int cmd_buffer_set_limits(const size_t max_buffer, const size_t max_command, const char *spill_dir);
 int cmd_buffer_get_command(char **command);
+int cmd_buffer_has_command(void);
+int cmd_buffer_get_args(int *argc, char ***argv, char * const *extra, const int n_extra);
+int cmd_buffer_tokenize(const char *cmd, const size_t len, char * const *extra, const int n_extra, int *argc, char ***argv);
 int cmd_buffer_free(void);
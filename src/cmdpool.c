@@ -0,0 +1,552 @@
+/*
+#  File:     cmdpool.c
+#
+#
+#  Revision history:
+#   17 Oct 2026 - Original release
+#   17 Oct 2026 - Fair share and concurrency limits per mapped user
+#   17 Oct 2026 - Per-user FIFOs served round robin, O(1) dequeue
+#
+#  Description:
+#   Fixed pool of worker threads serving the threaded commands,
+#   with one bounded work queue per kind of command.
+#   Within each queue, the waiting commands of each user (as mapped
+#   by sudo or glexec) are kept in order, and the users are served
+#   in turn, optionally up to a per-user limit of running commands.
+#
+#
+#  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
+#
+#    See http://www.eu-egee.org/partners/ for details on the copyright
+#    holders.
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+#
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cmdpool.h"
+
+typedef struct cmd_pool_task_s {
+	void *(*handler)(void *);
+	void *args;
+	struct cmd_pool_user_s *user;
+	struct cmd_pool_task_s *next;
+} cmd_pool_task;
+
+typedef struct cmd_pool_user_s {
+	char *name;
+	int running;              /* Tasks of this user being served */
+	int queued;               /* Tasks of this user waiting */
+	cmd_pool_task *head;      /* Oldest waiting task of this user */
+	cmd_pool_task *tail;
+	int in_ring;              /* Linked in the ring of users to serve */
+	struct cmd_pool_user_s *ring_next;
+	struct cmd_pool_user_s *ring_prev;
+	struct cmd_pool_user_s *next;
+} cmd_pool_user;
+
+typedef struct cmd_pool_queue_s {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;     /* A task was queued or completed */
+	cmd_pool_user *ring;      /* Next user to serve, among the ones with */
+	                          /* waiting tasks and below their limit */
+	cmd_pool_task *free_list; /* Recycled task structures */
+	cmd_pool_user *users;     /* Users with queued or running tasks */
+	int n_queued;             /* Tasks waiting for a worker */
+	int max_queued;           /* 0: no limit */
+	int max_per_user;         /* Running tasks per user, 0: no limit */
+	int n_workers;
+} cmd_pool_queue;
+
+static cmd_pool_queue cmd_pool_queues[CMDPOOL_NUM_QUEUES];
+
+
+/* Look up (or add) the record of a user on a queue
+ * Called with the queue lock held
+ * */
+static cmd_pool_user *
+cmd_pool_get_user(cmd_pool_queue *q, const char *name)
+{
+	cmd_pool_user *u;
+
+	if (name == NULL) name = "";
+	for (u = q->users; u != NULL; u = u->next)
+		if (strcmp(u->name, name) == 0) return(u);
+
+	if ((u = (cmd_pool_user *)malloc(sizeof(cmd_pool_user))) == NULL) return(NULL);
+	if ((u->name = strdup(name)) == NULL)
+	{
+		free(u);
+		return(NULL);
+	}
+	u->running = u->queued = 0;
+	u->head = u->tail = NULL;
+	u->in_ring = 0;
+	u->next = q->users;
+	q->users = u;
+	return(u);
+}
+
+/* Drop the record of a user with no more tasks
+ * Called with the queue lock held
+ * */
+static void
+cmd_pool_release_user(cmd_pool_queue *q, cmd_pool_user *user)
+{
+	cmd_pool_user **u;
+
+	if (user->running > 0 || user->queued > 0) return;
+	for (u = &q->users; *u != NULL; u = &((*u)->next))
+	{
+		if (*u == user)
+		{
+			*u = user->next;
+			free(user->name);
+			free(user);
+			return;
+		}
+	}
+}
+
+/* Add a user at the end of the ring, i.e. just before the next one
+ * to serve, if it has waiting tasks and is below its limit
+ * Called with the queue lock held
+ * */
+static void
+cmd_pool_ring_insert(cmd_pool_queue *q, cmd_pool_user *u)
+{
+	if (u->in_ring || u->head == NULL) return;
+	if (q->max_per_user > 0 && u->running >= q->max_per_user) return;
+
+	if (q->ring == NULL)
+	{
+		u->ring_next = u->ring_prev = u;
+		q->ring = u;
+	}
+	else
+	{
+		u->ring_next = q->ring;
+		u->ring_prev = q->ring->ring_prev;
+		u->ring_prev->ring_next = u;
+		q->ring->ring_prev = u;
+	}
+	u->in_ring = 1;
+}
+
+/* Called with the queue lock held
+ * */
+static void
+cmd_pool_ring_remove(cmd_pool_queue *q, cmd_pool_user *u)
+{
+	if (!u->in_ring) return;
+	if (u->ring_next == u)
+		q->ring = NULL;
+	else
+	{
+		u->ring_prev->ring_next = u->ring_next;
+		u->ring_next->ring_prev = u->ring_prev;
+		if (q->ring == u) q->ring = u->ring_next;
+	}
+	u->in_ring = 0;
+}
+
+/* Unlink the next task to serve: the oldest task of the next user
+ * in the ring, then move on to the following user.
+ * Return NULL if no task can be served now.
+ * Called with the queue lock held
+ * */
+static cmd_pool_task *
+cmd_pool_next_task(cmd_pool_queue *q)
+{
+	cmd_pool_user *u;
+	cmd_pool_task *task;
+
+	if ((u = q->ring) == NULL) return(NULL);
+
+	task = u->head;
+	if ((u->head = task->next) == NULL) u->tail = NULL;
+	u->queued--;
+	u->running++;
+	q->n_queued--;
+
+	q->ring = u->ring_next;
+	if (u->head == NULL || (q->max_per_user > 0 && u->running >= q->max_per_user))
+		cmd_pool_ring_remove(q, u);
+	return(task);
+}
+
+/* Worker thread: serve the tasks of one queue
+ * */
+static void *
+cmd_pool_worker(void *arg)
+{
+	cmd_pool_queue *q = (cmd_pool_queue *)arg;
+	cmd_pool_task *task;
+	cmd_pool_user *user;
+	void *(*handler)(void *);
+	void *args;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;)
+	{
+		while ((task = cmd_pool_next_task(q)) == NULL)
+			pthread_cond_wait(&q->ready, &q->lock);
+
+		handler = task->handler;
+		args = task->args;
+		user = task->user;
+		task->next = q->free_list;
+		q->free_list = task;
+		pthread_mutex_unlock(&q->lock);
+
+		/* The handler is responsible for freeing its arguments */
+		handler(args);
+
+		pthread_mutex_lock(&q->lock);
+		user->running--;
+		/* Tasks held back by the per-user limit may be served now */
+		cmd_pool_ring_insert(q, user);
+		cmd_pool_release_user(q, user);
+		if (q->ring != NULL) pthread_cond_signal(&q->ready);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return(NULL);
+}
+
+
+/* Start the worker threads of each queue
+ * n_workers[i], max_queued[i] and max_per_user[i] are the number of
+ * workers, the maximum number of waiting tasks (0 = unlimited) and
+ * the maximum number of running tasks per user (0 = unlimited)
+ * of queue i
+ * */
+int
+cmd_pool_init(const int *n_workers, const int *max_queued, const int *max_per_user)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	cmd_pool_queue *q;
+	int i, w;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < CMDPOOL_NUM_QUEUES; i++)
+	{
+		q = &cmd_pool_queues[i];
+		pthread_mutex_init(&q->lock, NULL);
+		pthread_cond_init(&q->ready, NULL);
+		q->ring = NULL;
+		q->free_list = NULL;
+		q->users = NULL;
+		q->n_queued = 0;
+		q->max_queued = (max_queued[i] > 0) ? max_queued[i] : 0;
+		q->max_per_user = (max_per_user[i] > 0) ? max_per_user[i] : 0;
+		q->n_workers = (n_workers[i] > 0) ? n_workers[i] : CMDPOOL_DEFAULT_WORKERS;
+
+		for (w = 0; w < q->n_workers; w++)
+		{
+			if (pthread_create(&tid, &attr, cmd_pool_worker, q))
+			{
+				pthread_attr_destroy(&attr);
+				return(CMDPOOL_ERROR_THREAD);
+			}
+		}
+	}
+	pthread_attr_destroy(&attr);
+	return(CMDPOOL_OK);
+}
+
+
+/* Queue a call to handler(args) on the given queue, on behalf
+ * of user (NULL when commands are not mapped)
+ * Return CMDPOOL_QUEUE_FULL (without queueing) if the queue
+ * already holds max_queued waiting tasks
+ * */
+int
+cmd_pool_submit(const int queue, const char *user, void *(*handler)(void *), void *args)
+{
+	cmd_pool_queue *q;
+	cmd_pool_task *task;
+
+	if (queue < 0 || queue >= CMDPOOL_NUM_QUEUES) return(CMDPOOL_ERROR_QUEUE);
+	q = &cmd_pool_queues[queue];
+
+	pthread_mutex_lock(&q->lock);
+	if (q->max_queued > 0 && q->n_queued >= q->max_queued)
+	{
+		pthread_mutex_unlock(&q->lock);
+		return(CMDPOOL_QUEUE_FULL);
+	}
+	if ((task = q->free_list) != NULL)
+		q->free_list = task->next;
+	else if ((task = (cmd_pool_task *)malloc(sizeof(cmd_pool_task))) == NULL)
+	{
+		pthread_mutex_unlock(&q->lock);
+		return(CMDPOOL_ERROR_NOMEM);
+	}
+	if ((task->user = cmd_pool_get_user(q, user)) == NULL)
+	{
+		task->next = q->free_list;
+		q->free_list = task;
+		pthread_mutex_unlock(&q->lock);
+		return(CMDPOOL_ERROR_NOMEM);
+	}
+	task->user->queued++;
+	task->handler = handler;
+	task->args = args;
+	task->next = NULL;
+	if (task->user->tail != NULL) task->user->tail->next = task;
+	else                          task->user->head = task;
+	task->user->tail = task;
+	cmd_pool_ring_insert(q, task->user);
+	q->n_queued++;
+	pthread_cond_signal(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+
+	return(CMDPOOL_OK);
+}
+
+
+/* Return the number of tasks waiting for a worker on a queue
+ * */
+int
+cmd_pool_queued(const int queue)
+{
+	int n_queued;
+
+	if (queue < 0 || queue >= CMDPOOL_NUM_QUEUES) return(-1);
+	pthread_mutex_lock(&cmd_pool_queues[queue].lock);
+	n_queued = cmd_pool_queues[queue].n_queued;
+	pthread_mutex_unlock(&cmd_pool_queues[queue].lock);
+	return(n_queued);
+}
+
+
+#ifdef CMDPOOL_DEBUG
+/* ------ TEST CODE HERE -------
+#
+#  Description:
+#   Flood the submit queue with slow tasks and measure the latency
+#   of fast status tasks queued meanwhile. Also check that a full
+#   queue rejects further tasks.
+#   Then flood the control queue with slow tasks of one user, and
+#   check that the per-user limit is enforced and that the tasks
+#   of another user are served without waiting for the flood.
+#   Finally, with the flood still waiting, measure how many tasks
+#   per second the queue serves for many other users.
+#
+#   Compile with -DCMDPOOL_DEBUG option, e.g.
+#   $ gcc -o test_cmdpool -DCMDPOOL_DEBUG cmdpool.c -lpthread
+#
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <getopt.h>
+
+static pthread_mutex_t test_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t test_done = PTHREAD_COND_INITIALIZER;
+static int test_n_done = 0;
+static double test_total_latency = 0;
+static double test_max_latency = 0;
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1000000.);
+}
+
+/* Slow task, standing for a submit script */
+void *
+slow_task(void *args)
+{
+	usleep(*(int *)args);
+	free(args);
+	return(NULL);
+}
+
+/* Slow task of the flooding user: track its concurrency */
+static int test_storm_running = 0;
+static int test_storm_max_running = 0;
+
+void *
+storm_task(void *args)
+{
+	pthread_mutex_lock(&test_lock);
+	if (++test_storm_running > test_storm_max_running)
+		test_storm_max_running = test_storm_running;
+	pthread_mutex_unlock(&test_lock);
+	usleep(*(int *)args);
+	free(args);
+	pthread_mutex_lock(&test_lock);
+	test_storm_running--;
+	pthread_mutex_unlock(&test_lock);
+	return(NULL);
+}
+
+/* Fast task: record the time spent in the queue */
+void *
+fast_task(void *args)
+{
+	double latency = now() - *(double *)args;
+
+	free(args);
+	pthread_mutex_lock(&test_lock);
+	test_total_latency += latency;
+	if (latency > test_max_latency) test_max_latency = latency;
+	test_n_done++;
+	pthread_cond_signal(&test_done);
+	pthread_mutex_unlock(&test_lock);
+	return(NULL);
+}
+
+/* Print usage
+ * */
+void
+usage(const char *cmd)
+{
+	printf("Usage: %s [-h] [-n <tasks>] [-s <usec>]\n", cmd);
+	printf("  -h             print this help and exit\n");
+	printf("  -n <tasks>     number of slow and of fast tasks (default = 200)\n");
+	printf("  -s <usec>      duration of each slow task (default = 50000)\n\n");
+	return;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int n_workers[CMDPOOL_NUM_QUEUES] = { 4, 4, 4 };
+	int max_queued[CMDPOOL_NUM_QUEUES] = { 0, 0, 0 };
+	int max_per_user[CMDPOOL_NUM_QUEUES] = { 0, 2, 0 };
+	int n_tasks = 200, slow_usec = 50000;
+	int i, opt, res, n_rejected = 0;
+	int n_fast = 100000;
+	char user[16];
+	double start;
+	int *slow_arg;
+	double *fast_arg;
+
+	while ((opt = getopt(argc, argv, "hn:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': n_tasks = atoi(optarg); break;
+		case 's': slow_usec = atoi(optarg); break;
+		default: usage(argv[0]); exit(opt == 'h' ? 0 : 1);
+		}
+	}
+	max_queued[CMDPOOL_QUEUE_SUBMIT] = n_tasks;
+
+	res = cmd_pool_init(n_workers, max_queued, max_per_user);
+	assert(res == CMDPOOL_OK);
+
+	/* Flood the submit queue, then go beyond its limit */
+	for (i = 0; i < n_tasks + n_workers[CMDPOOL_QUEUE_SUBMIT] + 10; i++)
+	{
+		slow_arg = (int *)malloc(sizeof(int));
+		*slow_arg = slow_usec;
+		if (cmd_pool_submit(CMDPOOL_QUEUE_SUBMIT, NULL, slow_task, slow_arg) == CMDPOOL_QUEUE_FULL)
+		{
+			free(slow_arg);
+			n_rejected++;
+		}
+	}
+	assert(n_rejected > 0);
+	assert(cmd_pool_queued(CMDPOOL_QUEUE_SUBMIT) <= n_tasks);
+
+	/* Status tasks must not wait for the slow ones */
+	for (i = 0; i < n_tasks; i++)
+	{
+		fast_arg = (double *)malloc(sizeof(double));
+		*fast_arg = now();
+		res = cmd_pool_submit(CMDPOOL_QUEUE_STATUS, NULL, fast_task, fast_arg);
+		assert(res == CMDPOOL_OK);
+	}
+
+	pthread_mutex_lock(&test_lock);
+	while (test_n_done < n_tasks)
+		pthread_cond_wait(&test_done, &test_lock);
+	pthread_mutex_unlock(&test_lock);
+
+	printf("%d slow tasks queued (%d rejected), %d submit tasks still waiting.\n",
+	       n_tasks + n_workers[CMDPOOL_QUEUE_SUBMIT] + 10 - n_rejected, n_rejected,
+	       cmd_pool_queued(CMDPOOL_QUEUE_SUBMIT));
+	printf("Status task latency: average %g s, max %g s (a slow task takes %g s).\n",
+	       test_total_latency / n_tasks, test_max_latency, slow_usec / 1000000.);
+	assert(test_max_latency < slow_usec / 1000000.);
+
+	/* One user floods the control queue, another one must */
+	/* find free workers. */
+	for (i = 0; i < n_tasks; i++)
+	{
+		slow_arg = (int *)malloc(sizeof(int));
+		*slow_arg = slow_usec;
+		res = cmd_pool_submit(CMDPOOL_QUEUE_CONTROL, "storm", storm_task, slow_arg);
+		assert(res == CMDPOOL_OK);
+	}
+	pthread_mutex_lock(&test_lock);
+	test_n_done = 0;
+	test_total_latency = test_max_latency = 0;
+	pthread_mutex_unlock(&test_lock);
+	for (i = 0; i < n_tasks; i++)
+	{
+		fast_arg = (double *)malloc(sizeof(double));
+		*fast_arg = now();
+		res = cmd_pool_submit(CMDPOOL_QUEUE_CONTROL, "other", fast_task, fast_arg);
+		assert(res == CMDPOOL_OK);
+	}
+
+	pthread_mutex_lock(&test_lock);
+	while (test_n_done < n_tasks)
+		pthread_cond_wait(&test_done, &test_lock);
+	pthread_mutex_unlock(&test_lock);
+
+	printf("Control queue: %d tasks of the flooding user waiting, at most %d running (limit %d).\n",
+	       cmd_pool_queued(CMDPOOL_QUEUE_CONTROL), test_storm_max_running,
+	       max_per_user[CMDPOOL_QUEUE_CONTROL]);
+	printf("Other user task latency: average %g s, max %g s.\n",
+	       test_total_latency / n_tasks, test_max_latency);
+	assert(test_storm_max_running <= max_per_user[CMDPOOL_QUEUE_CONTROL]);
+	assert(test_max_latency < slow_usec / 1000000.);
+
+	/* Dequeue rate, with many users and a long flood waiting */
+	pthread_mutex_lock(&test_lock);
+	test_n_done = 0;
+	pthread_mutex_unlock(&test_lock);
+	start = now();
+	for (i = 0; i < n_fast; i++)
+	{
+		snprintf(user, sizeof(user), "user%d", i % 100);
+		fast_arg = (double *)malloc(sizeof(double));
+		*fast_arg = now();
+		res = cmd_pool_submit(CMDPOOL_QUEUE_CONTROL, user, fast_task, fast_arg);
+		assert(res == CMDPOOL_OK);
+	}
+	pthread_mutex_lock(&test_lock);
+	while (test_n_done < n_fast)
+		pthread_cond_wait(&test_done, &test_lock);
+	pthread_mutex_unlock(&test_lock);
+	printf("%d tasks of 100 users served in %g s, %d tasks of the flooding user waiting.\n",
+	       n_fast, now() - start, cmd_pool_queued(CMDPOOL_QUEUE_CONTROL));
+	return(0);
+}
+#endif /* CMDPOOL_DEBUG */
@@ -0,0 +1,51 @@
+/*
+#  File:     cmdpool.h
+#
+#
+#  Revision history:
+#   17 Oct 2026 - Original release
+#   17 Oct 2026 - Added per-user limits
+#
+#  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
+#
+#    See http://www.eu-egee.org/partners/ for details on the copyright
+#    holders.
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+#
+*/
+
+#ifndef CMDPOOL_INCLUDED
+#define CMDPOOL_INCLUDED
+
+#define CMDPOOL_OK              0
+#define CMDPOOL_QUEUE_FULL      1
+#define CMDPOOL_ERROR_NOMEM     2
+#define CMDPOOL_ERROR_THREAD    3
+#define CMDPOOL_ERROR_QUEUE     4
+
+/* Work queues, each served by its own worker threads, so that */
+/* commands of one kind cannot starve the others. */
+#define CMDPOOL_QUEUE_STATUS    0  /* Job status lookups */
+#define CMDPOOL_QUEUE_CONTROL   1  /* Cancel, hold, resume, proxy renewal */
+#define CMDPOOL_QUEUE_SUBMIT    2  /* Job submission */
+#define CMDPOOL_NUM_QUEUES      3
+
+#define CMDPOOL_DEFAULT_WORKERS 8
+
+/* Exported functions */
+int cmd_pool_init(const int *n_workers, const int *max_queued, const int *max_per_user);
+int cmd_pool_submit(const int queue, const char *user, void *(*handler)(void *), void *args);
+int cmd_pool_queued(const int queue);
+
+#endif /* ifndef CMDPOOL_INCLUDED */
@@ -11,6 +11,8 @@
 #                 in commands.
 #   27 Mar 2006 - COMMANDS_NUM definition changed (no need to update
 #                 it manually when adding/removing commands).
+#   17 Oct 2026 - Added work queue of threaded commands.
+#   17 Oct 2026 - Commands are split in place by cmd_buffer_tokenize().
 #
 #  Description:
 #   Parse client commands
@@ -39,36 +41,38 @@
 #include <stdio.h>
 #include <string.h>
 #include "commands.h"
+#include "cmdpool.h"
+#include "cmdbuffer.h"
 #include "blahpd.h"
 
 /* Initialise commands array (strict alphabetical order)
  * handler functions prototypes are in commands.h
  * */    
 command_t commands_array[] = {
-	/* cmd string, # of pars, threaded (0=not threaded, 1=threaded, 2=treaded+proxy), handler */
-	{ "ASYNC_MODE_OFF",               0, 0, cmd_async_off },
-	{ "ASYNC_MODE_ON",                0, 0, cmd_async_on },
-	{ "BLAH_GET_HOSTPORT",            1, 1, cmd_get_hostport },
-	{ "BLAH_JOB_CANCEL",              2, 1, cmd_cancel_job },
-	{ "BLAH_JOB_HOLD",                2, 1, cmd_hold_job },
-	{ "BLAH_JOB_REFRESH_PROXY",       3, 2, cmd_renew_proxy },
-	{ "BLAH_JOB_RESUME",              2, 1, cmd_resume_job },
-	{ "BLAH_JOB_SEND_PROXY_TO_WORKER_NODE", 4, 2, cmd_send_proxy_to_worker_node },
-	{ "BLAH_JOB_STATUS",              2, 1, cmd_status_job },
-	{ "BLAH_JOB_STATUS_ALL",          1, 1, cmd_unknown },
-	{ "BLAH_JOB_STATUS_SELECT",       2, 1, cmd_unknown },
-	{ "BLAH_JOB_SUBMIT",              2, 2, cmd_submit_job },
-	{ "BLAH_SET_GLEXEC_DN",           3, 0, cmd_set_glexec_dn },
-	{ "BLAH_SET_GLEXEC_OFF",          0, 0, cmd_unset_glexec_dn },	
-	{ "BLAH_SET_SUDO_ID",             1, 0, cmd_set_sudo_id },
-	{ "BLAH_SET_SUDO_OFF",            0, 0, cmd_set_sudo_off },	
-	{ "CACHE_PROXY_FROM_FILE",        2, 0, cmd_unknown },
-	{ "COMMANDS",                     0, 0, cmd_commands },
-	{ "QUIT",                         0, 0, cmd_quit },
-	{ "RESULTS",                      0, 0, cmd_results },
-	{ "UNCACHE_PROXY",                1, 0, cmd_unknown },
-	{ "USE_CACHED_PROXY",             1, 0, cmd_unknown },
-	{ "VERSION",                      0, 0, cmd_version }
+	/* cmd string, # of pars, threaded (0=not threaded, 1=threaded, 2=treaded+proxy), queue, handler */
+	{ "ASYNC_MODE_OFF",               0, 0, 0,                     cmd_async_off },
+	{ "ASYNC_MODE_ON",                0, 0, 0,                     cmd_async_on },
+	{ "BLAH_GET_HOSTPORT",            1, 1, CMDPOOL_QUEUE_CONTROL, cmd_get_hostport },
+	{ "BLAH_JOB_CANCEL",              2, 1, CMDPOOL_QUEUE_CONTROL, cmd_cancel_job },
+	{ "BLAH_JOB_HOLD",                2, 1, CMDPOOL_QUEUE_CONTROL, cmd_hold_job },
+	{ "BLAH_JOB_REFRESH_PROXY",       3, 2, CMDPOOL_QUEUE_CONTROL, cmd_renew_proxy },
+	{ "BLAH_JOB_RESUME",              2, 1, CMDPOOL_QUEUE_CONTROL, cmd_resume_job },
+	{ "BLAH_JOB_SEND_PROXY_TO_WORKER_NODE", 4, 2, CMDPOOL_QUEUE_CONTROL, cmd_send_proxy_to_worker_node },
+	{ "BLAH_JOB_STATUS",              2, 1, CMDPOOL_QUEUE_STATUS,  cmd_status_job },
+	{ "BLAH_JOB_STATUS_ALL",          1, 1, CMDPOOL_QUEUE_STATUS,  cmd_unknown },
+	{ "BLAH_JOB_STATUS_SELECT",       2, 1, CMDPOOL_QUEUE_STATUS,  cmd_unknown },
+	{ "BLAH_JOB_SUBMIT",              2, 2, CMDPOOL_QUEUE_SUBMIT,  cmd_submit_job },
+	{ "BLAH_SET_GLEXEC_DN",           3, 0, 0,                     cmd_set_glexec_dn },
+	{ "BLAH_SET_GLEXEC_OFF",          0, 0, 0,                     cmd_unset_glexec_dn },	
+	{ "BLAH_SET_SUDO_ID",             1, 0, 0,                     cmd_set_sudo_id },
+	{ "BLAH_SET_SUDO_OFF",            0, 0, 0,                     cmd_set_sudo_off },	
+	{ "CACHE_PROXY_FROM_FILE",        2, 0, 0,                     cmd_unknown },
+	{ "COMMANDS",                     0, 0, 0,                     cmd_commands },
+	{ "QUIT",                         0, 0, 0,                     cmd_quit },
+	{ "RESULTS",                      0, 0, 0,                     cmd_results },
+	{ "UNCACHE_PROXY",                1, 0, 0,                     cmd_unknown },
+	{ "USE_CACHED_PROXY",             1, 0, 0,                     cmd_unknown },
+	{ "VERSION",                      0, 0, 0,                     cmd_version }
 };
 /* N.B.: KEEP STRICT ALPHABETICAL ORDER WHEN ADDING COMMANDS !!!*/
 
@@ -153,83 +157,21 @@ unescape_special_chars(char *str)
 }
 
 /* Split a command string into tokens
+ * argv and the tokens are a single allocation: free them with free_args()
  * */
 int
 parse_command(const char *cmd, int *argc, char ***argv)
 {
-	char *pointer;
-	char *parsed;
-	char *reallocated;
-	char *next;
-	char **retval;
-	char **curarg;
-	int my_argc, join_arg;
-
-	if (strlen(cmd) == 0)
-	{
-		*argv = NULL;
-		*argc = 0;
-		return(1);
-	}
-	
-	if((retval = (char **)malloc(sizeof(char *))) == NULL)
-	{
-		fprintf(stderr, "Out of memory.\n");
-		exit(MALLOC_ERROR);
-	}
-
-	if((parsed = strdup(cmd)) == NULL)
+	if (cmd_buffer_tokenize(cmd, strlen(cmd), NULL, 0, argc, argv) != CMDBUF_OK)
 	{
 		fprintf(stderr, "Out of memory.\n");
 		exit(MALLOC_ERROR);
 	}
-
-	my_argc = 0;
-	
-	next = strtok_r(parsed, " ", &pointer);
-	if (next != NULL) retval[my_argc] = strdup(next);
-	else              retval[my_argc] = NULL;
-
-	while (next != NULL)
-	{
-		join_arg = (retval[my_argc][strlen(retval[my_argc]) - 1] != '\\') ? 0 : 1;
-				
-		next = strtok_r(NULL, " ", &pointer);
-		if (next != NULL)
-		{
-			if (join_arg)
-			{
-				retval[my_argc][strlen(retval[my_argc]) - 1] = ' ';
-				retval[my_argc] = (char *) realloc (retval[my_argc], strlen(retval[my_argc]) + strlen(next) + 1);
-				strcat(retval[my_argc], next);
-			}
-			else
-			{
-				unescape_special_chars(retval[my_argc]);
-				my_argc++;
-				if ((retval = (char **) realloc (retval, (my_argc+1) * sizeof(char *))) == NULL)
-				{
-					fprintf(stderr, "Out of memory.\n");
-					exit(MALLOC_ERROR);
-				}
-				retval[my_argc] = strdup(next);
-			}
-		}
-	}
-
-	unescape_special_chars(retval[my_argc]);
-	my_argc++;
-	if ((retval = (char **) realloc (retval, (my_argc+1) * sizeof(char *))) == NULL)
+	if (*argc == 0)
 	{
-		fprintf(stderr, "Out of memory.\n");
-		exit(2);
+		free(*argv);
+		*argv = NULL;
+		return(1);
 	}
-	retval[my_argc] = NULL;
-
-	*argv = retval;
-	*argc = my_argc;
-
-	free(parsed);
-
 	return(0);
 }
@@ -30,6 +30,7 @@ typedef struct command_s {
 	char    cmd_name[COMMAND_MAX_LEN];
 	int     required_params;
 	int     threaded;
+	int     queue;      /* Work queue of threaded commands (see cmdpool.h) */
 	void    *(*cmd_handler)(void *);
 } command_t;
 
@@ -0,0 +1,934 @@
+/*
+#  File:     execpool.c
+#
+#
+#  Revision history:
+#   17 Oct 2026 - Original release
+#
+#  Description:
+#   Small pool of long-lived helper processes, forked at startup
+#   while the server is still small and single-threaded, that start
+#   the LRMS scripts on its behalf. The streams of the command are
+#   passed to a helper over a socket, and the helper reports the pid
+#   and then the exit status of the command on a per-command pipe.
+#   Without helpers (or if they die), commands are forked directly.
+#
+#
+#  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
+#
+#    See http://www.eu-egee.org/partners/ for details on the copyright
+#    holders.
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+#
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* pipe2() */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "execpool.h"
+
+#define EXECPOOL_MAX_FDS 4        /* stdout, stderr, status, stdin */
+#define EXECPOOL_STATUS_GRACE 100 /* ms to wait for an exit status with WNOHANG */
+
+/* Header of a request, followed by the argv and envp strings */
+typedef struct exec_pool_request_s {
+	int argc;
+	int envc;
+	int has_stdin;
+	size_t strings_len;
+} exec_pool_request;
+
+typedef struct exec_pool_helper_s {
+	pid_t pid;
+	int sock;
+	int dead;
+	pthread_mutex_t lock;     /* Serialises the requests on the socket */
+} exec_pool_helper;
+
+typedef struct exec_pool_running_s {
+	pid_t pid;
+	int status_fd;
+} exec_pool_running;
+
+static exec_pool_helper *exec_pool_helpers = NULL;
+static int exec_pool_n_helpers = 0;
+static int exec_pool_next = 0;
+static pthread_mutex_t exec_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static exec_pool_stats_t exec_pool_stats;
+static int exec_pool_sigchld_pipe[2];
+
+
+static double
+exec_pool_elapsed(const struct timeval *since)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return((now.tv_sec - since->tv_sec) + (now.tv_usec - since->tv_usec) / 1000000.);
+}
+
+static int
+exec_pool_read(const int fd, void *buf, size_t len)
+{
+	ssize_t got;
+
+	while (len > 0)
+	{
+		if ((got = read(fd, buf, len)) < 0)
+		{
+			if (errno == EINTR) continue;
+			return(-1);
+		}
+		if (got == 0) return(-1);
+		buf = (char *)buf + got;
+		len -= got;
+	}
+	return(0);
+}
+
+static void
+exec_pool_set_cloexec(const int fd)
+{
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+
+/* Execute the command in a forked process: the same for the helpers'
+ * children and for the commands forked directly
+ * CAUTION: the caller may be multithreaded, use fork-safe functions only
+ * */
+static void
+exec_pool_exec(char * const argv[], char * const envp[], const int stdin_fd,
+               const int stdout_fd, const int stderr_fd)
+{
+	pid_t process_group;
+
+	/* Set up process group so that the resulting process tree can be signaled. */
+	if (((process_group = setsid()) == -1) ||
+	     (process_group != getpid()))
+	{
+		fprintf(stderr,"Error: setsid() returns %d. getpid returns %d: ", process_group, getpid());
+		perror("");
+		_exit(1);
+	}
+
+	/* Connect stdin to the proxy file if opened */
+	if (stdin_fd != -1)
+	{
+		if (dup2(stdin_fd, STDIN_FILENO) == -1)
+		{
+			perror("dup2() stdin");
+			_exit(1);
+		}
+		umask(077);
+	}
+
+	/* Connect stdout & stderr to the pipes */
+	if (dup2(stdout_fd, STDOUT_FILENO) == -1)
+	{
+		perror("dup2() stdout");
+		_exit(1);
+	}
+	if (dup2(stderr_fd, STDERR_FILENO) == -1)
+	{
+		perror("dup2() stderr");
+		_exit(1);
+	}
+	if (stdin_fd > STDERR_FILENO) close(stdin_fd);
+	if (stdout_fd > STDERR_FILENO) close(stdout_fd);
+	if (stderr_fd > STDERR_FILENO) close(stderr_fd);
+
+	execve(argv[0], argv, envp);
+
+	/* If we are still here, execve failed */
+	fprintf(stderr, "%s: %s", argv[0], strerror(errno));
+	_exit(errno);
+}
+
+
+/* ------ Helper process ------ */
+
+static void
+exec_pool_sigchld(int sig)
+{
+	int saved_errno = errno;
+
+	(void)sig;
+	write(exec_pool_sigchld_pipe[1], "", 1);
+	errno = saved_errno;
+}
+
+/* Receive a request with its file descriptors and start the command
+ * Return the pid (with the status pipe in *status_fd), 0 if the command
+ * could not be started, -1 if the socket was closed or is unusable.
+ * */
+static pid_t
+exec_pool_serve(const int sock, int *status_fd)
+{
+	exec_pool_request req;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(EXECPOOL_MAX_FDS * sizeof(int))];
+	} control;
+	int fds[EXECPOOL_MAX_FDS];
+	int n_fds = 0, n, i, fd;
+	ssize_t got;
+	char *strings = NULL, *s;
+	char **vectors = NULL;
+	pid_t pid = -1;
+	int err;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	do got = recvmsg(sock, &msg, 0); while (got < 0 && errno == EINTR);
+	if (got <= 0) return(-1);
+
+	for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+	{
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+		n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++)
+		{
+			memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+			if (n_fds == EXECPOOL_MAX_FDS)
+			{
+				close(fd);
+				continue;
+			}
+			/* Only the ones dup'ed by the command must survive exec */
+			exec_pool_set_cloexec(fd);
+			fds[n_fds++] = fd;
+		}
+	}
+
+	if ((size_t)got < sizeof(req) && exec_pool_read(sock, (char *)&req + got, sizeof(req) - got) < 0)
+		goto broken;
+	if (n_fds != 3 + (req.has_stdin ? 1 : 0) || req.argc < 1 || req.envc < 0)
+		goto broken;
+	if ((strings = (char *)malloc(req.strings_len + 1)) == NULL ||
+	    (vectors = (char **)malloc((req.argc + req.envc + 2) * sizeof(char *))) == NULL ||
+	    exec_pool_read(sock, strings, req.strings_len) < 0)
+		goto broken;
+	strings[req.strings_len] = '\000';
+
+	/* argv and envp are laid out consecutively, each NULL-terminated */
+	for (i = 0, s = strings; i < req.argc + req.envc; i++, s += strlen(s) + 1)
+	{
+		if (s >= strings + req.strings_len) goto broken;
+		vectors[i + (i >= req.argc ? 1 : 0)] = s;
+	}
+	vectors[req.argc] = NULL;
+	vectors[req.argc + req.envc + 1] = NULL;
+
+	switch (pid = fork())
+	{
+		case -1:
+			err = errno;
+			write(fds[2], &pid, sizeof(pid));
+			write(fds[2], &err, sizeof(err));
+			close(fds[2]);
+			pid = 0;
+			break;
+
+		case 0:
+			/* Restore what the helper changed for itself */
+			signal(SIGPIPE, SIG_DFL);
+			signal(SIGCHLD, SIG_DFL);
+			exec_pool_exec(vectors, vectors + req.argc + 1, req.has_stdin ? fds[3] : -1, fds[0], fds[1]);
+			_exit(1); /* Not reached */
+
+		default:
+			write(fds[2], &pid, sizeof(pid));
+			*status_fd = fds[2];
+	}
+	close(fds[0]);
+	close(fds[1]);
+	if (req.has_stdin) close(fds[3]);
+	free(strings);
+	free(vectors);
+	return(pid);
+
+broken:
+	for (i = 0; i < n_fds; i++) close(fds[i]);
+	free(strings);
+	free(vectors);
+	return(-1);
+}
+
+/* Main loop of a helper: start the commands and report their exit
+ * status, until the server closes the socket and all commands are done
+ * */
+static void
+exec_pool_helper_main(int sock)
+{
+	exec_pool_running *running = NULL, *tmp_realloc;
+	int n_running = 0, n_alloc = 0, new_alloc;
+	struct pollfd fds[2];
+	struct sigaction sa;
+	sigset_t empty_set;
+	char drain[64];
+	pid_t pid;
+	int status, status_fd = -1, i, fd, max_fd;
+
+	/* Keep only stderr (for diagnostics) and the socket: the server */
+	/* connection must not be held open by the helpers or the commands */
+	if ((fd = open("/dev/null", O_RDWR)) >= 0)
+	{
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		if (fd > STDERR_FILENO) close(fd);
+	}
+	max_fd = sysconf(_SC_OPEN_MAX);
+	for (fd = STDERR_FILENO + 1; fd < max_fd && fd < 65536; fd++)
+		if (fd != sock) close(fd);
+
+	sigemptyset(&empty_set);
+	sigprocmask(SIG_SETMASK, &empty_set, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	if (pipe(exec_pool_sigchld_pipe) < 0) _exit(1);
+	for (i = 0; i < 2; i++)
+	{
+		exec_pool_set_cloexec(exec_pool_sigchld_pipe[i]);
+		fcntl(exec_pool_sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+	}
+	exec_pool_set_cloexec(sock);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = exec_pool_sigchld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+
+	for (;;)
+	{
+		if (sock < 0 && n_running == 0) _exit(0);
+
+		fds[0].fd = sock; /* Ignored by poll() once closed */
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = exec_pool_sigchld_pipe[0];
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			_exit(1);
+		}
+
+		if (fds[1].revents & POLLIN)
+		{
+			while (read(exec_pool_sigchld_pipe[0], drain, sizeof(drain)) > 0) /* Empty loop */;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			{
+				for (i = 0; i < n_running; i++)
+				{
+					if (running[i].pid != pid) continue;
+					write(running[i].status_fd, &status, sizeof(status));
+					close(running[i].status_fd);
+					running[i] = running[--n_running];
+					break;
+				}
+			}
+		}
+
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			if ((pid = exec_pool_serve(sock, &status_fd)) < 0)
+			{
+				close(sock);
+				sock = -1;
+			}
+			else if (pid > 0)
+			{
+				if (n_running == n_alloc)
+				{
+					new_alloc = n_alloc ? 2 * n_alloc : 32;
+					tmp_realloc = (exec_pool_running *)realloc(running, new_alloc * sizeof(exec_pool_running));
+					if (tmp_realloc == NULL)
+					{
+						/* The exit status won't be reported */
+						close(status_fd);
+						continue;
+					}
+					running = tmp_realloc;
+					n_alloc = new_alloc;
+				}
+				running[n_running].pid = pid;
+				running[n_running].status_fd = status_fd;
+				n_running++;
+			}
+		}
+	}
+}
+
+
+/* ------ Server side ------ */
+
+/* Start the helpers. Must be called while the process is still
+ * single-threaded (and preferably small).
+ * */
+int
+exec_pool_init(const int n_helpers)
+{
+	int sv[2];
+	int i, j;
+
+	memset(&exec_pool_stats, 0, sizeof(exec_pool_stats));
+	if (n_helpers <= 0) return(EXECPOOL_OK);
+
+	exec_pool_helpers = (exec_pool_helper *)calloc(n_helpers, sizeof(exec_pool_helper));
+	if (exec_pool_helpers == NULL) return(EXECPOOL_ERROR_NOMEM);
+
+	for (i = 0; i < n_helpers; i++)
+	{
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) break;
+		switch (exec_pool_helpers[i].pid = fork())
+		{
+			case -1:
+				close(sv[0]);
+				close(sv[1]);
+				break;
+
+			case 0:
+				for (j = 0; j < i; j++) close(exec_pool_helpers[j].sock);
+				close(sv[0]);
+				exec_pool_helper_main(sv[1]);
+				_exit(0);
+
+			default:
+				close(sv[1]);
+				exec_pool_set_cloexec(sv[0]);
+				exec_pool_helpers[i].sock = sv[0];
+				exec_pool_helpers[i].dead = 0;
+				pthread_mutex_init(&exec_pool_helpers[i].lock, NULL);
+				continue;
+		}
+		break;
+	}
+	exec_pool_n_helpers = i;
+	return(i == n_helpers ? EXECPOOL_OK : EXECPOOL_ERROR_HELPER);
+}
+
+
+/* Stop using a helper, e.g. after it died
+ * Called with the helper lock held
+ * */
+static void
+exec_pool_drop_helper(exec_pool_helper *h)
+{
+	if (h->dead) return;
+	h->dead = 1;
+	close(h->sock);
+	waitpid(h->pid, NULL, WNOHANG);
+}
+
+/* Create a pipe with both ends closed on exec, so that commands
+ * forked directly by other threads don't inherit them (the command
+ * gets its own ends on stdout and stderr through dup2())
+ * */
+int
+exec_pool_pipe(int fds[2])
+{
+	return(pipe2(fds, O_CLOEXEC));
+}
+
+/* Pass a command to a helper
+ * Return the pid, or -1 if the helper could not start it
+ * */
+static pid_t
+exec_pool_helper_spawn(exec_pool_helper *h, char * const argv[], char * const envp[],
+                       const int stdin_fd, const int stdout_fd, const int stderr_fd, int *status_fd)
+{
+	exec_pool_request req;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(EXECPOOL_MAX_FDS * sizeof(int))];
+	} control;
+	int fds[EXECPOOL_MAX_FDS];
+	int status_pipe[2];
+	char *strings, *w;
+	size_t len;
+	ssize_t sent;
+	pid_t pid;
+	int i, ok, err;
+
+	req.argc = req.envc = 0;
+	req.strings_len = 0;
+	for (i = 0; argv[i] != NULL; i++, req.argc++) req.strings_len += strlen(argv[i]) + 1;
+	for (i = 0; envp != NULL && envp[i] != NULL; i++, req.envc++) req.strings_len += strlen(envp[i]) + 1;
+	req.has_stdin = (stdin_fd != -1);
+	if ((strings = (char *)malloc(req.strings_len)) == NULL) return(-1);
+	for (i = 0, w = strings; i < req.argc; i++, w += len)
+	{
+		len = strlen(argv[i]) + 1;
+		memcpy(w, argv[i], len);
+	}
+	for (i = 0; i < req.envc; i++, w += len)
+	{
+		len = strlen(envp[i]) + 1;
+		memcpy(w, envp[i], len);
+	}
+
+	if (exec_pool_pipe(status_pipe) < 0)
+	{
+		free(strings);
+		return(-1);
+	}
+	fds[0] = stdout_fd;
+	fds[1] = stderr_fd;
+	fds[2] = status_pipe[1];
+	fds[3] = stdin_fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE((req.has_stdin ? 4 : 3) * sizeof(int));
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN((req.has_stdin ? 4 : 3) * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, (req.has_stdin ? 4 : 3) * sizeof(int));
+
+	pthread_mutex_lock(&h->lock);
+	ok = !h->dead;
+	if (ok)
+	{
+		do sent = sendmsg(h->sock, &msg, MSG_NOSIGNAL); while (sent < 0 && errno == EINTR);
+		ok = (sent == sizeof(req));
+		for (w = strings, len = req.strings_len; ok && len > 0; w += sent, len -= sent)
+		{
+			if ((sent = send(h->sock, w, len, MSG_NOSIGNAL)) < 0)
+			{
+				if (errno != EINTR) ok = 0;
+				sent = 0;
+			}
+		}
+		if (!ok) exec_pool_drop_helper(h);
+	}
+	pthread_mutex_unlock(&h->lock);
+	close(status_pipe[1]);
+	free(strings);
+
+	/* The helper answers with the pid (-1 and errno if fork failed) */
+	if (!ok || exec_pool_read(status_pipe[0], &pid, sizeof(pid)) < 0)
+	{
+		close(status_pipe[0]);
+		if (ok)
+		{
+			/* The helper died with the request */
+			pthread_mutex_lock(&h->lock);
+			exec_pool_drop_helper(h);
+			pthread_mutex_unlock(&h->lock);
+		}
+		errno = ECHILD;
+		return(-1);
+	}
+	if (pid < 0)
+	{
+		err = (exec_pool_read(status_pipe[0], &err, sizeof(err)) < 0) ? EAGAIN : err;
+		close(status_pipe[0]);
+		errno = err;
+		return(-1);
+	}
+	*status_fd = status_pipe[0];
+	return(pid);
+}
+
+/* Start a command, with its stdout and stderr connected to the given
+ * descriptors (and stdin too, if not -1), in a new process group.
+ * Return the pid of the command, or -1 and errno on failure.
+ * */
+pid_t
+exec_pool_spawn(char * const argv[], char * const envp[], const int stdin_fd,
+                const int stdout_fd, const int stderr_fd, exec_pool_child_t *child)
+{
+	exec_pool_helper *h;
+	double secs;
+	pid_t pid = -1;
+	int i;
+
+	gettimeofday(&child->started, NULL);
+	child->helper = 0;
+	child->status_fd = -1;
+
+	/* Try the helpers in turn */
+	for (i = 0; i < exec_pool_n_helpers && pid < 0; i++)
+	{
+		pthread_mutex_lock(&exec_pool_lock);
+		h = &exec_pool_helpers[exec_pool_next];
+		exec_pool_next = (exec_pool_next + 1) % exec_pool_n_helpers;
+		pthread_mutex_unlock(&exec_pool_lock);
+		if (h->dead) continue;
+		if ((pid = exec_pool_helper_spawn(h, argv, envp, stdin_fd, stdout_fd, stderr_fd, &child->status_fd)) > 0)
+			child->helper = 1;
+	}
+
+	/* Fork it ourselves */
+	if (pid < 0)
+	{
+		switch (pid = fork())
+		{
+			case -1:
+				return(-1);
+			case 0:
+				exec_pool_exec(argv, envp, stdin_fd, stdout_fd, stderr_fd);
+				_exit(1); /* Not reached */
+		}
+	}
+	child->pid = pid;
+
+	secs = exec_pool_elapsed(&child->started);
+	pthread_mutex_lock(&exec_pool_lock);
+	if (child->helper) exec_pool_stats.helper_spawns++;
+	else               exec_pool_stats.direct_forks++;
+	exec_pool_stats.spawn_secs += secs;
+	if (secs > exec_pool_stats.max_spawn_secs) exec_pool_stats.max_spawn_secs = secs;
+	pthread_mutex_unlock(&exec_pool_lock);
+	return(pid);
+}
+
+/* Get the exit status of a command, like waitpid() (options can be
+ * 0 or WNOHANG).
+ * With WNOHANG, wait a little for the status anyway: a command that
+ * closed its streams usually exits right after, and the callers
+ * would otherwise sleep before checking again.
+ * */
+pid_t
+exec_pool_wait(exec_pool_child_t *child, int *status, const int options)
+{
+	struct pollfd pfd;
+	pid_t res;
+	int tmp_status, waited;
+
+	if (status == NULL) status = &tmp_status;
+	if (!child->helper)
+	{
+		res = waitpid(child->pid, status, options);
+		for (waited = 0; res == 0 && waited < EXECPOOL_STATUS_GRACE; waited++)
+		{
+			usleep(1000);
+			res = waitpid(child->pid, status, options);
+		}
+	}
+	else if (child->status_fd < 0)
+	{
+		errno = ECHILD;
+		return(-1);
+	}
+	else
+	{
+		if (options & WNOHANG)
+		{
+			pfd.fd = child->status_fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, EXECPOOL_STATUS_GRACE) <= 0) return(0);
+		}
+		res = (exec_pool_read(child->status_fd, status, sizeof(int)) < 0) ? -1 : child->pid;
+		close(child->status_fd);
+		child->status_fd = -1;
+		if (res < 0) errno = ECHILD;
+	}
+
+	if (res == child->pid)
+	{
+		pthread_mutex_lock(&exec_pool_lock);
+		exec_pool_stats.completed++;
+		exec_pool_stats.run_secs += exec_pool_elapsed(&child->started);
+		pthread_mutex_unlock(&exec_pool_lock);
+	}
+	return(res);
+}
+
+/* Forget about a command (the exit status won't be collected)
+ * */
+void
+exec_pool_release(exec_pool_child_t *child)
+{
+	if (child->status_fd >= 0)
+	{
+		close(child->status_fd);
+		child->status_fd = -1;
+	}
+}
+
+void
+exec_pool_get_stats(exec_pool_stats_t *stats)
+{
+	pthread_mutex_lock(&exec_pool_lock);
+	*stats = exec_pool_stats;
+	pthread_mutex_unlock(&exec_pool_lock);
+}
+
+/* Stop the helpers: they exit as soon as their commands are done.
+ * Commands are forked directly from now on.
+ * */
+void
+exec_pool_shutdown(void)
+{
+	int i;
+
+	for (i = 0; i < exec_pool_n_helpers; i++)
+	{
+		pthread_mutex_lock(&exec_pool_helpers[i].lock);
+		if (!exec_pool_helpers[i].dead)
+		{
+			exec_pool_helpers[i].dead = 1;
+			close(exec_pool_helpers[i].sock);
+		}
+		pthread_mutex_unlock(&exec_pool_helpers[i].lock);
+	}
+}
+
+
+#ifdef EXECPOOL_DEBUG
+/* ------ TEST CODE HERE -------
+#
+#  Description:
+#   Run commands through the helpers, checking their output, exit
+#   status, stdin redirection and signal delivery, also from several
+#   threads at once. Then grow the address space of the process and
+#   compare the time to start a command through the helpers and by
+#   forking it directly.
+#
+#   Compile with -DEXECPOOL_DEBUG option, e.g.
+#   $ gcc -o test_execpool -DEXECPOOL_DEBUG execpool.c -lpthread
+#
+*/
+
+#include <assert.h>
+#include <getopt.h>
+
+extern char **environ;
+
+/* Run a command, collect its stdout (up to out_size bytes) and wait for it
+ * */
+static int
+run_command(char * const argv[], const int stdin_fd, char *out, const size_t out_size)
+{
+	exec_pool_child_t child;
+	int out_pipe[2], err_pipe[2];
+	int status, res;
+	size_t len = 0;
+	ssize_t got;
+	pid_t pid;
+
+	res = pipe(out_pipe);
+	assert(res == 0);
+	res = pipe(err_pipe);
+	assert(res == 0);
+	pid = exec_pool_spawn(argv, environ, stdin_fd, out_pipe[1], err_pipe[1], &child);
+	assert(pid > 0);
+	close(out_pipe[1]);
+	close(err_pipe[1]);
+	while (len < out_size - 1 && (got = read(out_pipe[0], out + len, out_size - 1 - len)) > 0)
+		len += got;
+	out[len] = '\000';
+	close(out_pipe[0]);
+	close(err_pipe[0]);
+	pid = exec_pool_wait(&child, &status, 0);
+	assert(pid == child.pid);
+	return(status);
+}
+
+static void *
+run_commands_thread(void *arg)
+{
+	char *argv[] = { "/bin/sh", "-c", "echo $0; exit 7", NULL, NULL };
+	char name[32], out[64];
+	int i, status;
+
+	for (i = 0; i < 50; i++)
+	{
+		snprintf(name, sizeof(name), "thread-%ld-%d", (long)arg, i);
+		argv[3] = name;
+		status = run_command(argv, -1, out, sizeof(out));
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 7);
+		assert(strncmp(out, name, strlen(name)) == 0);
+	}
+	return(NULL);
+}
+
+static void
+check_commands(void)
+{
+	char *echo_argv[] = { "/bin/sh", "-c", "echo out; echo err >&2; exit 3", NULL };
+	char *cat_argv[] = { "/bin/cat", NULL };
+	char *sleep_argv[] = { "/bin/sleep", "10", NULL };
+	char *missing_argv[] = { "/nonexistent/command", NULL };
+	char out[64];
+	char tmpl[] = "/tmp/test_execpool_XXXXXX";
+	exec_pool_child_t child;
+	pthread_t threads[8];
+	int out_pipe[2];
+	int status, fd, res;
+	pid_t pid;
+	long i;
+
+	status = run_command(echo_argv, -1, out, sizeof(out));
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 3);
+	assert(strcmp(out, "out\n") == 0);
+
+	fd = mkstemp(tmpl);
+	assert(fd >= 0);
+	unlink(tmpl);
+	res = write(fd, "proxy\n", 6);
+	assert(res == 6);
+	lseek(fd, 0, SEEK_SET);
+	status = run_command(cat_argv, fd, out, sizeof(out));
+	close(fd);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	assert(strcmp(out, "proxy\n") == 0);
+
+	status = run_command(missing_argv, -1, out, sizeof(out));
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == ENOENT);
+
+	/* The command leads its own process group */
+	res = pipe(out_pipe);
+	assert(res == 0);
+	pid = exec_pool_spawn(sleep_argv, environ, -1, out_pipe[1], out_pipe[1], &child);
+	assert(pid > 0);
+	close(out_pipe[1]);
+	pid = exec_pool_wait(&child, &status, WNOHANG);
+	assert(pid == 0);
+	while (getpgid(child.pid) != child.pid) usleep(1000);
+	res = kill(-child.pid, SIGTERM);
+	assert(res == 0);
+	pid = exec_pool_wait(&child, &status, 0);
+	assert(pid == child.pid);
+	assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM);
+	close(out_pipe[0]);
+
+	for (i = 0; i < 8; i++)
+	{
+		res = pthread_create(&threads[i], NULL, run_commands_thread, (void *)i);
+		assert(res == 0);
+	}
+	for (i = 0; i < 8; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/* Start n commands, return the average time to start one
+ * */
+static double
+time_spawns(const int n)
+{
+	char *argv[] = { "/bin/true", NULL };
+	exec_pool_stats_t before, after;
+	char out[8];
+	int i, status;
+
+	exec_pool_get_stats(&before);
+	for (i = 0; i < n; i++)
+	{
+		status = run_command(argv, -1, out, sizeof(out));
+		assert(status == 0);
+	}
+	exec_pool_get_stats(&after);
+	return((after.spawn_secs - before.spawn_secs) / n);
+}
+
+void
+print_usage(char *cmd)
+{
+	printf("Usage: %s [-h] [-n <cmds>] [-m <MB>]\n", cmd);
+	printf("  -h             print this help\n");
+	printf("  -n <cmds>      commands to start for the timing (default 200)\n");
+	printf("  -m <MB>        memory to allocate before the timing (default 256)\n\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	exec_pool_stats_t stats;
+	double helper_secs, fork_secs;
+	size_t mem_size = 256, n_blocks, i;
+	char **blocks;
+	int n = 200;
+	int c, res;
+
+	while ((c = getopt(argc, argv, "hn:m:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				n = atoi(optarg);
+				break;
+			case 'm':
+				mem_size = atoi(optarg);
+				break;
+			default:
+				print_usage(argv[0]);
+				exit(0);
+		}
+	}
+
+	res = exec_pool_init(EXECPOOL_DEFAULT_HELPERS);
+	assert(res == EXECPOOL_OK);
+	check_commands();
+	exec_pool_get_stats(&stats);
+	assert(stats.direct_forks == 0 && stats.helper_spawns == stats.completed);
+
+	/* Grow like a server holding a large job registry in memory */
+	n_blocks = mem_size * 1024;
+	blocks = (char **)malloc(n_blocks * sizeof(char *));
+	assert(blocks != NULL);
+	for (i = 0; i < n_blocks; i++)
+	{
+		blocks[i] = (char *)malloc(1024);
+		assert(blocks[i] != NULL);
+		memset(blocks[i], 1, 1024);
+	}
+
+	helper_secs = time_spawns(n);
+	exec_pool_shutdown();
+	fork_secs = time_spawns(n);
+	check_commands();
+	exec_pool_get_stats(&stats);
+	assert(stats.direct_forks > 0 && stats.helper_spawns + stats.direct_forks == stats.completed);
+
+	printf("%lu commands through the helpers, %lu forked directly, %g s average run time.\n",
+	       stats.helper_spawns, stats.direct_forks, stats.run_secs / stats.completed);
+	printf("Start a command with %lu MB allocated. Through the helpers: %g ms. Forking directly: %g ms.\n",
+	       (unsigned long)mem_size, helper_secs * 1000, fork_secs * 1000);
+	for (i = 0; i < n_blocks; i++) free(blocks[i]);
+	free(blocks);
+	return(0);
+}
+#endif /* EXECPOOL_DEBUG */
@@ -0,0 +1,66 @@
+/*
+#  File:     execpool.h
+#
+#
+#  Revision history:
+#   17 Oct 2026 - Original release
+#
+#  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
+#
+#    See http://www.eu-egee.org/partners/ for details on the copyright
+#    holders.
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+#
+*/
+
+#ifndef EXECPOOL_INCLUDED
+#define EXECPOOL_INCLUDED
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#define EXECPOOL_OK             0
+#define EXECPOOL_ERROR_NOMEM    1
+#define EXECPOOL_ERROR_HELPER   2
+
+#define EXECPOOL_DEFAULT_HELPERS 2
+
+/* A command started through the pool */
+typedef struct exec_pool_child_s {
+	pid_t pid;
+	int helper;               /* Started by a helper (not our child) */
+	int status_fd;            /* Exit status sent by the helper */
+	struct timeval started;
+} exec_pool_child_t;
+
+typedef struct exec_pool_stats_s {
+	unsigned long helper_spawns;  /* Commands started by the helpers */
+	unsigned long direct_forks;   /* Commands forked by the caller */
+	double spawn_secs;            /* Total time spent starting commands */
+	double max_spawn_secs;
+	unsigned long completed;      /* Commands whose exit status was collected */
+	double run_secs;              /* Total time from start to exit status */
+} exec_pool_stats_t;
+
+/* Exported functions */
+int exec_pool_init(const int n_helpers);
+int exec_pool_pipe(int fds[2]);
+pid_t exec_pool_spawn(char * const argv[], char * const envp[], const int stdin_fd,
+                      const int stdout_fd, const int stderr_fd, exec_pool_child_t *child);
+pid_t exec_pool_wait(exec_pool_child_t *child, int *status, const int options);
+void exec_pool_release(exec_pool_child_t *child);
+void exec_pool_get_stats(exec_pool_stats_t *stats);
+void exec_pool_shutdown(void);
+
+#endif /* ifndef EXECPOOL_INCLUDED */
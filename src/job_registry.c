@@ -30,6 +30,33 @@
  *              Added job_registry_check_index_key_uniqueness.
  *  21-Jul-2011 Added job_registry_need_update function.
  *  11-Sep-2015 Always return most recent job in job_registry_get_recnum.
+ *  17-Oct-2026 Added persistent handle mode with in-memory hash index.
+ *              Added copy-free access to the mapped registry.
+ *              Resync only indexes records appended since the last
+ *              resync.
+ *              Index sorted on (ID, recnum) by MSD radix sort.
+ *              Added front-coded compact index mode.
+ *              Added secondary hash indexes (job_registry_persist_index,
+ *              job_registry_get_by).
+ *              Added subject list cache and per-subject record lists
+ *              (job_registry_get_next_subject_match).
+ *              Added job_registry_update_batch.
+ *              Readers of single records (job_registry_get) copy them
+ *              with no lock, validated by a shared sequence counter.
+ *              Added job_registry_purge_online.
+ *              Added segment summary file, to skip segments of the
+ *              registry with no recent changes in mapped scans
+ *              (job_registry_get_next_mapped_since).
+ *              Added change journal read by job_registry_changes_since.
+ *              Added job_registry_wait_change (inotify, with a polling
+ *              fallback).
+ *              Non-privileged appends go to a shared spool file that is
+ *              merged in bulk. Merges skip reading npudir when nothing
+ *              can be pending there.
+ *              Added job_registry_entry_format_classad, writing into a
+ *              reusable buffer.
+ *              Added compiled selection expressions, evaluated directly
+ *              on registry entries (job_registry_select_compile).
  *
  *  Description:
  *    File-based container to cache job IDs and statuses to implement
@@ -56,22 +83,35 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <time.h>
+#include <sched.h>
 #include <errno.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "job_registry.h"
 
 #include "md5.h"
 
+/* Writer side of the shared sequence counter (see job_registry_seqlock_open) */
+static int job_registry_seq_write_begin(const job_registry_handle *rha);
+static void job_registry_seq_write_end(const job_registry_handle *rha);
+
 /*
  * jobregistry_construct_path
  *
@@ -211,7 +251,11 @@ job_registry_purge(const char *path, time_t oldest_creation_date,
 
   if ((ret = job_registry_seek_next(fd,&first)) < 0)
    {
-    if (force_rewrite) ftruncate(fileno(fd), 0);
+    if (force_rewrite && job_registry_seq_write_begin(jra) >= 0)
+     {
+      ftruncate(fileno(fd), 0);
+      job_registry_seq_write_end(jra);
+     }
     fclose(fd);
     job_registry_destroy(jra);
     return JOB_REGISTRY_NO_VALID_RECORD;
@@ -319,7 +363,18 @@ job_registry_purge(const char *path, time_t oldest_creation_date,
 
   fclose(fdw);
 
-  if (rename(newreg_path, jra->path) < 0)
+  if ((ret = job_registry_seq_write_begin(jra)) < 0)
+   {
+    unlink(newreg_path);
+    fclose(fd);
+    free(newreg_path);
+    job_registry_destroy(jra);
+    job_registry_free_hash_store(&hst); 
+    return ret;
+   }
+  ret = rename(newreg_path, jra->path);
+  job_registry_seq_write_end(jra);
+  if (ret < 0)
    {
     fclose(fd);
     free(newreg_path);
@@ -467,7 +522,8 @@ job_registry_update_reg(const job_registry_handle *rha,
     fclose(of);
     return -1;
    }
-  if (job_registry_wrlock(rha,nf) < 0)
+  if (job_registry_wrlock(rha,nf) < 0 ||
+      job_registry_seq_write_begin(rha) < 0)
    {
     fclose(of);
     fclose(nf);
@@ -483,6 +539,8 @@ job_registry_update_reg(const job_registry_handle *rha,
    }
 
   fclose(of);
+  fflush(nf);
+  job_registry_seq_write_end(rha);
   fclose(nf);
 
   if (wret < 1 || rret < 0)
@@ -496,1868 +554,5727 @@ job_registry_update_reg(const job_registry_handle *rha,
 }
 
 /*
- * job_registry_init
+ * job_registry_seqlock_covers
  *
- * Sets up for access to a job registry file pointed to by 'path'.
- * An entry index is loaded in memory if mode is not set to NO_INDEX.
+ * Check, by owner, group and permission bits, that whoever can write
+ * the registry file can also write the sequence counter file, and
+ * nobody else can. Otherwise some writers could rewrite records without
+ * bumping the counter (or anybody could reset it), and readers must not
+ * trust it.
  *
- * @param path Pathname of the job registry file.
- * @param mode Operation of the index cache: NO_INDEX disables the cache
- *             (job_registry_lookup, job_registry_update and job_registry_get
- *             cannot be used), BY_BATCH_ID uses batch_id as the cache index 
- *             key,  BY_BLAH_ID sets blah_id as the cache index key and
- *             BY_USER_PREFIX uses the user_prefix entry (must be unique!).
- *             NAMES_ONLY will fill the rha structure with the appropriate
- *             file paths without performing any file access.
+ * @param reg Status of the registry file.
+ * @param seq Status of the sequence counter file.
  *
- * @return Pointer to a dynamically allocated handle to the job registry.
- *         This needs to be freed via job_registry_destroy.
+ * @return TRUE if the counter can be trusted.
  */
 
-job_registry_handle *
-job_registry_init(const char *path,
-                  job_registry_index_mode mode)
+static int
+job_registry_seqlock_covers(const struct stat *reg, const struct stat *seq)
 {
-  job_registry_handle *rha;
-  job_registry_entry junk;
-  size_t found_size;
-  struct stat fst, lst, dst;
-  char real_file_name[FILENAME_MAX];
-  int rlnk_status;
+  if ((seq->st_mode & S_IWOTH) != 0) return ((reg->st_mode & S_IWOTH) != 0);
+  if ((reg->st_mode & S_IWOTH) != 0) return FALSE;
+  if ((reg->st_mode & S_IWGRP) != 0 &&
+      ((seq->st_mode & S_IWGRP) == 0 || seq->st_gid != reg->st_gid))
+    return FALSE;
+  if ((reg->st_mode & S_IWUSR) != 0 &&
+      ((seq->st_mode & S_IWUSR) == 0 || seq->st_uid != reg->st_uid))
+    return FALSE;
+  return TRUE;
+}
+
+/*
+ * job_registry_open_side_file
+ *
+ * Open (or create) a side file that every registry writer has to
+ * update, with the permissions of the subject list: writable by the
+ * registry group, readable by everybody. Files left by older versions
+ * that were not group-writable are fixed if we own them.
+ *
+ * @param path Path of the side file.
+ *
+ * @return File descriptor, open read-only if the file can't be written.
+ *         Less than zero on error.
+ */
+
+static int
+job_registry_open_side_file(const char *path)
+{
+  struct stat st;
   mode_t old_umask;
-  const char *npu_tail="/npu";
-  int cfd;
-  FILE *fd;
-  char *old_lockfile, *old_npudir, *old_path=NULL;
-  int need_to_create_regdir = FALSE;
-  char *dircreat[3];
-  char **dir;
-  int stret;
+  int fd;
 
-  rha = (job_registry_handle *)calloc(1, sizeof(job_registry_handle));
-  if (rha == NULL) 
+  old_umask = umask(0);
+  fd = open(path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+  umask(old_umask);
+  if (fd < 0) return open(path, O_RDONLY);
+
+  if (fstat(fd, &st) >= 0 && st.st_uid == geteuid() &&
+      (st.st_mode & S_IWGRP) == 0)
+    fchmod(fd, (st.st_mode & (S_IRWXU|S_IRWXG|S_IRWXO)) | S_IWGRP);
+  return fd;
+}
+
+/*
+ * job_registry_seqlock_open
+ *
+ * Map the sequence counter file (<registry>.seqlock) shared by all
+ * processes accessing a registry. Writers make the counter odd while
+ * they rewrite registry records (under the usual write lock) and even
+ * again when done, so that readers can copy a record with no lock at all
+ * and retry if the counter changed meanwhile.
+ * The counter is trusted by readers only if all processes that can
+ * write the registry can also write the counter file (see
+ * job_registry_seqlock_covers).
+ * Failures are not fatal: the handle keeps using fcntl locks only.
+ *
+ * @param rha Pointer to a job registry handle.
+ */
+
+static void
+job_registry_seqlock_open(job_registry_handle *rha)
+{
+  int sfd;
+  int prot = PROT_READ|PROT_WRITE;
+  struct stat sst, rst;
+  mode_t old_umask;
+  void *map;
+
+  /* Same permissions as the registry file */
+  old_umask = umask(S_IWOTH);
+  sfd = open(rha->seqfile, O_RDWR|O_CREAT,
+             S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+  umask(old_umask);
+  if (sfd < 0)
    {
-    errno = ENOMEM;
-    return NULL;
+    /* Enough for a handle that cannot write the registry anyway */
+    sfd = open(rha->seqfile, O_RDONLY);
+    if (sfd < 0) return;
+    prot = PROT_READ;
    }
 
-  rha->mode = mode;
-  rha->disk_firstrec = 0;
+  if (fstat(sfd, &sst) < 0 ||
+      (sst.st_size < (off_t)sizeof(job_registry_seqlock) &&
+       (prot == PROT_READ || 
+        ftruncate(sfd, sizeof(job_registry_seqlock)) < 0)))
+   {
+    close(sfd);
+    return;
+   }
 
-  /* Resolve symbolic link, if any */
-  if (lstat(path, &fst) >= 0)
+  /* Counters created by older versions were world-writable */
+  if (prot != PROT_READ && (sst.st_mode & S_IWOTH) != 0 &&
+      stat(rha->path, &rst) >= 0 && (rst.st_mode & S_IWOTH) == 0 &&
+      fchmod(sfd, sst.st_mode & (~(S_IXUSR|S_IXGRP|S_IXOTH|S_IWOTH))) >= 0)
+    sst.st_mode &= ~S_IWOTH;
+
+  map = mmap(0, sizeof(job_registry_seqlock), prot, MAP_SHARED, sfd, 0);
+  close(sfd);
+  if (map == MAP_FAILED) return;
+
+  rha->seqlock = (job_registry_seqlock *)map;
+  rha->seqlock_writable = (prot != PROT_READ);
+
+  if (rha->seqlock->magic != JOB_REGISTRY_SEQLOCK_MAGIC)
    {
-    if (S_ISLNK(fst.st_mode))
+    if (!rha->seqlock_writable)
      {
-      rlnk_status = readlink(path, real_file_name, sizeof(real_file_name));
-      if (rlnk_status > 0 && rlnk_status < sizeof(real_file_name))
-       {
-        real_file_name[rlnk_status] = '\000'; /* readlink does not NULL-terminate */
-        path = real_file_name;
-       }
+      munmap(map, sizeof(job_registry_seqlock));
+      rha->seqlock = NULL;
+      return;
      }
+    rha->seqlock->version = JOB_REGISTRY_SEQLOCK_VERSION;
+    rha->seqlock->magic = JOB_REGISTRY_SEQLOCK_MAGIC;
    }
 
-  rha->path = (char *)malloc(strlen(path) + strlen(JOB_REGISTRY_REGISTRY_NAME) + 2);
-  if (rha->path == NULL)
+  rha->seqlock_trusted = (stat(rha->path, &rst) >= 0 &&
+                          job_registry_seqlock_covers(&rst, &sst));
+}
+
+/* Readers may skip locks only if the counter is trusted */
+static int
+job_registry_seq_trusted(const job_registry_handle *rha)
+{
+  return (rha->seqlock != NULL && rha->seqlock_trusted);
+}
+
+/* Writer side. Must be called with the registry write lock held. */
+/* The counter is left odd by a writer that died halfway: it stays */
+/* odd (readers fall back to locks) until the next write completes. */
+/* A writer that cannot bump the counter may only go on if readers */
+/* don't trust it, otherwise the write fails (errno = EACCES). */
+static int
+job_registry_seq_write_begin(const job_registry_handle *rha)
+{
+  struct stat rst, sst;
+
+  if (rha->seqlock != NULL && rha->seqlock_writable)
    {
-    job_registry_destroy(rha);
-    errno = ENOMEM;
+    rha->seqlock->seq |= 1;
+    __sync_synchronize();
+    return JOB_REGISTRY_SUCCESS;
+   }
+  if (stat(rha->seqfile, &sst) < 0 || stat(rha->path, &rst) < 0 ||
+      !job_registry_seqlock_covers(&rst, &sst))
+    return JOB_REGISTRY_SUCCESS;
+
+  errno = EACCES;
+  return JOB_REGISTRY_FLOCK_FAIL;
+}
+
+static void
+job_registry_seq_write_end(const job_registry_handle *rha)
+{
+  if (rha->seqlock == NULL || !rha->seqlock_writable) return;
+  __sync_synchronize();
+  rha->seqlock->seq++;
+}
+
+/* Reader side: FALSE if a write is in progress */
+static int
+job_registry_seq_read_begin(const job_registry_handle *rha, uint64_t *seq)
+{
+  *seq = rha->seqlock->seq;
+  __sync_synchronize();
+  return ((*seq & 1) == 0);
+}
+
+/* Reader side: TRUE if no write happened since job_registry_seq_read_begin */
+static int
+job_registry_seq_read_valid(const job_registry_handle *rha, uint64_t seq)
+{
+  __sync_synchronize();
+  return (rha->seqlock->seq == seq);
+}
+
+/*
+ * job_registry_get_optimistic
+ *
+ * Copy record 'found' out of the registry file with no lock, validating
+ * the copy against the shared sequence counter. Used by job_registry_get
+ * before falling back to the locked path.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param found Record number to fetch.
+ *
+ * @return Dynamically allocated registry entry, or NULL if a consistent
+ *         copy could not be obtained (e.g. the registry was purged or
+ *         the counter kept changing): the caller should then lock.
+ */
+
+static job_registry_entry *
+job_registry_get_optimistic(const job_registry_handle *rha,
+                            job_registry_recnum_t found)
+{
+  job_registry_entry *entry;
+  job_registry_recnum_t firstrec, req_recn;
+  uint64_t seq;
+  int fd, tries;
+
+  if (!job_registry_seq_trusted(rha)) return NULL;
+
+  fd = open(rha->path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  entry = (job_registry_entry *)malloc(sizeof(job_registry_entry));
+  if (entry == NULL)
+   {
+    close(fd);
     return NULL;
    }
-  sprintf(rha->path, "%s/%s", path, JOB_REGISTRY_REGISTRY_NAME);
 
-  /* Create path and dir for NPU storage */
-  rha->npudir = jobregistry_construct_path("%s/%s.npudir",rha->path,0);
-  if (rha->npudir == NULL)
+  for (tries = 0; tries < JOB_REGISTRY_SEQLOCK_RETRIES; tries++)
+   {
+    if (!job_registry_seq_read_begin(rha, &seq))
+     {
+      sched_yield();
+      continue;
+     }
+
+    /* A purge changes the first record number: resync under lock */
+    if (pread(fd, &firstrec, sizeof(firstrec),
+              offsetof(job_registry_entry, recnum)) != sizeof(firstrec) ||
+        firstrec != rha->firstrec) break;
+    JOB_REGISTRY_GET_REC_OFFSET(req_recn,found,firstrec)
+
+    if (pread(fd, entry, sizeof(job_registry_entry),
+              (off_t)req_recn*sizeof(job_registry_entry)) 
+        != sizeof(job_registry_entry)) break;
+
+    if (!job_registry_seq_read_valid(rha, seq)) continue;
+
+    if ( (entry->magic_start != JOB_REGISTRY_MAGIC_START) ||
+         (entry->magic_end   != JOB_REGISTRY_MAGIC_END) ||
+         (entry->recnum != found) ) break;
+
+    close(fd);
+    return entry;
+   }
+
+  close(fd);
+  free(entry);
+  return NULL;
+}
+
+/*
+ * job_registry_segments_rebuild
+ *
+ * Recompute the segment summary file (<registry>.segments) from the
+ * contents of the registry. Called by writers, with the registry write
+ * lock held, when the summary does not describe the current registry
+ * file (e.g. after a purge or when it doesn't exist yet).
+ *
+ * @param rha Pointer to a job registry handle.
+ * @param regfd Descriptor of the open and write-locked registry file.
+ * @param hdr Summary header describing the registry file.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         The summary is left invalid in case of error.
+ */
+
+static int
+job_registry_segments_rebuild(const job_registry_handle *rha, int regfd,
+                              const job_registry_segment_header *hdr)
+{
+  job_registry_entry *seg;
+  job_registry_segment_header inval;
+  size_t seg_len = JOB_REGISTRY_SEGMENT_RECORDS*sizeof(job_registry_entry);
+  ssize_t rret;
+  time_t mdate;
+  uint32_t i, n_seg, n_recs;
+  int ret = JOB_REGISTRY_SUCCESS;
+
+  /* Readers must not trust the summary while it is being rewritten */
+  memset(&inval, 0, sizeof(inval));
+  if (pwrite(rha->segment_fd, &inval, sizeof(inval), 0) != sizeof(inval))
+    return JOB_REGISTRY_FWRITE_FAIL;
+
+  seg = (job_registry_entry *)malloc(seg_len);
+  if (seg == NULL)
    {
-    job_registry_destroy(rha);
     errno = ENOMEM;
-    return NULL;
+    return JOB_REGISTRY_MALLOC_FAIL;
    }
 
-  /* Check for reg dir existance, and convert from simple-file format */
-  /* in a backwards-compatible fashion */
-  if (mode != NAMES_ONLY)
+  for (n_seg = 0; ; n_seg++)
    {
-    stret = lstat(path, &fst);
-    if (stret < 0 && errno == ENOENT) need_to_create_regdir = TRUE;
-    if (stret >= 0)
+    rret = pread(regfd, seg, seg_len, (off_t)n_seg*seg_len);
+    if (rret < 0)
      {
-      if (!S_ISDIR(fst.st_mode))
-       {
-        old_lockfile = jobregistry_construct_path("%s/.%s.locktest",path,0);
-        old_npudir = jobregistry_construct_path("%s/.%s.npudir",path,0);
-        if (old_lockfile == NULL || old_npudir == NULL)
-         {
-          if (old_lockfile != NULL) free(old_lockfile);
-          if (old_npudir != NULL) free(old_npudir);
-          job_registry_destroy(rha);
-          errno = ENOMEM;
-          return NULL;
-         }
-        old_path = jobregistry_construct_path("%s/%s-OLD",path,0);
-        if (old_path == NULL)
-         {
-          free(old_lockfile); free(old_npudir);
-          job_registry_destroy(rha);
-          errno = ENOMEM;
-          return NULL;
-         }
-        if (rename(path, old_path) < 0)
-         {
-          free(old_lockfile); free(old_npudir); free(old_path);
-          job_registry_destroy(rha);
-          return NULL; /* keep the rename errno */
-         }
-        need_to_create_regdir = TRUE;
-       }
-      else
-       {
-        /* Make sure the file has as-restrictive as possible permissions */
-        chmod(path, fst.st_mode&(~(S_IROTH|S_IWOTH)));
-       }
+      ret = JOB_REGISTRY_FREAD_FAIL;
+      break;
      }
-    if (need_to_create_regdir)
+    n_recs = rret/sizeof(job_registry_entry);
+    if (n_recs == 0) break;
+
+    for (i = 0, mdate = 0; i < n_recs; i++)
+      if (seg[i].mdate > mdate) mdate = seg[i].mdate;
+    if (pwrite(rha->segment_fd, &mdate, sizeof(mdate),
+               sizeof(*hdr) + (off_t)n_seg*sizeof(time_t)) != sizeof(mdate))
      {
-      old_umask = umask(0);
-      if (mkdir(path,S_ISVTX|S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP|S_IXOTH) < 0)
-       {
-        if (old_path != NULL) 
-         {
-          free(old_lockfile); free(old_npudir); free(old_path);
-         }
-        umask(old_umask);
-        job_registry_destroy(rha);
-        return NULL;
-       }
-      umask(old_umask);
-      if (old_path != NULL)
-       {
-        rename(old_npudir, rha->npudir); /* An error here would deserve a
-                                            warning, but there's no
-                                            way to feed it back */
-        free(old_npudir);
-        unlink(old_lockfile); /* No real worry if this fails */
-        free(old_lockfile);
-        if (job_registry_update_reg(rha, old_path) < 0)
-         {
-          free(old_path);
-          job_registry_destroy(rha);
-          return NULL; /* keep the rename errno */
-         }
-       }
+      ret = JOB_REGISTRY_FWRITE_FAIL;
+      break;
+     }
+    if (n_recs < JOB_REGISTRY_SEGMENT_RECORDS)
+     {
+      n_seg++;
+      break;
      }
    }
+  free(seg);
 
-  /* Create path for lock test file */
-  rha->lockfile = jobregistry_construct_path("%s/%s.locktest",rha->path,0);
-  if (rha->lockfile == NULL)
+  if (ret < 0) return ret;
+  if (ftruncate(rha->segment_fd, sizeof(*hdr) + (off_t)n_seg*sizeof(time_t)) < 0 ||
+      pwrite(rha->segment_fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr))
+    return JOB_REGISTRY_FWRITE_FAIL;
+
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_segment_note
+ *
+ * Record in the segment summary that a registry record is about to be
+ * written with modification date 'mdate'. Must be called with the
+ * registry write lock held, before the record is written, so that
+ * readers never skip a segment holding a record that is more recent
+ * than the summary says.
+ *
+ * @param rha Pointer to a job registry handle.
+ * @param fd Stream descriptor of the open and write-locked registry file.
+ * @param firstrec Record number of the first record in the file.
+ * @param rec_index Position of the record in the file (in records).
+ * @param mdate Modification date of the record being written.
+ */
+
+static void
+job_registry_segment_note(const job_registry_handle *rha, FILE *fd,
+                          job_registry_recnum_t firstrec,
+                          job_registry_recnum_t rec_index, time_t mdate)
+{
+  job_registry_segment_header hdr, cur;
+  struct stat rst;
+  time_t seg_mdate = 0;
+  off_t slot;
+
+  if (rha->segment_fd < 0) return;
+
+  memset(&hdr, 0, sizeof(hdr));
+  if (fstat(fileno(fd), &rst) < 0) 
    {
-    job_registry_destroy(rha);
-    errno = ENOMEM;
-    return NULL;
+    /* Can't tell which file this is: invalidate the summary */
+    pwrite(rha->segment_fd, &hdr, sizeof(hdr), 0);
+    return;
    }
+  hdr.magic = JOB_REGISTRY_SEGMENT_MAGIC;
+  hdr.version = JOB_REGISTRY_SEGMENT_VERSION;
+  hdr.segment_records = JOB_REGISTRY_SEGMENT_RECORDS;
+  hdr.firstrec = firstrec;
+  hdr.registry_ino = rst.st_ino;
 
-  /* Create path for subject list */
-  rha->subjectlist = jobregistry_construct_path("%s/%s.subjectlist",rha->path,0);
-  if (rha->subjectlist == NULL)
+  if (pread(rha->segment_fd, &cur, sizeof(cur), 0) != sizeof(cur) ||
+      memcmp(&cur, &hdr, sizeof(hdr)) != 0)
    {
-    job_registry_destroy(rha);
-    errno = ENOMEM;
-    return NULL;
-   }
-  /* Create path for non-privileged updates to the subject list */
-  rha->npusubjectlist = jobregistry_construct_path("%s/%s.npusubjectlist",rha->path,0);
-  if (rha->npusubjectlist == NULL)
-   {
-    job_registry_destroy(rha);
-    errno = ENOMEM;
-    return NULL;
-   }
-  /* Create path for mmap-pable shared entry index */
-  rha->index_mmap_length = 0;
-  rha->mmap_fd = -1;
-  rha->mmappableindex = NULL;
-  if (mode == BY_BLAH_ID_MMAP || mode == BY_BATCH_ID_MMAP ||
-      mode == BY_USER_PREFIX_MMAP)
-   {
-    switch (mode)
-     {
-      case BY_BLAH_ID_MMAP:
-        rha->mmappableindex = jobregistry_construct_path("%s/%s.by_blah_index",rha->path,0);
-        break;
-      case BY_BATCH_ID_MMAP:
-        rha->mmappableindex = jobregistry_construct_path("%s/%s.by_batch_index",rha->path,0);
-        break;
-      case BY_USER_PREFIX_MMAP:
-        rha->mmappableindex = jobregistry_construct_path("%s/%s.by_user_index",rha->path,0);
-        break;
-      default:
-        break;
-     }
-    if (rha->mmappableindex == NULL)
-     {
-      job_registry_destroy(rha);
-      errno = ENOMEM;
-      return NULL;
-     }
+    if (job_registry_segments_rebuild(rha, fileno(fd), &hdr) < 0) return;
    }
 
-  if (mode != NAMES_ONLY)
-   {
-    if (stat(rha->lockfile, &lst) < 0)
-     {
-      if (errno == ENOENT)
-       {
-        old_umask = umask(0);
-        if ((cfd=creat(rha->lockfile,S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH)) < 0)
-         {
-          umask(old_umask);
-          job_registry_destroy(rha);
-          return NULL;
-         }
-	close(cfd);
-        umask(old_umask);
-       }
-      else
-       {
-        job_registry_destroy(rha);
-        return NULL;
-       }
-     }
-    else
-     {
-      /* Make sure the file is empty has as-restrictive as possible permissions */
-      chmod(rha->lockfile, lst.st_mode&(~(S_IXUSR|S_IXGRP|S_IXOTH)));
-      truncate(rha->lockfile, 0);
-     }
-    if (stat(rha->subjectlist, &lst) < 0)
-     {
-      if (errno == ENOENT)
-       {
-        old_umask = umask(0);
-        if ((cfd=creat(rha->subjectlist,S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH)) < 0)
-         {
-          umask(old_umask);
-          job_registry_destroy(rha);
-          return NULL;
-         }
-	close(cfd);
-        umask(old_umask);
-       }
-      else
-       {
-        job_registry_destroy(rha);
-        return NULL;
-       }
-     }
-    else
-     {
-      /* Make sure the file has as-restrictive as possible permissions */
-      chmod(rha->subjectlist, lst.st_mode&(~(S_IXUSR|S_IXGRP|S_IXOTH|S_IWOTH)));
-     }
-   }
+  slot = sizeof(hdr) + 
+         (off_t)(rec_index/JOB_REGISTRY_SEGMENT_RECORDS)*sizeof(time_t);
+  if (pread(rha->segment_fd, &seg_mdate, sizeof(seg_mdate), slot) 
+      != sizeof(seg_mdate)) seg_mdate = 0;
+  if (seg_mdate >= mdate) return;
 
-  /* Create path and dir for proxy storage */
-  rha->proxydir = jobregistry_construct_path("%s/%s.proxydir",rha->path,0);
-  if (rha->proxydir == NULL)
+  if (pwrite(rha->segment_fd, &mdate, sizeof(mdate), slot) != sizeof(mdate))
    {
-    job_registry_destroy(rha);
-    errno = ENOMEM;
-    return NULL;
+    memset(&hdr, 0, sizeof(hdr));
+    pwrite(rha->segment_fd, &hdr, sizeof(hdr), 0);
    }
+}
 
+/*
+ * job_registry_change_note
+ *
+ * Append an entry for a record that was just written to the change
+ * journal (<registry>.changes), restarting the journal if it doesn't
+ * refer to the current registry file or if it grew too large.
+ * Must be called with the registry write lock held, after the record
+ * was written, so that readers of the journal find it updated.
+ *
+ * @param rha Pointer to a job registry handle.
+ * @param fd Stream descriptor of the open and write-locked registry file.
+ * @param firstrec Record number of the first record in the file.
+ * @param recnum Record number of the record that was written.
+ * @param mdate Modification date of the record.
+ */
 
-  if (mode != NAMES_ONLY)
-   {
-    dircreat[0] = rha->npudir;
-    dircreat[1] = rha->proxydir;
-    dircreat[2] = NULL;
+static void
+job_registry_change_note(const job_registry_handle *rha, FILE *fd,
+                         job_registry_recnum_t firstrec,
+                         job_registry_recnum_t recnum, time_t mdate)
+{
+  job_registry_changes_header hdr;
+  job_registry_change chg;
+  struct stat rst, cst;
+  uint64_t generation;
+
+  if (rha->changes_fd < 0) return;
+
+  if (fstat(fileno(fd), &rst) < 0 || fstat(rha->changes_fd, &cst) < 0) return;
+
+  if (pread(rha->changes_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != JOB_REGISTRY_CHANGES_MAGIC ||
+      hdr.version != JOB_REGISTRY_CHANGES_VERSION ||
+      hdr.firstrec != firstrec || hdr.registry_ino != (uint64_t)rst.st_ino ||
+      ((cst.st_size - sizeof(hdr)) % sizeof(chg)) != 0 ||
+      cst.st_size >= (off_t)(sizeof(hdr) + 
+                             JOB_REGISTRY_CHANGES_MAX*sizeof(chg)))
+   {
+    /* Restart the journal. Readers notice the new generation. */
+    if (hdr.magic == JOB_REGISTRY_CHANGES_MAGIC) generation = hdr.generation + 1;
+    else generation = ((uint64_t)time(0) << 16) + 1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = JOB_REGISTRY_CHANGES_MAGIC;
+    hdr.version = JOB_REGISTRY_CHANGES_VERSION;
+    hdr.firstrec = firstrec;
+    hdr.registry_ino = rst.st_ino;
+    hdr.generation = generation;
+    if (pwrite(rha->changes_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        ftruncate(rha->changes_fd, sizeof(hdr)) < 0) return;
+    cst.st_size = sizeof(hdr);
+   }
+
+  memset(&chg, 0, sizeof(chg));
+  chg.recnum = recnum;
+  chg.mdate = mdate;
+  pwrite(rha->changes_fd, &chg, sizeof(chg), cst.st_size);
+}
 
-    for(dir = dircreat; *dir != NULL; dir++)
-     {
-      if (stat(*dir, &dst) < 0)
-       {
-        if (errno == ENOENT)
-         {
-          old_umask = umask(0);
-          if (mkdir(*dir,S_ISVTX|S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP|S_IWOTH|S_IXOTH) < 0)
-           {
-            umask(old_umask);
-            job_registry_destroy(rha);
-            return NULL;
-           }
-          umask(old_umask);
-         }
-        else
-         {
-          job_registry_destroy(rha);
-          return NULL;
-         }
-       }
-      else
-       {
-        if (!S_ISDIR(dst.st_mode))
-         {
-          job_registry_destroy(rha);
-          errno = ENOTDIR;
-          return NULL;
-         }
-        /* Make sure the file has as-restrictive as possible permissions */
-        chmod(*dir, dst.st_mode&(~(S_IROTH)));
-       }
-     }
-   }
-  
-  if (mode == NAMES_ONLY) return(rha);
+/*
+ * job_registry_npu_spool_lock
+ *
+ * Lock or unlock (l_type = F_UNLCK) the whole NPU spool file. The lock is
+ * held by submitters while appending and by the merging process until
+ * the spool is truncated.
+ *
+ * @param sfd File descriptor of the open NPU spool.
+ * @param l_type F_WRLCK or F_UNLCK.
+ * @param cmd F_SETLKW to wait for the lock, F_SETLK to fail if it's busy.
+ *
+ * @return Less than zero on error (errno is set by fcntl).
+ */
 
-  /* Now read the entire file and cache its contents */
+static int
+job_registry_npu_spool_lock(int sfd, short l_type, int cmd)
+{
+  struct flock slock;
 
-  /* In NO_INDEX mode only firstrec and lastrec will be updated */
-  /* Don't merge pending updates (use fopen instead of job_registry_open), as */
-  /* we may be in need of a registry format update. */
+  slock.l_type = l_type;
+  slock.l_whence = SEEK_SET;
+  slock.l_start = 0;
+  slock.l_len = 0; /* Lock whole file */
 
-  fd = fopen(rha->path, "r");
-  if (fd == NULL)
-   {
-    /* Make sure the file is group writable. */
-    old_umask = umask(S_IWOTH);
-    if (errno == ENOENT) fd = fopen(rha->path, "w+");
-    umask(old_umask);
-    if (fd == NULL)
-     {
-      job_registry_destroy(rha);
-      return NULL;
-     }
-   }
-  if (job_registry_rdlock(rha, fd) < 0)
+  return fcntl(sfd, cmd, &slock);
+}
+
+/* Write the NPU spool header, if it's missing and the spool isn't busy */
+static void
+job_registry_npu_spool_init(const job_registry_handle *rha)
+{
+  job_registry_npu_spool_header hdr;
+  struct stat sst;
+
+  if (job_registry_npu_spool_lock(rha->npuspool_fd, F_WRLCK, F_SETLK) < 0) return;
+  if (fstat(rha->npuspool_fd, &sst) >= 0 && 
+      sst.st_size < (off_t)sizeof(hdr))
    {
-    fclose(fd);
-    job_registry_destroy(rha);
-    return NULL;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = JOB_REGISTRY_NPU_SPOOL_MAGIC;
+    hdr.version = JOB_REGISTRY_NPU_SPOOL_VERSION;
+    hdr.reclen = sizeof(job_registry_entry);
+    if (pwrite(rha->npuspool_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+      ftruncate(rha->npuspool_fd, 0);
    }
+  job_registry_npu_spool_lock(rha->npuspool_fd, F_UNLCK, F_SETLK);
+}
 
-  /* Is the record structure on disk of a different size than our current one ? */
-  /* We may need a registry update. */
+/* Sources of NPU entries that job_registry_merge_pending_nonpriv_updates */
+/* needs to look at */
+#define JOB_REGISTRY_NPU_PENDING_SPOOL 0x1
+#define JOB_REGISTRY_NPU_PENDING_FILES 0x2
 
-  found_size = job_registry_probe_next_record(fd, &junk);
+/*
+ * job_registry_npu_pending
+ *
+ * Tell, with no directory read, whether non-privileged updates may be
+ * pending: entries are pending in the spool if it grew past its header,
+ * and npudir needs reading if it changed since it was last found empty.
+ * Without a valid spool, npudir is always read.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ *
+ * @return Mask of JOB_REGISTRY_NPU_PENDING_* bits.
+ */
 
-  if ((found_size > 0) && (found_size != sizeof(job_registry_entry)))
+static int
+job_registry_npu_pending(const job_registry_handle *rha)
+{
+  job_registry_npu_spool_header hdr;
+  struct stat sst, dst;
+  int pending = 0;
+
+  if (rha->npuspool_fd < 0 ||
+      pread(rha->npuspool_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != JOB_REGISTRY_NPU_SPOOL_MAGIC ||
+      hdr.version != JOB_REGISTRY_NPU_SPOOL_VERSION ||
+      hdr.reclen != sizeof(job_registry_entry) ||
+      fstat(rha->npuspool_fd, &sst) < 0)
+    return JOB_REGISTRY_NPU_PENDING_FILES;
+
+  if (sst.st_size > (off_t)sizeof(hdr)) pending |= JOB_REGISTRY_NPU_PENDING_SPOOL;
+  if (stat(rha->npudir, &dst) < 0 || dst.st_mtime >= hdr.npudir_scanned)
+    pending |= JOB_REGISTRY_NPU_PENDING_FILES;
+
+  return pending;
+}
+
+/*
+ * job_registry_npu_spool_append
+ *
+ * Append an entry to the NPU spool, if a valid one exists and isn't
+ * locked by somebody else.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param entry Entry to append, with all fields set.
+ *
+ * @return Less than zero on error, or if the spool can't be used.
+ */
+
+static int
+job_registry_npu_spool_append(const job_registry_handle *rha,
+                              const job_registry_entry *entry)
+{
+  job_registry_npu_spool_header hdr;
+  struct stat sst;
+  int sfd;
+  int ret = JOB_REGISTRY_FAIL;
+
+  sfd = open(rha->npuspool, O_RDWR|O_APPEND);
+  if (sfd < 0) return JOB_REGISTRY_FOPEN_FAIL;
+
+  if (job_registry_npu_spool_lock(sfd, F_WRLCK, F_SETLK) < 0)
    {
-    /* Move old registry away and update it */
-    old_path = jobregistry_construct_path("%s/%s.oldreg",rha->path,0);
-    if (old_path == NULL)
-     {
-      job_registry_destroy(rha);
-      errno = ENOMEM;
-      return NULL;
-     }
-    if (rename(rha->path, old_path) < 0)
+    close(sfd);
+    return JOB_REGISTRY_FLOCK_FAIL;
+   }
+
+  if (pread(sfd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+      hdr.magic == JOB_REGISTRY_NPU_SPOOL_MAGIC &&
+      hdr.version == JOB_REGISTRY_NPU_SPOOL_VERSION &&
+      hdr.reclen == sizeof(job_registry_entry) &&
+      fstat(sfd, &sst) >= 0)
+   {
+    /* Drop any partial entry left by a submitter that died */
+    if (((sst.st_size - sizeof(hdr)) % sizeof(job_registry_entry)) != 0)
      {
-      free(old_path);
-      job_registry_destroy(rha);
-      return NULL;
+      sst.st_size -= (sst.st_size - sizeof(hdr)) % sizeof(job_registry_entry);
+      ftruncate(sfd, sst.st_size);
      }
-    fclose(fd); /* Release lock */
-    if (job_registry_update_reg(rha, old_path) < 0)
+    if (write(sfd, entry, sizeof(job_registry_entry)) == 
+        sizeof(job_registry_entry)) ret = JOB_REGISTRY_SUCCESS;
+    else
      {
-      free(old_path);
-      job_registry_destroy(rha);
-      return NULL; /* keep the rename errno */
+      /* Don't leave a partial entry behind */
+      ftruncate(sfd, sst.st_size);
+      ret = JOB_REGISTRY_FWRITE_FAIL;
      }
-    free(old_path);
    }
-  else fclose(fd);
 
-  /* Now it's safe to attempt a NPU merge */
-  job_registry_merge_pending_nonpriv_updates(rha, NULL);
+  close(sfd); /* Releases the lock */
+  return ret;
+}
 
-  fd = fopen(rha->path, "r");
-  if (fd == NULL)
-   {
-    job_registry_destroy(rha);
-     return NULL;
-   }
-  if (job_registry_rdlock(rha, fd) < 0)
-   {
-    fclose(fd);
-    job_registry_destroy(rha);
-    return NULL;
+/*
+ * job_registry_segments_load
+ *
+ * Load the segment summary matching the current mapping of a persistent
+ * handle into rha->segment_mdate. rha->n_segments is set to zero if
+ * no valid summary is found, or if some registry writers can't update
+ * it (see job_registry_seqlock_covers).
+ *
+ * @param rha Pointer to a job registry handle in persistent mode.
+ */
+
+static void
+job_registry_segments_load(job_registry_handle *rha)
+{
+  job_registry_segment_header hdr, check;
+  struct stat sst, rst;
+  uint32_t n_seg, n_mapped_seg;
+  time_t *new_mdate;
+  int sfd;
+
+  rha->n_segments = 0;
+  if (rha->data_map_length == 0) return;
+
+  sfd = rha->segment_fd;
+  if (sfd < 0 && (sfd = open(rha->segfile, O_RDONLY)) < 0) return;
+
+  if (pread(sfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != JOB_REGISTRY_SEGMENT_MAGIC ||
+      hdr.version != JOB_REGISTRY_SEGMENT_VERSION ||
+      hdr.segment_records != JOB_REGISTRY_SEGMENT_RECORDS ||
+      hdr.firstrec != rha->data_map_firstrec ||
+      hdr.registry_ino != (uint64_t)rha->data_map_ino ||
+      fstat(sfd, &sst) < 0 || fstat(rha->persist_fd, &rst) < 0 ||
+      !job_registry_seqlock_covers(&rst, &sst))
+   {
+    /* Missing, stale or not writable by all registry writers */
+    if (sfd != rha->segment_fd) close(sfd);
+    return;
    }
 
-  if (job_registry_resync(rha, fd) < 0)
+  n_seg = (sst.st_size - sizeof(hdr))/sizeof(time_t);
+  n_mapped_seg = (rha->data_map_length/sizeof(job_registry_entry) +
+                  JOB_REGISTRY_SEGMENT_RECORDS - 1)/JOB_REGISTRY_SEGMENT_RECORDS;
+  if (n_seg > n_mapped_seg) n_seg = n_mapped_seg;
+
+  new_mdate = NULL;
+  if (n_seg > 0)
+    new_mdate = (time_t *)realloc(rha->segment_mdate, n_seg*sizeof(time_t));
+  if (new_mdate != NULL)
    {
-    fclose(fd);
-    job_registry_destroy(rha);
-    return NULL;
+    rha->segment_mdate = new_mdate;
+    /* The summary may have been rebuilt while we were reading it */
+    if (pread(sfd, rha->segment_mdate, n_seg*sizeof(time_t), sizeof(hdr))
+        == (ssize_t)(n_seg*sizeof(time_t)) &&
+        pread(sfd, &check, sizeof(check), 0) == sizeof(check) &&
+        memcmp(&check, &hdr, sizeof(hdr)) == 0)
+      rha->n_segments = n_seg;
    }
-     
-  fclose(fd);
 
-  return(rha);
+  if (sfd != rha->segment_fd) close(sfd);
 }
 
 /*
- * job_registry_destroy
+ * job_registry_purge_map
  *
- * Frees any dynamic content and the job registry handle itself.
+ * (Re)map the whole registry file being purged by
+ * job_registry_purge_online, if it grew since it was last mapped.
  *
- * @param rha Pointer to a job registry handle returned by job_registry_init
- */
+ * @param pw Pointer to the purge work state.
+ * @param fd Descriptor of the open registry file.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ */
 
-void 
-job_registry_destroy(job_registry_handle *rha)
+static int
+job_registry_purge_map(job_registry_purge_work *pw, int fd)
 {
-   if (rha->path != NULL) free(rha->path);
-   if (rha->lockfile != NULL) free(rha->lockfile);
-   if (rha->npudir != NULL) free(rha->npudir);
-   if (rha->proxydir != NULL) free(rha->proxydir);
-   if (rha->subjectlist != NULL) free(rha->subjectlist);
-   if (rha->npusubjectlist != NULL) free(rha->npusubjectlist);
-   if (rha->mmappableindex != NULL) free(rha->mmappableindex);
-   rha->n_entries = rha->n_alloc = 0;
-   if (rha->index_mmap_length > 0)
-    {
-     munmap(rha->entries, rha->index_mmap_length);
-     close(rha->mmap_fd);
-     rha->index_mmap_length = 0;
-     rha->mmap_fd = -1;
-    }
-   else if (rha->entries != NULL) free(rha->entries);
-   free(rha);
+  struct stat rst;
+  job_registry_recnum_t n_recs;
+  void *map;
+
+  if (fstat(fd, &rst) < 0) return JOB_REGISTRY_STAT_FAIL;
+  n_recs = rst.st_size / sizeof(job_registry_entry);
+
+  /* Records already copied were removed (undone appends): start over */
+  if (n_recs < pw->n_copied)
+   {
+    errno = EAGAIN;
+    return JOB_REGISTRY_FAIL;
+   }
+
+  pw->rfd = fd;
+  if (pw->recs != NULL && n_recs == pw->n_mapped) return JOB_REGISTRY_SUCCESS;
+
+  if (pw->recs != NULL)
+    munmap((void *)pw->recs, (size_t)pw->n_mapped*sizeof(job_registry_entry));
+  pw->recs = NULL;
+  pw->n_mapped = 0;
+  if (n_recs == 0) return JOB_REGISTRY_SUCCESS;
+
+  map = mmap(0, (size_t)n_recs*sizeof(job_registry_entry), PROT_READ,
+             MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) return JOB_REGISTRY_MMAP_FAIL;
+
+  pw->recs = (const job_registry_entry *)map;
+  pw->n_mapped = n_recs;
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/* Account for a record written at position 'pos' of the new registry */
+static int
+job_registry_purge_seg_note(job_registry_purge_work *pw,
+                            job_registry_recnum_t pos, time_t mdate)
+{
+  uint32_t seg = pos/JOB_REGISTRY_SEGMENT_RECORDS;
+  time_t *new_mdate;
+
+  if (seg >= pw->n_seg_alloc)
+   {
+    new_mdate = (time_t *)realloc(pw->seg_mdate,
+                                  (seg + 64)*sizeof(time_t));
+    if (new_mdate == NULL)
+     {
+      errno = ENOMEM;
+      return JOB_REGISTRY_MALLOC_FAIL;
+     }
+    memset(new_mdate + pw->n_seg_alloc, 0,
+           (seg + 64 - pw->n_seg_alloc)*sizeof(time_t));
+    pw->seg_mdate = new_mdate;
+    pw->n_seg_alloc = seg + 64;
+   }
+  if (mdate > pw->seg_mdate[seg]) pw->seg_mdate[seg] = mdate;
+  return JOB_REGISTRY_SUCCESS;
 }
 
 /*
- * job_registry_firstrec
- * 
- * Get the record number of the first record in the open registry file
- * pointed to by fd. 
- * Record numbers are supposed to be in ascending order, with no gaps. 
+ * job_registry_purge_segments
  *
- * @param rha Pointer to a job registry handle returned by job_registry_init
- * @param fd Stream descriptor of an open registry file.
- *        fd *must* be at least read locked before calling this function. 
- *        The file will be left positioned after the first record.
+ * Write the segment summary of the new registry file next to the
+ * current one, so that it can be renamed in place with the registry.
  *
- * @return Record number in the first record of the file.
+ * @param jra Pointer to a (NAMES_ONLY) handle to the registry.
+ * @param pw Pointer to the purge work state.
  *
+ * @return Dynamically allocated path of the new summary, or NULL
+ *         in case of error.
  */
 
-job_registry_recnum_t
-job_registry_firstrec(job_registry_handle *rha, FILE *fd)
+static char *
+job_registry_purge_segments(const job_registry_handle *jra,
+                            const job_registry_purge_work *pw)
 {
-  int ret;
-  job_registry_entry first; 
+  job_registry_segment_header hdr;
+  struct stat nst;
+  char *newseg_path;
+  uint32_t n_seg;
+  mode_t old_umask;
+  size_t len;
+  int sfd;
 
-  rha->disk_firstrec = 0;
+  if (fstat(pw->nfd, &nst) < 0) return NULL;
 
-  ret = fseek(fd, 0L, SEEK_SET);
-  if (ret < 0) return ret; 
+  newseg_path = jobregistry_construct_path("%s/%s.new.%d", jra->segfile, getpid());
+  if (newseg_path == NULL) return NULL;
 
-  ret = fread(&first, sizeof(job_registry_entry), 1, fd);
-  if (ret < 1) 
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = JOB_REGISTRY_SEGMENT_MAGIC;
+  hdr.version = JOB_REGISTRY_SEGMENT_VERSION;
+  hdr.segment_records = JOB_REGISTRY_SEGMENT_RECORDS;
+  hdr.firstrec = pw->new_first;
+  hdr.registry_ino = nst.st_ino;
+  n_seg = (pw->n_out + JOB_REGISTRY_SEGMENT_RECORDS - 1)/JOB_REGISTRY_SEGMENT_RECORDS;
+  len = n_seg*sizeof(time_t);
+
+  /* Writable by all registry writers */
+  old_umask = umask(0);
+  sfd = open(newseg_path, O_WRONLY|O_CREAT|O_TRUNC,
+             S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+  umask(old_umask);
+  if (sfd < 0 ||
+      write(sfd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      (len > 0 && write(sfd, pw->seg_mdate, len) != (ssize_t)len))
    {
-    if (feof(fd)) return 0;
-    else return JOB_REGISTRY_FREAD_FAIL;
+    if (sfd >= 0) close(sfd);
+    unlink(newseg_path);
+    free(newseg_path);
+    return NULL;
    }
+  close(sfd);
+  return newseg_path;
+}
 
-  if ( (first.magic_start != JOB_REGISTRY_MAGIC_START) ||
-       (first.magic_end   != JOB_REGISTRY_MAGIC_END) )
+/* Copy record 'pos' of the registry being purged. With no lock held */
+/* it's read from the file, as the mapping faults past the end of a */
+/* file truncated meanwhile. */
+static int
+job_registry_purge_read(const job_registry_purge_work *pw,
+                        job_registry_recnum_t pos, job_registry_entry *dest,
+                        int locked)
+{
+  if (locked)
    {
-    errno = ENOMSG;
-    return JOB_REGISTRY_CORRUPT_RECORD;
+    memcpy(dest, pw->recs + pos, sizeof(job_registry_entry));
+    return JOB_REGISTRY_SUCCESS;
+   }
+  if (pread(pw->rfd, dest, sizeof(job_registry_entry),
+            (off_t)pos*sizeof(job_registry_entry)) != sizeof(job_registry_entry))
+   {
+    errno = EAGAIN;
+    return JOB_REGISTRY_FAIL;
    }
+  return JOB_REGISTRY_SUCCESS;
+}
 
-  rha->disk_firstrec = first.recnum;
-  return first.recnum;
+/* Append the pw->buf contents to the new registry file */
+static int
+job_registry_purge_flush(job_registry_purge_work *pw, int n_buf)
+{
+  size_t len = (size_t)n_buf*sizeof(job_registry_entry);
+
+  if (n_buf <= 0) return JOB_REGISTRY_SUCCESS;
+  if (pwrite(pw->nfd, pw->buf, len,
+             (off_t)pw->n_out*sizeof(job_registry_entry)) != (ssize_t)len)
+    return JOB_REGISTRY_FWRITE_FAIL;
+  pw->n_out += n_buf;
+  return JOB_REGISTRY_SUCCESS;
 }
 
 /*
- * job_registry_resync_mmap
+ * job_registry_purge_copy
  *
- * Update an index cache on file that can be shared among different
- * processes.
- * 
- * @param fd Stream descriptor of an open registry file.
- *        fd *must* be at least read locked before calling this function. 
- * @param rha Pointer to a job registry handle returned by job_registry_init
+ * Copy to the new registry file the mapped records that were not seen
+ * yet, dropping the ones created before 'oldest_creation_date'. The
+ * proxies of dropped records are unlinked by
+ * job_registry_purge_unlink_proxies once the new file is in place.
+ * Surviving records are renumbered as done by job_registry_purge.
  *
- * @return Less than zero on error. Zero on unchanged registry. Greater than 0
- *         if registry changed, See job_registry.h for error codes.
- *         errno is also set in case of error.
+ * @param jra Pointer to a (NAMES_ONLY) handle to the registry.
+ * @param pw Pointer to the purge work state.
+ * @param oldest_creation_date Oldest cdate of entries that will be kept.
+ * @param locked Whether the registry write lock is held. Without the
+ *        lock, copying stops at the first record that isn't complete yet.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
  */
 
-int
-job_registry_resync_mmap(job_registry_handle *rha, FILE *fd)
+static int
+job_registry_purge_copy(const job_registry_handle *jra,
+                        job_registry_purge_work *pw,
+                        time_t oldest_creation_date, int locked)
 {
-  struct stat rst, mst;
-  job_registry_recnum_t firstrec;
-  job_registry_recnum_t old_firstrec, old_lastrec;
-  char *chosen_id;
-  int mst_ret;
-  job_registry_entry *ren;
-  job_registry_index newin; 
-  int need_to_update = TRUE;
-  int update_exponential_backoff = 1;
-  char *new_index;
-  int newindex_fd=-1;
-  int i;
-
-  if (fstat(fileno(fd), &rst) < 0) return JOB_REGISTRY_STAT_FAIL;
-  mst_ret = stat(rha->mmappableindex, &mst);
-  if (mst_ret >= 0)
-   {
-    if ((mst.st_size/sizeof(job_registry_index)) ==
-        (rst.st_size/sizeof(job_registry_entry))) need_to_update = FALSE;
-   }
-
-  firstrec = job_registry_firstrec(rha,fd);
-  if (fseek(fd,0L,SEEK_SET) < 0) return JOB_REGISTRY_FSEEK_FAIL;
+  job_registry_entry *cur;
+  job_registry_recnum_t *new_pos;
+  int n_buf = 0;
+  int ret;
 
-  if ((rha->lastrec != 0 || rha->firstrec != 0) && firstrec != rha->firstrec)
+  while (pw->n_copied < pw->n_mapped)
    {
-    /* The registry may have been purged. */
-    need_to_update = TRUE;
-   }
-
-  old_lastrec = rha->lastrec;
-  old_firstrec = rha->firstrec;
+    cur = pw->buf + n_buf;
+    if (job_registry_purge_read(pw, pw->n_copied, cur, locked) < 0) break;
 
-  while (need_to_update)
-   {
-    new_index = (char *)malloc(strlen(rha->mmappableindex)+5);
-    if (new_index == NULL) 
+    if ( (cur->magic_start != JOB_REGISTRY_MAGIC_START) ||
+         (cur->magic_end   != JOB_REGISTRY_MAGIC_END) )
      {
-      errno = ENOMEM;
-      return JOB_REGISTRY_MALLOC_FAIL;
+      if (!locked) break;
+      job_registry_purge_flush(pw, n_buf);
+      errno = ENOMSG;
+      return JOB_REGISTRY_CORRUPT_RECORD;
      }
-    sprintf(new_index,"%s.tmp",rha->mmappableindex);
 
-    newindex_fd = open(new_index, O_RDWR|O_CREAT|O_EXCL, 
-                       S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-    if (newindex_fd < 0 && errno != EEXIST && errno != EACCES)
-     {
-      free(new_index);
-      return JOB_REGISTRY_FOPEN_FAIL;
-     }
-    else if (newindex_fd < 0 && errno == EACCES)
-     {
-      /* If we cannot update the mmap file we are non-privileged and
-         we'd better use the one that's there. */
-      free(new_index);
-      break;
-     }
-    else if (newindex_fd >= 0)
+    pw->n_copied++;
+    pw->st.n_scanned++;
+    if (cur->cdate < oldest_creation_date)
      {
-      /* Dispose of old index. */
-      if (rha->index_mmap_length > 0)
-       {
-        munmap(rha->entries, rha->index_mmap_length);
-        close(rha->mmap_fd);
-        rha->index_mmap_length = 0;
-        rha->mmap_fd = -1;
-       }
-      else if (rha->entries != NULL) free(rha->entries);
-      rha->entries = NULL;
-      rha->firstrec = 0;
-      rha->lastrec = 0;
-      rha->n_entries = 0;
-      rha->n_alloc = 0;
-
-      while ((ren = job_registry_get_next(rha, fd)) != NULL)
+      pw->st.n_purged++;
+      if (cur->proxy_link[0] == '\000') continue;
+      if (pw->n_purged_pos >= pw->n_purged_alloc)
        {
-        if (rha->firstrec == 0) rha->firstrec = ren->recnum;
-        if (ren->recnum > rha->lastrec) rha->lastrec = ren->recnum;
-        (rha->n_entries)++;
-        if (rha->mode == BY_BLAH_ID_MMAP)         chosen_id = ren->blah_id;
-        else if(rha->mode == BY_USER_PREFIX_MMAP) chosen_id = ren->user_prefix;
-        else                                      chosen_id = ren->batch_id;
-      
-        JOB_REGISTRY_ASSIGN_ENTRY(newin.id,chosen_id);
-        newin.recnum = ren->recnum; 
-        if (write(newindex_fd, &newin, sizeof(newin)) < sizeof(newin))
+        new_pos = (job_registry_recnum_t *)realloc(pw->purged_pos,
+                    (pw->n_purged_alloc + JOB_REGISTRY_PURGE_CHUNK) *
+                    sizeof(job_registry_recnum_t));
+        if (new_pos == NULL)
          {
-          free(ren);
-          unlink(new_index);
-          close(newindex_fd);
-          free(new_index);
-          rha->firstrec = 0;
-          rha->lastrec = 0;
-          rha->n_entries = 0;
-          return JOB_REGISTRY_FWRITE_FAIL;
+          errno = ENOMEM;
+          return JOB_REGISTRY_MALLOC_FAIL;
          }
-        free(ren);
-       } /* End of mmap file update cycle */
-
-      if (rha->n_entries == 0)
-       {
-        /* Registry empty - no need to mmap */
-        unlink(new_index);
-        close(newindex_fd);
-        free(new_index);
-        return JOB_REGISTRY_NO_VALID_RECORD;
+        pw->purged_pos = new_pos;
+        pw->n_purged_alloc += JOB_REGISTRY_PURGE_CHUNK;
        }
+      pw->purged_pos[pw->n_purged_pos++] = pw->n_copied - 1;
+      continue;
+     }
 
-      rha->index_mmap_length = lseek(newindex_fd, 0, SEEK_CUR);
-
-      rha->entries = mmap(0, rha->index_mmap_length, 
-                          PROT_READ|PROT_WRITE, MAP_SHARED, newindex_fd, 0);
-      if (rha->entries == MAP_FAILED)
-       {
-        unlink(new_index);
-        close(newindex_fd);
-        free(new_index);
-        rha->firstrec = 0;
-        rha->lastrec = 0;
-        rha->n_entries = 0;
-        rha->entries = NULL;
-        rha->index_mmap_length = 0;
-        return JOB_REGISTRY_MMAP_FAIL;
-       }
-      job_registry_sort(rha);
-      if (munmap(rha->entries, rha->index_mmap_length) < 0)
-       {
-        /* Something went wrong while syncing the sorted index to disk */
-        unlink(new_index);
-        close(newindex_fd);
-        free(new_index);
-        rha->firstrec = 0;
-        rha->lastrec = 0;
-        rha->n_entries = 0;
-        rha->index_mmap_length = 0;
-        return JOB_REGISTRY_MUNMAP_FAIL;
-       }
-      if (rename (new_index, rha->mmappableindex) < 0)
-       {
-        unlink(new_index);
-        close(newindex_fd);
-        free(new_index);
-        rha->firstrec = 0;
-        rha->lastrec = 0;
-        rha->n_entries = 0;
-        rha->index_mmap_length = 0;
-        return JOB_REGISTRY_RENAME_FAIL;
-       }
-      rha->entries = mmap(0, rha->index_mmap_length, PROT_READ, MAP_SHARED, newindex_fd, 0);
-      if (rha->entries == NULL)
+    if (pw->n_out + n_buf >= pw->n_alloc)
+     {
+      new_pos = (job_registry_recnum_t *)realloc(pw->old_pos,
+                  (pw->n_alloc + JOB_REGISTRY_PURGE_CHUNK*16) *
+                  sizeof(job_registry_recnum_t));
+      if (new_pos == NULL)
        {
-        close(newindex_fd);
-        free(new_index);
-        rha->firstrec = 0;
-        rha->lastrec = 0;
-        rha->n_entries = 0;
-        rha->index_mmap_length = 0;
-        return JOB_REGISTRY_MMAP_FAIL;
+        errno = ENOMEM;
+        return JOB_REGISTRY_MALLOC_FAIL;
        }
-      free(new_index);
-      break; /* Done with registry update. */
+      pw->old_pos = new_pos;
+      pw->n_alloc += JOB_REGISTRY_PURGE_CHUNK*16;
      }
+    pw->old_pos[pw->n_out + n_buf] = pw->n_copied - 1;
+    cur->recnum = pw->new_first + pw->n_out + n_buf;
+    if ((ret = job_registry_purge_seg_note(pw, pw->n_out + n_buf,
+                                           cur->mdate)) < 0) return ret;
+    job_registry_store_hash(&(pw->hst), cur->subject_hash);
+    if (locked) pw->st.n_locked++;
+
+    if (++n_buf >= JOB_REGISTRY_PURGE_CHUNK)
+     {
+      if ((ret = job_registry_purge_flush(pw, n_buf)) < 0) return ret;
+      n_buf = 0;
+     }
+   }
+  return job_registry_purge_flush(pw, n_buf);
+}
 
-    /* If we reach here, the creation of the new mmappable index failed */
-    /* with EEXIST, i.e. someone else is trying to update it. */
-    /* We back off until (hopefully) this is complete. */
+/*
+ * job_registry_purge_refresh
+ *
+ * Copy again to the new registry file any surviving record that was
+ * updated in place after it was copied.
+ *
+ * @param pw Pointer to the purge work state.
+ * @param locked Whether the registry write lock is held.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ */
 
-    sleep(update_exponential_backoff);
-    update_exponential_backoff*=2;
+static int
+job_registry_purge_refresh(job_registry_purge_work *pw, int locked)
+{
+  job_registry_entry cur;
+  job_registry_recnum_t k, j, n_chunk;
+  size_t len;
 
-    /* Did a good index (updated by somebody else) appear in the meanwhile ? */
-    if (fstat(fileno(fd), &rst) < 0) return JOB_REGISTRY_STAT_FAIL;
-    mst_ret = stat(rha->mmappableindex, &mst);
-    if (mst_ret >= 0)
-     {
-      if ((mst.st_size/sizeof(job_registry_index)) ==
-          (rst.st_size/sizeof(job_registry_entry)))
-       { 
-        free(new_index);
-        break;
-       }
-     }
+  for (k = 0; k < pw->n_out; k += n_chunk)
+   {
+    n_chunk = pw->n_out - k;
+    if (n_chunk > JOB_REGISTRY_PURGE_CHUNK) n_chunk = JOB_REGISTRY_PURGE_CHUNK;
+    len = (size_t)n_chunk*sizeof(job_registry_entry);
+    if (pread(pw->nfd, pw->buf, len,
+              (off_t)k*sizeof(job_registry_entry)) != (ssize_t)len)
+      return JOB_REGISTRY_FREAD_FAIL;
 
-    if (update_exponential_backoff > JOB_REGISTRY_MMAP_UPDATE_TIMEOUT)
+    for (j = 0; j < n_chunk; j++)
      {
-      /* Unlinking the 'new' file after this long cannot hurt anyone */
-      /* If there is a process that was really trying to write it, it */
-      /* will just fall back to the in-memory index. */
-      /* This will handle the case of a 'new_index' file left behind */
-      /* by a dead process */
-      if (unlink(new_index) < 0)
-       {
-        free(new_index);
-        return JOB_REGISTRY_UPDATE_TIMEOUT;
-       }
-      /* We try creating the updated index again if we were able to unlink */
-      /* the stale one. */
+      if (job_registry_purge_read(pw, pw->old_pos[k+j], &cur, locked) < 0)
+        return JOB_REGISTRY_FAIL;
+      cur.recnum = pw->new_first + k + j;
+      if (memcmp(&cur, pw->buf + j, sizeof(job_registry_entry)) == 0) continue;
+
+      if (pwrite(pw->nfd, &cur, sizeof(job_registry_entry),
+                 (off_t)(k+j)*sizeof(job_registry_entry))
+          != sizeof(job_registry_entry))
+        return JOB_REGISTRY_FWRITE_FAIL;
+      job_registry_store_hash(&(pw->hst), cur.subject_hash);
+      job_registry_purge_seg_note(pw, k + j, cur.mdate);
+      pw->st.n_refreshed++;
+      if (locked) pw->st.n_locked++;
      }
-    free(new_index);
-   } /* End of while(need_to_update) loop */
+   }
+  return JOB_REGISTRY_SUCCESS;
+}
 
-  if (newindex_fd < 0)
+/*
+ * job_registry_purge_unlink_proxies
+ *
+ * Unlink the proxies of the records dropped by job_registry_purge_copy.
+ * To be called after the new registry file was renamed in place, with
+ * the write lock still held, so that the proxy links are read from the
+ * final version of the purged records.
+ *
+ * @param jra Pointer to a (NAMES_ONLY) handle to the registry.
+ * @param pw Pointer to the purge work state.
+ */
+
+static void
+job_registry_purge_unlink_proxies(const job_registry_handle *jra,
+                                  const job_registry_purge_work *pw)
+{
+  job_registry_entry cur;
+  job_registry_recnum_t k;
+
+  for (k = 0; k < pw->n_purged_pos; k++)
    {
-    /* Need to attach to an existing and up-to-date mmap file */
-    newindex_fd = open(rha->mmappableindex, O_RDONLY);
-    if (newindex_fd < 0) return JOB_REGISTRY_FOPEN_FAIL;
+    if (pw->purged_pos[k] >= pw->n_mapped) continue;
+    memcpy(&cur, pw->recs + pw->purged_pos[k], sizeof(job_registry_entry));
+    if (cur.proxy_link[0] != '\000') job_registry_unlink_proxy(jra, &cur);
+   }
+}
 
-    /* Dispose of old index. */
-    if (rha->index_mmap_length > 0)
-     {
-      munmap(rha->entries, rha->index_mmap_length);
-      close(rha->mmap_fd);
-      rha->index_mmap_length = 0;
-      rha->mmap_fd = -1;
-     }
-    else if (rha->entries != NULL) free(rha->entries);
-    rha->entries = NULL;
-    rha->firstrec = 0;
-    rha->lastrec = 0;
-    rha->n_entries = 0;
-    rha->n_alloc = 0;
+/* Wait for the registry sequence counter to be even. FALSE if it */
+/* can't be used to detect updates. */
+static int
+job_registry_purge_seq_begin(const job_registry_handle *jra, uint64_t *seq)
+{
+  int tries;
 
-    rha->index_mmap_length = lseek(newindex_fd, 0, SEEK_END);
-    if (rha->index_mmap_length < 0)
-     {
-      close(newindex_fd);
-      rha->index_mmap_length = 0;
-      return JOB_REGISTRY_FSEEK_FAIL;
-     }
+  if (!job_registry_seq_trusted(jra)) return FALSE;
+  for (tries = 0; tries < JOB_REGISTRY_SEQLOCK_RETRIES; tries++)
+   {
+    if (job_registry_seq_read_begin(jra, seq)) return TRUE;
+    sched_yield();
+   }
+  return FALSE;
+}
 
-    rha->entries = mmap(0, rha->index_mmap_length, PROT_READ, MAP_SHARED, newindex_fd, 0);
-    if (rha->entries == NULL)
+static double
+job_registry_purge_elapsed(const struct timeval *from)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - from->tv_sec) + (now.tv_usec - from->tv_usec)/1e6;
+}
+
+/*
+ * job_registry_purge_online_work
+ *
+ * Body of job_registry_purge_online. Resources in 'pw' are freed by
+ * the caller.
+ */
+
+static int
+job_registry_purge_online_work(job_registry_handle *jra, FILE *fd,
+                               job_registry_purge_work *pw,
+                               const char *newreg_path,
+                               time_t oldest_creation_date)
+{
+  struct stat cst, rst;
+  struct timeval tm_lock;
+  char *newseg_path;
+  uint64_t seq = 0;
+  int seq_valid;
+  int ret;
+
+  /* First copy, with no lock held */
+  seq_valid = job_registry_purge_seq_begin(jra, &seq);
+  if ((ret = job_registry_purge_map(pw, fileno(fd))) < 0) return ret;
+  if ((ret = job_registry_purge_copy(jra, pw, oldest_creation_date,
+                                     FALSE)) < 0) return ret;
+  pw->st.n_passes = 1;
+
+  /* Catch up with records updated or appended meanwhile, until a pass */
+  /* completes with no registry writes. */
+  while (job_registry_seq_trusted(jra) &&
+         pw->st.n_passes < JOB_REGISTRY_PURGE_MAX_PASSES)
+   {
+    if (seq_valid && job_registry_seq_read_valid(jra, seq)) break;
+    seq_valid = job_registry_purge_seq_begin(jra, &seq);
+    if ((ret = job_registry_purge_map(pw, fileno(fd))) < 0) return ret;
+    if ((ret = job_registry_purge_refresh(pw, FALSE)) < 0) return ret;
+    if ((ret = job_registry_purge_copy(jra, pw, oldest_creation_date,
+                                       FALSE)) < 0) return ret;
+    pw->st.n_passes++;
+   }
+  fdatasync(pw->nfd);
+
+  /* Final switch, under the write lock */
+  if (job_registry_wrlock(jra, fd) < 0) return JOB_REGISTRY_FLOCK_FAIL;
+  gettimeofday(&tm_lock, NULL);
+
+  if (fstat(fileno(fd), &cst) < 0 || stat(jra->path, &rst) < 0)
+   {
+    job_registry_unlock(fd);
+    return JOB_REGISTRY_STAT_FAIL;
+   }
+  if (cst.st_ino != rst.st_ino || cst.st_dev != rst.st_dev)
+   {
+    /* Registry was rotated by somebody else meanwhile. */
+    job_registry_unlock(fd);
+    errno = EAGAIN;
+    return JOB_REGISTRY_FAIL;
+   }
+
+  ret = job_registry_purge_map(pw, fileno(fd));
+  if (ret >= 0 && !(seq_valid && job_registry_seq_read_valid(jra, seq)))
+    ret = job_registry_purge_refresh(pw, TRUE);
+  if (ret >= 0)
+    ret = job_registry_purge_copy(jra, pw, oldest_creation_date, TRUE);
+
+  if (ret >= 0)
+   {
+    /* Writers rebuild the summary if this fails */
+    newseg_path = job_registry_purge_segments(jra, pw);
+
+    if ((ret = job_registry_seq_write_begin(jra)) >= 0)
      {
-      close(newindex_fd);
-      rha->index_mmap_length = 0;
-      return JOB_REGISTRY_MMAP_FAIL;
+      if (rename(newreg_path, jra->path) < 0) ret = JOB_REGISTRY_RENAME_FAIL;
+      job_registry_seq_write_end(jra);
      }
+    if (ret >= 0) job_registry_purge_unlink_proxies(jra, pw);
 
-    rha->n_entries = (rha->index_mmap_length)/sizeof(job_registry_index);
-    rha->firstrec = JOB_REGISTRY_MAX_RECNUM;
-    /* Compute first/last recnum from sorted index. */
-    for (i=0; i<rha->n_entries; i++)
+    if (newseg_path != NULL)
      {
-      if (rha->entries[i].recnum < rha->firstrec) 
-        rha->firstrec = rha->entries[i].recnum;
-      if (rha->entries[i].recnum > rha->lastrec) 
-        rha->lastrec = rha->entries[i].recnum;
+      if (ret < 0 || rename(newseg_path, jra->segfile) < 0) unlink(newseg_path);
+      free(newseg_path);
      }
    }
 
-  rha->mmap_fd = newindex_fd;
+  job_registry_unlock(fd);
+  pw->st.pause_seconds = job_registry_purge_elapsed(&tm_lock);
 
-  if ((rha->lastrec != old_lastrec) || (rha->firstrec != old_firstrec))
+  return ret;
+}
+
+/*
+ * job_registry_purge_online
+ *
+ * Same as job_registry_purge, for registries that are in use: surviving
+ * entries are copied to the new registry file with no lock held, and
+ * copied again if they are updated meanwhile (this is detected via the
+ * registry sequence counter). The registry write lock is held only to copy
+ * the entries that were updated or appended since the last pass and to
+ * rename the new file in place.
+ * Corrupted registries cannot be repaired this way: use
+ * job_registry_purge with 'force_rewrite' for that.
+ *
+ * @param path Path to the job registry file.
+ * @param oldest_creation_date Oldest cdate of entries that will be
+ *        kept in the registry.
+ * @param stats Pointer to a job_registry_purge_stats structure that will
+ *        be filled with counters and timings. Can be NULL.
+ *
+ * @return Less than zero on error. errno is set in case of error.
+ *
+ */
+
+int
+job_registry_purge_online(const char *path, time_t oldest_creation_date,
+                          job_registry_purge_stats *stats)
+{
+  FILE *fd;
+  char *newreg_path;
+  job_registry_entry first;
+  job_registry_handle *jra;
+  job_registry_purge_work pw;
+  struct timeval tm_start;
+  mode_t old_umask;
+  ssize_t rret;
+  int ret;
+
+  gettimeofday(&tm_start, NULL);
+  memset(&pw, 0, sizeof(pw));
+  if (stats != NULL) memset(stats, 0, sizeof(job_registry_purge_stats));
+
+  jra = job_registry_init(path, NAMES_ONLY);
+  if (jra == NULL) return -1;
+
+  fd = fopen(jra->path,"r+");
+  if (fd == NULL) 
    {
-    return JOB_REGISTRY_CHANGED;
+    job_registry_destroy(jra);
+    return JOB_REGISTRY_FOPEN_FAIL;
+   }
+
+  rret = pread(fileno(fd), &first, sizeof(job_registry_entry), 0);
+  if (rret < (ssize_t)sizeof(job_registry_entry))
+   {
+    fclose(fd);
+    job_registry_destroy(jra);
+    /* Empty registry: nothing to do */
+    if (rret == 0) return JOB_REGISTRY_SUCCESS;
+    return JOB_REGISTRY_NO_VALID_RECORD;
+   }
+
+  if ( (first.magic_start != JOB_REGISTRY_MAGIC_START) ||
+       (first.magic_end   != JOB_REGISTRY_MAGIC_END) )
+   {
+    errno = ENOMSG;
+    fclose(fd);
+    job_registry_destroy(jra);
+    return JOB_REGISTRY_CORRUPT_RECORD;
+   }
+
+  if (first.cdate >= oldest_creation_date)
+   {
+    /* Nothing to purge. Go home. */
+    fclose(fd);
+    job_registry_destroy(jra);
+    return JOB_REGISTRY_SUCCESS;
+   }
+
+  /* NAMES_ONLY handles don't map the sequence counter by default */
+  job_registry_seqlock_open(jra);
+
+  newreg_path = jobregistry_construct_path("%s/%s.new.%d", jra->path, getpid());
+  pw.buf = (job_registry_entry *)malloc(JOB_REGISTRY_PURGE_CHUNK *
+                                        sizeof(job_registry_entry));
+  if (newreg_path == NULL || pw.buf == NULL) 
+   {
+    fclose(fd);
+    if (newreg_path != NULL) free(newreg_path);
+    if (pw.buf != NULL) free(pw.buf);
+    job_registry_destroy(jra);
+    errno = ENOMEM;
+    return JOB_REGISTRY_MALLOC_FAIL;
+   }
+
+  /* Make sure the file is group writable. */
+  old_umask=umask(S_IWOTH);
+  pw.nfd = open(newreg_path, O_RDWR|O_CREAT|O_TRUNC, 0666);
+  umask(old_umask);
+  if (pw.nfd < 0)
+   {
+    fclose(fd);
+    free(newreg_path);
+    free(pw.buf);
+    job_registry_destroy(jra);
+    return JOB_REGISTRY_FOPEN_FAIL;
    }
+
+  /* Same numbering as job_registry_purge */
+  pw.new_first = first.recnum + 1;
+
+  ret = job_registry_purge_online_work(jra, fd, &pw, newreg_path,
+                                       oldest_creation_date);
+
+  /* Closing fd releases the write lock, if still held. */
+  fclose(fd);
+  close(pw.nfd);
+  if (ret < 0) unlink(newreg_path);
+  else job_registry_purge_subject_hash_list(jra, &(pw.hst));
+
+  if (pw.recs != NULL)
+    munmap((void *)pw.recs, (size_t)pw.n_mapped*sizeof(job_registry_entry));
+  job_registry_free_hash_store(&(pw.hst)); 
+  if (pw.old_pos != NULL) free(pw.old_pos);
+  if (pw.purged_pos != NULL) free(pw.purged_pos);
+  if (pw.seg_mdate != NULL) free(pw.seg_mdate);
+  free(pw.buf);
+  free(newreg_path);
+  job_registry_destroy(jra);
+
+  pw.st.copy_seconds = job_registry_purge_elapsed(&tm_start);
+  if (stats != NULL) *stats = pw.st;
+
+  if (ret < 0) return ret;
   return JOB_REGISTRY_SUCCESS;
 }
 
 /*
- * job_registry_resync
+ * job_registry_init
+ *
+ * Sets up for access to a job registry file pointed to by 'path'.
+ * An entry index is loaded in memory if mode is not set to NO_INDEX.
+ *
+ * @param path Pathname of the job registry file.
+ * @param mode Operation of the index cache: NO_INDEX disables the cache
+ *             (job_registry_lookup, job_registry_update and job_registry_get
+ *             cannot be used), BY_BATCH_ID uses batch_id as the cache index 
+ *             key,  BY_BLAH_ID sets blah_id as the cache index key and
+ *             BY_USER_PREFIX uses the user_prefix entry (must be unique!).
+ *             NAMES_ONLY will fill the rha structure with the appropriate
+ *             file paths without performing any file access.
+ *
+ * @return Pointer to a dynamically allocated handle to the job registry.
+ *         This needs to be freed via job_registry_destroy.
+ */
+
+job_registry_handle *
+job_registry_init(const char *path,
+                  job_registry_index_mode mode)
+{
+  job_registry_handle *rha;
+  job_registry_entry junk;
+  size_t found_size;
+  struct stat fst, lst, dst;
+  char real_file_name[FILENAME_MAX];
+  int rlnk_status;
+  mode_t old_umask;
+  const char *npu_tail="/npu";
+  int cfd;
+  FILE *fd;
+  char *old_lockfile, *old_npudir, *old_path=NULL;
+  int need_to_create_regdir = FALSE;
+  char *dircreat[3];
+  char **dir;
+  int stret;
+
+  rha = (job_registry_handle *)calloc(1, sizeof(job_registry_handle));
+  if (rha == NULL) 
+   {
+    errno = ENOMEM;
+    return NULL;
+   }
+
+  rha->mode = mode;
+  rha->disk_firstrec = 0;
+  rha->persist_fd = -1;
+  rha->segment_fd = -1;
+  rha->changes_fd = -1;
+  rha->watch_fd = -1;
+  rha->npuspool_fd = -1;
+
+  /* Resolve symbolic link, if any */
+  if (lstat(path, &fst) >= 0)
+   {
+    if (S_ISLNK(fst.st_mode))
+     {
+      rlnk_status = readlink(path, real_file_name, sizeof(real_file_name));
+      if (rlnk_status > 0 && rlnk_status < sizeof(real_file_name))
+       {
+        real_file_name[rlnk_status] = '\000'; /* readlink does not NULL-terminate */
+        path = real_file_name;
+       }
+     }
+   }
+
+  rha->path = (char *)malloc(strlen(path) + strlen(JOB_REGISTRY_REGISTRY_NAME) + 2);
+  if (rha->path == NULL)
+   {
+    job_registry_destroy(rha);
+    errno = ENOMEM;
+    return NULL;
+   }
+  sprintf(rha->path, "%s/%s", path, JOB_REGISTRY_REGISTRY_NAME);
+
+  /* Create path and dir for NPU storage */
+  rha->npudir = jobregistry_construct_path("%s/%s.npudir",rha->path,0);
+  if (rha->npudir == NULL)
+   {
+    job_registry_destroy(rha);
+    errno = ENOMEM;
+    return NULL;
+   }
+
+  /* Check for reg dir existance, and convert from simple-file format */
+  /* in a backwards-compatible fashion */
+  if (mode != NAMES_ONLY)
+   {
+    stret = lstat(path, &fst);
+    if (stret < 0 && errno == ENOENT) need_to_create_regdir = TRUE;
+    if (stret >= 0)
+     {
+      if (!S_ISDIR(fst.st_mode))
+       {
+        old_lockfile = jobregistry_construct_path("%s/.%s.locktest",path,0);
+        old_npudir = jobregistry_construct_path("%s/.%s.npudir",path,0);
+        if (old_lockfile == NULL || old_npudir == NULL)
+         {
+          if (old_lockfile != NULL) free(old_lockfile);
+          if (old_npudir != NULL) free(old_npudir);
+          job_registry_destroy(rha);
+          errno = ENOMEM;
+          return NULL;
+         }
+        old_path = jobregistry_construct_path("%s/%s-OLD",path,0);
+        if (old_path == NULL)
+         {
+          free(old_lockfile); free(old_npudir);
+          job_registry_destroy(rha);
+          errno = ENOMEM;
+          return NULL;
+         }
+        if (rename(path, old_path) < 0)
+         {
+          free(old_lockfile); free(old_npudir); free(old_path);
+          job_registry_destroy(rha);
+          return NULL; /* keep the rename errno */
+         }
+        need_to_create_regdir = TRUE;
+       }
+      else
+       {
+        /* Make sure the file has as-restrictive as possible permissions */
+        chmod(path, fst.st_mode&(~(S_IROTH|S_IWOTH)));
+       }
+     }
+    if (need_to_create_regdir)
+     {
+      old_umask = umask(0);
+      if (mkdir(path,S_ISVTX|S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP|S_IXOTH) < 0)
+       {
+        if (old_path != NULL) 
+         {
+          free(old_lockfile); free(old_npudir); free(old_path);
+         }
+        umask(old_umask);
+        job_registry_destroy(rha);
+        return NULL;
+       }
+      umask(old_umask);
+      if (old_path != NULL)
+       {
+        rename(old_npudir, rha->npudir); /* An error here would deserve a
+                                            warning, but there's no
+                                            way to feed it back */
+        free(old_npudir);
+        unlink(old_lockfile); /* No real worry if this fails */
+        free(old_lockfile);
+        if (job_registry_update_reg(rha, old_path) < 0)
+         {
+          free(old_path);
+          job_registry_destroy(rha);
+          return NULL; /* keep the rename errno */
+         }
+       }
+     }
+   }
+
+  /* Create path for lock test file */
+  rha->lockfile = jobregistry_construct_path("%s/%s.locktest",rha->path,0);
+  if (rha->lockfile == NULL)
+   {
+    job_registry_destroy(rha);
+    errno = ENOMEM;
+    return NULL;
+   }
+
+  /* Create path for the shared sequence counter */
+  rha->seqfile = jobregistry_construct_path("%s/%s.seqlock",rha->path,0);
+  if (rha->seqfile == NULL)
+   {
+    job_registry_destroy(rha);
+    errno = ENOMEM;
+    return NULL;
+   }
+
+  /* Create path for the segment summary */
+  rha->segfile = jobregistry_construct_path("%s/%s.segments",rha->path,0);
+  if (rha->segfile == NULL)
+   {
+    job_registry_destroy(rha);
+    errno = ENOMEM;
+    return NULL;
+   }
+
+  /* Create path for the change journal */
+  rha->changesfile = jobregistry_construct_path("%s/%s.changes",rha->path,0);
+  if (rha->changesfile == NULL)
+   {
+    job_registry_destroy(rha);
+    errno = ENOMEM;
+    return NULL;
+   }
+
+  /* Create path for subject list */
+  rha->subjectlist = jobregistry_construct_path("%s/%s.subjectlist",rha->path,0);
+  if (rha->subjectlist == NULL)
+   {
+    job_registry_destroy(rha);
+    errno = ENOMEM;
+    return NULL;
+   }
+  /* Create path for non-privileged updates to the subject list */
+  rha->npusubjectlist = jobregistry_construct_path("%s/%s.npusubjectlist",rha->path,0);
+  if (rha->npusubjectlist == NULL)
+   {
+    job_registry_destroy(rha);
+    errno = ENOMEM;
+    return NULL;
+   }
+  /* Create path for the spool of non-privileged appends */
+  rha->npuspool = jobregistry_construct_path("%s/%s.npuspool",rha->path,0);
+  if (rha->npuspool == NULL)
+   {
+    job_registry_destroy(rha);
+    errno = ENOMEM;
+    return NULL;
+   }
+  /* Create path for mmap-pable shared entry index */
+  rha->index_mmap_length = 0;
+  rha->mmap_fd = -1;
+  rha->mmappableindex = NULL;
+  if (mode == BY_BLAH_ID_MMAP || mode == BY_BATCH_ID_MMAP ||
+      mode == BY_USER_PREFIX_MMAP)
+   {
+    switch (mode)
+     {
+      case BY_BLAH_ID_MMAP:
+        rha->mmappableindex = jobregistry_construct_path("%s/%s.by_blah_index",rha->path,0);
+        break;
+      case BY_BATCH_ID_MMAP:
+        rha->mmappableindex = jobregistry_construct_path("%s/%s.by_batch_index",rha->path,0);
+        break;
+      case BY_USER_PREFIX_MMAP:
+        rha->mmappableindex = jobregistry_construct_path("%s/%s.by_user_index",rha->path,0);
+        break;
+      default:
+        break;
+     }
+    if (rha->mmappableindex == NULL)
+     {
+      job_registry_destroy(rha);
+      errno = ENOMEM;
+      return NULL;
+     }
+   }
+
+  if (mode != NAMES_ONLY)
+   {
+    if (stat(rha->lockfile, &lst) < 0)
+     {
+      if (errno == ENOENT)
+       {
+        old_umask = umask(0);
+        if ((cfd=creat(rha->lockfile,S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH)) < 0)
+         {
+          umask(old_umask);
+          job_registry_destroy(rha);
+          return NULL;
+         }
+	close(cfd);
+        umask(old_umask);
+       }
+      else
+       {
+        job_registry_destroy(rha);
+        return NULL;
+       }
+     }
+    else
+     {
+      /* Make sure the file is empty has as-restrictive as possible permissions */
+      chmod(rha->lockfile, lst.st_mode&(~(S_IXUSR|S_IXGRP|S_IXOTH)));
+      truncate(rha->lockfile, 0);
+     }
+    if (stat(rha->subjectlist, &lst) < 0)
+     {
+      if (errno == ENOENT)
+       {
+        old_umask = umask(0);
+        if ((cfd=creat(rha->subjectlist,S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH)) < 0)
+         {
+          umask(old_umask);
+          job_registry_destroy(rha);
+          return NULL;
+         }
+	close(cfd);
+        umask(old_umask);
+       }
+      else
+       {
+        job_registry_destroy(rha);
+        return NULL;
+       }
+     }
+    else
+     {
+      /* Make sure the file has as-restrictive as possible permissions */
+      chmod(rha->subjectlist, lst.st_mode&(~(S_IXUSR|S_IXGRP|S_IXOTH|S_IWOTH)));
+     }
+    job_registry_seqlock_open(rha);
+
+    /* The segment summary is optional: readers that can't use it */
+    /* just scan all of the registry. */
+    rha->segment_fd = job_registry_open_side_file(rha->segfile);
+
+    rha->changes_fd = job_registry_open_side_file(rha->changesfile);
+
+    /* The NPU spool is shared by the registry group only, as its */
+    /* entries (and locks) are trusted by the merging process. */
+    /* Other non-privileged submitters write files in npudir. */
+    old_umask = umask(0);
+    rha->npuspool_fd = open(rha->npuspool, O_RDWR|O_CREAT,
+                       S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+    umask(old_umask);
+    if (rha->npuspool_fd >= 0)
+     {
+      /* Spools created by older versions were world-writable */
+      if (fstat(rha->npuspool_fd, &lst) >= 0 &&
+          (lst.st_mode & (S_IROTH|S_IWOTH)) != 0)
+        fchmod(rha->npuspool_fd, lst.st_mode&(~(S_IXUSR|S_IXGRP|S_IRWXO)));
+      job_registry_npu_spool_init(rha);
+     }
+    else rha->npuspool_fd = open(rha->npuspool, O_RDONLY);
+   }
+
+  /* Create path and dir for proxy storage */
+  rha->proxydir = jobregistry_construct_path("%s/%s.proxydir",rha->path,0);
+  if (rha->proxydir == NULL)
+   {
+    job_registry_destroy(rha);
+    errno = ENOMEM;
+    return NULL;
+   }
+
+
+  if (mode != NAMES_ONLY)
+   {
+    dircreat[0] = rha->npudir;
+    dircreat[1] = rha->proxydir;
+    dircreat[2] = NULL;
+
+    for(dir = dircreat; *dir != NULL; dir++)
+     {
+      if (stat(*dir, &dst) < 0)
+       {
+        if (errno == ENOENT)
+         {
+          old_umask = umask(0);
+          if (mkdir(*dir,S_ISVTX|S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IWGRP|S_IXGRP|S_IWOTH|S_IXOTH) < 0)
+           {
+            umask(old_umask);
+            job_registry_destroy(rha);
+            return NULL;
+           }
+          umask(old_umask);
+         }
+        else
+         {
+          job_registry_destroy(rha);
+          return NULL;
+         }
+       }
+      else
+       {
+        if (!S_ISDIR(dst.st_mode))
+         {
+          job_registry_destroy(rha);
+          errno = ENOTDIR;
+          return NULL;
+         }
+        /* Make sure the file has as-restrictive as possible permissions */
+        chmod(*dir, dst.st_mode&(~(S_IROTH)));
+       }
+     }
+   }
+  
+  if (mode == NAMES_ONLY) return(rha);
+
+  /* Now read the entire file and cache its contents */
+
+  /* In NO_INDEX mode only firstrec and lastrec will be updated */
+  /* Don't merge pending updates (use fopen instead of job_registry_open), as */
+  /* we may be in need of a registry format update. */
+
+  fd = fopen(rha->path, "r");
+  if (fd == NULL)
+   {
+    /* Make sure the file is group writable. */
+    old_umask = umask(S_IWOTH);
+    if (errno == ENOENT) fd = fopen(rha->path, "w+");
+    umask(old_umask);
+    if (fd == NULL)
+     {
+      job_registry_destroy(rha);
+      return NULL;
+     }
+   }
+  if (job_registry_rdlock(rha, fd) < 0)
+   {
+    fclose(fd);
+    job_registry_destroy(rha);
+    return NULL;
+   }
+
+  /* Is the record structure on disk of a different size than our current one ? */
+  /* We may need a registry update. */
+
+  found_size = job_registry_probe_next_record(fd, &junk);
+
+  if ((found_size > 0) && (found_size != sizeof(job_registry_entry)))
+   {
+    /* Move old registry away and update it */
+    old_path = jobregistry_construct_path("%s/%s.oldreg",rha->path,0);
+    if (old_path == NULL)
+     {
+      job_registry_destroy(rha);
+      errno = ENOMEM;
+      return NULL;
+     }
+    if (rename(rha->path, old_path) < 0)
+     {
+      free(old_path);
+      job_registry_destroy(rha);
+      return NULL;
+     }
+    fclose(fd); /* Release lock */
+    if (job_registry_update_reg(rha, old_path) < 0)
+     {
+      free(old_path);
+      job_registry_destroy(rha);
+      return NULL; /* keep the rename errno */
+     }
+    free(old_path);
+   }
+  else fclose(fd);
+
+  /* Now it's safe to attempt a NPU merge */
+  job_registry_merge_pending_nonpriv_updates(rha, NULL);
+
+  fd = fopen(rha->path, "r");
+  if (fd == NULL)
+   {
+    job_registry_destroy(rha);
+     return NULL;
+   }
+  if (job_registry_rdlock(rha, fd) < 0)
+   {
+    fclose(fd);
+    job_registry_destroy(rha);
+    return NULL;
+   }
+
+  if (job_registry_resync(rha, fd) < 0)
+   {
+    fclose(fd);
+    job_registry_destroy(rha);
+    return NULL;
+   }
+     
+  fclose(fd);
+
+  return(rha);
+}
+
+/* Free the contents of a subject list cache (not the struct itself) */
+static void
+job_registry_subject_cache_free(job_registry_subject_cache *sc)
+{
+  int i;
+
+  for (i=0; i<sc->n_lines; i++) free(sc->lines[i]);
+  if (sc->lines != NULL) free(sc->lines);
+  if (sc->table != NULL) free(sc->table);
+  memset(sc, 0, sizeof(job_registry_subject_cache));
+}
+
+/*
+ * job_registry_destroy
+ *
+ * Frees any dynamic content and the job registry handle itself.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init
+ */
+
+void 
+job_registry_destroy(job_registry_handle *rha)
+{
+   int i;
+
+   if (rha->path != NULL) free(rha->path);
+   if (rha->lockfile != NULL) free(rha->lockfile);
+   if (rha->npudir != NULL) free(rha->npudir);
+   if (rha->proxydir != NULL) free(rha->proxydir);
+   if (rha->subjectlist != NULL) free(rha->subjectlist);
+   if (rha->npusubjectlist != NULL) free(rha->npusubjectlist);
+   if (rha->npuspool != NULL) free(rha->npuspool);
+   if (rha->npuspool_fd >= 0) close(rha->npuspool_fd);
+   if (rha->mmappableindex != NULL) free(rha->mmappableindex);
+   if (rha->seqfile != NULL) free(rha->seqfile);
+   if (rha->seqlock != NULL) 
+     munmap((void *)rha->seqlock, sizeof(job_registry_seqlock));
+   if (rha->segfile != NULL) free(rha->segfile);
+   if (rha->segment_fd >= 0) close(rha->segment_fd);
+   if (rha->segment_mdate != NULL) free(rha->segment_mdate);
+   if (rha->changesfile != NULL) free(rha->changesfile);
+   if (rha->changes_fd >= 0) close(rha->changes_fd);
+   if (rha->changed != NULL) free(rha->changed);
+   if (rha->scan_buf != NULL) free(rha->scan_buf);
+   if (rha->watch_fd >= 0) close(rha->watch_fd);
+   rha->n_entries = rha->n_alloc = 0;
+   if (rha->index_mmap_length > 0)
+    {
+     munmap(rha->entries, rha->index_mmap_length);
+     close(rha->mmap_fd);
+     rha->index_mmap_length = 0;
+     rha->mmap_fd = -1;
+    }
+   else if (rha->entries != NULL) free(rha->entries);
+   if (rha->data_map != NULL) munmap(rha->data_map, rha->data_map_length);
+   if (rha->persist_fd >= 0) close(rha->persist_fd);
+   for (i=0; i<JOB_REGISTRY_N_HASH_KEYS; i++)
+     if (rha->hash_index[i] != NULL) free(rha->hash_index[i]);
+   if (rha->subject_slots != NULL) free(rha->subject_slots);
+   if (rha->subject_chain != NULL) free(rha->subject_chain);
+   if (rha->subject_cache != NULL)
+    {
+     job_registry_subject_cache_free(rha->subject_cache);
+     free(rha->subject_cache);
+    }
+   if (rha->compact != NULL)
+    {
+     job_registry_compact_free(rha->compact);
+     free(rha->compact);
+    }
+   free(rha);
+}
+
+/*
+ * job_registry_firstrec
+ * 
+ * Get the record number of the first record in the open registry file
+ * pointed to by fd. 
+ * Record numbers are supposed to be in ascending order, with no gaps. 
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init
+ * @param fd Stream descriptor of an open registry file.
+ *        fd *must* be at least read locked before calling this function. 
+ *        The file will be left positioned after the first record.
+ *
+ * @return Record number in the first record of the file.
+ *
+ */
+
+job_registry_recnum_t
+job_registry_firstrec(job_registry_handle *rha, FILE *fd)
+{
+  int ret;
+  job_registry_entry first; 
+
+  rha->disk_firstrec = 0;
+
+  ret = fseek(fd, 0L, SEEK_SET);
+  if (ret < 0) return ret; 
+
+  ret = fread(&first, sizeof(job_registry_entry), 1, fd);
+  if (ret < 1) 
+   {
+    if (feof(fd)) return 0;
+    else return JOB_REGISTRY_FREAD_FAIL;
+   }
+
+  if ( (first.magic_start != JOB_REGISTRY_MAGIC_START) ||
+       (first.magic_end   != JOB_REGISTRY_MAGIC_END) )
+   {
+    errno = ENOMSG;
+    return JOB_REGISTRY_CORRUPT_RECORD;
+   }
+
+  rha->disk_firstrec = first.recnum;
+  return first.recnum;
+}
+
+/*
+ * job_registry_resync_mmap
+ *
+ * Update an index cache on file that can be shared among different
+ * processes. If the registry wasn't purged since the currently mapped
+ * index was built, only the newly appended records are read and merged
+ * into a copy of the mapped index.
+ * 
+ * @param fd Stream descriptor of an open registry file.
+ *        fd *must* be at least read locked before calling this function. 
+ * @param rha Pointer to a job registry handle returned by job_registry_init
+ *
+ * @return Less than zero on error. Zero on unchanged registry. Greater than 0
+ *         if registry changed, See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
+
+int
+job_registry_resync_mmap(job_registry_handle *rha, FILE *fd)
+{
+  struct stat rst, mst;
+  job_registry_recnum_t firstrec;
+  job_registry_recnum_t old_firstrec, old_lastrec;
+  char *chosen_id;
+  int mst_ret;
+  job_registry_entry *ren;
+  job_registry_index newin; 
+  int need_to_update = TRUE;
+  int update_exponential_backoff = 1;
+  char *new_index;
+  int newindex_fd=-1;
+  int n_sorted;
+  int i;
+
+  if (fstat(fileno(fd), &rst) < 0) return JOB_REGISTRY_STAT_FAIL;
+  mst_ret = stat(rha->mmappableindex, &mst);
+  if (mst_ret >= 0)
+   {
+    if ((mst.st_size/sizeof(job_registry_index)) ==
+        (rst.st_size/sizeof(job_registry_entry))) need_to_update = FALSE;
+   }
+
+  firstrec = job_registry_firstrec(rha,fd);
+  if (fseek(fd,0L,SEEK_SET) < 0) return JOB_REGISTRY_FSEEK_FAIL;
+
+  if ((rha->lastrec != 0 || rha->firstrec != 0) && firstrec != rha->firstrec)
+   {
+    /* The registry may have been purged. */
+    need_to_update = TRUE;
+   }
+
+  old_lastrec = rha->lastrec;
+  old_firstrec = rha->firstrec;
+
+  while (need_to_update)
+   {
+    new_index = (char *)malloc(strlen(rha->mmappableindex)+5);
+    if (new_index == NULL) 
+     {
+      errno = ENOMEM;
+      return JOB_REGISTRY_MALLOC_FAIL;
+     }
+    sprintf(new_index,"%s.tmp",rha->mmappableindex);
+
+    newindex_fd = open(new_index, O_RDWR|O_CREAT|O_EXCL, 
+                       S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+    if (newindex_fd < 0 && errno != EEXIST && errno != EACCES)
+     {
+      free(new_index);
+      return JOB_REGISTRY_FOPEN_FAIL;
+     }
+    else if (newindex_fd < 0 && errno == EACCES)
+     {
+      /* If we cannot update the mmap file we are non-privileged and
+         we'd better use the one that's there. */
+      free(new_index);
+      break;
+     }
+    else if (newindex_fd >= 0)
+     {
+      n_sorted = 0;
+      if (rha->index_mmap_length > 0 && rha->n_entries > 0 &&
+          firstrec == old_firstrec)
+       {
+        /* No purge happened since the index we have mapped was built: */
+        /* copy it over and index only the records appended since. */
+        if (write(newindex_fd, rha->entries, 
+                  rha->n_entries*sizeof(job_registry_index)) ==
+            rha->n_entries*sizeof(job_registry_index) &&
+            fseek(fd,(long)((old_lastrec - old_firstrec + 1)*sizeof(job_registry_entry)),
+                  SEEK_SET) >= 0)
+         {
+          n_sorted = rha->n_entries;
+         }
+        else
+         {
+          /* Fall back to a full rebuild */
+          if (ftruncate(newindex_fd, 0) < 0 ||
+              lseek(newindex_fd, 0, SEEK_SET) < 0 ||
+              fseek(fd,0L,SEEK_SET) < 0)
+           {
+            unlink(new_index);
+            close(newindex_fd);
+            free(new_index);
+            return JOB_REGISTRY_FSEEK_FAIL;
+           }
+         }
+       }
+
+      /* Dispose of old index. */
+      if (rha->index_mmap_length > 0)
+       {
+        munmap(rha->entries, rha->index_mmap_length);
+        close(rha->mmap_fd);
+        rha->index_mmap_length = 0;
+        rha->mmap_fd = -1;
+       }
+      else if (rha->entries != NULL) free(rha->entries);
+      rha->entries = NULL;
+      rha->n_alloc = 0;
+      if (n_sorted == 0)
+       {
+        rha->firstrec = 0;
+        rha->lastrec = 0;
+        rha->n_entries = 0;
+       }
+
+      while ((ren = job_registry_get_next(rha, fd)) != NULL)
+       {
+        if (rha->firstrec == 0) rha->firstrec = ren->recnum;
+        if (ren->recnum > rha->lastrec) rha->lastrec = ren->recnum;
+        (rha->n_entries)++;
+        if (rha->mode == BY_BLAH_ID_MMAP)         chosen_id = ren->blah_id;
+        else if(rha->mode == BY_USER_PREFIX_MMAP) chosen_id = ren->user_prefix;
+        else                                      chosen_id = ren->batch_id;
+      
+        JOB_REGISTRY_ASSIGN_ENTRY(newin.id,chosen_id);
+        newin.recnum = ren->recnum; 
+        if (write(newindex_fd, &newin, sizeof(newin)) < sizeof(newin))
+         {
+          free(ren);
+          unlink(new_index);
+          close(newindex_fd);
+          free(new_index);
+          rha->firstrec = 0;
+          rha->lastrec = 0;
+          rha->n_entries = 0;
+          return JOB_REGISTRY_FWRITE_FAIL;
+         }
+        free(ren);
+       } /* End of mmap file update cycle */
+
+      if (rha->n_entries == 0)
+       {
+        /* Registry empty - no need to mmap */
+        unlink(new_index);
+        close(newindex_fd);
+        free(new_index);
+        return JOB_REGISTRY_NO_VALID_RECORD;
+       }
+
+      rha->index_mmap_length = lseek(newindex_fd, 0, SEEK_CUR);
+
+      rha->entries = mmap(0, rha->index_mmap_length, 
+                          PROT_READ|PROT_WRITE, MAP_SHARED, newindex_fd, 0);
+      if (rha->entries == MAP_FAILED)
+       {
+        unlink(new_index);
+        close(newindex_fd);
+        free(new_index);
+        rha->firstrec = 0;
+        rha->lastrec = 0;
+        rha->n_entries = 0;
+        rha->entries = NULL;
+        rha->index_mmap_length = 0;
+        return JOB_REGISTRY_MMAP_FAIL;
+       }
+      if (job_registry_sort_merge(rha, n_sorted) < 0)
+       {
+        munmap(rha->entries, rha->index_mmap_length);
+        unlink(new_index);
+        close(newindex_fd);
+        free(new_index);
+        rha->firstrec = 0;
+        rha->lastrec = 0;
+        rha->n_entries = 0;
+        rha->entries = NULL;
+        rha->index_mmap_length = 0;
+        return JOB_REGISTRY_MALLOC_FAIL;
+       }
+      if (munmap(rha->entries, rha->index_mmap_length) < 0)
+       {
+        /* Something went wrong while syncing the sorted index to disk */
+        unlink(new_index);
+        close(newindex_fd);
+        free(new_index);
+        rha->firstrec = 0;
+        rha->lastrec = 0;
+        rha->n_entries = 0;
+        rha->index_mmap_length = 0;
+        return JOB_REGISTRY_MUNMAP_FAIL;
+       }
+      if (rename (new_index, rha->mmappableindex) < 0)
+       {
+        unlink(new_index);
+        close(newindex_fd);
+        free(new_index);
+        rha->firstrec = 0;
+        rha->lastrec = 0;
+        rha->n_entries = 0;
+        rha->index_mmap_length = 0;
+        return JOB_REGISTRY_RENAME_FAIL;
+       }
+      rha->entries = mmap(0, rha->index_mmap_length, PROT_READ, MAP_SHARED, newindex_fd, 0);
+      if (rha->entries == NULL)
+       {
+        close(newindex_fd);
+        free(new_index);
+        rha->firstrec = 0;
+        rha->lastrec = 0;
+        rha->n_entries = 0;
+        rha->index_mmap_length = 0;
+        return JOB_REGISTRY_MMAP_FAIL;
+       }
+      free(new_index);
+      break; /* Done with registry update. */
+     }
+
+    /* If we reach here, the creation of the new mmappable index failed */
+    /* with EEXIST, i.e. someone else is trying to update it. */
+    /* We back off until (hopefully) this is complete. */
+
+    sleep(update_exponential_backoff);
+    update_exponential_backoff*=2;
+
+    /* Did a good index (updated by somebody else) appear in the meanwhile ? */
+    if (fstat(fileno(fd), &rst) < 0) return JOB_REGISTRY_STAT_FAIL;
+    mst_ret = stat(rha->mmappableindex, &mst);
+    if (mst_ret >= 0)
+     {
+      if ((mst.st_size/sizeof(job_registry_index)) ==
+          (rst.st_size/sizeof(job_registry_entry)))
+       { 
+        free(new_index);
+        break;
+       }
+     }
+
+    if (update_exponential_backoff > JOB_REGISTRY_MMAP_UPDATE_TIMEOUT)
+     {
+      /* Unlinking the 'new' file after this long cannot hurt anyone */
+      /* If there is a process that was really trying to write it, it */
+      /* will just fall back to the in-memory index. */
+      /* This will handle the case of a 'new_index' file left behind */
+      /* by a dead process */
+      if (unlink(new_index) < 0)
+       {
+        free(new_index);
+        return JOB_REGISTRY_UPDATE_TIMEOUT;
+       }
+      /* We try creating the updated index again if we were able to unlink */
+      /* the stale one. */
+     }
+    free(new_index);
+   } /* End of while(need_to_update) loop */
+
+  if (newindex_fd < 0)
+   {
+    /* Need to attach to an existing and up-to-date mmap file */
+    newindex_fd = open(rha->mmappableindex, O_RDONLY);
+    if (newindex_fd < 0) return JOB_REGISTRY_FOPEN_FAIL;
+
+    /* Dispose of old index. */
+    if (rha->index_mmap_length > 0)
+     {
+      munmap(rha->entries, rha->index_mmap_length);
+      close(rha->mmap_fd);
+      rha->index_mmap_length = 0;
+      rha->mmap_fd = -1;
+     }
+    else if (rha->entries != NULL) free(rha->entries);
+    rha->entries = NULL;
+    rha->firstrec = 0;
+    rha->lastrec = 0;
+    rha->n_entries = 0;
+    rha->n_alloc = 0;
+
+    rha->index_mmap_length = lseek(newindex_fd, 0, SEEK_END);
+    if (rha->index_mmap_length < 0)
+     {
+      close(newindex_fd);
+      rha->index_mmap_length = 0;
+      return JOB_REGISTRY_FSEEK_FAIL;
+     }
+
+    rha->entries = mmap(0, rha->index_mmap_length, PROT_READ, MAP_SHARED, newindex_fd, 0);
+    if (rha->entries == NULL)
+     {
+      close(newindex_fd);
+      rha->index_mmap_length = 0;
+      return JOB_REGISTRY_MMAP_FAIL;
+     }
+
+    rha->n_entries = (rha->index_mmap_length)/sizeof(job_registry_index);
+    rha->firstrec = JOB_REGISTRY_MAX_RECNUM;
+    /* Compute first/last recnum from sorted index. */
+    for (i=0; i<rha->n_entries; i++)
+     {
+      if (rha->entries[i].recnum < rha->firstrec) 
+        rha->firstrec = rha->entries[i].recnum;
+      if (rha->entries[i].recnum > rha->lastrec) 
+        rha->lastrec = rha->entries[i].recnum;
+     }
+   }
+
+  rha->mmap_fd = newindex_fd;
+
+  if ((rha->lastrec != old_lastrec) || (rha->firstrec != old_firstrec))
+   {
+    return JOB_REGISTRY_CHANGED;
+   }
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_resync
+ *
+ * Update the cache inside the job registry handle, if enabled,
+ * otherwise just update rha->firstrec and rha->lastrec.
+ * Only records appended after rha->lastrec are read and merged into
+ * the sorted index. Will rescan the entire file in case this was found
+ * to be purged.
+ * 
+ * @param fd Stream descriptor of an open registry file.
+ *        fd *must* be at least read locked before calling this function. 
+ * @param rha Pointer to a job registry handle returned by job_registry_init
+ *
+ * @return Less than zero on error. Zero un unchanged registru. Greater than 0
+ *         if registry changed, See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
+
+int
+job_registry_resync(job_registry_handle *rha, FILE *fd)
+{
+
+  job_registry_recnum_t firstrec;
+  job_registry_recnum_t old_firstrec, old_lastrec;
+  job_registry_entry *ren;
+  job_registry_index *new_entries;
+  char *chosen_id;
+  int mret;
+  int n_sorted;
+
+  if ((rha->mode == BY_BLAH_ID_MMAP || rha->mode == BY_BATCH_ID_MMAP ||
+       rha->mode == BY_USER_PREFIX_MMAP) && rha->compact == NULL)
+   {
+     if ((mret = job_registry_resync_mmap(rha, fd)) >= 0)
+       return mret;
+   }
+
+  old_lastrec = rha->lastrec;
+  old_firstrec = rha->firstrec;
+
+  firstrec = job_registry_firstrec(rha,fd);
+
+       /* File new or changed? Or mmap failed ? */
+  if ( (rha->lastrec == 0 && rha->firstrec == 0) || firstrec != rha->firstrec
+                                                 || rha->index_mmap_length > 0 )
+   {
+    if (fseek(fd,0L,SEEK_SET) < 0) return JOB_REGISTRY_FSEEK_FAIL;
+    if (rha->index_mmap_length > 0)
+     {
+      munmap(rha->entries, rha->index_mmap_length);
+      close(rha->mmap_fd);
+      rha->index_mmap_length = 0;
+      rha->mmap_fd = -1;
+     }
+    else if (rha->entries != NULL) free(rha->entries);
+    if (rha->compact != NULL) job_registry_compact_free(rha->compact);
+    rha->entries = NULL;
+    rha->firstrec = 0;
+    rha->lastrec = 0;
+    rha->n_entries = 0;
+    rha->n_alloc = 0;
+   }
+  else
+   {
+    /* Move to the last known end of file and keep on reading. */
+    /* Only the records appended since need to be merged in. */
+    if (fseek(fd,(long)((rha->lastrec - rha->firstrec + 1)*sizeof(job_registry_entry)),
+              SEEK_SET) < 0) return JOB_REGISTRY_FSEEK_FAIL;
+   }
+  n_sorted = rha->n_entries;
+
+  if (rha->mode == NO_INDEX) 
+   {
+    /* Just figure out the first and last recnum */
+    if ((ren = job_registry_get_next(rha, fd)) != NULL)
+     {
+      if (rha->firstrec == 0) rha->firstrec = ren->recnum;
+      free(ren);
+      if (fseek(fd,(long)-sizeof(job_registry_entry),SEEK_END) >= 0)
+       {
+        if ((ren = job_registry_get_next(rha, fd)) != NULL)
+         {
+          rha->lastrec = ren->recnum;
+          free(ren);
+         }
+        else return JOB_REGISTRY_NO_VALID_RECORD;
+       }
+     }
+    return JOB_REGISTRY_SUCCESS;
+   }
+
+  while ((ren = job_registry_get_next(rha, fd)) != NULL)
+   {
+    if (rha->firstrec == 0) rha->firstrec = ren->recnum;
+    if (ren->recnum > rha->lastrec) rha->lastrec = ren->recnum;
+    (rha->n_entries)++;
+    if (rha->n_entries > rha->n_alloc)
+     {
+      rha->n_alloc += JOB_REGISTRY_ALLOC_CHUNK;
+      new_entries = realloc(rha->entries, 
+                            rha->n_alloc * sizeof(job_registry_index));
+      if (new_entries == NULL)
+       {
+        errno = ENOMEM;
+        free(ren);
+        return JOB_REGISTRY_MALLOC_FAIL;
+       }
+      rha->entries = new_entries;
+     }
+    if (rha->mode == BY_BLAH_ID)         chosen_id = ren->blah_id;
+    else if(rha->mode == BY_USER_PREFIX) chosen_id = ren->user_prefix;
+    else                                 chosen_id = ren->batch_id;
+
+    JOB_REGISTRY_ASSIGN_ENTRY((rha->entries[rha->n_entries-1]).id,
+                              chosen_id);
+            
+    (rha->entries[rha->n_entries-1]).recnum = ren->recnum; 
+    free(ren);
+   }
+  if ((rha->lastrec != old_lastrec) || (rha->firstrec != old_firstrec))
+   {
+    if ((mret = job_registry_sort_merge(rha, n_sorted)) < 0)
+     {
+      /* Force a full rescan next time around. */
+      rha->firstrec = 0;
+      rha->lastrec = 0;
+      return mret;
+     }
+    if (rha->compact != NULL && 
+        (rha->n_entries > JOB_REGISTRY_COMPACT_MIN_DELTA ||
+         rha->n_entries > rha->compact->n_entries/8))
+     {
+      /* Failure just leaves the new entries outside the compact index */
+      job_registry_compact_merge(rha);
+     }
+    return JOB_REGISTRY_CHANGED;
+   }
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_index_cmp
+ *
+ * Ordering of index entries: by ID, then by record number, so that
+ * duplicate IDs end up with the most recent record last.
+ *
+ * @param a First index entry.
+ * @param b Second index entry.
+ *
+ * @return Less than, equal to or greater than zero as for strcmp.
+ */
+
+static int
+job_registry_index_cmp(const job_registry_index *a,
+                       const job_registry_index *b)
+{
+  int cmp;
+
+  cmp = strcmp(a->id, b->id);
+  if (cmp != 0) return cmp;
+  if (a->recnum < b->recnum) return -1;
+  if (a->recnum > b->recnum) return 1;
+  return 0;
+}
+
+/*
+ * job_registry_sort_radix
+ *
+ * Stable LSD radix sort of an array of sort keys on their 64-bit
+ * 'prefix' field, one byte per pass. Passes where all keys share
+ * the same byte value (e.g. common ID prefixes, or high bytes of
+ * record numbers) are skipped.
+ *
+ * @param keys Array of keys to be sorted. Sorted in place.
+ * @param scratch Scratch array with room for n_keys elements.
+ * @param n_keys Number of keys.
+ */
+
+static void
+job_registry_sort_radix(job_registry_sort_key *keys,
+                        job_registry_sort_key *scratch, int n_keys)
+{
+  int count[8][256];
+  int pass, i, sum, tmp;
+  job_registry_sort_key *src, *dst, *swp;
+
+  memset(count, 0, sizeof(count));
+  for (i=0; i<n_keys; i++)
+    for (pass=0; pass<8; pass++)
+      count[pass][(keys[i].prefix >> (pass*8)) & 0xff]++;
+
+  src = keys;
+  dst = scratch;
+  for (pass=0; pass<8; pass++)
+   {
+    if (count[pass][(keys[0].prefix >> (pass*8)) & 0xff] == n_keys) continue;
+
+    for (i=0, sum=0; i<256; i++)
+     {
+      tmp = count[pass][i];
+      count[pass][i] = sum;
+      sum += tmp;
+     }
+    for (i=0; i<n_keys; i++)
+      dst[count[pass][(src[i].prefix >> (pass*8)) & 0xff]++] = src[i];
+
+    swp = src; src = dst; dst = swp;
+   }
+  if (src != keys) memcpy(keys, src, n_keys*sizeof(job_registry_sort_key));
+}
+
+/*
+ * job_registry_sort_keys
+ *
+ * MSD sort of index keys: keys are radix-sorted on the 8 ID bytes
+ * starting at 'depth', then runs of keys sharing those bytes are
+ * sorted recursively on the following 8 bytes. Runs of identical
+ * IDs are sorted on record number. Small runs are insertion-sorted.
+ * Only the compact key array is moved around, the (large) index
+ * entries are just read.
+ *
+ * @param entries Index entries the keys refer to.
+ * @param keys Array of keys to be sorted ('pos' field set).
+ * @param scratch Scratch array with room for n_keys elements.
+ * @param n_keys Number of keys.
+ * @param depth Number of leading ID bytes all keys are known to share.
+ */
+
+static void
+job_registry_sort_keys(const job_registry_index *entries,
+                       job_registry_sort_key *keys,
+                       job_registry_sort_key *scratch,
+                       int n_keys, int depth)
+{
+  int i, j, k;
+  const unsigned char *id;
+  job_registry_sort_key cur;
+
+  if (n_keys < JOB_REGISTRY_SORT_INSERTION_THRESHOLD)
+   {
+    for (i=1; i<n_keys; i++)
+     {
+      cur = keys[i];
+      for (j=i; j>0 && job_registry_index_cmp(&(entries[keys[j-1].pos]),
+                                             &(entries[cur.pos])) > 0; j--)
+        keys[j] = keys[j-1];
+      keys[j] = cur;
+     }
+    return;
+   }
+
+  for (i=0; i<n_keys; i++)
+   {
+    id = (const unsigned char *)entries[keys[i].pos].id;
+    keys[i].prefix = 0;
+    for (k=0, j=depth; k<8; k++)
+     {
+      keys[i].prefix <<= 8;
+      if (j < JOBID_MAX_LEN && id[j] != '\000') keys[i].prefix |= id[j++];
+      else j = JOBID_MAX_LEN;
+     }
+   }
+  job_registry_sort_radix(keys, scratch, n_keys);
+
+  for (i=0; i<n_keys; i=j)
+   {
+    for (j=i+1; j<n_keys && keys[j].prefix == keys[i].prefix; j++) ;
+    if ((j - i) <= 1) continue;
+
+    if ((keys[i].prefix & 0xff) != 0 && (depth + 8) < JOBID_MAX_LEN)
+     {
+      job_registry_sort_keys(entries, keys+i, scratch+i, j-i, depth+8);
+     }
+    else
+     {
+      /* IDs are identical: order on record number */
+      for (k=i; k<j; k++) keys[k].prefix = entries[keys[k].pos].recnum;
+      job_registry_sort_radix(keys+i, scratch+i, j-i);
+     }
+   }
+}
+
+/*
+ * job_registry_sort
+ * job_registry_sort_entries
+ *
+ * Sort the registry index on (ID, record number). Duplicate IDs are
+ * kept in ascending recnum order, so that the most recent record for
+ * an ID is the last one in its run.
+ * This needs to be called before job_registry_lookup, as the latter
+ * assumes the index to be ordered.
+ * The sort is performed on a compact array of (ID prefix, position)
+ * keys (see job_registry_sort_keys); the index entries are then
+ * permuted in place following the sorted keys.
+ * job_registry_sort_entries works on a bare array of index entries,
+ * so that a portion of the index can be sorted by itself.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init
+ * @param entries Array of index entries to be sorted.
+ * @param n_entries Number of entries in the array.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
+
+int
+job_registry_sort(job_registry_handle *rha)
+{
+  return job_registry_sort_entries(rha->entries, rha->n_entries);
+}
+
+int
+job_registry_sort_entries(job_registry_index *entries, int n_entries)
+{
+  job_registry_sort_key *keys;
+  job_registry_index swap;
+  int i, j, k;
+
+  /* Anything to do ? */
+  if (n_entries <= 1) return JOB_REGISTRY_SUCCESS;
+
+  keys = (job_registry_sort_key *)malloc(2 * n_entries * 
+              sizeof(job_registry_sort_key));
+  if (keys == NULL)
+   {
+    errno = ENOMEM;
+    return JOB_REGISTRY_MALLOC_FAIL;
+   }
+
+  for (i=0; i<n_entries; i++) keys[i].pos = i;
+  job_registry_sort_keys(entries, keys, keys + n_entries, n_entries, 0);
+
+  /* keys[i].pos is now the current position of the entry that */
+  /* belongs in slot 'i'. Follow the permutation cycles. */
+  for (i=0; i<n_entries; i++)
+   {
+    if (keys[i].pos == i) continue;
+    swap = entries[i];
+    for (j=i; keys[j].pos != i; j=k)
+     {
+      k = keys[j].pos;
+      entries[j] = entries[k];
+      keys[j].pos = j;
+     }
+    entries[j] = swap;
+    keys[j].pos = j;
+   }
+
+  free(keys);
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_sort_merge
+ *
+ * Bring the registry index back in order after new entries were
+ * appended at its end. The appended entries are sorted by themselves
+ * and then merged into the already sorted leading part of the
+ * index, so the cost is proportional to the number of new entries
+ * plus a single linear pass, instead of a full sort.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init
+ * @param n_sorted Number of leading entries in rha->entries that are
+ *        known to be already sorted. If zero, the whole index is sorted.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
+
+int
+job_registry_sort_merge(job_registry_handle *rha, int n_sorted)
+{
+  job_registry_index *tail;
+  int n_tail;
+  int i,k,d;
+  int ret;
+
+  if (n_sorted <= 0 || n_sorted > rha->n_entries)
+    return job_registry_sort(rha);
+
+  n_tail = rha->n_entries - n_sorted;
+  if (n_tail == 0) return JOB_REGISTRY_SUCCESS;
+
+  ret = job_registry_sort_entries(rha->entries + n_sorted, n_tail);
+  if (ret < 0) return ret;
+
+  /* IDs are often generated in increasing order: nothing to merge then. */
+  if (job_registry_index_cmp(&(rha->entries[n_sorted-1]),
+                             &(rha->entries[n_sorted])) <= 0)
+    return JOB_REGISTRY_SUCCESS;
+
+  tail = (job_registry_index *)malloc(n_tail * sizeof(job_registry_index));
+  if (tail == NULL)
+   {
+    errno = ENOMEM;
+    return JOB_REGISTRY_MALLOC_FAIL;
+   }
+  memcpy(tail, rha->entries + n_sorted, n_tail * sizeof(job_registry_index));
+
+  /* Merge from the end, so that only the new entries need to be copied */
+  i = n_sorted - 1;
+  k = n_tail - 1;
+  d = rha->n_entries - 1;
+  while (k >= 0)
+   {
+    if (i >= 0 && job_registry_index_cmp(&(rha->entries[i]), &(tail[k])) > 0)
+      rha->entries[d--] = rha->entries[i--];
+    else
+      rha->entries[d--] = tail[k--];
+   }
+
+  free(tail);
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_compact_next
+ *
+ * Decode the next entry of a front-coded compact index.
+ *
+ * @param ci Pointer to a compact index.
+ * @param cit Iterator state. Must be zeroed before the first call.
+ *        On return cit->id holds the ID of the entry and cit->recnum
+ *        its record number.
+ *
+ * @return TRUE if an entry was decoded, FALSE at the end of the index.
+ */
+
+static int
+job_registry_compact_next(const job_registry_compact_index *ci,
+                          job_registry_compact_iterator *cit)
+{
+  const char *p;
+  int shared;
+
+  if (cit->n >= ci->n_entries) return FALSE;
+
+  p = ci->arena + cit->pos;
+  if ((cit->n % JOB_REGISTRY_COMPACT_BLOCK) == 0) shared = 0;
+  else shared = (unsigned char)*(p++);
+
+  strncpy(cit->id + shared, p, JOBID_MAX_LEN - shared);
+  cit->id[JOBID_MAX_LEN-1] = '\000';
+  cit->pos = (p - ci->arena) + strlen(p) + 1;
+  cit->recnum = ci->recnums[cit->n];
+  (cit->n)++;
+  return TRUE;
+}
+
+/*
+ * job_registry_compact_append
+ *
+ * Append an entry to a compact index that is being built. Entries
+ * must be appended in index order. Every JOB_REGISTRY_COMPACT_BLOCK
+ * entries a new block is started with the full ID, the other
+ * entries store the length of the prefix they share with the
+ * previous ID (one byte) followed by the remaining suffix.
+ *
+ * @param ci Pointer to the compact index being built.
+ * @param n_alloc Pointer to the allocated number of entries/blocks.
+ * @param a_alloc Pointer to the allocated arena size.
+ * @param prev ID of the previously appended entry.
+ * @param id ID of the entry to append.
+ * @param recnum Record number of the entry to append.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
+
+static int
+job_registry_compact_append(job_registry_compact_index *ci,
+                            uint32_t *n_alloc, uint32_t *a_alloc,
+                            const char *prev, const char *id,
+                            job_registry_recnum_t recnum)
+{
+  uint32_t shared = 0;
+  size_t len;
+  void *new_area;
+
+  if (ci->recnums == NULL || ci->n_entries >= *n_alloc)
+   {
+    if (ci->recnums != NULL || *n_alloc == 0)
+      *n_alloc = (*n_alloc > 0) ? (*n_alloc)*2 : JOB_REGISTRY_ALLOC_CHUNK;
+    new_area = realloc(ci->recnums, (*n_alloc)*sizeof(job_registry_recnum_t));
+    if (new_area == NULL) return JOB_REGISTRY_MALLOC_FAIL;
+    ci->recnums = (job_registry_recnum_t *)new_area;
+    new_area = realloc(ci->block_offsets, 
+                       ((*n_alloc)/JOB_REGISTRY_COMPACT_BLOCK + 1)*sizeof(uint32_t));
+    if (new_area == NULL) return JOB_REGISTRY_MALLOC_FAIL;
+    ci->block_offsets = (uint32_t *)new_area;
+   }
+
+  if ((ci->n_entries % JOB_REGISTRY_COMPACT_BLOCK) == 0)
+   {
+    ci->block_offsets[ci->n_blocks++] = ci->arena_len;
+   }
+  else
+   {
+    while (shared < 255 && prev[shared] != '\000' && prev[shared] == id[shared])
+      shared++;
+   }
+
+  len = strlen(id + shared) + 2;
+  if (ci->arena_len + len > *a_alloc)
+   {
+    *a_alloc = (*a_alloc > 0) ? (*a_alloc)*2 : JOB_REGISTRY_COMPACT_BLOCK*JOBID_MAX_LEN;
+    if (*a_alloc < ci->arena_len + len) *a_alloc = ci->arena_len + len;
+    new_area = realloc(ci->arena, *a_alloc);
+    if (new_area == NULL) return JOB_REGISTRY_MALLOC_FAIL;
+    ci->arena = (char *)new_area;
+   }
+
+  if ((ci->n_entries % JOB_REGISTRY_COMPACT_BLOCK) != 0)
+    ci->arena[ci->arena_len++] = (char)shared;
+  strcpy(ci->arena + ci->arena_len, id + shared);
+  ci->arena_len += strlen(id + shared) + 1;
+
+  ci->recnums[ci->n_entries++] = recnum;
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_compact_free
+ *
+ * Free the storage of a compact index and leave it empty.
+ *
+ * @param ci Pointer to a compact index.
+ */
+
+void
+job_registry_compact_free(job_registry_compact_index *ci)
+{
+  if (ci->arena != NULL) free(ci->arena);
+  if (ci->recnums != NULL) free(ci->recnums);
+  if (ci->block_offsets != NULL) free(ci->block_offsets);
+  memset(ci, 0, sizeof(job_registry_compact_index));
+}
+
+/*
+ * job_registry_compact_merge
+ *
+ * Fold the (sorted) entries of the handle index into the compact
+ * index, and empty the handle index.
+ *
+ * @param rha Pointer to a job registry handle in compact mode.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         errno is also set in case of error. On error, both the
+ *         compact index and the handle index are left untouched.
+ */
+
+int
+job_registry_compact_merge(job_registry_handle *rha)
+{
+  job_registry_compact_index nci;
+  job_registry_compact_iterator cit;
+  uint32_t n_alloc, a_alloc;
+  char prev[JOBID_MAX_LEN];
+  int have_old;
+  int i, ret;
+  job_registry_index old;
+
+  memset(&nci, 0, sizeof(nci));
+  memset(&cit, 0, sizeof(cit));
+  n_alloc = rha->compact->n_entries + rha->n_entries;
+  a_alloc = 0;
+  prev[0] = '\000';
+  ret = JOB_REGISTRY_SUCCESS;
+
+  have_old = job_registry_compact_next(rha->compact, &cit);
+  i = 0;
+  while (have_old || i < rha->n_entries)
+   {
+    if (have_old)
+     {
+      JOB_REGISTRY_ASSIGN_ENTRY(old.id, cit.id);
+      old.recnum = cit.recnum;
+     }
+    if (have_old && (i >= rha->n_entries ||
+                     job_registry_index_cmp(&old, &(rha->entries[i])) <= 0))
+     {
+      ret = job_registry_compact_append(&nci, &n_alloc, &a_alloc, prev,
+                                        old.id, old.recnum);
+      if (ret < 0) break;
+      JOB_REGISTRY_ASSIGN_ENTRY(prev, old.id);
+      have_old = job_registry_compact_next(rha->compact, &cit);
+     }
+    else
+     {
+      ret = job_registry_compact_append(&nci, &n_alloc, &a_alloc, prev,
+                                        rha->entries[i].id, 
+                                        rha->entries[i].recnum);
+      if (ret < 0) break;
+      JOB_REGISTRY_ASSIGN_ENTRY(prev, rha->entries[i].id);
+      i++;
+     }
+   }
+  if (ret < 0)
+   {
+    job_registry_compact_free(&nci);
+    errno = ENOMEM;
+    return ret;
+   }
+
+  /* Give back unused arena space. */
+  if (nci.arena_len > 0 && nci.arena_len < a_alloc)
+   {
+    void *shrunk = realloc(nci.arena, nci.arena_len);
+    if (shrunk != NULL) nci.arena = (char *)shrunk;
+   }
+
+  job_registry_compact_free(rha->compact);
+  *(rha->compact) = nci;
+
+  if (rha->entries != NULL) free(rha->entries);
+  rha->entries = NULL;
+  rha->n_entries = 0;
+  rha->n_alloc = 0;
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_compact
+ *
+ * Switch a handle to compact index mode: the sorted index is moved into
+ * a front-coded string arena (see job_registry_compact_append), which
+ * takes a small fraction of the memory of the fixed-width index entries.
+ * Works with both in-memory and mmap index modes: for the latter, the
+ * shared index file is left alone and only used to build the compact
+ * index, after which it is unmapped. Further records appended to the
+ * registry are collected by job_registry_resync in the regular
+ * rha->entries array, and folded into the compact index once they
+ * exceed JOB_REGISTRY_COMPACT_MIN_DELTA or 1/8 of the compact index.
+ * Lookups (job_registry_get_recnum) search both.
+ * Note that job_registry_check_index_key_uniqueness only sees the
+ * entries that were not yet compacted.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
+
+int
+job_registry_compact(job_registry_handle *rha)
+{
+  job_registry_index *copy = NULL;
+  int ret;
+
+  if (rha->mode == NO_INDEX || rha->mode == NAMES_ONLY)
+   {
+    errno = EINVAL;
+    return JOB_REGISTRY_FAIL;
+   }
+  if (rha->compact != NULL) return JOB_REGISTRY_SUCCESS;
+
+  rha->compact = (job_registry_compact_index *)calloc(1, 
+                                     sizeof(job_registry_compact_index));
+  if (rha->compact == NULL)
+   {
+    errno = ENOMEM;
+    return JOB_REGISTRY_MALLOC_FAIL;
+   }
+
+  if (rha->index_mmap_length > 0)
+   {
+    /* The merge will free() the entries: work on a private copy. */
+    copy = (job_registry_index *)malloc(rha->n_entries*sizeof(job_registry_index));
+    if (copy == NULL)
+     {
+      free(rha->compact);
+      rha->compact = NULL;
+      errno = ENOMEM;
+      return JOB_REGISTRY_MALLOC_FAIL;
+     }
+    memcpy(copy, rha->entries, rha->n_entries*sizeof(job_registry_index));
+    munmap(rha->entries, rha->index_mmap_length);
+    close(rha->mmap_fd);
+    rha->index_mmap_length = 0;
+    rha->mmap_fd = -1;
+    rha->entries = copy;
+    rha->n_alloc = rha->n_entries;
+   }
+
+  if ((ret = job_registry_compact_merge(rha)) < 0)
+   {
+    free(rha->compact);
+    rha->compact = NULL;
+    return ret;
+   }
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_compact_lookup
+ *
+ * Binary search for an ID in a compact index: the block is found by
+ * looking at the full IDs at the start of each block, then the block
+ * is decoded sequentially.
+ *
+ * @param ci Pointer to a compact index.
+ * @param id Job id key to be looked up 
+ *
+ * @return Highest record number found for the ID, or 0 if the ID was 
+ *         not found.
+ */
+
+job_registry_recnum_t
+job_registry_compact_lookup(const job_registry_compact_index *ci,
+                            const char *id)
+{
+  job_registry_compact_iterator cit;
+  job_registry_recnum_t found = 0;
+  int left, right, cur, cmp;
+
+  left = 0;
+  right = ci->n_blocks;
+  while (left < right)
+   {
+    cur = (right + left) /2;
+    if (strcmp(ci->arena + ci->block_offsets[cur], id) <= 0) left = cur+1;
+    else                                                      right = cur;
+   }
+  if (left == 0) return 0;
+
+  memset(&cit, 0, sizeof(cit));
+  cit.n = (left-1)*JOB_REGISTRY_COMPACT_BLOCK;
+  cit.pos = ci->block_offsets[left-1];
+  while (cit.n < left*JOB_REGISTRY_COMPACT_BLOCK &&
+         job_registry_compact_next(ci, &cit))
+   {
+    cmp = strcmp(cit.id, id);
+    if (cmp == 0) found = cit.recnum;
+    else if (cmp > 0) break;
+   }
+  return found;
+}
+
+/*
+ * job_registry_index_memory
+ *
+ * Compute the amount of memory used by the index of a job registry handle.
+ * Memory that is mmapped from the shared index file is also counted.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init
+ *
+ * @return Index size in bytes.
+ */
+
+size_t
+job_registry_index_memory(const job_registry_handle *rha)
+{
+  size_t total;
+
+  if (rha->index_mmap_length > 0) total = rha->index_mmap_length;
+  else total = rha->n_alloc * sizeof(job_registry_index);
+
+  if (rha->compact != NULL)
+   {
+    total += sizeof(job_registry_compact_index) +
+             rha->compact->arena_len +
+             rha->compact->n_entries * sizeof(job_registry_recnum_t) +
+             rha->compact->n_blocks * sizeof(uint32_t);
+   }
+  return total;
+}
+
+/*
+ * job_registry_append
+ * job_registry_append_op
+ *
+ * Appends an entry to the registry, unless an entry with the same
+ * active ID is found there already (in that case will fall through
+ * to job_registry_update).
+ * job_registry_append will cause job_registry_append_op to open, (write) lock 
+ * and close the registry file, while job_registry_append_op will work
+ * on a file that's aleady open and writelocked.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param entry pointer to a registry entry to append to the registry.
+ *        entry->recnum, entry->cdate and entry->mdate will be updated
+ *        to current values. entry->magic_start and entry->magic_end will
+ *        be appropriately set.
+ * @param fd Stream descriptor of an open (for write) and writelocked 
+ *        registry file. The file will be opened and closed if fd==NULL.
+ * @param now Timestamp to be used for the update.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
+int
+job_registry_append(job_registry_handle *rha,
+                    job_registry_entry *entry)
+{
+  return job_registry_append_op(rha, entry, NULL, time(0));
+}
+
+int
+job_registry_append_op(job_registry_handle *rha,
+                       job_registry_entry *entry, FILE *fd, time_t now)
+{
+  job_registry_recnum_t found,curr_recn;
+  job_registry_entry last;
+  long curr_pos;
+  int need_to_fclose = FALSE;
+  int ret;
+
+  if (rha->mode != NO_INDEX)
+   {
+    if (rha->mode == BY_BLAH_ID) 
+      found = job_registry_lookup_op(rha, entry->blah_id, fd);
+    else if (rha->mode == BY_USER_PREFIX)
+      found = job_registry_lookup_op(rha, entry->user_prefix, fd);
+    else
+      found = job_registry_lookup_op(rha, entry->batch_id, fd);
+    if (found != 0)
+     { 
+      entry->recnum = found;
+      return job_registry_update_op(rha, entry, TRUE, fd, JOB_REGISTRY_UPDATE_ALL);
+     }
+   }
+
+  if (fd == NULL)
+   {
+    /* Open file, writelock it and append entry */
+
+    fd = job_registry_open(rha,"a+");
+    if (fd == NULL) return JOB_REGISTRY_FOPEN_FAIL;
+
+    if (job_registry_wrlock(rha,fd) < 0)
+     {
+      fclose(fd);
+      return JOB_REGISTRY_FLOCK_FAIL;
+     }
+    need_to_fclose = TRUE;
+   }
+
+  /* 'a+' positions the read pointer at the beginning of the file */
+  /* Make sure we move there in case of an open fd. */
+  if (fseek(fd, 0L, SEEK_END) < 0)
+   {
+    if (need_to_fclose) fclose(fd);
+    return JOB_REGISTRY_FSEEK_FAIL;
+   }
+
+  curr_pos = ftell(fd);
+  if (curr_pos > 0)
+   {
+    /* Read in last recnum */
+    if (fseek(fd, (long)-sizeof(job_registry_entry), SEEK_CUR) < 0)
+     {
+      if (need_to_fclose) fclose(fd);
+      return JOB_REGISTRY_FSEEK_FAIL;
+     }
+    if (fread(&last, sizeof(job_registry_entry),1,fd) < 1)
+     {
+      if (need_to_fclose) fclose(fd);
+      return JOB_REGISTRY_FREAD_FAIL;
+     }
+    /* Consistency checks */
+    if ( (last.magic_start != JOB_REGISTRY_MAGIC_START) ||
+         (last.magic_end   != JOB_REGISTRY_MAGIC_END) )
+     {
+      errno = ENOMSG;
+      if (need_to_fclose) fclose(fd);
+      return JOB_REGISTRY_CORRUPT_RECORD;
+     }
+    entry->recnum = last.recnum+1;
+   }
+  else entry->recnum = 1;
+
+  entry->magic_start = JOB_REGISTRY_MAGIC_START;
+  entry->magic_end   = JOB_REGISTRY_MAGIC_END;
+  entry->reclen = sizeof(job_registry_entry);
+  entry->cdate = entry->mdate = now;
+
+  job_registry_segment_note(rha, fd,
+                            entry->recnum - curr_pos/sizeof(job_registry_entry),
+                            curr_pos/sizeof(job_registry_entry), now);
+  
+  if ((ret = job_registry_seq_write_begin(rha)) < 0)
+   {
+    if (need_to_fclose) fclose(fd);
+    return ret;
+   }
+  if (fwrite(entry, sizeof(job_registry_entry),1,fd) < 1 || fflush(fd) < 0)
+   {
+    job_registry_seq_write_end(rha);
+    if (need_to_fclose) fclose(fd);
+    return JOB_REGISTRY_FWRITE_FAIL;
+   }
+  job_registry_seq_write_end(rha);
+  job_registry_change_note(rha, fd,
+                           entry->recnum - curr_pos/sizeof(job_registry_entry),
+                           entry->recnum, now);
+
+  ret = job_registry_resync(rha,fd);
+  if (need_to_fclose) fclose(fd);
+  return ret;
+}
+
+/*
+ * job_registry_get_new_npufd
+ *
+ * Open a unique file for storage or retrieval of
+ * non-privileged-update entries.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ *
+ * @return Stream descriptor to open file, NULL (and errno set to
+ *         ENOMEM) when running out of memory, NULL (and errno set
+ *         appropriately) when file operations fail..
+ */
+FILE*
+job_registry_get_new_npufd(job_registry_handle *rha)
+{
+  FILE *rfd = NULL;
+  int lfd;
+  char *tp;
+  struct stat fst;
+  const char *npu_tail="/npu_XXXXXX";
+  int i;
+
+  /* Append a filename to rha->npudir, so it can be passed back to */
+  /* jobregistry_construct_path */
+  tp = (char *)malloc(strlen(rha->npudir) + strlen(npu_tail) + 1);
+  if (tp == NULL)
+   {
+    errno = ENOMEM;
+    return NULL;
+   }
+
+  sprintf(tp, "%s%s", rha->npudir, npu_tail);
+  lfd = mkstemp(tp);
+  if (lfd >= 0) 
+   {
+    /* Make it group writable as usual */
+    fchmod(lfd, 0664);
+    rfd = fdopen(lfd, "w"); 
+   }
+
+  free (tp);
+
+  return(rfd);
+}
+
+/*
+ * job_registry_append_nonpriv
+ *
+ * Schedule an entry for appending it into the registry. This is done
+ * by appending the entry to the NPU spool (rha->npuspool) or, if that
+ * can't be used, by writing the entry as a file in rha->npudir.
+ * Only members of the registry group can write to the spool: other
+ * submitters always go through npudir.
+ * The entry will be appended on the first lookup done by a
+ * process that owns write rights to teh registry.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param entry pointer to a registry entry to append to the registry.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
+int
+job_registry_append_nonpriv(job_registry_handle *rha,
+                            job_registry_entry *entry)
+{
+    FILE *cfd;
+
+    entry->magic_start = JOB_REGISTRY_MAGIC_START;
+    entry->magic_end   = JOB_REGISTRY_MAGIC_END;
+    entry->reclen = sizeof(job_registry_entry);
+    entry->cdate = entry->mdate = time(0);
+
+    /* Use the shared spool when possible, a file of our own otherwise. */
+    if (job_registry_npu_spool_append(rha, entry) == JOB_REGISTRY_SUCCESS)
+      return JOB_REGISTRY_SUCCESS;
+
+    cfd = job_registry_get_new_npufd(rha);
+
+    if (cfd == NULL) return JOB_REGISTRY_FOPEN_FAIL;
+
+    /* We don't need to lock the file or to make sure some sort of atomic  */
+    /* write is made. If an incomplete entry is read, the file will be     */
+    /* left untouched and read again. */
+
+    if (fwrite(entry,sizeof(job_registry_entry), 1, cfd) < 1)
+     {
+      fclose(cfd);
+      return JOB_REGISTRY_FWRITE_FAIL;
+     }
+
+    fclose(cfd);
+
+    return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_npu_append_batch
+ *
+ * Append entries at the end of an open and write-locked registry file,
+ * with one write and no index lookup or resync. The entries get their
+ * record numbers assigned, and their mdate is used as creation time.
+ * The segment summary and the change journal are not touched: the
+ * caller notes the entries with job_registry_npu_note_batch once the
+ * appends can no longer be undone.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param fd Stream descriptor of the open and write-locked registry file.
+ * @param entries Array of entries to append.
+ * @param n_entries Number of entries in 'entries'.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         A partial write is not undone.
+ */
+
+static int
+job_registry_npu_append_batch(const job_registry_handle *rha, FILE *fd,
+                              job_registry_entry *entries, int n_entries)
+{
+  job_registry_entry last;
+  job_registry_recnum_t recnum = 1;
+  long curr_pos;
+  int i, ret;
+
+  if (n_entries <= 0) return JOB_REGISTRY_SUCCESS;
+
+  if (fseek(fd, 0L, SEEK_END) < 0) return JOB_REGISTRY_FSEEK_FAIL;
+  curr_pos = ftell(fd);
+  if (curr_pos > 0)
+   {
+    /* Read in last recnum */
+    if (fseek(fd, (long)-sizeof(job_registry_entry), SEEK_CUR) < 0)
+      return JOB_REGISTRY_FSEEK_FAIL;
+    if (fread(&last, sizeof(job_registry_entry),1,fd) < 1)
+      return JOB_REGISTRY_FREAD_FAIL;
+    if ( (last.magic_start != JOB_REGISTRY_MAGIC_START) ||
+         (last.magic_end   != JOB_REGISTRY_MAGIC_END) )
+     {
+      errno = ENOMSG;
+      return JOB_REGISTRY_CORRUPT_RECORD;
+     }
+    recnum = last.recnum+1;
+    if (fseek(fd, 0L, SEEK_END) < 0) return JOB_REGISTRY_FSEEK_FAIL;
+   }
+
+  for (i=0; i<n_entries; i++)
+   {
+    entries[i].recnum = recnum + i;
+    entries[i].magic_start = JOB_REGISTRY_MAGIC_START;
+    entries[i].magic_end   = JOB_REGISTRY_MAGIC_END;
+    entries[i].reclen = sizeof(job_registry_entry);
+    entries[i].cdate = entries[i].mdate;
+   }
+
+  if ((ret = job_registry_seq_write_begin(rha)) < 0) return ret;
+  if (fwrite(entries, sizeof(job_registry_entry), n_entries, fd) < n_entries ||
+      fflush(fd) < 0)
+   {
+    job_registry_seq_write_end(rha);
+    return JOB_REGISTRY_FWRITE_FAIL;
+   }
+  job_registry_seq_write_end(rha);
+
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_npu_note_batch
+ *
+ * Note entries appended by job_registry_npu_append_batch in the segment
+ * summary and in the change journal.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param fd Stream descriptor of the open and write-locked registry file.
+ * @param pos Offset of the first entry in the registry file.
+ * @param entries Array of appended entries.
+ * @param n_entries Number of entries in 'entries'.
+ */
+
+static void
+job_registry_npu_note_batch(const job_registry_handle *rha, FILE *fd,
+                            off_t pos, const job_registry_entry *entries,
+                            int n_entries)
+{
+  job_registry_recnum_t rec_index, firstrec;
+  int i;
+
+  if (n_entries <= 0) return;
+  rec_index = pos/sizeof(job_registry_entry);
+  firstrec = entries[0].recnum - rec_index;
+
+  for (i=0; i<n_entries; i++)
+   {
+    job_registry_segment_note(rha, fd, firstrec, rec_index + i,
+                              entries[i].mdate);
+    job_registry_change_note(rha, fd, firstrec, entries[i].recnum,
+                             entries[i].mdate);
+   }
+}
+
+/* Undo appends to an open and write-locked registry file */
+static void
+job_registry_npu_undo(const job_registry_handle *rha, FILE *fd, off_t end)
+{
+  fflush(fd);
+  if (job_registry_seq_write_begin(rha) < 0) return;
+  ftruncate(fileno(fd), end);
+  job_registry_seq_write_end(rha);
+}
+
+/* Open and write-lock the registry for a NPU merge, unless already done. */
+/* Don't use job_registry_open, as we get called from within it. */
+static int
+job_registry_npu_merge_lock(const job_registry_handle *rha, FILE **ofd)
+{
+  if (*ofd != NULL) return JOB_REGISTRY_SUCCESS;
+
+  *ofd = fopen(rha->path,"a+");
+  if (*ofd == NULL) return JOB_REGISTRY_FOPEN_FAIL;
+
+  if (job_registry_wrlock(rha,*ofd) < 0)
+   {
+    fclose(*ofd);
+    *ofd = NULL;
+    return JOB_REGISTRY_FLOCK_FAIL;
+   }
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/*
+ * job_registry_npu_merge_spool
+ *
+ * Append all entries in the NPU spool to the registry and empty the
+ * spool. Either all of them are appended, or none. Nothing is done if
+ * the spool is locked by somebody else. The appended entries
+ * are noted in the segment summary and in the change journal after the
+ * spool is emptied.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param ofd Stream descriptor of the open and write-locked registry, or
+ *        NULL to have it opened and locked (and returned here).
+ * @param ents Buffer for JOB_REGISTRY_NPU_MERGE_CHUNK entries.
+ *
+ * @return Number of appended entries. Less than zero on error.
+ */
+
+static int
+job_registry_npu_merge_spool(const job_registry_handle *rha, FILE **ofd,
+                             job_registry_entry *ents)
+{
+  struct stat sst;
+  off_t pos, start_end, end;
+  int i, n, nvalid;
+  int nadd = 0;
+  int ret;
+
+  if ((ret = job_registry_npu_merge_lock(rha, ofd)) < 0) return ret;
+
+  /* Never wait for the spool while holding the registry lock: */
+  /* a busy spool is merged next time. */
+  if (job_registry_npu_spool_lock(rha->npuspool_fd, F_WRLCK, F_SETLK) < 0)
+   {
+    if (errno == EAGAIN || errno == EACCES) return 0;
+    return JOB_REGISTRY_FLOCK_FAIL;
+   }
+  if (fstat(rha->npuspool_fd, &sst) < 0)
+   {
+    job_registry_npu_spool_lock(rha->npuspool_fd, F_UNLCK, F_SETLK);
+    return JOB_REGISTRY_STAT_FAIL;
+   }
+
+  fseek(*ofd, 0L, SEEK_END);
+  start_end = ftell(*ofd);
+
+  /* A trailing partial entry is dropped */
+  for (pos = sizeof(job_registry_npu_spool_header);
+       pos + (off_t)sizeof(job_registry_entry) <= sst.st_size;
+       pos += n*sizeof(job_registry_entry))
+   {
+    n = (sst.st_size - pos)/sizeof(job_registry_entry);
+    if (n > JOB_REGISTRY_NPU_MERGE_CHUNK) n = JOB_REGISTRY_NPU_MERGE_CHUNK;
+
+    if (pread(rha->npuspool_fd, ents, n*sizeof(job_registry_entry), pos) !=
+        n*sizeof(job_registry_entry))
+     {
+      ret = JOB_REGISTRY_FREAD_FAIL;
+      break;
+     }
+    for (i = 0, nvalid = 0; i < n; i++)
+     {
+      if ( (ents[i].magic_start != JOB_REGISTRY_MAGIC_START) ||
+           (ents[i].magic_end   != JOB_REGISTRY_MAGIC_END) ) continue;
+      if (nvalid < i) ents[nvalid] = ents[i];
+      nvalid++;
+     }
+    if ((ret = job_registry_npu_append_batch(rha, *ofd, ents, nvalid)) < 0)
+      break;
+    nadd += nvalid;
+   }
+
+  /* Failing to empty the spool would cause duplicate entries */
+  if (ret >= 0 && ftruncate(rha->npuspool_fd, 
+                            sizeof(job_registry_npu_spool_header)) < 0)
+    ret = JOB_REGISTRY_FWRITE_FAIL;
+
+  if (ret < 0)
+   {
+    /* Undo the appends while we still hold a write lock */
+    job_registry_npu_undo(rha, *ofd, start_end);
+    nadd = ret;
+   }
+  job_registry_npu_spool_lock(rha->npuspool_fd, F_UNLCK, F_SETLK);
+
+  /* Committed: note what was appended, reading it back in chunks */
+  end = start_end + (off_t)(nadd > 0 ? nadd : 0)*sizeof(job_registry_entry);
+  for (pos = start_end; pos < end; pos += n*sizeof(job_registry_entry))
+   {
+    n = (end - pos)/sizeof(job_registry_entry);
+    if (n > JOB_REGISTRY_NPU_MERGE_CHUNK) n = JOB_REGISTRY_NPU_MERGE_CHUNK;
+    if (pread(fileno(*ofd), ents, n*sizeof(job_registry_entry), pos) !=
+        n*sizeof(job_registry_entry)) break;
+    job_registry_npu_note_batch(rha, *ofd, pos, ents, n);
+   }
+
+  return nadd;
+}
+
+/*
+ * job_registry_npu_merge_batch
+ *
+ * Append entries read from NPU files to the registry, then unlink
+ * the files. Entries whose file could not be unlinked are removed
+ * from the registry again, while the entries whose file is gone are
+ * kept (renumbered if needed).
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param ofd Stream descriptor of the open and write-locked registry, or
+ *        NULL to have it opened and locked (and returned here).
+ * @param ents Entries to append.
+ * @param paths Paths of the files holding each entry.
+ * @param n_entries Number of entries.
+ * @param left_behind Set to TRUE if some files could not be unlinked.
+ *
+ * @return Number of appended entries. Less than zero on error.
+ */
+
+static int
+job_registry_npu_merge_batch(const job_registry_handle *rha, FILE **ofd,
+                             job_registry_entry *ents, char **paths,
+                             int n_entries, int *left_behind)
+{
+  off_t last_end;
+  job_registry_recnum_t first_recnum;
+  int i, n_kept, ret;
+
+  if ((ret = job_registry_npu_merge_lock(rha, ofd)) < 0) return ret;
+
+  fseek(*ofd, 0L, SEEK_END);
+  last_end = ftell(*ofd);
+
+  if ((ret = job_registry_npu_append_batch(rha, *ofd, ents, n_entries)) < 0)
+   {
+    job_registry_npu_undo(rha, *ofd, last_end);
+    return ret;
+   }
+  first_recnum = ents[0].recnum;
+
+  /* With no entry uniqueness check, failing to unlink the */
+  /* NPU file becomes a consistency error we have to avoid. */
+  for (i = 0, n_kept = 0; i < n_entries; i++)
+   {
+    if (unlink(paths[i]) < 0)
+     {
+      *left_behind = TRUE;
+      continue;
+     }
+    if (n_kept < i)
+     {
+      ents[n_kept] = ents[i];
+      ents[n_kept].recnum = first_recnum + n_kept;
+     }
+    n_kept++;
+   }
+
+  if (n_kept < n_entries)
+   {
+    /* Rewrite the kept entries in place of the appended ones, */
+    /* while we still hold a write lock */
+    if ((ret = job_registry_seq_write_begin(rha)) < 0) return ret;
+    if (ftruncate(fileno(*ofd), last_end) < 0 ||
+        fseek(*ofd, 0L, SEEK_END) < 0 ||
+        (n_kept > 0 &&
+         fwrite(ents, sizeof(job_registry_entry), n_kept, *ofd) < n_kept) ||
+        fflush(*ofd) < 0)
+     {
+      job_registry_seq_write_end(rha);
+      return JOB_REGISTRY_FWRITE_FAIL;
+     }
+    job_registry_seq_write_end(rha);
+   }
+
+  job_registry_npu_note_batch(rha, *ofd, last_end, ents, n_kept);
+  return n_kept;
+}
+
+/*
+ * job_registry_merge_pending_nonpriv_updates
+ *
+ * Look for new entries that could not be appended to the registry
+ * file due to lack of privileges and append them to the registry.
+ * Entries are taken from the NPU spool and from files in rha->npudir,
+ * and appended in bulk, with one resync at the end. Nothing is read
+ * if job_registry_npu_pending finds that nothing is pending.
+ *
+ * NOTE: for non privileged updates, any check that the added entries
+ *       are unique w.r.t. the current index/search key is dropped.
+ *
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param fd Stream descriptor of an open and *write* locked 
+ *        registry file. The registry file will be opened and closed if
+ *        fd==NULL.
+ *
+ * @return Number of added entries. Less than zero on error. 
+ *         See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
+int
+job_registry_merge_pending_nonpriv_updates(job_registry_handle *rha,
+                                           FILE *fd)
+{
+  int i;
+  int nadd = 0;
+  int n_files = 0;
+  int pending;
+  int ret = 0;
+  int frret;
+  int left_behind = FALSE;
+  job_registry_entry *ents;
+  char *paths[JOB_REGISTRY_NPU_MERGE_CHUNK];
+  FILE *ofd = NULL;
+  struct stat cfp_st;
+  char *cfp;
+  FILE *cfd, *npsfd;
+  DIR  *npd;
+  struct dirent *de;
+  char subline[JOB_REGISTRY_MAX_SUBJECTLIST_LINE];
+  char *sp;
+  time_t scan_start;
+  int64_t scanned;
+
+  pending = job_registry_npu_pending(rha);
+  if (pending == 0) return 0;
+
+  ents = (job_registry_entry *)malloc(JOB_REGISTRY_NPU_MERGE_CHUNK *
+                                      sizeof(job_registry_entry));
+  if (ents == NULL)
+   {
+    errno = ENOMEM;
+    return JOB_REGISTRY_MALLOC_FAIL;
+   }
+
+  ofd = fd;
+
+  if ((pending & JOB_REGISTRY_NPU_PENDING_SPOOL) != 0)
+   {
+    ret = job_registry_npu_merge_spool(rha, &ofd, ents);
+    if (ret > 0) nadd += ret;
+   }
+
+  if (ret >= 0 && (pending & JOB_REGISTRY_NPU_PENDING_FILES) != 0)
+   {
+    scan_start = time(0);
+    npd = opendir(rha->npudir);
+    if (npd == NULL) ret = JOB_REGISTRY_OPENDIR_FAIL;
+    else
+     {
+      while ((de = readdir(npd)) != NULL) 
+       {
+        cfp = (char *)malloc(strlen(rha->npudir)+strlen(de->d_name)+2);
+        if (cfp == NULL) continue;
+
+        sprintf(cfp,"%s/%s",rha->npudir,de->d_name);
+        if (stat(cfp, &cfp_st) < 0)   { free(cfp); continue; }
+        if (!S_ISREG(cfp_st.st_mode)) { free(cfp); continue; }
+        cfd = fopen(cfp, "r");
+        if (cfd == NULL) { free(cfp); left_behind = TRUE; continue; }
+
+        frret = job_registry_probe_next_record(cfd, &ents[n_files]);
+        fclose(cfd);
+        if (frret == 0)
+         {
+          /* Can't get anything out of this file. It could be in the  */
+          /* process of being written */
+          /* Get rid of the file only if it was last modified "long" time ago */
+          if ((time(0) - cfp_st.st_mtime) > 
+              JOB_REGISTRY_CORRUPTED_NPU_FILES_MAX_LIFETIME) 
+            unlink(cfp);
+          else left_behind = TRUE;
+          free(cfp);
+          continue;
+         }
+
+        /* Use the file mtime as event creation timestamp */
+        ents[n_files].mdate = cfp_st.st_mtime;
+        paths[n_files++] = cfp;
+        if (n_files < JOB_REGISTRY_NPU_MERGE_CHUNK) continue;
+
+        ret = job_registry_npu_merge_batch(rha, &ofd, ents, paths, n_files,
+                                           &left_behind);
+        for (i=0; i<n_files; i++) free(paths[i]);
+        n_files = 0;
+        if (ret < 0) break;
+        nadd += ret;
+       }
+      closedir(npd);
+
+      if (ret >= 0 && n_files > 0)
+       {
+        ret = job_registry_npu_merge_batch(rha, &ofd, ents, paths, n_files,
+                                           &left_behind);
+        if (ret > 0) nadd += ret;
+       }
+      for (i=0; i<n_files; i++) free(paths[i]);
+
+      /* Let the next merges skip npudir until it changes */
+      if (ret >= 0 && !left_behind && rha->npuspool_fd >= 0)
+       {
+        scanned = scan_start;
+        pwrite(rha->npuspool_fd, &scanned, sizeof(scanned),
+               offsetof(job_registry_npu_spool_header, npudir_scanned));
+       }
+     }
+   }
+  free(ents);
+
+  /* Resync before (possibly) dropping the write lock */
+  if (ofd != NULL) job_registry_resync(rha, ofd);
+  if (fd == NULL && ofd != NULL) fclose(ofd);
+
+  if (ret < 0) return ret;
+
+  if (nadd > 0)
+   {
+    /* Try merging the non-privileged subject list, if any */
+    npsfd = fopen(rha->npusubjectlist, "r+");
+    if (npsfd != NULL && job_registry_wrlock(rha,npsfd) >= 0)
+     {
+      while (!feof(npsfd))
+       {
+        if (fgets(subline, sizeof(subline), npsfd) != NULL)
+         {
+          sp = strchr(subline, ' ');
+          if (sp == NULL) continue;
+          *sp = '\000';
+          sp++;
+          if (sp[strlen(sp)-1] == '\n') sp[strlen(sp)-1] = '\000';
+          job_registry_record_subject_hash(rha, subline, sp, FALSE);
+         }
+       }
+      unlink(rha->npusubjectlist);
+     }
+    if (npsfd != NULL) fclose(npsfd);
+   }
+
+  return nadd;
+}
+
+/*
+ * job_registry_update
+ * job_registry_update_select
+ * job_registry_update_recn
+ * job_registry_update_recn_select
+ * job_registry_update_op
+ *
+ * Update an existing entry in the job registry pointed to by rha.
+ * Will return JOB_REGISTRY_NOT_FOUND if the entry does not exist.
+ * job_registry_update will cause job_registry_update_op to open, (write) lock 
+ * and close the registry file, while job_registry_update_op will work
+ * on a file that's aleady open and writelocked.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param entry pointer to a registry entry with values to be
+ *        updated into the registry.
+ *        The values of udate, status, exitcode, exitreason, wn_addr
+ *        and updater_info will be used for the update.
+ *        The entry is updated with the actual registry contents upon
+ *        successful return.
+ * @param recn Cause an update of the specified record number.
+ * @param use_recn If TRUE use the recnum field in 'entry' instead 
+ *        of an index lookup operation.
+ * @param fd Stream descriptor of an open (for write) and writelocked 
+ *        registry file. The file will be opened and closed if fd==NULL.
+ * @param upbits Bitmask selecting which registry fields should get updated by
+ *        job_registry_update_op. Or'ed combination of the following:
+ *         - JOB_REGISTRY_UPDATE_WN_ADDR 
+ *         - JOB_REGISTRY_UPDATE_STATUS  
+ *         - JOB_REGISTRY_UPDATE_EXITCODE 
+ *         - JOB_REGISTRY_UPDATE_UDATE 
+ *         - JOB_REGISTRY_UPDATE_EXITREASON 
+ *         - JOB_REGISTRY_UPDATE_UPDATER_INFO
+ *         or JOB_REGISTRY_UPDATE_ALL for all of the above fields.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         errno is also set in case of error. JOB_REGISTRY_UNCHANGED (>0)
+ *         is returned if the update operation caused no change. 
+ */
+
+int
+job_registry_update_select(job_registry_handle *rha,
+                           job_registry_entry *entry,
+                           job_registry_update_bitmask_t upbits)
+{
+  return job_registry_update_op(rha, entry, FALSE, NULL, upbits);
+}
+
+int
+job_registry_update(job_registry_handle *rha,
+                    job_registry_entry *entry)
+{
+  return job_registry_update_op(rha, entry, FALSE, NULL, JOB_REGISTRY_UPDATE_ALL);
+}
+
+int
+job_registry_update_recn_select(job_registry_handle *rha,
+                           job_registry_entry *entry,
+                           job_registry_recnum_t recn,
+                           job_registry_update_bitmask_t upbits)
+{
+  entry->recnum = recn;
+  return job_registry_update_op(rha, entry, TRUE, NULL, upbits);
+}
+
+int
+job_registry_update_recn(job_registry_handle *rha,
+                         job_registry_entry *entry,
+                         job_registry_recnum_t recn)
+{
+  entry->recnum = recn;
+  return job_registry_update_op(rha, entry, TRUE, NULL, JOB_REGISTRY_UPDATE_ALL);
+}
+
+int
+job_registry_update_op(job_registry_handle *rha,
+                       job_registry_entry *entry, int use_recn, FILE *fd,
+                       job_registry_update_bitmask_t upbits)
+{
+  job_registry_recnum_t found, firstrec, req_recn;
+  job_registry_entry old_entry;
+  int need_to_fclose = FALSE;
+  int need_to_update = FALSE;
+  int update_binfo_only = TRUE;
+  int retcod;
+
+  if (use_recn)
+   {
+    found = entry->recnum;
+   }
+  else
+   {
+    if (rha->mode == NO_INDEX)
+      return JOB_REGISTRY_NO_INDEX;
+    else if (rha->mode == BY_BLAH_ID) 
+      found = job_registry_lookup_op(rha, entry->blah_id, fd);
+    else if (rha->mode == BY_USER_PREFIX) 
+      found = job_registry_lookup_op(rha, entry->user_prefix, fd);
+    else
+      found = job_registry_lookup_op(rha, entry->batch_id, fd);
+    if (found == 0)
+     {
+      return JOB_REGISTRY_NOT_FOUND;
+     }
+   }
+
+  if (fd == NULL)
+   {
+    /* Open file, writelock it and replace entry */
+
+    fd = job_registry_open(rha,"r+");
+    if (fd == NULL) return JOB_REGISTRY_FOPEN_FAIL;
+
+    if (job_registry_wrlock(rha,fd) < 0)
+     {
+      fclose(fd);
+      return JOB_REGISTRY_FLOCK_FAIL;
+     }
+    need_to_fclose = TRUE;
+   }
+
+  firstrec = job_registry_firstrec(rha,fd);
+  /* Was this record just purged ? */
+  if ((firstrec > rha->firstrec) && (found >= rha->firstrec) && (found < firstrec))
+   {
+    if (need_to_fclose) fclose(fd);
+    return JOB_REGISTRY_NOT_FOUND;
+   }
+  JOB_REGISTRY_GET_REC_OFFSET(req_recn,found,firstrec)
+  
+  if (fseek(fd, (long)(req_recn*sizeof(job_registry_entry)), SEEK_SET) < 0)
+   {
+    if (need_to_fclose) fclose(fd);
+    return JOB_REGISTRY_FSEEK_FAIL;
+   }
+  if (fread(&old_entry, sizeof(job_registry_entry),1,fd) < 1)
+   {
+    if (need_to_fclose) fclose(fd);
+    return JOB_REGISTRY_FREAD_FAIL;
+   }
+  if (old_entry.recnum != found)
+   {
+    errno = EBADMSG;
+    if (need_to_fclose) fclose(fd);
+    return JOB_REGISTRY_BAD_RECNUM;
+   }
+  if (fseek(fd, (long)(req_recn*sizeof(job_registry_entry)), SEEK_SET) < 0)
+   {
+    if (need_to_fclose) fclose(fd);
+    return JOB_REGISTRY_FSEEK_FAIL;
+   }
+
+  /* Update original entry and rewrite it */
+  /* Warning: these checks should all be mirrored in job_registry_need_update */
+  /*          below */
+  if (((upbits & JOB_REGISTRY_UPDATE_WN_ADDR) != 0) &&
+      (strncmp(old_entry.wn_addr, entry->wn_addr, 
+               sizeof(old_entry.wn_addr)) != 0))
+   {
+    JOB_REGISTRY_ASSIGN_ENTRY(old_entry.wn_addr, entry->wn_addr);
+    need_to_update = TRUE;
+    update_binfo_only = FALSE;
+   }
+  if (((upbits & JOB_REGISTRY_UPDATE_STATUS) != 0) &&
+       (old_entry.status != entry->status))
+   {
+    old_entry.status = entry->status;
+    need_to_update = TRUE;
+    update_binfo_only = FALSE;
+   }
+  if (((upbits & JOB_REGISTRY_UPDATE_EXITCODE) != 0) &&
+       (old_entry.exitcode != entry->exitcode))
+   {
+    old_entry.exitcode = entry->exitcode;
+    need_to_update = TRUE;
+    update_binfo_only = FALSE;
+   }
+  if (((upbits & JOB_REGISTRY_UPDATE_UDATE) != 0) &&
+       (old_entry.udate != entry->udate))
+   {
+    old_entry.udate = entry->udate;
+    need_to_update = TRUE;
+    update_binfo_only = FALSE;
+   }
+  if (((upbits & JOB_REGISTRY_UPDATE_EXITREASON) != 0) &&
+       (strncmp(old_entry.exitreason, entry->exitreason, 
+                sizeof(old_entry.exitreason)) != 0))
+   {
+    JOB_REGISTRY_ASSIGN_ENTRY(old_entry.exitreason, entry->exitreason);
+    need_to_update = TRUE;
+    update_binfo_only = FALSE;
+   }
+  if (((upbits & JOB_REGISTRY_UPDATE_UPDATER_INFO) != 0) &&
+       (strncmp(old_entry.updater_info, entry->updater_info, 
+                sizeof(old_entry.updater_info)) != 0))
+   {
+    JOB_REGISTRY_ASSIGN_ENTRY(old_entry.updater_info, entry->updater_info);
+    need_to_update = TRUE;
+   }
+  else update_binfo_only = FALSE;
+
+  retcod = JOB_REGISTRY_UNCHANGED;
+
+  if (need_to_update)
+   {
+    if (! update_binfo_only)
+     {
+      old_entry.mdate = time(0);
+      job_registry_segment_note(rha, fd, firstrec, req_recn, old_entry.mdate);
+     }
+  
+    /* The record must reach the file before the counter is released */
+    if ((retcod = job_registry_seq_write_begin(rha)) < 0)
+     {
+      if (need_to_fclose) fclose(fd);
+      return retcod;
+     }
+    if (fwrite(&old_entry, sizeof(job_registry_entry),1,fd) < 1 ||
+        fflush(fd) < 0)
+     {
+      job_registry_seq_write_end(rha);
+      if (need_to_fclose) fclose(fd);
+      return JOB_REGISTRY_FWRITE_FAIL;
+     }
+    else
+     {
+      job_registry_seq_write_end(rha);
+      job_registry_change_note(rha, fd, firstrec, found, old_entry.mdate);
+      if (update_binfo_only) retcod = JOB_REGISTRY_BINFO_ONLY;
+      else                   retcod = JOB_REGISTRY_SUCCESS;
+     }
+   }
+
+  if (need_to_fclose) fclose(fd);
+
+  /* Update entry contents with actual registry entry */
+  memcpy(entry, &old_entry, sizeof(job_registry_entry));
+
+  return retcod;
+}
+
+/*
+ * job_registry_batch_push
+ *
+ * Queue an in-place update of a registry entry, to be applied by
+ * job_registry_update_batch.
+ *
+ * @param batch Pointer to a batch (zero-initialised on first use).
+ * @param entry Pointer to the new entry contents (copied).
+ * @param recn Record number of the entry to update, or 0 to look it up
+ *        by the handle index key (as job_registry_update does).
+ * @param upbits Bitmask selecting which registry fields should get
+ *        updated (see job_registry_update_op).
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ */
+
+int
+job_registry_batch_push(job_registry_batch *batch,
+                        const job_registry_entry *entry,
+                        job_registry_recnum_t recn,
+                        job_registry_update_bitmask_t upbits)
+{
+  job_registry_batch_item *new_items;
+  int new_alloc;
+
+  if (batch->n_items >= batch->n_alloc)
+   {
+    new_alloc = (batch->n_alloc > 0) ? batch->n_alloc*2 : JOB_REGISTRY_ALLOC_CHUNK;
+    new_items = (job_registry_batch_item *)realloc(batch->items,
+                                   new_alloc*sizeof(job_registry_batch_item));
+    if (new_items == NULL)
+     {
+      errno = ENOMEM;
+      return JOB_REGISTRY_MALLOC_FAIL;
+     }
+    batch->items = new_items;
+    batch->n_alloc = new_alloc;
+   }
+
+  memcpy(&(batch->items[batch->n_items].entry), entry, 
+         sizeof(job_registry_entry));
+  batch->items[batch->n_items].entry.recnum = recn;
+  batch->items[batch->n_items].upbits = upbits;
+  batch->items[batch->n_items].result = JOB_REGISTRY_UNCHANGED;
+  batch->n_items++;
+
+  return JOB_REGISTRY_SUCCESS;
+}
+
+static int
+job_registry_batch_item_cmp(const void *a, const void *b)
+{
+  const job_registry_batch_item *ia = *(const job_registry_batch_item **)a;
+  const job_registry_batch_item *ib = *(const job_registry_batch_item **)b;
+
+  if (ia->entry.recnum < ib->entry.recnum) return -1;
+  if (ia->entry.recnum > ib->entry.recnum) return 1;
+  return 0;
+}
+
+/*
+ * job_registry_update_batch
+ *
+ * Apply all the updates queued in a batch (see job_registry_batch_push)
+ * under a single write lock of the registry file. Updates are applied
+ * in record number order, so that the file is written front to back,
+ * and the file is synced once at the end, if anything was written.
+ * This replaces one open/lock/seek/write/close cycle per entry in the
+ * BUpdater status sweeps.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param batch Pointer to a batch. The 'result' field of each item is set
+ *        to the return code of job_registry_update_op for that entry, and
+ *        on success the entry is filled with the actual registry contents.
+ *
+ * @return Less than zero if the registry could not be opened or locked
+ *         (in which case the result of each item is set to the same
+ *         error code). Otherwise the number of entries that were
+ *         actually written.
+ */
+
+int
+job_registry_update_batch(job_registry_handle *rha,
+                          job_registry_batch *batch)
+{
+  FILE *fd;
+  job_registry_batch_item **order;
+  job_registry_batch_item *it;
+  const char *key;
+  int i, n_order, n_written = 0;
+  int ret = JOB_REGISTRY_SUCCESS;
+
+  if (batch->n_items <= 0) return 0;
+
+  order = (job_registry_batch_item **)malloc(batch->n_items *
+                                   sizeof(job_registry_batch_item *));
+  if (order == NULL)
+   {
+    errno = ENOMEM;
+    ret = JOB_REGISTRY_MALLOC_FAIL;
+   }
+  else if ((fd = job_registry_open(rha,"r+")) == NULL)
+   {
+    ret = JOB_REGISTRY_FOPEN_FAIL;
+   }
+  else if (job_registry_wrlock(rha,fd) < 0)
+   {
+    fclose(fd);
+    ret = JOB_REGISTRY_FLOCK_FAIL;
+   }
+
+  if (ret < 0)
+   {
+    for (i=0; i<batch->n_items; i++) batch->items[i].result = ret;
+    if (order != NULL) free(order);
+    return ret;
+   }
+
+  /* Resolve the entries that were queued with no record number */
+  for (i=0, n_order=0; i<batch->n_items; i++)
+   {
+    it = &(batch->items[i]);
+    if (it->entry.recnum == 0)
+     {
+      if (rha->mode == NO_INDEX || rha->mode == NAMES_ONLY)
+       {
+        it->result = JOB_REGISTRY_NO_INDEX;
+        continue;
+       }
+      else if (rha->mode == BY_BLAH_ID || rha->mode == BY_BLAH_ID_MMAP)
+        key = it->entry.blah_id;
+      else if (rha->mode == BY_USER_PREFIX || rha->mode == BY_USER_PREFIX_MMAP)
+        key = it->entry.user_prefix;
+      else
+        key = it->entry.batch_id;
+      it->entry.recnum = job_registry_lookup_op(rha, key, fd);
+      if (it->entry.recnum == 0)
+       {
+        it->result = JOB_REGISTRY_NOT_FOUND;
+        continue;
+       }
+     }
+    order[n_order++] = it;
+   }
+
+  qsort(order, n_order, sizeof(job_registry_batch_item *),
+        job_registry_batch_item_cmp);
+
+  for (i=0; i<n_order; i++)
+   {
+    it = order[i];
+    it->result = job_registry_update_op(rha, &(it->entry), TRUE, fd,
+                                        it->upbits);
+    if (it->result == JOB_REGISTRY_SUCCESS || 
+        it->result == JOB_REGISTRY_BINFO_ONLY) n_written++;
+   }
+
+  if (n_written > 0)
+   {
+    fflush(fd);
+    fsync(fileno(fd));
+   }
+
+  fclose(fd);
+  free(order);
+  return n_written;
+}
+
+/*
+ * job_registry_batch_clear
+ * job_registry_batch_free
+ *
+ * Empty a batch, keeping (job_registry_batch_clear) or releasing
+ * (job_registry_batch_free) its storage.
+ *
+ * @param batch Pointer to a batch.
+ */
+
+void
+job_registry_batch_clear(job_registry_batch *batch)
+{
+  batch->n_items = 0;
+}
+
+void
+job_registry_batch_free(job_registry_batch *batch)
+{
+  if (batch->items != NULL) free(batch->items);
+  batch->items = NULL;
+  batch->n_items = 0;
+  batch->n_alloc = 0;
+}
+
+/*
+ * job_registry_need_update
+ *
+ * Check two job registry entries, an 'old' and a 'new' one, and
+ * check whether job_registry_update would need to actually write
+ * an update to disk. This function is meant to save the unneeded
+ * acquisition of a write lock.
+ *
+ * @param olde pointer to an existing registry entry.
+ * @param newe pointer to a possibly updated registry entry.
+ * @param upbits Bitmask selecting which registry fields should be
+ *               checked. Or'ed combination of the following:
+ *         - JOB_REGISTRY_UPDATE_WN_ADDR 
+ *         - JOB_REGISTRY_UPDATE_STATUS  
+ *         - JOB_REGISTRY_UPDATE_EXITCODE 
+ *         - JOB_REGISTRY_UPDATE_UDATE 
+ *         - JOB_REGISTRY_UPDATE_EXITREASON 
+ *         - JOB_REGISTRY_UPDATE_UPDATER_INFO
+ *         or JOB_REGISTRY_UPDATE_ALL for all of the above fields.
+ *
+ * @return Boolean valued integer. TRUE (nonzero) if an update is
+ *         actually needed.
+ */
+
+int
+job_registry_need_update(const job_registry_entry *olde,
+                         const job_registry_entry *newe,
+                         job_registry_update_bitmask_t upbits)
+{
+  int need_to_update = FALSE;
+
+  if (((upbits & JOB_REGISTRY_UPDATE_WN_ADDR) != 0) &&
+      (strncmp(olde->wn_addr, newe->wn_addr, 
+               sizeof(olde->wn_addr)) != 0))
+   {
+    need_to_update = TRUE;
+   }
+  if (((upbits & JOB_REGISTRY_UPDATE_STATUS) != 0) &&
+       (olde->status != newe->status))
+   {
+    need_to_update = TRUE;
+   }
+  if (((upbits & JOB_REGISTRY_UPDATE_EXITCODE) != 0) &&
+       (olde->exitcode != newe->exitcode))
+   {
+    need_to_update = TRUE;
+   }
+  if (((upbits & JOB_REGISTRY_UPDATE_UDATE) != 0) &&
+       (olde->udate != newe->udate))
+   {
+    need_to_update = TRUE;
+   }
+  if (((upbits & JOB_REGISTRY_UPDATE_EXITREASON) != 0) &&
+       (strncmp(olde->exitreason, newe->exitreason, 
+                sizeof(olde->exitreason)) != 0))
+   {
+    need_to_update = TRUE;
+   }
+  if (((upbits & JOB_REGISTRY_UPDATE_UPDATER_INFO) != 0) &&
+       (strncmp(olde->updater_info, newe->updater_info, 
+                sizeof(olde->updater_info)) != 0))
+   {
+    need_to_update = TRUE;
+   }
+  return need_to_update;
+}
+
+/*
+ * job_registry_get_recnum
+ *
+ * Binary search for an entry in the indexed, sorted job registry pointed to by
+ * rha. The record number in the current JR cache is returned.
+ * No file access is required.
+ * In case multiple entries are found, the highest (most recent) recnum 
+ * is returned. As the index is sorted on (ID, recnum), this is the last
+ * entry with a matching ID. Handles in compact mode (see 
+ * job_registry_compact) also search the compact index.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param id Job id key to be looked up 
+ *
+ * @return Record number of the found record, or 0 if the record was not found.
+ */
+
+job_registry_recnum_t 
+job_registry_get_recnum(const job_registry_handle *rha,
+                        const char *id)
+{
+  /* Binary search in entries for the first ID greater than 'id' */
+  int left,right,cur;
+
+  left = 0;
+  right = rha->n_entries;
+
+  while (left < right)
+   {
+    cur = (right + left) /2;
+    if (strcmp(rha->entries[cur].id,id) <= 0) left = cur+1;
+    else                                       right = cur;
+   }
+  if (left > 0 && strcmp(rha->entries[left-1].id,id) == 0)
+    return rha->entries[left-1].recnum;
+
+  /* Entries that are not in the handle index may be compacted */
+  if (rha->compact != NULL) return job_registry_compact_lookup(rha->compact, id);
+  return 0;
+}
+
+/*
+ * job_registry_lookup
+ * job_registry_lookup_op
+ *
+ * Binary search for an entry in the indexed, sorted job registry pointed to by
+ * rha. If the entry is not found, a job_registry_resync will be attempted.
+ * job_registry_lookup_op can operate on an already open and at least read-
+ * locked file.
  *
- * Update the cache inside the job registry handle, if enabled,
- * otherwise just update rha->firstrec and rha->lastrec.
- * Will rescan the entire file in case this was found to be purged.
- * 
- * @param fd Stream descriptor of an open registry file.
- *        fd *must* be at least read locked before calling this function. 
- * @param rha Pointer to a job registry handle returned by job_registry_init
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param id Job id key to be looked up 
+ * @param fd Stream descriptor of an open and *write* locked 
+ *        registry file. The write lock is needed only in case
+ *        non privileged new entries need to be merged into the registry.
+ *        When fd==NULL, the file will be opened and closed if new 
+ *        non-privileged entries are present (write lock), or 
+ *        job_registry_resync is needed (read lock).
  *
- * @return Less than zero on error. Zero un unchanged registru. Greater than 0
- *         if registry changed, See job_registry.h for error codes.
- *         errno is also set in case of error.
+ * @return Record number of the found record, or 0 if the record was not found.
  */
 
-int
-job_registry_resync(job_registry_handle *rha, FILE *fd)
+job_registry_recnum_t 
+job_registry_lookup(job_registry_handle *rha,
+                    const char *id)
 {
+  /* As a resync attempt is performed inside this function, */
+  /* the registry should not be open when this function is called. */
+  /* Use job_registry_lookup_op if an open file is needed */
 
-  job_registry_recnum_t firstrec;
-  job_registry_recnum_t old_firstrec, old_lastrec;
-  job_registry_entry *ren;
-  job_registry_index *new_entries;
-  char *chosen_id;
-  int mret;
-
-  if (rha->mode == BY_BLAH_ID_MMAP || rha->mode == BY_BATCH_ID_MMAP ||
-      rha->mode == BY_USER_PREFIX_MMAP)
-   {
-     if ((mret = job_registry_resync_mmap(rha, fd)) >= 0)
-       return mret;
-   }
-
-  old_lastrec = rha->lastrec;
-  old_firstrec = rha->firstrec;
+  return job_registry_lookup_op(rha, id, NULL);
+}
 
-  firstrec = job_registry_firstrec(rha,fd);
+job_registry_recnum_t 
+job_registry_lookup_op(job_registry_handle *rha,
+                       const char *id, FILE *fd)
+{
+  job_registry_recnum_t found=0;
+  int retry;
+  int need_to_fclose = FALSE;
 
-       /* File new or changed? Or mmap failed ? */
-  if ( (rha->lastrec == 0 && rha->firstrec == 0) || firstrec != rha->firstrec
-                                                 || rha->index_mmap_length > 0 )
-   {
-    if (fseek(fd,0L,SEEK_SET) < 0) return JOB_REGISTRY_FSEEK_FAIL;
-    if (rha->index_mmap_length > 0)
-     {
-      munmap(rha->entries, rha->index_mmap_length);
-      close(rha->mmap_fd);
-      rha->index_mmap_length = 0;
-      rha->mmap_fd = -1;
-     }
-    else if (rha->entries != NULL) free(rha->entries);
-    rha->entries = NULL;
-    rha->firstrec = 0;
-    rha->lastrec = 0;
-    rha->n_entries = 0;
-    rha->n_alloc = 0;
-   }
-  else
+  for (retry=0; retry < 2; retry++)
    {
-    /* Move to the last known end of file and keep on reading */
-    if (fseek(fd,(long)((rha->lastrec - rha->firstrec + 1)*sizeof(job_registry_entry)),
-              SEEK_SET) < 0) return JOB_REGISTRY_FSEEK_FAIL;
-   }
+    found = job_registry_get_recnum(rha, id); 
 
-  if (rha->mode == NO_INDEX) 
-   {
-    /* Just figure out the first and last recnum */
-    if ((ren = job_registry_get_next(rha, fd)) != NULL)
+    /* If the entry was not found the first time around, try resyncing once */
+    if (found == 0 && retry == 0)
      {
-      if (rha->firstrec == 0) rha->firstrec = ren->recnum;
-      free(ren);
-      if (fseek(fd,(long)-sizeof(job_registry_entry),SEEK_END) >= 0)
+      if (fd == NULL)
        {
-        if ((ren = job_registry_get_next(rha, fd)) != NULL)
+        fd = job_registry_open(rha, "r");
+        if (fd == NULL) break;
+        if (job_registry_rdlock(rha, fd) < 0)
          {
-          rha->lastrec = ren->recnum;
-          free(ren);
+          fclose(fd);
+          break;
          }
-        else return JOB_REGISTRY_NO_VALID_RECORD;
+        need_to_fclose = TRUE;
        }
-     }
-    return JOB_REGISTRY_SUCCESS;
-   }
-
-  while ((ren = job_registry_get_next(rha, fd)) != NULL)
-   {
-    if (rha->firstrec == 0) rha->firstrec = ren->recnum;
-    if (ren->recnum > rha->lastrec) rha->lastrec = ren->recnum;
-    (rha->n_entries)++;
-    if (rha->n_entries > rha->n_alloc)
-     {
-      rha->n_alloc += JOB_REGISTRY_ALLOC_CHUNK;
-      new_entries = realloc(rha->entries, 
-                            rha->n_alloc * sizeof(job_registry_index));
-      if (new_entries == NULL)
+      if (job_registry_resync(rha, fd) <= 0)
        {
-        errno = ENOMEM;
-        free(ren);
-        return JOB_REGISTRY_MALLOC_FAIL;
+        if (need_to_fclose) fclose(fd);
+        break;
        }
-      rha->entries = new_entries;
+      if (need_to_fclose) fclose(fd);
      }
-    if (rha->mode == BY_BLAH_ID)         chosen_id = ren->blah_id;
-    else if(rha->mode == BY_USER_PREFIX) chosen_id = ren->user_prefix;
-    else                                 chosen_id = ren->batch_id;
-
-    JOB_REGISTRY_ASSIGN_ENTRY((rha->entries[rha->n_entries-1]).id,
-                              chosen_id);
-            
-    (rha->entries[rha->n_entries-1]).recnum = ren->recnum; 
-    free(ren);
-   }
-  if ((rha->lastrec != old_lastrec) || (rha->firstrec != old_firstrec))
-   {
-    job_registry_sort(rha);
-    return JOB_REGISTRY_CHANGED;
+    if (found > 0) break;
    }
-  return JOB_REGISTRY_SUCCESS;
+  return found;
 }
 
 /*
- * job_registry_sort
+ * job_registry_get
  *
- * Will perform a non-recursive quicksort of the registry index.
- * This needs to be called before job_registry_lookup, as the latter
- * assumes the index to be ordered.
+ * Search for an entry in the indexed, sorted job registry pointed to by
+ * rha and fetch it from the registry file. If the entry is not found, a 
+ * job_registry_resync will be attempted.
+ * The registry file will be opened, locked and closed as an effect
+ * of this operation, so the file should not be open upon entering
+ * this function. Handles in persistent mode (see job_registry_persist)
+ * look the entry up in memory first.
  *
- * @param rha Pointer to a job registry handle returned by job_registry_init
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param id Job id key to be looked up 
  *
- * @return Less than zero on error. See job_registry.h for error codes.
- *         errno is also set in case of error.
+ * @return Dynamically allocated registry entry. Needs to be free'd.
  */
 
-int
-job_registry_sort(job_registry_handle *rha)
+job_registry_entry *
+job_registry_get(job_registry_handle *rha,
+                 const char *id)
 {
-  /* Non-recursive quicksort of registry data */
+  job_registry_recnum_t found, firstrec, req_recn;
+  job_registry_entry *entry;
+  FILE *fd;
 
-  job_registry_sort_state *sst;
-  job_registry_index swap;
-  int i,k,kp,left,right,size,median;
-  char median_id[JOBID_MAX_LEN];
-  int n_sorted;
+  if (rha->mode == NO_INDEX)
+   {
+    errno = EINVAL;
+    return NULL;
+   }
 
-  /* Anything to do ? */
-  if (rha->n_entries <= 1) return JOB_REGISTRY_SUCCESS;
+  /* Persistent handles can be served from the mapped registry. */
+  /* Fall back to the file-based lookup on a miss, so that pending */
+  /* non-privileged updates get merged. */
+  if (rha->persist_fd >= 0)
+   {
+    if ((entry = job_registry_persist_get(rha, id)) != NULL) return entry;
+   }
+
+  found = job_registry_lookup(rha, id);
+  if (found == 0)
+   {
+    errno = ENOENT;
+    return NULL;
+   }
 
-  srand(time(0));
+  /* Try a lock-free copy first. Fall back to locking on purges */
+  /* or if writers keep changing the registry. */
+  job_registry_merge_pending_nonpriv_updates(rha, NULL);
+  if ((entry = job_registry_get_optimistic(rha, found)) != NULL) return entry;
+
+  /* Open file, readlock it and fetch entry */
+
+  fd = job_registry_open(rha,"r");
+  if (fd == NULL) return NULL;
 
-  sst = (job_registry_sort_state *)malloc(rha->n_entries * 
-              sizeof(job_registry_sort_state));
-  if (sst == NULL)
+  if (job_registry_rdlock(rha,fd) < 0)
    {
-    errno = ENOMEM;
-    return JOB_REGISTRY_MALLOC_FAIL;
+    fclose(fd);
+    return NULL;
    }
-  
-  sst[0] = LEFT_BOUND;
-  for (i=1;i<(rha->n_entries - 1);i++) sst[i] = UNSORTED;
-  sst[rha->n_entries - 1] = RIGHT_BOUND;
 
-  for (n_sorted = 0; n_sorted < rha->n_entries; )
+  firstrec = job_registry_firstrec(rha,fd);
+
+  /* Determine if the job registry index must be resync'd.
+   * The record numbers are monotonically increasing through the lifetime
+   * of the registry; the firstrec we read from the data file above must
+   * match the firstrec in our in-memory index.  The firstrec on the index
+   * is guaranteed to change if a purge operation occurred.
+   */
+  if (firstrec != rha->firstrec)
    {
-    for (left=0; left<rha->n_entries; left=right+1)
+    int retval = job_registry_resync(rha, fd);
+    if (retval < 0)  // Registry failed to update.
      {
-      if (sst[left] == SORTED) 
-       {
-        right = left;
-        continue;
-       }
-      else if (sst[left] == LEFT_BOUND)
+      fclose(fd);
+      return NULL;
+     }
+    if (retval > 0)  // Registry has been updated; our lookup was invalid.
+     {
+      found = job_registry_lookup(rha, id);
+      if (found == 0)
        {
-        /* Find end of current sort partition */
-        for (right = left+1; right<rha->n_entries; right++)
-         {
-          if (sst[right] == RIGHT_BOUND) break;
-          else sst[right] = UNSORTED;
-         }
-        /* Separate entries from 'right' to 'left' and separate them at */
-        /* entry 'median'. */
-        size = (right - left + 1);
-        median = rand()%size + left;
-        JOB_REGISTRY_ASSIGN_ENTRY(median_id, rha->entries[median].id);
-        for (i = left, k = right; ; i++,k--)
-         {
-          while (strcmp(rha->entries[i].id,median_id) < 0) i++;
-          while (strcmp(rha->entries[k].id,median_id) > 0) k--;
-          if (i>=k) break; /* Indices crossed ? */
-
-          /* If we reach here entries 'i' and 'k' need to be swapped. */
-          swap = rha->entries[i];
-          rha->entries[i] = rha->entries[k];
-          rha->entries[k] = swap;
-         }
-        /* 'k' is a new candidate right bound. 'k+1' a candidate left bound */
-        if (k >= left)
-         {
-          if (sst[k] == LEFT_BOUND)  sst[k] = SORTED, n_sorted++;
-          else                       sst[k] = RIGHT_BOUND;
-         }
-        kp = k+1;
-        if ((kp) <= right)
-         {
-          if (sst[kp] == RIGHT_BOUND) sst[kp] = SORTED, n_sorted++;
-          else                        sst[kp] = LEFT_BOUND;
-         }
+        errno = ENOENT;
+        fclose(fd);
+        return NULL;
        }
      }
    }
-  free(sst);
-  return JOB_REGISTRY_SUCCESS;
+
+  /* Was this record just purged ? */
+  if ((firstrec > rha->firstrec) && (found >= rha->firstrec) && (found < firstrec))
+   {
+    fclose(fd);
+    return NULL;
+   }
+  JOB_REGISTRY_GET_REC_OFFSET(req_recn,found,firstrec)
+  
+  if (fseek(fd, (long)(req_recn*sizeof(job_registry_entry)), SEEK_SET) < 0)
+   {
+    fclose(fd);
+    return NULL;
+   }
+  
+  entry = job_registry_get_next(rha, fd);
+
+  fclose(fd);
+  return entry;
 }
 
-/*
- * job_registry_append
- * job_registry_append_op
- *
- * Appends an entry to the registry, unless an entry with the same
- * active ID is found there already (in that case will fall through
- * to job_registry_update).
- * job_registry_append will cause job_registry_append_op to open, (write) lock 
- * and close the registry file, while job_registry_append_op will work
- * on a file that's aleady open and writelocked.
+/* Hash index slot (0..JOB_REGISTRY_N_HASH_KEYS-1) for an index mode */
+static int
+job_registry_hash_key_slot(job_registry_index_mode mode)
+{
+  switch (mode)
+   {
+    case BY_BLAH_ID:
+    case BY_BLAH_ID_MMAP:
+      return 0;
+    case BY_BATCH_ID:
+    case BY_BATCH_ID_MMAP:
+      return 1;
+    case BY_USER_PREFIX:
+    case BY_USER_PREFIX_MMAP:
+      return 2;
+    default:
+      return -1;
+   }
+}
+
+static const job_registry_index_mode
+  job_registry_hash_key_modes[JOB_REGISTRY_N_HASH_KEYS] = 
+    { BY_BLAH_ID, BY_BATCH_ID, BY_USER_PREFIX };
+
+/*
+ * job_registry_persist
+ *
+ * Switch a job registry handle to persistent mode: the registry file is
+ * kept open and mapped read-only for the lifetime of the handle, and
+ * a hash index on the handle key (as selected by the index mode)
+ * is kept in memory. Secondary keys can be hash-indexed as well
+ * (see job_registry_persist_index). The subject list files are also
+ * cached in memory (see job_registry_lookup_subject_hash).
+ * NO_INDEX handles can be switched to persistent mode for the
+ * mapped scan calls (job_registry_get_next_mapped,
+ * job_registry_get_next_subject_match). job_registry_get will then be served from memory,
+ * and the mapping will be revalidated only when the registry file
+ * changes size or is replaced (e.g. by a purge).
  *
  * @param rha Pointer to a job registry handle returned by job_registry_init.
- * @param entry pointer to a registry entry to append to the registry.
- *        entry->recnum, entry->cdate and entry->mdate will be updated
- *        to current values. entry->magic_start and entry->magic_end will
- *        be appropriately set.
- * @param fd Stream descriptor of an open (for write) and writelocked 
- *        registry file. The file will be opened and closed if fd==NULL.
- * @param now Timestamp to be used for the update.
  *
  * @return Less than zero on error. See job_registry.h for error codes.
  *         errno is also set in case of error.
  */
-int
-job_registry_append(job_registry_handle *rha,
-                    job_registry_entry *entry)
-{
-  return job_registry_append_op(rha, entry, NULL, time(0));
-}
 
 int
-job_registry_append_op(job_registry_handle *rha,
-                       job_registry_entry *entry, FILE *fd, time_t now)
+job_registry_persist(job_registry_handle *rha)
 {
-  job_registry_recnum_t found,curr_recn;
-  job_registry_entry last;
-  long curr_pos;
-  int need_to_fclose = FALSE;
-  int ret;
+  int ret, k;
 
-  if (rha->mode != NO_INDEX)
+  if (rha->mode == NAMES_ONLY)
    {
-    if (rha->mode == BY_BLAH_ID) 
-      found = job_registry_lookup_op(rha, entry->blah_id, fd);
-    else if (rha->mode == BY_USER_PREFIX)
-      found = job_registry_lookup_op(rha, entry->user_prefix, fd);
-    else
-      found = job_registry_lookup_op(rha, entry->batch_id, fd);
-    if (found != 0)
-     { 
-      entry->recnum = found;
-      return job_registry_update_op(rha, entry, TRUE, fd, JOB_REGISTRY_UPDATE_ALL);
-     }
+    errno = EINVAL;
+    return JOB_REGISTRY_NO_INDEX;
    }
+  if (rha->persist_fd >= 0) return JOB_REGISTRY_SUCCESS;
 
-  if (fd == NULL)
-   {
-    /* Open file, writelock it and append entry */
-
-    fd = job_registry_open(rha,"a+");
-    if (fd == NULL) return JOB_REGISTRY_FOPEN_FAIL;
+  /* NO_INDEX handles can be made persistent for mapped scans only */
+  if ((k = job_registry_hash_key_slot(rha->mode)) >= 0)
+    rha->hash_keys |= (1 << k);
 
-    if (job_registry_wrlock(rha,fd) < 0)
+  if (rha->subject_cache == NULL)
+   {
+    rha->subject_cache = (job_registry_subject_cache *)calloc(1,
+                                     sizeof(job_registry_subject_cache));
+    if (rha->subject_cache == NULL)
      {
-      fclose(fd);
-      return JOB_REGISTRY_FLOCK_FAIL;
+      errno = ENOMEM;
+      return JOB_REGISTRY_MALLOC_FAIL;
      }
-    need_to_fclose = TRUE;
    }
 
-  /* 'a+' positions the read pointer at the beginning of the file */
-  /* Make sure we move there in case of an open fd. */
-  if (fseek(fd, 0L, SEEK_END) < 0)
+  rha->persist_fd = open(rha->path, O_RDONLY);
+  if (rha->persist_fd < 0) return JOB_REGISTRY_FOPEN_FAIL;
+
+  rha->data_map = NULL;
+  rha->data_map_length = 0;
+  rha->data_map_ino = 0;
+  rha->data_map_firstrec = 0;
+  rha->scan_buf_n = 0;
+
+  if ((ret = job_registry_persist_revalidate(rha)) < 0)
    {
-    if (need_to_fclose) fclose(fd);
-    return JOB_REGISTRY_FSEEK_FAIL;
+    close(rha->persist_fd);
+    rha->persist_fd = -1;
+    return ret;
    }
+  return JOB_REGISTRY_SUCCESS;
+}
 
-  curr_pos = ftell(fd);
-  if (curr_pos > 0)
+/* Key of 'en' according to an index mode */
+static const char *
+job_registry_entry_key(job_registry_index_mode mode,
+                       const job_registry_entry *en)
+{
+  switch (mode)
    {
-    /* Read in last recnum */
-    if (fseek(fd, (long)-sizeof(job_registry_entry), SEEK_CUR) < 0)
-     {
-      if (need_to_fclose) fclose(fd);
-      return JOB_REGISTRY_FSEEK_FAIL;
-     }
-    if (fread(&last, sizeof(job_registry_entry),1,fd) < 1)
-     {
-      if (need_to_fclose) fclose(fd);
-      return JOB_REGISTRY_FREAD_FAIL;
-     }
-    /* Consistency checks */
-    if ( (last.magic_start != JOB_REGISTRY_MAGIC_START) ||
-         (last.magic_end   != JOB_REGISTRY_MAGIC_END) )
-     {
-      errno = ENOMSG;
-      if (need_to_fclose) fclose(fd);
-      return JOB_REGISTRY_CORRUPT_RECORD;
-     }
-    entry->recnum = last.recnum+1;
+    case BY_BLAH_ID:
+    case BY_BLAH_ID_MMAP:
+      return en->blah_id;
+    case BY_USER_PREFIX:
+    case BY_USER_PREFIX_MMAP:
+      return en->user_prefix;
+    default:
+      return en->batch_id;
    }
-  else entry->recnum = 1;
+}
 
-  entry->magic_start = JOB_REGISTRY_MAGIC_START;
-  entry->magic_end   = JOB_REGISTRY_MAGIC_END;
-  entry->reclen = sizeof(job_registry_entry);
-  entry->cdate = entry->mdate = now;
-  
-  if (fwrite(entry, sizeof(job_registry_entry),1,fd) < 1)
+/* FNV-1a hash of a (possibly not NUL-terminated) ID field */
+static uint32_t
+job_registry_hash_id(const char *id, size_t maxlen)
+{
+  uint32_t h = 2166136261U;
+  size_t i;
+
+  for (i=0; i<maxlen && id[i] != '\000'; i++)
    {
-    if (need_to_fclose) fclose(fd);
-    return JOB_REGISTRY_FWRITE_FAIL;
+    h ^= (unsigned char)id[i];
+    h *= 16777619U;
    }
-
-  ret = job_registry_resync(rha,fd);
-  if (need_to_fclose) fclose(fd);
-  return ret;
+  return h;
 }
 
-/*
- * job_registry_get_new_npufd
- *
- * Open a unique file for storage or retrieval of
- * non-privileged-update entries.
- *
- * @param rha Pointer to a job registry handle returned by job_registry_init.
- *
- * @return Stream descriptor to open file, NULL (and errno set to
- *         ENOMEM) when running out of memory, NULL (and errno set
- *         appropriately) when file operations fail..
- */
-FILE*
-job_registry_get_new_npufd(job_registry_handle *rha)
+/* Pointer to record 'recn' inside the registry mapping, or NULL */
+static const job_registry_entry *
+job_registry_persist_record(const job_registry_handle *rha,
+                            job_registry_recnum_t recn)
 {
-  FILE *rfd = NULL;
-  int lfd;
-  char *tp;
-  struct stat fst;
-  const char *npu_tail="/npu_XXXXXX";
-  int i;
+  job_registry_recnum_t off;
 
-  /* Append a filename to rha->npudir, so it can be passed back to */
-  /* jobregistry_construct_path */
-  tp = (char *)malloc(strlen(rha->npudir) + strlen(npu_tail) + 1);
-  if (tp == NULL)
-   {
-    errno = ENOMEM;
+  if (rha->data_map == NULL) return NULL;
+  JOB_REGISTRY_GET_REC_OFFSET(off,recn,rha->data_map_firstrec)
+  if ((off_t)(off+1)*sizeof(job_registry_entry) > rha->data_map_length)
     return NULL;
-   }
+  return (const job_registry_entry *)(rha->data_map +
+                                      off*sizeof(job_registry_entry));
+}
 
-  sprintf(tp, "%s%s", rha->npudir, npu_tail);
-  lfd = mkstemp(tp);
-  if (lfd >= 0) 
+/* Add (or replace with a more recent recnum) one record in hash index 'k' */
+static void
+job_registry_hash_insert(job_registry_handle *rha, int k,
+                         const job_registry_entry *en)
+{
+  const char *key;
+  const job_registry_entry *hen;
+  job_registry_recnum_t *table = rha->hash_index[k];
+  job_registry_index_mode mode = job_registry_hash_key_modes[k];
+  uint32_t slot, mask;
+
+  key = job_registry_entry_key(mode, en);
+  if (key[0] == '\000') return; /* e.g. user_prefix of non-CREAM jobs */
+
+  mask = rha->hash_size - 1;
+  slot = job_registry_hash_id(key, JOBID_MAX_LEN) & mask;
+
+  while (table[slot] != 0)
    {
-    /* Make it group writable as usual */
-    fchmod(lfd, 0664);
-    rfd = fdopen(lfd, "w"); 
+    hen = job_registry_persist_record(rha, table[slot]);
+    if (hen != NULL &&
+        strncmp(job_registry_entry_key(mode, hen), key, JOBID_MAX_LEN) == 0)
+     {
+      /* Records are inserted in append order: keep the most recent one. */
+      table[slot] = en->recnum;
+      return;
+     }
+    slot = (slot+1) & mask;
    }
+  table[slot] = en->recnum;
+  rha->hash_used[k]++;
+}
 
-  free (tp);
+/* Append one record to the posting list of its subject hash */
+static void
+job_registry_subject_insert(job_registry_handle *rha,
+                            const job_registry_entry *en)
+{
+  const job_registry_entry *hen;
+  job_registry_recnum_t off;
+  uint32_t slot, mask;
 
-  return(rfd);
+  if (en->subject_hash[0] == '\000') return;
+
+  mask = rha->hash_size - 1;
+  slot = job_registry_hash_id(en->subject_hash, 
+                              sizeof(en->subject_hash)) & mask;
+
+  while (rha->subject_slots[slot].first != 0)
+   {
+    hen = job_registry_persist_record(rha, rha->subject_slots[slot].first);
+    if (hen != NULL && strncmp(hen->subject_hash, en->subject_hash,
+                               sizeof(en->subject_hash)) == 0)
+     {
+      JOB_REGISTRY_GET_REC_OFFSET(off,rha->subject_slots[slot].last,
+                                  rha->data_map_firstrec)
+      if (off < rha->subject_chain_alloc) rha->subject_chain[off] = en->recnum;
+      rha->subject_slots[slot].last = en->recnum;
+      return;
+     }
+    slot = (slot+1) & mask;
+   }
+  rha->subject_slots[slot].first = en->recnum;
+  rha->subject_slots[slot].last = en->recnum;
 }
 
-/*
- * job_registry_append_nonpriv
- *
- * Schedule an entry for appending it into the registry. This is done
- * by writing the entry as a file in rha->npudir.
- * The entry will be appended on the first lookup done by a
- * process that owns write rights to teh registry.
- *
- * @param rha Pointer to a job registry handle returned by job_registry_init.
- * @param entry pointer to a registry entry to append to the registry.
- *
- * @return Less than zero on error. See job_registry.h for error codes.
- *         errno is also set in case of error.
- */
-int
-job_registry_append_nonpriv(job_registry_handle *rha,
-                            job_registry_entry *entry)
+/* TRUE if some key was enabled and has no hash index yet */
+static int
+job_registry_hash_pending(const job_registry_handle *rha)
 {
-    FILE *cfd;
+  int k;
 
-    cfd = job_registry_get_new_npufd(rha);
+  for (k=0; k<JOB_REGISTRY_N_HASH_KEYS; k++)
+   {
+    if ((rha->hash_keys & (1 << k)) != 0 && rha->hash_index[k] == NULL)
+      return TRUE;
+   }
+  if ((rha->hash_keys & JOB_REGISTRY_SUBJECT_KEY_BIT) != 0 && 
+      rha->subject_slots == NULL) return TRUE;
+  return FALSE;
+}
 
-    if (cfd == NULL) return JOB_REGISTRY_FOPEN_FAIL;
+/* Size the hash indexes for 'n_records' and (re)insert 'first'..'n_records' */
+/* All enabled keys are indexed in the same scan. */
+static int
+job_registry_hash_fill(job_registry_handle *rha, uint32_t first,
+                       uint32_t n_records, int rebuild)
+{
+  const job_registry_entry *en;
+  job_registry_recnum_t *new_index[JOB_REGISTRY_N_HASH_KEYS];
+  job_registry_subject_slot *new_slots = NULL;
+  job_registry_recnum_t *new_chain;
+  uint32_t new_size, i;
+  int k;
 
-    entry->magic_start = JOB_REGISTRY_MAGIC_START;
-    entry->magic_end   = JOB_REGISTRY_MAGIC_END;
-    entry->reclen = sizeof(job_registry_entry);
-    entry->cdate = entry->mdate = time(0);
+  new_size = rha->hash_size;
+  if (new_size < JOB_REGISTRY_HASH_MIN_SIZE) new_size = JOB_REGISTRY_HASH_MIN_SIZE;
+  while (new_size < 2*n_records) new_size *= 2;
 
-    /* We don't need to lock the file or to make sure some sort of atomic  */
-    /* write is made. If an incomplete entry is read, the file will be     */
-    /* left untouched and read again. */
+  if (job_registry_hash_pending(rha)) rebuild = TRUE;
 
-    if (fwrite(entry,sizeof(job_registry_entry), 1, cfd) < 1)
+  if (rebuild || new_size != rha->hash_size)
+   {
+    for (k=0; k<JOB_REGISTRY_N_HASH_KEYS; k++)
      {
-      fclose(cfd);
-      return JOB_REGISTRY_FWRITE_FAIL;
+      new_index[k] = NULL;
+      if ((rha->hash_keys & (1 << k)) == 0) continue;
+      new_index[k] = (job_registry_recnum_t *)calloc(new_size,
+                                         sizeof(job_registry_recnum_t));
+      if (new_index[k] == NULL)
+       {
+        while (--k >= 0) if (new_index[k] != NULL) free(new_index[k]);
+        errno = ENOMEM;
+        return JOB_REGISTRY_MALLOC_FAIL;
+       }
+     }
+    if ((rha->hash_keys & JOB_REGISTRY_SUBJECT_KEY_BIT) != 0)
+     {
+      new_slots = (job_registry_subject_slot *)calloc(new_size,
+                                         sizeof(job_registry_subject_slot));
+      if (new_slots == NULL)
+       {
+        for (k=0; k<JOB_REGISTRY_N_HASH_KEYS; k++)
+          if (new_index[k] != NULL) free(new_index[k]);
+        errno = ENOMEM;
+        return JOB_REGISTRY_MALLOC_FAIL;
+       }
+     }
+    for (k=0; k<JOB_REGISTRY_N_HASH_KEYS; k++)
+     {
+      if (rha->hash_index[k] != NULL) free(rha->hash_index[k]);
+      rha->hash_index[k] = new_index[k];
+      rha->hash_used[k] = 0;
      }
+    if (rha->subject_slots != NULL) free(rha->subject_slots);
+    rha->subject_slots = new_slots;
+    rha->hash_size = new_size;
+    first = 0;
+   }
 
-    fclose(cfd);
+  if (rha->subject_slots != NULL)
+   {
+    /* One posting list link per record */
+    if (n_records > rha->subject_chain_alloc)
+     {
+      new_chain = (job_registry_recnum_t *)realloc(rha->subject_chain,
+                                   n_records*sizeof(job_registry_recnum_t));
+      if (new_chain == NULL)
+       {
+        errno = ENOMEM;
+        return JOB_REGISTRY_MALLOC_FAIL;
+       }
+      rha->subject_chain = new_chain;
+      rha->subject_chain_alloc = n_records;
+     }
+    if (n_records > first)
+      memset(rha->subject_chain + first, 0, 
+             (n_records - first)*sizeof(job_registry_recnum_t));
+   }
 
-    return JOB_REGISTRY_SUCCESS;
+  for (i=first; i<n_records; i++)
+   {
+    en = (const job_registry_entry *)(rha->data_map +
+                                      i*sizeof(job_registry_entry));
+    if ( (en->magic_start != JOB_REGISTRY_MAGIC_START) ||
+         (en->magic_end   != JOB_REGISTRY_MAGIC_END) || en->recnum == 0)
+      continue;
+    for (k=0; k<JOB_REGISTRY_N_HASH_KEYS; k++)
+      if (rha->hash_index[k] != NULL) job_registry_hash_insert(rha, k, en);
+    if (rha->subject_slots != NULL) job_registry_subject_insert(rha, en);
+   }
+  return JOB_REGISTRY_SUCCESS;
 }
 
 /*
- * job_registry_merge_pending_nonpriv_updates
- *
- * Look for new entries that could not be appended to the registry
- * file due to lack of privileges and append them to the registry.
- *
- * NOTE: for non privileged updates, any check that the added entries
- *       are unique w.r.t. the current index/search key is dropped.
+ * job_registry_persist_index
  *
+ * Add a secondary key to the hash indexes of a persistent handle, so
+ * that entries can be looked up by blah_id, batch_id and user_prefix
+ * on the same handle (see job_registry_get_by), with no other handle
+ * to initialise. The handle is switched to persistent mode, if needed.
+ * All hash indexes are then rebuilt in a single scan of the mapping,
+ * and kept up to date together by job_registry_persist_revalidate.
  *
  * @param rha Pointer to a job registry handle returned by job_registry_init.
- * @param fd Stream descriptor of an open and *write* locked 
- *        registry file. The registry file will be opened and closed if
- *        fd==NULL.
+ * @param key Index mode selecting the key (BY_BLAH_ID, BY_BATCH_ID or
+ *        BY_USER_PREFIX, or their _MMAP variants).
  *
- * @return Number of added entries. Less than zero on error. 
- *         See job_registry.h for error codes.
+ * @return Less than zero on error. See job_registry.h for error codes.
  *         errno is also set in case of error.
  */
+
 int
-job_registry_merge_pending_nonpriv_updates(job_registry_handle *rha,
-                                           FILE *fd)
+job_registry_persist_index(job_registry_handle *rha,
+                           job_registry_index_mode key)
 {
-  int i;
-  int nadd = 0;
-  int rapp;
-  int frret;
-  job_registry_entry en;
-  FILE *ofd = NULL;
-  struct stat cfp_st;
-  char *cfp;
-  FILE *cfd, *npsfd;
-  DIR  *npd;
-  struct dirent *de;
-  char subline[JOB_REGISTRY_MAX_SUBJECTLIST_LINE];
-  char *sp;
-  job_registry_index_mode saved_rha_mode;
-  off_t last_end;
-  uint32_t saved_rha_lastrec;
-
-  ofd = fd;
+  int k;
 
-  npd = opendir(rha->npudir);
-  if (npd == NULL)
+  k = job_registry_hash_key_slot(key);
+  if (k < 0)
    {
-    return JOB_REGISTRY_OPENDIR_FAIL; 
+    errno = EINVAL;
+    return JOB_REGISTRY_NO_INDEX;
    }
-  
-  saved_rha_mode = rha->mode;
-  saved_rha_lastrec = rha->lastrec;
+  if ((rha->hash_keys & (1 << k)) != 0 && rha->persist_fd >= 0)
+    return JOB_REGISTRY_SUCCESS;
 
-  while ((de = readdir(npd)) != NULL) 
-   {
-    cfp = (char *)malloc(strlen(rha->npudir)+strlen(de->d_name)+2);
-    if (cfp != NULL)
-     {
-      sprintf(cfp,"%s/%s",rha->npudir,de->d_name);
-      if (stat(cfp, &cfp_st) < 0)   { free(cfp); continue; }
-      if (!S_ISREG(cfp_st.st_mode)) { free(cfp); continue; }
-      cfd = fopen(cfp, "r");
-      if (cfd == NULL) continue;
+  rha->hash_keys |= (1 << k);
+  if (rha->persist_fd < 0) return job_registry_persist(rha);
 
-      frret = job_registry_probe_next_record(cfd, &en);
-      if (frret == 0)
-       {
-        /* Can't get anything out of this file. It could be in the  */
-        /* process of being written */
-        fclose(cfd);
-        /* Get rid of the file only if it was last modified "long" time ago */
-        if ((time(0) - cfp_st.st_mtime) > 
-            JOB_REGISTRY_CORRUPTED_NPU_FILES_MAX_LIFETIME) 
-          unlink(cfp);
-        free(cfp);
-        continue;
-       }
+  /* The new table is filled by revalidation */
+  return job_registry_persist_revalidate(rha);
+}
+
+/*
+ * job_registry_persist_revalidate
+ *
+ * Check whether the registry file underlying a persistent handle
+ * changed (a single stat call) and, if so, remap it and update the hash
+ * indexes. Only newly appended records are indexed, unless the file was
+ * replaced or its first record changed (registry purge), in which case
+ * the index is rebuilt.
+ *
+ * @param rha Pointer to a job registry handle in persistent mode.
+ *
+ * @return Less than zero on error. Zero on unchanged registry. Greater than 0
+ *         if registry changed, See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
 
-      fclose(cfd);
-      if (ofd == NULL)
-       {
-        /* Open file and writelock it */
-        /* Don't user job_registry_open, as we get called from */
-        /* within it. */
+int
+job_registry_persist_revalidate(job_registry_handle *rha)
+{
+  struct stat st;
+  struct flock rlock;
+  int rebuild = FALSE;
+  int nfd, ret;
+  uint32_t old_records, n_records;
+  const job_registry_entry *first;
 
-        ofd = fopen(rha->path,"a+");
-        if (ofd == NULL) return JOB_REGISTRY_FOPEN_FAIL;
+  if (rha->persist_fd < 0)
+   {
+    errno = EINVAL;
+    return JOB_REGISTRY_FAIL;
+   }
 
-        if (job_registry_wrlock(rha,ofd) < 0)
-         {
-          free(cfp);
-          fclose(ofd);
-          closedir(npd);
-          return JOB_REGISTRY_FLOCK_FAIL;
-         }
-        /* Append nonpriv entries with no further check */
-        job_registry_resync(rha, ofd);
-        saved_rha_lastrec = rha->lastrec;
-        rha->mode = NO_INDEX;
-       }
+  if (stat(rha->path, &st) < 0) return JOB_REGISTRY_STAT_FAIL;
 
-      fseek(ofd, 0L, SEEK_END);
-      last_end = ftell(ofd);
-      /* Use the file mtime as event creation timestamp */
-      if ((rapp = job_registry_append_op(rha, &en, ofd, cfp_st.st_mtime)) < 0) 
-       {
-        free(cfp);
-        rha->mode = saved_rha_mode;
-        rha->lastrec = saved_rha_lastrec;
-        job_registry_resync(rha, ofd);
-        if (fd == NULL && ofd != NULL) fclose(ofd);
-        closedir(npd);
-        return rapp;
-       }
-      else
-       {
-        /* With no entry uniqueness check, failing to unlink the */
-        /* NPU file becomes a consistency error we have to avoid. */
-        if (unlink(cfp) < 0)
-         {
-          free(cfp);
-          /* Undo the append while we still hold a write lock */
-          ftruncate(fileno(ofd), last_end);
-          rha->mode = saved_rha_mode;
-          rha->lastrec = saved_rha_lastrec;
-          job_registry_resync(rha, ofd);
-          if (fd == NULL && ofd != NULL) fclose(ofd);
-          closedir(npd);
-          return JOB_REGISTRY_UNLINK_FAIL;
-         }
-        nadd++;
-       }
-      free(cfp);
-     }
+  if (st.st_ino != rha->data_map_ino)
+   {
+    /* The registry file was replaced. Reopen it. */
+    nfd = open(rha->path, O_RDONLY);
+    if (nfd < 0) return JOB_REGISTRY_FOPEN_FAIL;
+    close(rha->persist_fd);
+    rha->persist_fd = nfd;
+    rebuild = TRUE;
    }
-  closedir(npd);
-  /* Resync before (possibly) dropping the write lock */
-  if (ofd != NULL)
+  else if (st.st_size == rha->data_map_length &&
+           !job_registry_hash_pending(rha)) return JOB_REGISTRY_SUCCESS;
+
+  rlock.l_type = F_RDLCK;
+  rlock.l_whence = SEEK_SET;
+  rlock.l_start = 0;
+  rlock.l_len = 0; /* Lock whole file */
+  if (fcntl(rha->persist_fd, F_SETLKW, &rlock) < 0) return JOB_REGISTRY_FLOCK_FAIL;
+
+  /* Get the size under lock. Only whole records are mapped. */
+  if (fstat(rha->persist_fd, &st) < 0)
    {
-    rha->mode = saved_rha_mode;
-    rha->lastrec = saved_rha_lastrec;
-    job_registry_resync(rha, ofd);
+    job_registry_unlock_fd(rha->persist_fd);
+    return JOB_REGISTRY_STAT_FAIL;
    }
-  if (fd == NULL && ofd != NULL) fclose(ofd);
 
-  if (nadd > 0)
+  old_records = rha->data_map_length/sizeof(job_registry_entry);
+  n_records = st.st_size/sizeof(job_registry_entry);
+
+  if (rha->data_map != NULL) munmap(rha->data_map, rha->data_map_length);
+  rha->data_map = NULL;
+  rha->data_map_length = 0;
+  rha->data_map_ino = st.st_ino;
+  rha->scan_buf_n = 0;
+
+  if (n_records > 0)
    {
-    /* Try merging the non-privileged subject list, if any */
-    npsfd = fopen(rha->npusubjectlist, "r+");
-    if (npsfd != NULL && job_registry_wrlock(rha,npsfd) >= 0)
+    rha->data_map = mmap(0, n_records*sizeof(job_registry_entry), PROT_READ,
+                         MAP_SHARED, rha->persist_fd, 0);
+    if (rha->data_map == MAP_FAILED)
      {
-      while (!feof(npsfd))
-       {
-        if (fgets(subline, sizeof(subline), npsfd) != NULL)
-         {
-          sp = strchr(subline, ' ');
-          if (sp == NULL) continue;
-          *sp = '\000';
-          sp++;
-          if (sp[strlen(sp)-1] == '\n') sp[strlen(sp)-1] = '\000';
-          job_registry_record_subject_hash(rha, subline, sp, FALSE);
-         }
-       }
-      unlink(rha->npusubjectlist);
+      rha->data_map = NULL;
+      rha->data_map_ino = 0;
+      job_registry_unlock_fd(rha->persist_fd);
+      return JOB_REGISTRY_MMAP_FAIL;
      }
-    if (npsfd != NULL) fclose(npsfd);
+    rha->data_map_length = n_records*sizeof(job_registry_entry);
+
+    first = (const job_registry_entry *)rha->data_map;
+    if (first->recnum != rha->data_map_firstrec) rebuild = TRUE;
+    rha->data_map_firstrec = first->recnum;
    }
+  else rebuild = TRUE;
 
-  return nadd;
+  if (n_records < old_records) rebuild = TRUE;
+
+  ret = job_registry_hash_fill(rha, old_records, n_records, rebuild);
+
+  job_registry_unlock_fd(rha->persist_fd);
+
+  if (ret < 0) return ret;
+  return JOB_REGISTRY_CHANGED;
 }
 
 /*
- * job_registry_update
- * job_registry_update_select
- * job_registry_update_recn
- * job_registry_update_recn_select
- * job_registry_update_op
+ * job_registry_hash_lookup
+ * job_registry_hash_lookup_by
  *
- * Update an existing entry in the job registry pointed to by rha.
- * Will return JOB_REGISTRY_NOT_FOUND if the entry does not exist.
- * job_registry_update will cause job_registry_update_op to open, (write) lock 
- * and close the registry file, while job_registry_update_op will work
- * on a file that's aleady open and writelocked.
+ * Look up an ID in the hash index of a persistent job registry handle.
+ * No file access is required. The most recent record is returned in case
+ * of duplicate IDs. job_registry_hash_lookup uses the handle key,
+ * job_registry_hash_lookup_by any key that was hash-indexed 
+ * (see job_registry_persist_index).
  *
- * @param rha Pointer to a job registry handle returned by job_registry_init.
- * @param entry pointer to a registry entry with values to be
- *        updated into the registry.
- *        The values of udate, status, exitcode, exitreason, wn_addr
- *        and updater_info will be used for the update.
- *        The entry is updated with the actual registry contents upon
- *        successful return.
- * @param recn Cause an update of the specified record number.
- * @param use_recn If TRUE use the recnum field in 'entry' instead 
- *        of an index lookup operation.
- * @param fd Stream descriptor of an open (for write) and writelocked 
- *        registry file. The file will be opened and closed if fd==NULL.
- * @param upbits Bitmask selecting which registry fields should get updated by
- *        job_registry_update_op. Or'ed combination of the following:
- *         - JOB_REGISTRY_UPDATE_WN_ADDR 
- *         - JOB_REGISTRY_UPDATE_STATUS  
- *         - JOB_REGISTRY_UPDATE_EXITCODE 
- *         - JOB_REGISTRY_UPDATE_UDATE 
- *         - JOB_REGISTRY_UPDATE_EXITREASON 
- *         - JOB_REGISTRY_UPDATE_UPDATER_INFO
- *         or JOB_REGISTRY_UPDATE_ALL for all of the above fields.
+ * @param rha Pointer to a job registry handle in persistent mode.
+ * @param key Index mode selecting the key to search.
+ * @param id Job id key to be looked up 
  *
- * @return Less than zero on error. See job_registry.h for error codes.
- *         errno is also set in case of error. JOB_REGISTRY_UNCHANGED (>0)
- *         is returned if the update operation caused no change. 
+ * @return Record number of the found record, or 0 if the record was not found.
  */
 
-int
-job_registry_update_select(job_registry_handle *rha,
-                           job_registry_entry *entry,
-                           job_registry_update_bitmask_t upbits)
+job_registry_recnum_t
+job_registry_hash_lookup(const job_registry_handle *rha,
+                         const char *id)
 {
-  return job_registry_update_op(rha, entry, FALSE, NULL, upbits);
+  return job_registry_hash_lookup_by(rha, rha->mode, id);
 }
 
-int
-job_registry_update(job_registry_handle *rha,
-                    job_registry_entry *entry)
+job_registry_recnum_t
+job_registry_hash_lookup_by(const job_registry_handle *rha,
+                            job_registry_index_mode key,
+                            const char *id)
 {
-  return job_registry_update_op(rha, entry, FALSE, NULL, JOB_REGISTRY_UPDATE_ALL);
-}
+  const job_registry_entry *hen;
+  const job_registry_recnum_t *table;
+  uint32_t slot, mask;
+  int k;
 
-int
-job_registry_update_recn_select(job_registry_handle *rha,
-                           job_registry_entry *entry,
-                           job_registry_recnum_t recn,
-                           job_registry_update_bitmask_t upbits)
-{
-  entry->recnum = recn;
-  return job_registry_update_op(rha, entry, TRUE, NULL, upbits);
+  if ((k = job_registry_hash_key_slot(key)) < 0) return 0;
+  table = rha->hash_index[k];
+  if (table == NULL || id == NULL) return 0;
+
+  mask = rha->hash_size - 1;
+  slot = job_registry_hash_id(id, JOBID_MAX_LEN) & mask;
+
+  while (table[slot] != 0)
+   {
+    hen = job_registry_persist_record(rha, table[slot]);
+    if (hen != NULL &&
+        strncmp(job_registry_entry_key(key, hen), id, JOBID_MAX_LEN) == 0)
+      return table[slot];
+    slot = (slot+1) & mask;
+   }
+  return 0;
 }
 
-int
-job_registry_update_recn(job_registry_handle *rha,
-                         job_registry_entry *entry,
-                         job_registry_recnum_t recn)
+/*
+ * job_registry_persist_get
+ * job_registry_persist_get_by
+ *
+ * Fetch an entry from a persistent job registry handle. Only the
+ * registry file status is checked and the record region is read-locked
+ * while it's copied out of the mapping: no file is opened.
+ * job_registry_persist_get_by searches any hash-indexed key.
+ *
+ * @param rha Pointer to a job registry handle in persistent mode.
+ * @param key Index mode selecting the key to search.
+ * @param id Job id key to be looked up 
+ *
+ * @return Dynamically allocated registry entry. Needs to be free'd.
+ *         NULL (and errno set) if not found or in case of error.
+ */
+
+job_registry_entry *
+job_registry_persist_get(job_registry_handle *rha,
+                         const char *id)
 {
-  entry->recnum = recn;
-  return job_registry_update_op(rha, entry, TRUE, NULL, JOB_REGISTRY_UPDATE_ALL);
+  return job_registry_persist_get_by(rha, rha->mode, id);
 }
 
-int
-job_registry_update_op(job_registry_handle *rha,
-                       job_registry_entry *entry, int use_recn, FILE *fd,
-                       job_registry_update_bitmask_t upbits)
+job_registry_entry *
+job_registry_persist_get_by(job_registry_handle *rha,
+                            job_registry_index_mode key,
+                            const char *id)
 {
-  job_registry_recnum_t found, firstrec, req_recn;
-  job_registry_entry old_entry;
-  int need_to_fclose = FALSE;
-  int need_to_update = FALSE;
-  int update_binfo_only = TRUE;
-  int retcod;
+  job_registry_recnum_t found, req_recn;
+  const job_registry_entry *ren;
+  job_registry_entry *entry;
+  struct flock rlock;
+  struct stat st;
+  uint64_t seq;
+  int tries, copied;
 
-  if (use_recn)
+  if (rha->persist_fd < 0)
    {
-    found = entry->recnum;
+    errno = EINVAL;
+    return NULL;
    }
-  else
+  if (job_registry_persist_revalidate(rha) < 0) return NULL;
+
+  found = job_registry_hash_lookup_by(rha, key, id);
+  if (found == 0)
    {
-    if (rha->mode == NO_INDEX)
-      return JOB_REGISTRY_NO_INDEX;
-    else if (rha->mode == BY_BLAH_ID) 
-      found = job_registry_lookup_op(rha, entry->blah_id, fd);
-    else if (rha->mode == BY_USER_PREFIX) 
-      found = job_registry_lookup_op(rha, entry->user_prefix, fd);
-    else
-      found = job_registry_lookup_op(rha, entry->batch_id, fd);
-    if (found == 0)
-     {
-      return JOB_REGISTRY_NOT_FOUND;
-     }
+    errno = ENOENT;
+    return NULL;
    }
 
-  if (fd == NULL)
+  entry = (job_registry_entry *)malloc(sizeof(job_registry_entry));
+  if (entry == NULL)
    {
-    /* Open file, writelock it and replace entry */
+    errno = ENOMEM;
+    return NULL;
+   }
 
-    fd = job_registry_open(rha,"r+");
-    if (fd == NULL) return JOB_REGISTRY_FOPEN_FAIL;
+  JOB_REGISTRY_GET_REC_OFFSET(req_recn,found,rha->data_map_firstrec)
 
-    if (job_registry_wrlock(rha,fd) < 0)
+  rlock.l_type = F_RDLCK;
+  rlock.l_whence = SEEK_SET;
+  rlock.l_start = (off_t)req_recn*sizeof(job_registry_entry);
+  rlock.l_len = sizeof(job_registry_entry);
+
+  /* Lock-free copy first, validated by the shared sequence counter */
+  copied = FALSE;
+  for (tries = 0; job_registry_seq_trusted(rha) &&
+                  tries < JOB_REGISTRY_SEQLOCK_RETRIES; tries++)
+   {
+    if (!job_registry_seq_read_begin(rha, &seq))
      {
-      fclose(fd);
-      return JOB_REGISTRY_FLOCK_FAIL;
+      sched_yield();
+      continue;
+     }
+    /* pread() rather than the mapping, which faults past the end */
+    /* of a file truncated meanwhile */
+    if ((ren = job_registry_persist_record(rha, found)) == NULL ||
+        pread(rha->persist_fd, entry, sizeof(job_registry_entry),
+              rlock.l_start) != sizeof(job_registry_entry)) break;
+    if (job_registry_seq_read_valid(rha, seq))
+     {
+      copied = TRUE;
+      break;
      }
-    need_to_fclose = TRUE;
    }
 
-  firstrec = job_registry_firstrec(rha,fd);
-  /* Was this record just purged ? */
-  if ((firstrec > rha->firstrec) && (found >= rha->firstrec) && (found < firstrec))
+  if (!copied)
    {
-    if (need_to_fclose) fclose(fd);
-    return JOB_REGISTRY_NOT_FOUND;
+    if (fcntl(rha->persist_fd, F_SETLKW, &rlock) < 0)
+     {
+      free(entry);
+      return NULL;
+     }
+
+    /* Make sure the record is still there before touching the mapping */
+    if (fstat(rha->persist_fd, &st) < 0 ||
+        st.st_size < rlock.l_start + (off_t)sizeof(job_registry_entry) ||
+        (ren = job_registry_persist_record(rha, found)) == NULL)
+      ren = NULL;
+    else memcpy(entry, ren, sizeof(job_registry_entry));
+
+    rlock.l_type = F_UNLCK;
+    fcntl(rha->persist_fd, F_SETLKW, &rlock);
    }
-  JOB_REGISTRY_GET_REC_OFFSET(req_recn,found,firstrec)
-  
-  if (fseek(fd, (long)(req_recn*sizeof(job_registry_entry)), SEEK_SET) < 0)
+
+  if (ren == NULL)
    {
-    if (need_to_fclose) fclose(fd);
-    return JOB_REGISTRY_FSEEK_FAIL;
+    free(entry);
+    errno = ENOENT;
+    return NULL;
    }
-  if (fread(&old_entry, sizeof(job_registry_entry),1,fd) < 1)
+
+  if ( (entry->magic_start != JOB_REGISTRY_MAGIC_START) ||
+       (entry->magic_end   != JOB_REGISTRY_MAGIC_END) ||
+       (entry->recnum != found) )
    {
-    if (need_to_fclose) fclose(fd);
-    return JOB_REGISTRY_FREAD_FAIL;
+    errno = EBADMSG;
+    free(entry);
+    return NULL;
    }
-  if (old_entry.recnum != found)
+  return entry;
+}
+
+/*
+ * job_registry_get_by
+ *
+ * Fetch the most recent entry with a given blah_id, batch_id or 
+ * user_prefix from a job registry handle, whatever key the handle was
+ * initialised with. The handle is switched to persistent mode and the
+ * key is hash-indexed on first use (see job_registry_persist_index).
+ * If the entry is not found, pending non-privileged updates are merged
+ * and the lookup is retried once.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param key Index mode selecting the key to search (BY_BLAH_ID, 
+ *        BY_BATCH_ID or BY_USER_PREFIX).
+ * @param id Job id key to be looked up 
+ *
+ * @return Dynamically allocated registry entry. Needs to be free'd.
+ *         NULL (and errno set) if not found or in case of error.
+ */
+
+job_registry_entry *
+job_registry_get_by(job_registry_handle *rha,
+                    job_registry_index_mode key,
+                    const char *id)
+{
+  job_registry_entry *entry;
+
+  if (job_registry_persist_index(rha, key) < 0) return NULL;
+
+  entry = job_registry_persist_get_by(rha, key, id);
+  if (entry == NULL && errno == ENOENT &&
+      job_registry_merge_pending_nonpriv_updates(rha, NULL) > 0)
    {
-    errno = EBADMSG;
-    if (need_to_fclose) fclose(fd);
-    return JOB_REGISTRY_BAD_RECNUM;
+    entry = job_registry_persist_get_by(rha, key, id);
    }
-  if (fseek(fd, (long)(req_recn*sizeof(job_registry_entry)), SEEK_SET) < 0)
+  return entry;
+}
+
+/* Start of a mapped scan: see job_registry_get_next_mapped */
+static int
+job_registry_mapped_scan_start(job_registry_handle *rha)
+{
+  rha->scan_buf_n = 0;
+  job_registry_merge_pending_nonpriv_updates(rha, NULL);
+  if (rha->persist_fd < 0) return job_registry_persist(rha);
+  return job_registry_persist_revalidate(rha);
+}
+
+/*
+ * job_registry_mapped_copy
+ *
+ * Copy records out of the registry mapping, making sure that none of
+ * them is caught while being rewritten: the copy is validated by the
+ * sequence counter or, if the counter can't be trusted (or keeps
+ * changing), made under a read lock on the copied records. Records
+ * are read with pread() when no lock is held, as the file can be
+ * truncated meanwhile.
+ *
+ * @param rha Pointer to a persistent job registry handle.
+ * @param off Offset (in records) of the first record to copy.
+ * @param n_recs Number of records to copy.
+ * @param dest Destination buffer for 'n_recs' records.
+ *
+ * @return Number of records copied: fewer than 'n_recs' if the registry
+ *         file shrank meanwhile. Less than zero on error.
+ */
+
+static int
+job_registry_mapped_copy(const job_registry_handle *rha,
+                         job_registry_recnum_t off, int n_recs,
+                         job_registry_entry *dest)
+{
+  struct flock rlock;
+  struct stat st;
+  uint64_t seq;
+  off_t n_avail;
+  ssize_t rret;
+  int tries, n;
+
+  n_avail = rha->data_map_length/sizeof(job_registry_entry) - (off_t)off;
+  if (n_avail < n_recs) n_recs = n_avail;
+  if (n_recs <= 0) return 0;
+
+  for (tries = 0; job_registry_seq_trusted(rha) &&
+                  tries < JOB_REGISTRY_SEQLOCK_RETRIES; tries++)
    {
-    if (need_to_fclose) fclose(fd);
-    return JOB_REGISTRY_FSEEK_FAIL;
+    if (!job_registry_seq_read_begin(rha, &seq))
+     {
+      sched_yield();
+      continue;
+     }
+    /* Read from the file, not the mapping: pages past the end of a */
+    /* file truncated meanwhile would fault. */
+    rret = pread(rha->persist_fd, dest, n_recs*sizeof(job_registry_entry),
+                 (off_t)off*sizeof(job_registry_entry));
+    if (rret < 0) break;
+    if (job_registry_seq_read_valid(rha, seq))
+      return rret/sizeof(job_registry_entry);
    }
 
-  /* Update original entry and rewrite it */
-  /* Warning: these checks should all be mirrored in job_registry_need_update */
-  /*          below */
-  if (((upbits & JOB_REGISTRY_UPDATE_WN_ADDR) != 0) &&
-      (strncmp(old_entry.wn_addr, entry->wn_addr, 
-               sizeof(old_entry.wn_addr)) != 0))
+  rlock.l_type = F_RDLCK;
+  rlock.l_whence = SEEK_SET;
+  rlock.l_start = (off_t)off*sizeof(job_registry_entry);
+  rlock.l_len = n_recs*sizeof(job_registry_entry);
+  if (fcntl(rha->persist_fd, F_SETLKW, &rlock) < 0)
+    return JOB_REGISTRY_FLOCK_FAIL;
+
+  if (fstat(rha->persist_fd, &st) < 0) n = JOB_REGISTRY_STAT_FAIL;
+  else
    {
-    JOB_REGISTRY_ASSIGN_ENTRY(old_entry.wn_addr, entry->wn_addr);
-    need_to_update = TRUE;
-    update_binfo_only = FALSE;
+    n_avail = st.st_size/sizeof(job_registry_entry) - (off_t)off;
+    n = (n_avail < n_recs) ? n_avail : n_recs;
+    if (n < 0) n = 0;
+    if (n > 0)
+      memcpy(dest, rha->data_map + (off_t)off*sizeof(job_registry_entry),
+             n*sizeof(job_registry_entry));
    }
-  if (((upbits & JOB_REGISTRY_UPDATE_STATUS) != 0) &&
-       (old_entry.status != entry->status))
+
+  rlock.l_type = F_UNLCK;
+  fcntl(rha->persist_fd, F_SETLKW, &rlock);
+  return n;
+}
+
+/* Buffer for the copies returned by mapped scans, allocated on first use */
+static job_registry_entry *
+job_registry_scan_buf(job_registry_handle *rha)
+{
+  if (rha->scan_buf == NULL)
    {
-    old_entry.status = entry->status;
-    need_to_update = TRUE;
-    update_binfo_only = FALSE;
+    rha->scan_buf = (job_registry_entry *)malloc(JOB_REGISTRY_SCAN_BATCH *
+                                                 sizeof(job_registry_entry));
+    if (rha->scan_buf == NULL) errno = ENOMEM;
+    rha->scan_buf_n = 0;
    }
-  if (((upbits & JOB_REGISTRY_UPDATE_EXITCODE) != 0) &&
-       (old_entry.exitcode != entry->exitcode))
+  return rha->scan_buf;
+}
+
+/* Copy of the mapped record at *cursor, which is then advanced. */
+/* Records are copied JOB_REGISTRY_SCAN_BATCH at a time. */
+static const job_registry_entry *
+job_registry_get_mapped_at(job_registry_handle *rha,
+                           job_registry_recnum_t *cursor)
+{
+  const job_registry_entry *ren;
+  job_registry_recnum_t curr_recn;
+  int ret;
+
+  if ((off_t)(*cursor+1)*sizeof(job_registry_entry) > rha->data_map_length)
+    return NULL;
+
+  if (*cursor < rha->scan_buf_first ||
+      *cursor >= rha->scan_buf_first + rha->scan_buf_n)
    {
-    old_entry.exitcode = entry->exitcode;
-    need_to_update = TRUE;
-    update_binfo_only = FALSE;
+    if (job_registry_scan_buf(rha) == NULL) return NULL;
+    rha->scan_buf_n = 0;
+    ret = job_registry_mapped_copy(rha, *cursor, JOB_REGISTRY_SCAN_BATCH,
+                                   rha->scan_buf);
+    if (ret <= 0) return NULL;
+    rha->scan_buf_first = *cursor;
+    rha->scan_buf_n = ret;
    }
-  if (((upbits & JOB_REGISTRY_UPDATE_UDATE) != 0) &&
-       (old_entry.udate != entry->udate))
+
+  ren = rha->scan_buf + (*cursor - rha->scan_buf_first);
+  if ( (ren->magic_start != JOB_REGISTRY_MAGIC_START) ||
+       (ren->magic_end   != JOB_REGISTRY_MAGIC_END) )
    {
-    old_entry.udate = entry->udate;
-    need_to_update = TRUE;
-    update_binfo_only = FALSE;
+    errno = ENOMSG;
+    return NULL;
    }
-  if (((upbits & JOB_REGISTRY_UPDATE_EXITREASON) != 0) &&
-       (strncmp(old_entry.exitreason, entry->exitreason, 
-                sizeof(old_entry.exitreason)) != 0))
+  /* Keep checking file consistency */
+  /* (correspondence of file offset and record num) */
+  JOB_REGISTRY_GET_REC_OFFSET(curr_recn,ren->recnum,rha->data_map_firstrec)
+  if (curr_recn != *cursor)
    {
-    JOB_REGISTRY_ASSIGN_ENTRY(old_entry.exitreason, entry->exitreason);
-    need_to_update = TRUE;
-    update_binfo_only = FALSE;
+    errno = EBADMSG;
+    return NULL;
    }
-  if (((upbits & JOB_REGISTRY_UPDATE_UPDATER_INFO) != 0) &&
-       (strncmp(old_entry.updater_info, entry->updater_info, 
-                sizeof(old_entry.updater_info)) != 0))
+
+  (*cursor)++;
+  return ren;
+}
+
+/*
+ * job_registry_get_next_mapped
+ *
+ * Iterate over the registry entries of a persistent handle, with no
+ * allocation and no registry lock held by the caller: the entries are
+ * copied out of the read-only mapping of the registry file a batch at a
+ * time, into a buffer of the handle. Each batch is validated by the
+ * registry sequence counter, or copied under a read lock on its records
+ * (see job_registry_mapped_copy), so no entry is seen half-rewritten.
+ * When *cursor is zero (start of a scan) any pending non-privileged
+ * update is merged (as job_registry_open would do), the handle is switched
+ * to persistent mode if needed and the mapping is revalidated.
+ * The mapping is not remapped during the rest of the scan.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param cursor Pointer to the scan position. Must be set to zero
+ *        to start a scan. Updated at every call.
+ *
+ * @return Pointer to a copy of the registry entry, or NULL at the
+ *         end of the registry (or in case of error, with errno set).
+ *         The pointer stays valid until the next scan call on the handle
+ *         (job_registry_get_next_mapped, job_registry_get_next_mapped_since
+ *         or job_registry_get_next_changed).
+ */
+
+const job_registry_entry *
+job_registry_get_next_mapped(job_registry_handle *rha,
+                             job_registry_recnum_t *cursor)
+{
+  if (*cursor == 0 && job_registry_mapped_scan_start(rha) < 0) return NULL;
+
+  return job_registry_get_mapped_at(rha, cursor);
+}
+
+/*
+ * job_registry_get_next_mapped_since
+ *
+ * Same as job_registry_get_next_mapped, but skips whole segments of the
+ * registry where no entry was modified at or after 'since', as recorded
+ * in the segment summary file. Entries older than 'since' can still be
+ * returned from the segments that are not skipped, so callers have to
+ * keep checking mdate. If no valid summary is found, the whole registry
+ * is scanned.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param cursor Pointer to the scan position. Must be set to zero
+ *        to start a scan. Updated at every call.
+ * @param since Oldest modification date of interest.
+ *
+ * @return Pointer to a copy of the registry entry, or NULL at the
+ *         end of the registry (see job_registry_get_next_mapped).
+ */
+
+const job_registry_entry *
+job_registry_get_next_mapped_since(job_registry_handle *rha,
+                                   job_registry_recnum_t *cursor,
+                                   time_t since)
+{
+  uint32_t seg;
+
+  if (*cursor == 0)
    {
-    JOB_REGISTRY_ASSIGN_ENTRY(old_entry.updater_info, entry->updater_info);
-    need_to_update = TRUE;
+    if (job_registry_mapped_scan_start(rha) < 0) return NULL;
+    job_registry_segments_load(rha);
    }
-  else update_binfo_only = FALSE;
-
-  retcod = JOB_REGISTRY_UNCHANGED;
 
-  if (need_to_update)
+  for (;;)
    {
-    if (! update_binfo_only) old_entry.mdate = time(0);
-  
-    if (fwrite(&old_entry, sizeof(job_registry_entry),1,fd) < 1)
-     {
-      if (need_to_fclose) fclose(fd);
-      return JOB_REGISTRY_FWRITE_FAIL;
-     }
-    else
-     {
-      if (update_binfo_only) retcod = JOB_REGISTRY_BINFO_ONLY;
-      else                   retcod = JOB_REGISTRY_SUCCESS;
-     }
+    seg = *cursor/JOB_REGISTRY_SEGMENT_RECORDS;
+    if (seg >= rha->n_segments || rha->segment_mdate[seg] >= since) break;
+    *cursor = (seg + 1)*JOB_REGISTRY_SEGMENT_RECORDS;
    }
 
-  if (need_to_fclose) fclose(fd);
+  return job_registry_get_mapped_at(rha, cursor);
+}
 
-  /* Update entry contents with actual registry entry */
-  memcpy(entry, &old_entry, sizeof(job_registry_entry));
+/* Ascending order of record numbers */
+static int
+job_registry_recnum_compare(const void *a, const void *b)
+{
+  job_registry_recnum_t ra = *(const job_registry_recnum_t *)a;
+  job_registry_recnum_t rb = *(const job_registry_recnum_t *)b;
 
-  return retcod;
+  if (ra < rb) return -1;
+  if (ra > rb) return 1;
+  return 0;
 }
 
 /*
- * job_registry_need_update
+ * job_registry_changes_since
  *
- * Check two job registry entries, an 'old' and a 'new' one, and
- * check whether job_registry_update would need to actually write
- * an update to disk. This function is meant to save the unneeded
- * acquisition of a write lock.
+ * Collect the records changed since the previous call with the same
+ * cursor, as found in the change journal of the registry. The handle is
+ * switched to persistent mode (or revalidated) and the changed records
+ * can then be visited with job_registry_get_next_changed.
+ * Journal entries with an mdate at or after 'until', or for records
+ * appended after the registry was mapped, are left for the next call.
  *
- * @param olde pointer to an existing registry entry.
- * @param newe pointer to a possibly updated registry entry.
- * @param upbits Bitmask selecting which registry fields should be
- *               checked. Or'ed combination of the following:
- *         - JOB_REGISTRY_UPDATE_WN_ADDR 
- *         - JOB_REGISTRY_UPDATE_STATUS  
- *         - JOB_REGISTRY_UPDATE_EXITCODE 
- *         - JOB_REGISTRY_UPDATE_UDATE 
- *         - JOB_REGISTRY_UPDATE_EXITREASON 
- *         - JOB_REGISTRY_UPDATE_UPDATER_INFO
- *         or JOB_REGISTRY_UPDATE_ALL for all of the above fields.
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param cursor Pointer to the journal position. Zero it before the first
+ *        call. Updated at every call.
+ * @param until Journal entries this recent or more are not consumed.
  *
- * @return Boolean valued integer. TRUE (nonzero) if an update is
- *         actually needed.
+ * @return Number of changed records, or JOB_REGISTRY_CHANGES_RESET if
+ *         the journal cannot tell what changed since the cursor position
+ *         (first call, journal restarted, registry purged, journal not
+ *         writable by all registry writers): the caller
+ *         should then scan the whole registry. The cursor is positioned
+ *         for the next call in either case. Other values less than zero
+ *         are errors (see job_registry.h).
  */
 
 int
-job_registry_need_update(const job_registry_entry *olde,
-                         const job_registry_entry *newe,
-                         job_registry_update_bitmask_t upbits)
+job_registry_changes_since(job_registry_handle *rha,
+                           job_registry_changes_cursor *cursor,
+                           time_t until)
 {
-  int need_to_update = FALSE;
+  job_registry_changes_header hdr, check;
+  job_registry_change chg[JOB_REGISTRY_CHANGES_CHUNK];
+  job_registry_recnum_t *new_changed;
+  job_registry_recnum_t off, n_mapped;
+  off_t pos, pending = -1;
+  struct stat cst, rst;
+  ssize_t rret;
+  int i, n_read;
+  int reset = FALSE;
+  int ret, cfd;
 
-  if (((upbits & JOB_REGISTRY_UPDATE_WN_ADDR) != 0) &&
-      (strncmp(olde->wn_addr, newe->wn_addr, 
-               sizeof(olde->wn_addr)) != 0))
+  rha->n_changed = 0;
+  if ((ret = job_registry_mapped_scan_start(rha)) < 0) return ret;
+
+  n_mapped = rha->data_map_length/sizeof(job_registry_entry);
+
+  cfd = rha->changes_fd;
+  if (cfd < 0 && (cfd = open(rha->changesfile, O_RDONLY)) < 0)
    {
-    need_to_update = TRUE;
+    memset(cursor, 0, sizeof(job_registry_changes_cursor));
+    return JOB_REGISTRY_CHANGES_RESET;
    }
-  if (((upbits & JOB_REGISTRY_UPDATE_STATUS) != 0) &&
-       (olde->status != newe->status))
+
+  if (pread(cfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != JOB_REGISTRY_CHANGES_MAGIC ||
+      hdr.version != JOB_REGISTRY_CHANGES_VERSION ||
+      hdr.firstrec != rha->data_map_firstrec ||
+      hdr.registry_ino != (uint64_t)rha->data_map_ino ||
+      fstat(cfd, &cst) < 0 || fstat(rha->persist_fd, &rst) < 0 ||
+      !job_registry_seqlock_covers(&rst, &cst))
    {
-    need_to_update = TRUE;
+    /* No journal for this registry file yet, or one that some */
+    /* registry writers can't append to */
+    if (cfd != rha->changes_fd) close(cfd);
+    memset(cursor, 0, sizeof(job_registry_changes_cursor));
+    return JOB_REGISTRY_CHANGES_RESET;
    }
-  if (((upbits & JOB_REGISTRY_UPDATE_EXITCODE) != 0) &&
-       (olde->exitcode != newe->exitcode))
+
+  if (hdr.generation != cursor->generation || 
+      cursor->offset < (off_t)sizeof(hdr))
    {
-    need_to_update = TRUE;
+    reset = TRUE;
+    cursor->generation = hdr.generation;
+    cursor->offset = sizeof(hdr);
    }
-  if (((upbits & JOB_REGISTRY_UPDATE_UDATE) != 0) &&
-       (olde->udate != newe->udate))
+
+  for (pos = cursor->offset; ; pos += n_read*sizeof(job_registry_change))
    {
-    need_to_update = TRUE;
+    rret = pread(cfd, chg, sizeof(chg), pos);
+    if (rret < 0)
+     {
+      if (cfd != rha->changes_fd) close(cfd);
+      return JOB_REGISTRY_FREAD_FAIL;
+     }
+    n_read = rret/sizeof(job_registry_change);
+    if (n_read == 0) break;
+
+    for (i = 0; i < n_read; i++)
+     {
+      /* Records not mapped yet are left for the next call as well */
+      JOB_REGISTRY_GET_REC_OFFSET(off,chg[i].recnum,rha->data_map_firstrec)
+      if (chg[i].mdate >= until || off >= n_mapped)
+       {
+        if (pending < 0) pending = pos + i*sizeof(job_registry_change);
+        continue;
+       }
+      if (reset) continue;
+      if (rha->n_changed >= rha->n_changed_alloc)
+       {
+        new_changed = (job_registry_recnum_t *)realloc(rha->changed,
+                       (rha->n_changed_alloc + JOB_REGISTRY_CHANGES_CHUNK) *
+                       sizeof(job_registry_recnum_t));
+        if (new_changed == NULL)
+         {
+          if (cfd != rha->changes_fd) close(cfd);
+          rha->n_changed = 0;
+          errno = ENOMEM;
+          return JOB_REGISTRY_MALLOC_FAIL;
+         }
+        rha->changed = new_changed;
+        rha->n_changed_alloc += JOB_REGISTRY_CHANGES_CHUNK;
+       }
+      rha->changed[rha->n_changed++] = chg[i].recnum;
+     }
    }
-  if (((upbits & JOB_REGISTRY_UPDATE_EXITREASON) != 0) &&
-       (strncmp(olde->exitreason, newe->exitreason, 
-                sizeof(olde->exitreason)) != 0))
+
+  /* Was the journal restarted while we were reading it ? */
+  if (pread(cfd, &check, sizeof(check), 0) != sizeof(check) ||
+      memcmp(&check, &hdr, sizeof(hdr)) != 0)
    {
-    need_to_update = TRUE;
+    if (cfd != rha->changes_fd) close(cfd);
+    rha->n_changed = 0;
+    memset(cursor, 0, sizeof(job_registry_changes_cursor));
+    return JOB_REGISTRY_CHANGES_RESET;
    }
-  if (((upbits & JOB_REGISTRY_UPDATE_UPDATER_INFO) != 0) &&
-       (strncmp(olde->updater_info, newe->updater_info, 
-                sizeof(olde->updater_info)) != 0))
+  if (cfd != rha->changes_fd) close(cfd);
+
+  cursor->offset = (pending >= 0) ? pending : pos;
+  if (reset) return JOB_REGISTRY_CHANGES_RESET;
+
+  /* Visit each record once */
+  if (rha->n_changed > 1)
    {
-    need_to_update = TRUE;
+    qsort(rha->changed, rha->n_changed, sizeof(job_registry_recnum_t),
+          job_registry_recnum_compare);
+    for (i = 1, n_read = 1; i < rha->n_changed; i++)
+      if (rha->changed[i] != rha->changed[n_read-1])
+        rha->changed[n_read++] = rha->changed[i];
+    rha->n_changed = n_read;
    }
-  return need_to_update;
+
+  return rha->n_changed;
 }
 
 /*
- * job_registry_get_recnum
+ * job_registry_get_next_changed
  *
- * Binary search for an entry in the indexed, sorted job registry pointed to by
- * rha. The record number in the current JR cache is returned.
- * No file access is required.
- * In case multiple entries are found, the highest (most recent) recnum 
- * is returned.
+ * Iterate over the records collected by the last call to
+ * job_registry_changes_since. Records are copied one at a time, as
+ * done by job_registry_get_next_mapped.
  *
  * @param rha Pointer to a job registry handle returned by job_registry_init.
- * @param id Job id key to be looked up 
+ * @param cursor Pointer to the iteration position. Must be set to zero
+ *        to start. Updated at every call.
  *
- * @return Record number of the found record, or 0 if the record was not found.
+ * @return Pointer to a copy of the registry entry (see
+ *         job_registry_get_next_mapped), or NULL when all changed
+ *         records were visited.
  */
 
-job_registry_recnum_t 
-job_registry_get_recnum(const job_registry_handle *rha,
-                        const char *id)
+const job_registry_entry *
+job_registry_get_next_changed(job_registry_handle *rha,
+                              job_registry_recnum_t *cursor)
 {
-  /* Binary search in entries */
-  int left,right,cur,tcur;
-  job_registry_recnum_t found=0;
-  int cmp;
+  const job_registry_entry *ren;
+  job_registry_recnum_t off;
 
-  left = 0;
-  right = rha->n_entries -1;
+  if (job_registry_scan_buf(rha) == NULL) return NULL;
 
-  while (right >= left)
+  while (*cursor < rha->n_changed)
    {
-    cur = (right + left) /2;
-    cmp = strcmp(rha->entries[cur].id,id);
-    if (cmp == 0)
-     {
-      found = rha->entries[cur].recnum;
-      /* Check for duplicates. */
-      for (tcur=cur-1; tcur >=0 && strcmp(rha->entries[tcur].id,id)==0; tcur--)
-       {
-        if (rha->entries[tcur].recnum > found) found = rha->entries[tcur].recnum;
-       }
-      for (tcur=cur+1;tcur < rha->n_entries && 
-                             strcmp(rha->entries[tcur].id,id)==0; tcur++)
-       {
-        if (rha->entries[tcur].recnum > found) found = rha->entries[tcur].recnum;
-       }
-      break;
-     }
-    else if (cmp < 0)
-     {
-      left = cur+1;
-     }
-    else
-     {
-      right = cur-1;
-     }
+    if (job_registry_persist_record(rha, rha->changed[(*cursor)++]) == NULL)
+      continue;
+    JOB_REGISTRY_GET_REC_OFFSET(off,rha->changed[*cursor - 1],rha->data_map_firstrec)
+    rha->scan_buf_n = 0;
+    if (job_registry_mapped_copy(rha, off, 1, rha->scan_buf) <= 0) continue;
+    ren = rha->scan_buf;
+    if ( (ren->magic_start != JOB_REGISTRY_MAGIC_START) ||
+         (ren->magic_end   != JOB_REGISTRY_MAGIC_END) ||
+         (ren->recnum != rha->changed[*cursor - 1]) ) continue;
+    return ren;
    }
-  return found;
+  return NULL;
+}
+
+/* JOB_REGISTRY_WATCH_NPU if the NPU spool grew since the previous call */
+static int
+job_registry_watch_spool(job_registry_handle *rha)
+{
+  struct stat sst;
+  int changes = 0;
+
+  if (stat(rha->npuspool, &sst) < 0) return 0;
+  if (sst.st_size > rha->watch_npu_size) changes = JOB_REGISTRY_WATCH_NPU;
+  rha->watch_npu_size = sst.st_size;
+  return changes;
 }
 
 /*
- * job_registry_lookup
- * job_registry_lookup_op
+ * job_registry_watch_check
  *
- * Binary search for an entry in the indexed, sorted job registry pointed to by
- * rha. If the entry is not found, a job_registry_resync will be attempted.
- * job_registry_lookup_op can operate on an already open and at least read-
- * locked file.
+ * Compare the registry file, the shared sequence counter, the NPU
+ * directory and the NPU spool with their state at the previous call,
+ * and remember their current state.
  *
  * @param rha Pointer to a job registry handle returned by job_registry_init.
- * @param id Job id key to be looked up 
- * @param fd Stream descriptor of an open and *write* locked 
- *        registry file. The write lock is needed only in case
- *        non privileged new entries need to be merged into the registry.
- *        When fd==NULL, the file will be opened and closed if new 
- *        non-privileged entries are present (write lock), or 
- *        job_registry_resync is needed (read lock).
+ * @param check_npudir Whether to look at the NPU directory mtime. It also
+ *        changes when NPU files are merged, so it is not looked at when
+ *        the directory is watched with inotify.
  *
- * @return Record number of the found record, or 0 if the record was not found.
+ * @return Mask of JOB_REGISTRY_WATCH_* changes found.
  */
 
-job_registry_recnum_t 
-job_registry_lookup(job_registry_handle *rha,
-                    const char *id)
+static int
+job_registry_watch_check(job_registry_handle *rha, int check_npudir)
 {
-  /* As a resync attempt is performed inside this function, */
-  /* the registry should not be open when this function is called. */
-  /* Use job_registry_lookup_op if an open file is needed */
-
-  return job_registry_lookup_op(rha, id, NULL);
+  struct stat rst, nst;
+  uint64_t seq;
+  int changes = 0;
+
+  if (stat(rha->path, &rst) >= 0)
+   {
+    if (rst.st_ino != rha->watch_ino || rst.st_size < rha->watch_size)
+      changes |= JOB_REGISTRY_WATCH_REPLACE;
+    else if (rst.st_size > rha->watch_size)
+      changes |= JOB_REGISTRY_WATCH_APPEND;
+    else if (rst.st_mtime != rha->watch_mtime)
+      changes |= JOB_REGISTRY_WATCH_UPDATE;
+    rha->watch_ino = rst.st_ino;
+    rha->watch_size = rst.st_size;
+    rha->watch_mtime = rst.st_mtime;
+   }
+  if (job_registry_seq_trusted(rha))
+   {
+    /* Catches in-place updates within the same mtime second */
+    seq = rha->seqlock->seq;
+    if (seq != rha->watch_seq && changes == 0)
+      changes |= JOB_REGISTRY_WATCH_UPDATE;
+    rha->watch_seq = seq;
+   }
+  if (check_npudir && stat(rha->npudir, &nst) >= 0)
+   {
+    if (nst.st_mtime != rha->watch_npu_mtime)
+      changes |= JOB_REGISTRY_WATCH_NPU;
+    rha->watch_npu_mtime = nst.st_mtime;
+   }
+  changes |= job_registry_watch_spool(rha);
+  return changes;
 }
 
-job_registry_recnum_t 
-job_registry_lookup_op(job_registry_handle *rha,
-                       const char *id, FILE *fd)
+#ifdef __linux__
+/*
+ * job_registry_watch_read
+ *
+ * Drain the inotify descriptor of a watching handle.
+ *
+ * @param rha Pointer to a job registry handle set up by job_registry_watch.
+ *
+ * @return Mask of JOB_REGISTRY_WATCH_* changes found.
+ */
+
+static int
+job_registry_watch_read(job_registry_handle *rha)
 {
-  job_registry_recnum_t found=0;
-  int retry;
-  int need_to_fclose = FALSE;
+  char evbuf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t len;
+  char *p;
+  int changes = 0;
+  int reg_changes;
+  int reg_event = FALSE;
 
-  for (retry=0; retry < 2; retry++)
+  while ((len = read(rha->watch_fd, evbuf, sizeof(evbuf))) > 0)
    {
-    found = job_registry_get_recnum(rha, id); 
-
-    /* If the entry was not found the first time around, try resyncing once */
-    if (found == 0 && retry == 0)
+    for (p = evbuf; p < evbuf + len; p += sizeof(struct inotify_event) + ev->len)
      {
-      if (fd == NULL)
+      ev = (const struct inotify_event *)p;
+      if ((ev->mask & IN_Q_OVERFLOW) != 0)
        {
-        fd = job_registry_open(rha, "r");
-        if (fd == NULL) break;
-        if (job_registry_rdlock(rha, fd) < 0)
-         {
-          fclose(fd);
-          break;
-         }
-        need_to_fclose = TRUE;
+        reg_event = TRUE;
+        changes |= JOB_REGISTRY_WATCH_NPU;
        }
-      if (job_registry_resync(rha, fd) <= 0)
-       {
-        if (need_to_fclose) fclose(fd);
-        break;
+      else if ((ev->mask & IN_IGNORED) != 0)
+       {
+        /* A watched directory is gone: fall back to polling. */
+        close(rha->watch_fd);
+        rha->watch_fd = -1;
+        return changes | job_registry_watch_check(rha, TRUE);
        }
-      if (need_to_fclose) fclose(fd);
+      else if (ev->wd == rha->watch_npu_wd)
+        changes |= JOB_REGISTRY_WATCH_NPU;
+      else if (ev->len > 0 && strcmp(ev->name, JOB_REGISTRY_REGISTRY_NAME) == 0)
+        reg_event = TRUE;
+      else if (ev->len > 0 &&
+               strcmp(ev->name, JOB_REGISTRY_REGISTRY_NAME ".npuspool") == 0)
+        changes |= job_registry_watch_spool(rha);
      }
-    if (found > 0) break;
    }
-  return found;
+
+  if (reg_event)
+   {
+    reg_changes = job_registry_watch_check(rha, FALSE);
+    if (reg_changes == 0 && !job_registry_seq_trusted(rha))
+      reg_changes = JOB_REGISTRY_WATCH_UPDATE;
+    changes |= reg_changes;
+   }
+  return changes;
 }
+#endif
 
 /*
- * job_registry_get
+ * job_registry_watch
  *
- * Search for an entry in the indexed, sorted job registry pointed to by
- * rha and fetch it from the registry file. If the entry is not found, a 
- * job_registry_resync will be attempted.
- * The registry file will be opened, locked and closed as an effect
- * of this operation, so the file should not be open upon entering
- * this function.
+ * Start watching a registry for changes, to be waited for with
+ * job_registry_wait_change. inotify watches on the registry directory
+ * and on the NPU directory are used where available, otherwise the
+ * registry is polled every JOB_REGISTRY_WATCH_POLL_MS milliseconds.
+ * Changes made before the first call (this is also called by
+ * job_registry_wait_change) are not reported.
  *
  * @param rha Pointer to a job registry handle returned by job_registry_init.
- * @param id Job id key to be looked up 
  *
- * @return Dynamically allocated registry entry. Needs to be free'd.
+ * @return TRUE if inotify is used, FALSE if the registry is polled.
  */
 
-job_registry_entry *
-job_registry_get(job_registry_handle *rha,
-                 const char *id)
+int
+job_registry_watch(job_registry_handle *rha)
 {
-  job_registry_recnum_t found, firstrec, req_recn;
-  job_registry_entry *entry;
-  FILE *fd;
-
-  if (rha->mode == NO_INDEX)
-   {
-    errno = EINVAL;
-    return NULL;
+#ifdef __linux__
+  char *regdir, *sl;
+#endif
+
+  if (rha->watch_setup) return (rha->watch_fd >= 0);
+  rha->watch_setup = TRUE;
+  rha->watch_fd = -1;
+
+#ifdef __linux__
+  rha->watch_fd = inotify_init();
+  if (rha->watch_fd >= 0)
+   {
+    fcntl(rha->watch_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(rha->watch_fd, F_SETFL, O_NONBLOCK);
+
+    regdir = strdup(rha->path);
+    if (regdir != NULL && (sl = strrchr(regdir, '/')) != NULL) *sl = '\000';
+    if (regdir == NULL ||
+        inotify_add_watch(rha->watch_fd, regdir, 
+                          IN_MODIFY|IN_CREATE|IN_MOVED_TO) < 0 ||
+        (rha->watch_npu_wd = inotify_add_watch(rha->watch_fd, rha->npudir,
+                          IN_CLOSE_WRITE|IN_MOVED_TO)) < 0)
+     {
+      close(rha->watch_fd);
+      rha->watch_fd = -1;
+     }
+    if (regdir != NULL) free(regdir);
    }
+#endif
 
-  found = job_registry_lookup(rha, id);
-  if (found == 0)
-   {
-    errno = ENOENT;
-    return NULL;
-   }
+  /* After the watches are in place, so that no change is missed. */
+  job_registry_watch_check(rha, TRUE);
 
-  /* Open file, readlock it and fetch entry */
+  return (rha->watch_fd >= 0);
+}
 
-  fd = job_registry_open(rha,"r");
-  if (fd == NULL) return NULL;
+/*
+ * job_registry_wait_change
+ *
+ * Block until the registry changes in one of the ways selected by
+ * 'mask', or until 'timeout_ms' milliseconds have passed. Changes that
+ * are not selected (e.g. the caller's own updates) are discarded.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param mask Mask of JOB_REGISTRY_WATCH_* changes to wait for.
+ * @param timeout_ms Timeout in milliseconds. A negative value waits forever,
+ *        zero just checks for changes.
+ *
+ * @return Mask of the selected changes since the previous call (or
+ *         since job_registry_watch), 0 on timeout, less than zero
+ *         on error.
+ */
 
-  if (job_registry_rdlock(rha,fd) < 0)
-   {
-    fclose(fd);
-    return NULL;
-   }
+int
+job_registry_wait_change(job_registry_handle *rha, int mask, int timeout_ms)
+{
+  struct timeval tm_start, tm_now;
+  int left, wait_ms, ret;
+  int changes;
+#ifdef __linux__
+  struct pollfd pfd;
+#endif
 
-  firstrec = job_registry_firstrec(rha,fd);
+  job_registry_watch(rha);
+  gettimeofday(&tm_start, NULL);
 
-  /* Determine if the job registry index must be resync'd.
-   * The record numbers are monotonically increasing through the lifetime
-   * of the registry; the firstrec we read from the data file above must
-   * match the firstrec in our in-memory index.  The firstrec on the index
-   * is guaranteed to change if a purge operation occurred.
-   */
-  if (firstrec != rha->firstrec)
+  for (;;)
    {
-    int retval = job_registry_resync(rha, fd);
-    if (retval < 0)  // Registry failed to update.
+    left = -1;
+    if (timeout_ms >= 0)
      {
-      fclose(fd);
-      return NULL;
+      gettimeofday(&tm_now, NULL);
+      left = timeout_ms - ((tm_now.tv_sec - tm_start.tv_sec)*1000 +
+                           (tm_now.tv_usec - tm_start.tv_usec)/1000);
+      if (left < 0) left = 0;
      }
-    if (retval > 0)  // Registry has been updated; our lookup was invalid.
+
+    changes = 0;
+#ifdef __linux__
+    if (rha->watch_fd >= 0)
      {
-      found = job_registry_lookup(rha, id);
-      if (found == 0)
-       {
-        errno = ENOENT;
-        fclose(fd);
-        return NULL;
-       }
+      pfd.fd = rha->watch_fd;
+      pfd.events = POLLIN;
+      ret = poll(&pfd, 1, left);
+      if (ret > 0) changes = job_registry_watch_read(rha);
+     }
+    else
+#endif
+     {
+      wait_ms = left;
+      if (wait_ms < 0 || wait_ms > JOB_REGISTRY_WATCH_POLL_MS)
+        wait_ms = JOB_REGISTRY_WATCH_POLL_MS;
+      ret = poll(NULL, 0, wait_ms);
+      changes = job_registry_watch_check(rha, TRUE);
      }
+    if (ret < 0 && errno != EINTR) return JOB_REGISTRY_FAIL;
+
+    if ((changes & mask) != 0) return (changes & mask);
+    if (left == 0) return 0;
    }
+}
 
-  /* Was this record just purged ? */
-  if ((firstrec > rha->firstrec) && (found >= rha->firstrec) && (found < firstrec))
+/*
+ * job_registry_lookup_mapped
+ * job_registry_lookup_mapped_by
+ *
+ * Look an entry up in a persistent job registry handle and return
+ * a pointer to it inside the registry mapping, with no copy.
+ * job_registry_lookup_mapped_by searches any hash-indexed key.
+ *
+ * @param rha Pointer to a job registry handle in persistent mode.
+ * @param key Index mode selecting the key to search.
+ * @param id Job id key to be looked up 
+ *
+ * @return Pointer to a registry entry inside the mapping (see
+ *         job_registry_get_next_mapped for its validity), or NULL
+ *         (and errno set) if not found or in case of error.
+ */
+
+const job_registry_entry *
+job_registry_lookup_mapped(job_registry_handle *rha,
+                           const char *id)
+{
+  return job_registry_lookup_mapped_by(rha, rha->mode, id);
+}
+
+const job_registry_entry *
+job_registry_lookup_mapped_by(job_registry_handle *rha,
+                              job_registry_index_mode key,
+                              const char *id)
+{
+  job_registry_recnum_t found;
+  const job_registry_entry *ren;
+
+  if (rha->persist_fd < 0)
    {
-    fclose(fd);
+    errno = EINVAL;
     return NULL;
    }
-  JOB_REGISTRY_GET_REC_OFFSET(req_recn,found,firstrec)
-  
-  if (fseek(fd, (long)(req_recn*sizeof(job_registry_entry)), SEEK_SET) < 0)
+  if (job_registry_persist_revalidate(rha) < 0) return NULL;
+
+  found = job_registry_hash_lookup_by(rha, key, id);
+  if (found == 0 || (ren = job_registry_persist_record(rha, found)) == NULL)
    {
-    fclose(fd);
+    errno = ENOENT;
     return NULL;
    }
-  
-  entry = job_registry_get_next(rha, fd);
-
-  fclose(fd);
-  return entry;
+  if ( (ren->magic_start != JOB_REGISTRY_MAGIC_START) ||
+       (ren->magic_end   != JOB_REGISTRY_MAGIC_END) )
+   {
+    errno = ENOMSG;
+    return NULL;
+   }
+  return ren;
 }
 
 /*
@@ -2387,8 +6304,9 @@ job_registry_open(job_registry_handle *rha, const char *mode)
 
 /*
  * job_registry_unlock
+ * job_registry_unlock_fd
  *
- * Release any lock on open file sfd. This is useful to yield
+ * Release any lock on open file sfd (or file descriptor fd). This is useful to yield
  * permission to other processes on long read cycles.
  *
  * @param sfd Stream descriptor of an open where fcntl locks are released.
@@ -2417,6 +6335,19 @@ job_registry_unlock(FILE *sfd)
   return ret;
 }
 
+int
+job_registry_unlock_fd(int fd)
+{
+  struct flock ulock;
+
+  ulock.l_type = F_UNLCK;
+  ulock.l_whence = SEEK_SET;
+  ulock.l_start = 0;
+  ulock.l_len = 0; /* Lock whole file */
+  
+  return fcntl(fd, F_SETLKW, &ulock);
+}
+
 /*
  * job_registry_rdlock
  *
@@ -2660,81 +6591,126 @@ job_registry_seek_next(FILE *fd, job_registry_entry *result)
  *         rappresentation of entry.
  */
 
-#define JOB_REGISTRY_APPEND_ATTRIBUTE(format,attribute) \
-    fmt_extra = (format); \
-    esiz = snprintf(NULL, 0, fmt_extra, (attribute)) + 1; \
-    new_extra_attrs = (char *)realloc(extra_attrs, extra_attrs_size + esiz); \
-    if (new_extra_attrs == NULL) \
-     { \
-      if (extra_attrs != NULL) free(extra_attrs); \
-      return NULL; \
-     } \
-    need_to_free_extra_attrs = TRUE; \
-    extra_attrs = new_extra_attrs; \
-    snprintf(extra_attrs+extra_attrs_size, esiz, fmt_extra, (attribute)); \
-    extra_attrs_size += (esiz-1); 
-
 char *
 job_registry_entry_as_classad(const job_registry_handle *rha,
                               const job_registry_entry *entry)
 {
-  char *fmt_base = "[ BatchJobId=\"%s\"; JobStatus=%d; BlahJobId=\"%s\"; "
-                   "CreateTime=%u; ModifiedTime=%u; UserTime=%u; "
-                   "SubmitterUid=%d; %s]";
-  char *result, *fmt_extra, *extra_attrs=NULL, *new_extra_attrs;
-  char *extra_attrs_append;
-  int extra_attrs_size = 0;
-  int need_to_free_extra_attrs = FALSE;
-  int esiz,fsiz;
-  char *proxypath;
-
-  if ((entry->wn_addr != NULL) && (strlen(entry->wn_addr) > 0)) 
-   { 
-    JOB_REGISTRY_APPEND_ATTRIBUTE("WorkerNode=\"%s\"; ",entry->wn_addr);
+  char *result = NULL;
+  size_t result_size = 0;
+
+  if (job_registry_entry_format_classad(rha, entry, &result, &result_size) < 0)
+   {
+    if (result != NULL) free(result);
+    return NULL;
    }
-  if ((entry->proxy_link != NULL) && (strlen(entry->proxy_link) > 0)) 
+  return result;
+}
+
+/* Append a formatted string at 'off' in a buffer of 'size' bytes, */
+/* as far as it fits. Returns the offset past the complete string. */
+static size_t
+job_registry_classad_append(char *buf, size_t size, size_t off,
+                            const char *fmt, ...)
+{
+  va_list ap;
+  int len;
+
+  va_start(ap, fmt);
+  len = vsnprintf((off < size) ? buf+off : NULL, (off < size) ? size-off : 0,
+                  fmt, ap);
+  va_end(ap);
+  if (len < 0) return off;
+  return off + len;
+}
+
+/*
+ * job_registry_entry_format_classad
+ *
+ * Write the classad representation of a registry entry (the same one
+ * returned by job_registry_entry_as_classad) into a caller-supplied
+ * buffer, that is grown with realloc only when it's too small. 
+ * Formatting entries into the same buffer needs no allocation per entry.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param entry Job registry entry to be formatted as classad.
+ * @param buf Pointer to the buffer. *buf can be NULL, and is to be 
+ *        freed by the caller.
+ * @param buf_size Pointer to the allocated size of *buf.
+ *
+ * @return Length of the classad string in *buf. Less than zero (and
+ *         errno set) on error.
+ */
+
+int
+job_registry_entry_format_classad(const job_registry_handle *rha,
+                                  const job_registry_entry *entry,
+                                  char **buf, size_t *buf_size)
+{
+  char linkpath[FILENAME_MAX];
+  char proxybuf[FILENAME_MAX];
+  char *proxypath = NULL;
+  char *new_buf;
+  size_t off, new_size;
+  int rlret;
+
+  if (entry->proxy_link[0] != '\000') 
    { 
-    proxypath = job_registry_get_proxy(rha, entry);
-    if (proxypath != NULL)
+    /* Read the proxy link with no allocation, if it fits. */
+    rlret = -1;
+    if (snprintf(linkpath, sizeof(linkpath), "%s/%s", rha->proxydir,
+                 entry->proxy_link) < (int)sizeof(linkpath))
+      rlret = readlink(linkpath, proxybuf, sizeof(proxybuf));
+    if (rlret >= 0 && rlret < (int)sizeof(proxybuf))
      {
-      JOB_REGISTRY_APPEND_ATTRIBUTE("X509UserProxy=\"%s\"; ",proxypath);
-      free(proxypath);
+      proxybuf[rlret] = '\000'; /* readlink does not NULL-terminate */
+      proxypath = proxybuf;
      }
-   }
-  if (entry->status == COMPLETED)
-   {
-    JOB_REGISTRY_APPEND_ATTRIBUTE("ExitCode=%d; ",entry->exitcode);
-   }
-  if ((entry->exitreason != NULL) && (strlen(entry->exitreason) > 0)) 
-   { 
-    JOB_REGISTRY_APPEND_ATTRIBUTE("ExitReason=\"%s\"; ",entry->exitreason);
-   }
-  if ((entry->user_prefix != NULL) && (strlen(entry->user_prefix) > 0)) 
-   { 
-    JOB_REGISTRY_APPEND_ATTRIBUTE("UserPrefix=\"%s\"; ",entry->user_prefix);
+    else if (rlret >= 0) proxypath = job_registry_get_proxy(rha, entry);
    }
 
-  if (extra_attrs == NULL) 
+  for (;;)
    {
-    extra_attrs = "";
-    need_to_free_extra_attrs = FALSE;
+    off = job_registry_classad_append(*buf, *buf_size, 0, 
+                   "[ BatchJobId=\"%s\"; JobStatus=%d; BlahJobId=\"%s\"; "
+                   "CreateTime=%u; ModifiedTime=%u; UserTime=%u; "
+                   "SubmitterUid=%d; ",
+                   entry->batch_id, entry->status, entry->blah_id,
+                   entry->cdate, entry->mdate, entry->udate, entry->submitter);
+    if (entry->wn_addr[0] != '\000')
+      off = job_registry_classad_append(*buf, *buf_size, off,
+                   "WorkerNode=\"%s\"; ", entry->wn_addr);
+    if (proxypath != NULL)
+      off = job_registry_classad_append(*buf, *buf_size, off,
+                   "X509UserProxy=\"%s\"; ", proxypath);
+    if (entry->status == COMPLETED)
+      off = job_registry_classad_append(*buf, *buf_size, off,
+                   "ExitCode=%d; ", entry->exitcode);
+    if (entry->exitreason[0] != '\000')
+      off = job_registry_classad_append(*buf, *buf_size, off,
+                   "ExitReason=\"%s\"; ", entry->exitreason);
+    if (entry->user_prefix[0] != '\000')
+      off = job_registry_classad_append(*buf, *buf_size, off,
+                   "UserPrefix=\"%s\"; ", entry->user_prefix);
+    off = job_registry_classad_append(*buf, *buf_size, off, "]");
+
+    if (off < *buf_size) break;
+
+    /* Grow geometrically, so that reused buffers settle quickly */
+    new_size = off + 1;
+    if (*buf_size > 0 && new_size < 2*(*buf_size)) new_size = 2*(*buf_size);
+    new_buf = (char *)realloc(*buf, new_size);
+    if (new_buf == NULL)
+     {
+      if (proxypath != NULL && proxypath != proxybuf) free(proxypath);
+      errno = ENOMEM;
+      return JOB_REGISTRY_MALLOC_FAIL;
+     }
+    *buf = new_buf;
+    *buf_size = new_size;
    }
 
-  fsiz = snprintf(NULL, 0, fmt_base, 
-                  entry->batch_id, entry->status, entry->blah_id,
-                  entry->cdate, entry->mdate, entry->udate, entry->submitter,
-                  extra_attrs) + 1;
-
-  result = (char *)malloc(fsiz);
-  if (result)
-    snprintf(result, fsiz, fmt_base,
-             entry->batch_id, entry->status, entry->blah_id,
-             entry->cdate, entry->mdate, entry->udate, entry->submitter,
-             extra_attrs);
-
-  if (need_to_free_extra_attrs) free(extra_attrs);
-
-  return result;
+  if (proxypath != NULL && proxypath != proxybuf) free(proxypath);
+  return (int)off;
 }
 
 /*
@@ -3011,49 +6987,226 @@ job_registry_unlink_proxy(const job_registry_handle *rha,
 
   unret = unlink(fullpath);
 
-  if (unret >= 0)
+  if (unret >= 0)
+   {
+    en->proxy_link[0]='\000';
+   }
+
+  free(fullpath);
+  return unret;
+}
+
+/*
+ * job_registry_compute_subject_hash
+ *
+ * Compute a MD5 hash out of a string containing a proxy certificate subject.
+ *
+ * @param en Pointer to a job registry entry. Its subject_hash will be
+ *           modified to contain an MD5 hash of subject.
+ * @param subject Pointer to a string containing the certificate subject.
+ *
+ */
+
+void
+job_registry_compute_subject_hash(job_registry_entry *en, const char *subject)
+{
+  md5_state_t ctx;
+  md5_byte_t digest[16];
+  char nibble[4];
+  int i;
+
+  if (en == NULL || subject == NULL) return;
+
+  md5_init(&ctx);
+  md5_append(&ctx, subject, strlen(subject));
+  md5_finish(&ctx, digest);
+
+  if (sizeof(en->subject_hash) < 4) return;
+  en->subject_hash[0] = '\000';
+
+  for (i=0; i<16; i++)
+   {
+    if (i >= (sizeof(en->subject_hash)/2 - 3)) break;
+    sprintf(nibble,"%02x",digest[i]);
+    strcat(en->subject_hash, nibble);
+   }
+}
+
+/* Line index + 1 of 'hash' in the subject cache, or 0 */
+static uint32_t
+job_registry_subject_cache_find(const job_registry_subject_cache *sc,
+                                const char *hash)
+{
+  uint32_t slot, mask;
+
+  if (sc->table == NULL) return 0;
+  mask = sc->table_size - 1;
+  slot = job_registry_hash_id(hash, JOB_REGISTRY_MAX_SUBJECTLIST_LINE) & mask;
+
+  while (sc->table[slot] != 0)
+   {
+    if (strcmp(sc->lines[sc->table[slot]-1], hash) == 0) return sc->table[slot];
+    slot = (slot+1) & mask;
+   }
+  return 0;
+}
+
+/* Add one "hash subject" line to the subject cache. */
+/* As in the linear file scan, the first line for a hash wins. */
+static int
+job_registry_subject_cache_add(job_registry_subject_cache *sc,
+                               const char *subline)
+{
+  char *line, *sp, **new_lines;
+  int new_alloc;
+  uint32_t *new_table, new_size, slot, mask, i;
+
+  line = strdup(subline);
+  if (line == NULL) return JOB_REGISTRY_MALLOC_FAIL;
+  if ((sp = strchr(line, '\n')) != NULL) *sp = '\000';
+  if ((sp = strchr(line, ' ')) == NULL)
+   {
+    /* Bogus entry ?! */
+    free(line);
+    return JOB_REGISTRY_SUCCESS;
+   }
+  *sp = '\000';
+
+  if (job_registry_subject_cache_find(sc, line) != 0)
+   {
+    free(line);
+    return JOB_REGISTRY_SUCCESS;
+   }
+
+  if (sc->n_lines >= sc->n_alloc)
+   {
+    new_alloc = (sc->n_alloc > 0) ? sc->n_alloc*2 : JOB_REGISTRY_ALLOC_CHUNK;
+    new_lines = (char **)realloc(sc->lines, new_alloc*sizeof(char *));
+    if (new_lines == NULL)
+     {
+      free(line);
+      return JOB_REGISTRY_MALLOC_FAIL;
+     }
+    sc->lines = new_lines;
+    sc->n_alloc = new_alloc;
+   }
+
+  /* Keep the table load factor below 1/2 */
+  if ((uint32_t)(sc->n_lines + 1)*2 > sc->table_size)
+   {
+    new_size = (sc->table_size > 0) ? sc->table_size*2 : 64;
+    new_table = (uint32_t *)calloc(new_size, sizeof(uint32_t));
+    if (new_table == NULL)
+     {
+      free(line);
+      return JOB_REGISTRY_MALLOC_FAIL;
+     }
+    if (sc->table != NULL) free(sc->table);
+    sc->table = new_table;
+    sc->table_size = new_size;
+    mask = new_size - 1;
+    for (i=0; i<(uint32_t)sc->n_lines; i++)
+     {
+      slot = job_registry_hash_id(sc->lines[i], 
+                                  JOB_REGISTRY_MAX_SUBJECTLIST_LINE) & mask;
+      while (sc->table[slot] != 0) slot = (slot+1) & mask;
+      sc->table[slot] = i+1;
+     }
+   }
+
+  mask = sc->table_size - 1;
+  slot = job_registry_hash_id(line, JOB_REGISTRY_MAX_SUBJECTLIST_LINE) & mask;
+  while (sc->table[slot] != 0) slot = (slot+1) & mask;
+  sc->lines[sc->n_lines] = line;
+  sc->n_lines++;
+  sc->table[slot] = sc->n_lines;
+
+  return JOB_REGISTRY_SUCCESS;
+}
+
+/* Read the lines appended to a subject list file after *offset. */
+/* Only complete lines are consumed. */
+static int
+job_registry_subject_cache_read(const job_registry_handle *rha,
+                                job_registry_subject_cache *sc,
+                                const char *path, off_t *offset)
+{
+  FILE *fd;
+  char subline[JOB_REGISTRY_MAX_SUBJECTLIST_LINE];
+  size_t len;
+  int ret = JOB_REGISTRY_SUCCESS;
+
+  fd = fopen(path, "r");
+  if (fd == NULL) return JOB_REGISTRY_FOPEN_FAIL;
+
+  if (job_registry_rdlock(rha, fd) < 0)
+   {
+    fclose(fd);
+    return JOB_REGISTRY_FLOCK_FAIL;
+   }
+
+  if (fseeko(fd, *offset, SEEK_SET) < 0)
+   {
+    fclose(fd);
+    return JOB_REGISTRY_FSEEK_FAIL;
+   }
+
+  while (fgets(subline, sizeof(subline), fd) != NULL)
    {
-    en->proxy_link[0]='\000';
+    len = strlen(subline);
+    if (len == 0 || subline[len-1] != '\n') break; /* Partial line */
+    if ((ret = job_registry_subject_cache_add(sc, subline)) < 0) break;
+    *offset += len;
    }
 
-  free(fullpath);
-  return unret;
+  fclose(fd);
+  return ret;
 }
 
 /*
- * job_registry_compute_subject_hash
+ * job_registry_subject_cache_sync
  *
- * Compute a MD5 hash out of a string containing a proxy certificate subject.
+ * Bring the in-memory copy of the subject list files of a persistent
+ * handle up to date. Only lines appended since the previous call are
+ * read, unless either file was replaced or truncated (subject list purge),
+ * in which case the cache is reloaded.
  *
- * @param en Pointer to a job registry entry. Its subject_hash will be
- *           modified to contain an MD5 hash of subject.
- * @param subject Pointer to a string containing the certificate subject.
+ * @param rha Pointer to a job registry handle in persistent mode.
  *
+ * @return Less than zero on error. See job_registry.h for error codes.
  */
 
-void
-job_registry_compute_subject_hash(job_registry_entry *en, const char *subject)
+static int
+job_registry_subject_cache_sync(const job_registry_handle *rha)
 {
-  md5_state_t ctx;
-  md5_byte_t digest[16];
-  char nibble[4];
-  int i;
-
-  if (en == NULL || subject == NULL) return;
+  job_registry_subject_cache *sc = rha->subject_cache;
+  struct stat lst, nst;
+  int ret;
 
-  md5_init(&ctx);
-  md5_append(&ctx, subject, strlen(subject));
-  md5_finish(&ctx, digest);
+  if (stat(rha->subjectlist, &lst) < 0) lst.st_ino = 0, lst.st_size = 0;
+  if (stat(rha->npusubjectlist, &nst) < 0) nst.st_ino = 0, nst.st_size = 0;
 
-  if (sizeof(en->subject_hash) < 4) return;
-  en->subject_hash[0] = '\000';
+  if (lst.st_ino != sc->list_ino || lst.st_size < sc->list_offset ||
+      nst.st_ino != sc->npulist_ino || nst.st_size < sc->npulist_offset)
+   {
+    job_registry_subject_cache_free(sc);
+    sc->list_ino = lst.st_ino;
+    sc->npulist_ino = nst.st_ino;
+   }
 
-  for (i=0; i<16; i++)
+  if (lst.st_size > sc->list_offset)
    {
-    if (i >= (sizeof(en->subject_hash)/2 - 3)) break;
-    sprintf(nibble,"%02x",digest[i]);
-    strcat(en->subject_hash, nibble);
+    ret = job_registry_subject_cache_read(rha, sc, rha->subjectlist,
+                                          &(sc->list_offset));
+    if (ret < 0) return ret;
+   }
+  if (nst.st_size > sc->npulist_offset)
+   {
+    ret = job_registry_subject_cache_read(rha, sc, rha->npusubjectlist,
+                                          &(sc->npulist_offset));
+    if (ret < 0) return ret;
    }
+  return JOB_REGISTRY_SUCCESS;
 }
 
 /*
@@ -3080,9 +7233,22 @@ job_registry_record_subject_hash(const job_registry_handle *rha,
   FILE *fd;
   char subline[JOB_REGISTRY_MAX_SUBJECTLIST_LINE];
   int retcod;
+  uint32_t line;
+  const char *cached;
 
   if (rha == NULL || hash == NULL || subject == NULL) return -1;
 
+  /* Persistent handles can check the cached subject lists first */
+  if (rha->subject_cache != NULL && 
+      job_registry_subject_cache_sync(rha) >= 0 &&
+      (line = job_registry_subject_cache_find(rha->subject_cache, hash)) > 0)
+   {
+    cached = rha->subject_cache->lines[line-1];
+    if (strcmp(cached+strlen(cached)+1, subject) != 0)
+      return JOB_REGISTRY_HASH_EXISTS;
+    return JOB_REGISTRY_SUCCESS;
+   }
+
   fd = fopen(rha->subjectlist, "a+");
   if (fd == NULL)
    {
@@ -3133,7 +7299,8 @@ job_registry_record_subject_hash(const job_registry_handle *rha,
  * job_registry_lookup_subject_hash
  *
  * Find in a file archive (linear search) the full proxy subject cached 
- * under a given MD5 hash.
+ * under a given MD5 hash. Persistent handles (see job_registry_persist)
+ * keep a hashed in-memory copy of the archive, that is looked up instead.
  *
  * @param rha Pointer to a job registry handle returned by job_registry_init.
  * @param hash    Pointer to a string containing the MD5 hash of subject.
@@ -3151,9 +7318,23 @@ job_registry_lookup_subject_hash(const job_registry_handle *rha,
   char subline[JOB_REGISTRY_MAX_SUBJECTLIST_LINE];
   int retcod;
   char *en;
+  uint32_t line;
 
   if (rha == NULL || hash == NULL) return NULL;
 
+  if (rha->subject_cache != NULL &&
+      job_registry_subject_cache_sync(rha) >= 0)
+   {
+    line = job_registry_subject_cache_find(rha->subject_cache, hash);
+    if (line == 0)
+     {
+      errno = ENOENT;
+      return NULL;
+     }
+    en = rha->subject_cache->lines[line-1];
+    return strdup(en+strlen(en)+1);
+   }
+
   fd = fopen(rha->subjectlist, "r");
   if (fd == NULL) return NULL;
 
@@ -3253,6 +7434,126 @@ job_registry_get_next_hash_match(const job_registry_handle *rha,
   return result;
 }
 
+/*
+ * job_registry_persist_subjects
+ *
+ * Switch a job registry handle to persistent mode (if needed) and
+ * keep a per-subject-hash list of its records, so that all records for
+ * a given proxy subject can be found (job_registry_get_next_subject_match)
+ * without scanning the registry file.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ *
+ * @return Less than zero on error. See job_registry.h for error codes.
+ *         errno is also set in case of error.
+ */
+
+int
+job_registry_persist_subjects(job_registry_handle *rha)
+{
+  if ((rha->hash_keys & JOB_REGISTRY_SUBJECT_KEY_BIT) != 0 && 
+      rha->persist_fd >= 0) return JOB_REGISTRY_SUCCESS;
+
+  rha->hash_keys |= JOB_REGISTRY_SUBJECT_KEY_BIT;
+  if (rha->persist_fd < 0) return job_registry_persist(rha);
+
+  /* The posting lists are built by revalidation */
+  return job_registry_persist_revalidate(rha);
+}
+
+/*
+ * job_registry_get_next_subject_match
+ *
+ * Iterate, in registry file order, over the entries whose 'subject_hash'
+ * field matches the 'hash' argument. This is the mapped equivalent of
+ * job_registry_get_next_hash_match: only matching records are visited,
+ * and each is copied out of the mapping as done by
+ * job_registry_get_next_mapped.
+ * When *cursor is zero (start of a scan) any pending non-privileged
+ * update is merged, the handle is set up by job_registry_persist_subjects
+ * if needed and the mapping is revalidated.
+ *
+ * @param rha Pointer to a job registry handle returned by job_registry_init.
+ * @param hash string pointer to a MD5 hash of a proxy subject (as stored 
+ *        in the subject_hash field of registry entries).
+ * @param cursor Pointer to the scan position. Must be set to zero
+ *        to start a scan. Updated at every call.
+ *
+ * @return Pointer to a copy of the registry entry (see
+ *         job_registry_get_next_mapped for its validity), or NULL at the
+ *         end of the scan (or in case of error, with errno set).
+ */
+
+const job_registry_entry *
+job_registry_get_next_subject_match(job_registry_handle *rha,
+                                    const char *hash,
+                                    job_registry_recnum_t *cursor)
+{
+  const job_registry_entry *ren;
+  job_registry_recnum_t next, off;
+  uint32_t slot, mask;
+
+  if (rha == NULL || hash == NULL || cursor == NULL) return NULL;
+  if (job_registry_scan_buf(rha) == NULL) return NULL;
+  ren = rha->scan_buf;
+
+  if (*cursor == 0)
+   {
+    job_registry_merge_pending_nonpriv_updates(rha, NULL);
+    if ((rha->hash_keys & JOB_REGISTRY_SUBJECT_KEY_BIT) == 0 ||
+        rha->persist_fd < 0)
+     {
+      if (job_registry_persist_subjects(rha) < 0) return NULL;
+     }
+    else if (job_registry_persist_revalidate(rha) < 0) return NULL;
+
+    if (rha->subject_slots == NULL || hash[0] == '\000') return NULL;
+
+    mask = rha->hash_size - 1;
+    slot = job_registry_hash_id(hash, JOB_REGISTRY_MAX_SUBJECTLIST_LINE) & mask;
+    next = 0;
+    while (rha->subject_slots[slot].first != 0)
+     {
+      JOB_REGISTRY_GET_REC_OFFSET(off,rha->subject_slots[slot].first,rha->data_map_firstrec)
+      rha->scan_buf_n = 0;
+      if (job_registry_mapped_copy(rha, off, 1, rha->scan_buf) == 1 &&
+          strncmp(ren->subject_hash, hash, sizeof(ren->subject_hash)) == 0)
+       {
+        next = rha->subject_slots[slot].first;
+        break;
+       }
+      slot = (slot+1) & mask;
+     }
+   }
+  else
+   {
+    JOB_REGISTRY_GET_REC_OFFSET(off,*cursor,rha->data_map_firstrec)
+    if (off >= rha->subject_chain_alloc) return NULL;
+    next = rha->subject_chain[off];
+   }
+
+  if (next == 0) return NULL;
+
+  JOB_REGISTRY_GET_REC_OFFSET(off,next,rha->data_map_firstrec)
+  rha->scan_buf_n = 0;
+  if (job_registry_persist_record(rha, next) == NULL ||
+      job_registry_mapped_copy(rha, off, 1, rha->scan_buf) != 1 ||
+      ren->recnum != next)
+   {
+    errno = EBADMSG;
+    return NULL;
+   }
+  if ( (ren->magic_start != JOB_REGISTRY_MAGIC_START) ||
+       (ren->magic_end   != JOB_REGISTRY_MAGIC_END) )
+   {
+    errno = ENOMSG;
+    return NULL;
+   }
+
+  *cursor = next;
+  return ren;
+}
+
 /*
  * job_registry_store_hash
  *
@@ -3536,3 +7837,483 @@ int job_registry_check_index_key_uniqueness(const job_registry_handle *rha,
 
   return JOB_REGISTRY_SUCCESS; 
 }
+
+/* Registry classad attributes (see job_registry_entry_format_classad) that */
+/* are always defined and can be compared without the classad library. */
+static const struct
+ {
+  const char *name;
+  job_registry_select_attr attr;
+  int is_string;
+ } job_registry_select_attrs[] =
+ {
+  { "BatchJobId",   JOB_REGISTRY_SELECT_BATCH_ID,  TRUE  },
+  { "BlahJobId",    JOB_REGISTRY_SELECT_BLAH_ID,   TRUE  },
+  { "JobStatus",    JOB_REGISTRY_SELECT_STATUS,    FALSE },
+  { "CreateTime",   JOB_REGISTRY_SELECT_CDATE,     FALSE },
+  { "ModifiedTime", JOB_REGISTRY_SELECT_MDATE,     FALSE },
+  { "UserTime",     JOB_REGISTRY_SELECT_UDATE,     FALSE },
+  { "SubmitterUid", JOB_REGISTRY_SELECT_SUBMITTER, FALSE },
+  { NULL,           0,                             FALSE }
+ };
+
+/* Comparison operators, longest first */
+static const struct
+ {
+  const char *token;
+  job_registry_select_op op;
+ } job_registry_select_ops[] =
+ {
+  { "=?=",  JOB_REGISTRY_SELECT_IS   },
+  { "=!=",  JOB_REGISTRY_SELECT_ISNT },
+  { "==",   JOB_REGISTRY_SELECT_EQ   },
+  { "!=",   JOB_REGISTRY_SELECT_NE   },
+  { "<=",   JOB_REGISTRY_SELECT_LE   },
+  { ">=",   JOB_REGISTRY_SELECT_GE   },
+  { "<",    JOB_REGISTRY_SELECT_LT   },
+  { ">",    JOB_REGISTRY_SELECT_GT   },
+  { "isnt", JOB_REGISTRY_SELECT_ISNT },
+  { "is",   JOB_REGISTRY_SELECT_IS   },
+  { NULL,   0                        }
+ };
+
+#define JOB_REGISTRY_SELECT_MAX_DEPTH 64
+
+typedef struct job_registry_select_parser_s
+ {
+  const char *pos;
+  int depth;
+  job_registry_select *sel;
+ } job_registry_select_parser;
+
+typedef enum job_registry_select_operand_e
+ {
+  JOB_REGISTRY_SELECT_OPERAND_ATTR,
+  JOB_REGISTRY_SELECT_OPERAND_INT,
+  JOB_REGISTRY_SELECT_OPERAND_STRING
+ } job_registry_select_operand;
+
+static int job_registry_select_parse_or(job_registry_select_parser *p);
+
+#define JOB_REGISTRY_SELECT_IS_IDCHAR(c) \
+  (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+   ((c) >= '0' && (c) <= '9') || (c) == '_')
+
+/* Skip blanks, then consume 'token' if found at the current position. */
+/* Word tokens must not be followed by an identifier character. */
+static int
+job_registry_select_accept(job_registry_select_parser *p, const char *token)
+{
+  size_t tlen = strlen(token);
+
+  while (*(p->pos) == ' ' || *(p->pos) == '\t' ||
+         *(p->pos) == '\r' || *(p->pos) == '\n') (p->pos)++;
+
+  if (strncasecmp(p->pos, token, tlen) != 0) return FALSE;
+  if (JOB_REGISTRY_SELECT_IS_IDCHAR(token[0]) &&
+      JOB_REGISTRY_SELECT_IS_IDCHAR(p->pos[tlen])) return FALSE;
+
+  p->pos += tlen;
+  return TRUE;
+}
+
+/* Append a node to the compiled expression. Returns the node index. */
+static int
+job_registry_select_add_node(job_registry_select *sel,
+                             job_registry_select_op op)
+{
+  job_registry_select_node *new_nodes;
+  int new_alloc;
+
+  if (sel->n_nodes >= JOB_REGISTRY_SELECT_MAX_NODES)
+   {
+    errno = EINVAL;
+    return JOB_REGISTRY_FAIL;
+   }
+  if (sel->n_nodes >= sel->n_alloc)
+   {
+    new_alloc = (sel->n_alloc > 0) ? sel->n_alloc * 2 : 8;
+    new_nodes = (job_registry_select_node *)realloc(sel->nodes,
+                       new_alloc * sizeof(job_registry_select_node));
+    if (new_nodes == NULL)
+     {
+      errno = ENOMEM;
+      return JOB_REGISTRY_MALLOC_FAIL;
+     }
+    sel->nodes = new_nodes;
+    sel->n_alloc = new_alloc;
+   }
+  memset(&(sel->nodes[sel->n_nodes]), 0, sizeof(job_registry_select_node));
+  sel->nodes[sel->n_nodes].op = op;
+  return (sel->n_nodes)++;
+}
+
+/* Attribute name, integer or (unescaped) string literal */
+static int
+job_registry_select_parse_operand(job_registry_select_parser *p,
+                                  job_registry_select_operand *kind,
+                                  int *attr, long long *ival,
+                                  const char **sval, size_t *slen)
+{
+  const char *start, *end;
+  char *endp;
+  int i;
+
+  job_registry_select_accept(p, ""); /* Skip blanks */
+  start = p->pos;
+
+  if (*start == '"')
+   {
+    for (end = start + 1; *end != '"'; end++)
+     {
+      /* Escapes are left to the classad library */
+      if (*end == '\000' || *end == '\\') return JOB_REGISTRY_FAIL;
+     }
+    *kind = JOB_REGISTRY_SELECT_OPERAND_STRING;
+    *sval = start + 1;
+    *slen = end - start - 1;
+    p->pos = end + 1;
+    return JOB_REGISTRY_SUCCESS;
+   }
+
+  if ((*start >= '0' && *start <= '9') || *start == '-')
+   {
+    /* Leading zeroes could be read as octal */
+    end = (*start == '-') ? start + 1 : start;
+    if (end[0] == '0' && end[1] >= '0' && end[1] <= '9') return JOB_REGISTRY_FAIL;
+    errno = 0;
+    *ival = strtoll(start, &endp, 10);
+    /* Reals, and anything but a plain integer, are left to the */
+    /* classad library */
+    if (endp == start || errno != 0 || *endp == '.' ||
+        JOB_REGISTRY_SELECT_IS_IDCHAR(*endp)) return JOB_REGISTRY_FAIL;
+    *kind = JOB_REGISTRY_SELECT_OPERAND_INT;
+    p->pos = endp;
+    return JOB_REGISTRY_SUCCESS;
+   }
+
+  for (end = start; JOB_REGISTRY_SELECT_IS_IDCHAR(*end); end++) /* */ ;
+  if (end == start) return JOB_REGISTRY_FAIL;
+
+  for (i = 0; job_registry_select_attrs[i].name != NULL; i++)
+   {
+    if (strlen(job_registry_select_attrs[i].name) == (size_t)(end - start) &&
+        strncasecmp(job_registry_select_attrs[i].name, start, end - start) == 0)
+     {
+      *kind = JOB_REGISTRY_SELECT_OPERAND_ATTR;
+      *attr = i;
+      p->pos = end;
+      return JOB_REGISTRY_SUCCESS;
+     }
+   }
+  return JOB_REGISTRY_FAIL;
+}
+
+/* <attribute> <op> <literal>, or <literal> <op> <attribute> */
+static int
+job_registry_select_parse_compare(job_registry_select_parser *p)
+{
+  job_registry_select_operand kind[2];
+  int attr[2];
+  long long ival[2];
+  const char *sval[2];
+  size_t slen[2];
+  job_registry_select_op op;
+  int i, a, l, node;
+
+  if (job_registry_select_parse_operand(p, &kind[0], &attr[0], &ival[0],
+                                        &sval[0], &slen[0]) < 0)
+    return JOB_REGISTRY_FAIL;
+
+  for (i = 0; job_registry_select_ops[i].token != NULL; i++)
+    if (job_registry_select_accept(p, job_registry_select_ops[i].token)) break;
+  if (job_registry_select_ops[i].token == NULL) return JOB_REGISTRY_FAIL;
+  op = job_registry_select_ops[i].op;
+
+  if (job_registry_select_parse_operand(p, &kind[1], &attr[1], &ival[1],
+                                        &sval[1], &slen[1]) < 0)
+    return JOB_REGISTRY_FAIL;
+
+  if (kind[0] == JOB_REGISTRY_SELECT_OPERAND_ATTR &&
+      kind[1] != JOB_REGISTRY_SELECT_OPERAND_ATTR)
+   {
+    a = 0; l = 1;
+   }
+  else if (kind[1] == JOB_REGISTRY_SELECT_OPERAND_ATTR &&
+           kind[0] != JOB_REGISTRY_SELECT_OPERAND_ATTR)
+   {
+    a = 1; l = 0;
+    /* Literal on the left: mirror the operator */
+    switch (op)
+     {
+      case JOB_REGISTRY_SELECT_LT: op = JOB_REGISTRY_SELECT_GT; break;
+      case JOB_REGISTRY_SELECT_LE: op = JOB_REGISTRY_SELECT_GE; break;
+      case JOB_REGISTRY_SELECT_GT: op = JOB_REGISTRY_SELECT_LT; break;
+      case JOB_REGISTRY_SELECT_GE: op = JOB_REGISTRY_SELECT_LE; break;
+      default: break;
+     }
+   }
+  else return JOB_REGISTRY_FAIL;
+
+  /* Type mismatches evaluate to ERROR in the classad library, */
+  /* and string ordering is left to it as well. */
+  if (job_registry_select_attrs[attr[a]].is_string)
+   {
+    if (kind[l] != JOB_REGISTRY_SELECT_OPERAND_STRING) return JOB_REGISTRY_FAIL;
+    if (op != JOB_REGISTRY_SELECT_EQ && op != JOB_REGISTRY_SELECT_NE &&
+        op != JOB_REGISTRY_SELECT_IS && op != JOB_REGISTRY_SELECT_ISNT)
+      return JOB_REGISTRY_FAIL;
+   }
+  else if (kind[l] != JOB_REGISTRY_SELECT_OPERAND_INT) return JOB_REGISTRY_FAIL;
+
+  if ((node = job_registry_select_add_node(p->sel, op)) < 0) return node;
+  p->sel->nodes[node].attr = job_registry_select_attrs[attr[a]].attr;
+  if (kind[l] == JOB_REGISTRY_SELECT_OPERAND_STRING)
+   {
+    p->sel->nodes[node].sval = (char *)malloc(slen[l] + 1);
+    if (p->sel->nodes[node].sval == NULL)
+     {
+      errno = ENOMEM;
+      return JOB_REGISTRY_MALLOC_FAIL;
+     }
+    memcpy(p->sel->nodes[node].sval, sval[l], slen[l]);
+    p->sel->nodes[node].sval[slen[l]] = '\000';
+   }
+  else p->sel->nodes[node].ival = ival[l];
+
+  return node;
+}
+
+static int
+job_registry_select_parse_unary(job_registry_select_parser *p)
+{
+  int node, operand;
+
+  if (++(p->depth) > JOB_REGISTRY_SELECT_MAX_DEPTH) return JOB_REGISTRY_FAIL;
+
+  if (job_registry_select_accept(p, "!"))
+   {
+    /* '!' binds tighter than comparisons: only negate */
+    /* parenthesized expressions and constants. */
+    job_registry_select_accept(p, ""); /* Skip blanks */
+    if (*(p->pos) != '(' && *(p->pos) != '!' &&
+        strncasecmp(p->pos, "true", 4) != 0 &&
+        strncasecmp(p->pos, "false", 5) != 0) return JOB_REGISTRY_FAIL;
+    if ((operand = job_registry_select_parse_unary(p)) < 0) return operand;
+    if ((node = job_registry_select_add_node(p->sel, JOB_REGISTRY_SELECT_NOT)) < 0)
+      return node;
+    p->sel->nodes[node].left = operand;
+   }
+  else if (job_registry_select_accept(p, "("))
+   {
+    if ((node = job_registry_select_parse_or(p)) < 0) return node;
+    if (!job_registry_select_accept(p, ")")) return JOB_REGISTRY_FAIL;
+   }
+  else if (job_registry_select_accept(p, "true"))
+    node = job_registry_select_add_node(p->sel, JOB_REGISTRY_SELECT_TRUE);
+  else if (job_registry_select_accept(p, "false"))
+    node = job_registry_select_add_node(p->sel, JOB_REGISTRY_SELECT_FALSE);
+  else node = job_registry_select_parse_compare(p);
+
+  (p->depth)--;
+  return node;
+}
+
+static int
+job_registry_select_parse_and(job_registry_select_parser *p)
+{
+  int left, right, node;
+
+  if ((left = job_registry_select_parse_unary(p)) < 0) return left;
+  while (job_registry_select_accept(p, "&&"))
+   {
+    if ((right = job_registry_select_parse_unary(p)) < 0) return right;
+    if ((node = job_registry_select_add_node(p->sel, JOB_REGISTRY_SELECT_AND)) < 0)
+      return node;
+    p->sel->nodes[node].left = left;
+    p->sel->nodes[node].right = right;
+    left = node;
+   }
+  return left;
+}
+
+static int
+job_registry_select_parse_or(job_registry_select_parser *p)
+{
+  int left, right, node;
+
+  if ((left = job_registry_select_parse_and(p)) < 0) return left;
+  while (job_registry_select_accept(p, "||"))
+   {
+    if ((right = job_registry_select_parse_and(p)) < 0) return right;
+    if ((node = job_registry_select_add_node(p->sel, JOB_REGISTRY_SELECT_OR)) < 0)
+      return node;
+    p->sel->nodes[node].left = left;
+    p->sel->nodes[node].right = right;
+    left = node;
+   }
+  return left;
+}
+
+/*
+ * job_registry_select_compile
+ *
+ * Compile a classad selection expression (as used by
+ * BLAH_JOB_STATUS_SELECT) into a form that can be evaluated directly
+ * on registry entries by job_registry_select_match.
+ * Only a common subset of expressions is recognised: comparisons of
+ * BatchJobId, BlahJobId (==, !=, =?=, =!=, is, isnt with a string
+ * literal) and JobStatus, CreateTime, ModifiedTime, UserTime,
+ * SubmitterUid (any comparison with an integer literal), combined with
+ * &&, ||, parentheses, '!' and the true/false constants. The result
+ * matches the evaluation of the expression by the classad library in
+ * the context of job_registry_entry_format_classad output.
+ *
+ * @param expr Selection expression.
+ *
+ * @return Pointer to the compiled expression, to be freed with
+ *         job_registry_select_free, or NULL when the expression is
+ *         outside the supported subset (errno is set to EINVAL) or
+ *         in case of memory allocation failure (ENOMEM). Callers
+ *         are expected to fall back to the classad library in the
+ *         former case.
+ */
+
+job_registry_select *
+job_registry_select_compile(const char *expr)
+{
+  job_registry_select_parser p;
+  job_registry_select *sel;
+
+  if (expr == NULL)
+   {
+    errno = EINVAL;
+    return NULL;
+   }
+
+  sel = (job_registry_select *)calloc(1, sizeof(job_registry_select));
+  if (sel == NULL)
+   {
+    errno = ENOMEM;
+    return NULL;
+   }
+
+  p.pos = expr;
+  p.depth = 0;
+  p.sel = sel;
+
+  errno = 0;
+  sel->root = job_registry_select_parse_or(&p);
+  if (sel->root < 0 || !job_registry_select_accept(&p, "") ||
+      *(p.pos) != '\000')
+   {
+    if (errno != ENOMEM) errno = EINVAL;
+    job_registry_select_free(sel);
+    return NULL;
+   }
+
+  return sel;
+}
+
+static int
+job_registry_select_eval(const job_registry_select *sel, int n,
+                         const job_registry_entry *en)
+{
+  const job_registry_select_node *node = &(sel->nodes[n]);
+  const char *sval;
+  long long ival;
+  int cmp;
+
+  switch (node->op)
+   {
+    case JOB_REGISTRY_SELECT_TRUE:  return TRUE;
+    case JOB_REGISTRY_SELECT_FALSE: return FALSE;
+    case JOB_REGISTRY_SELECT_NOT:
+      return !job_registry_select_eval(sel, node->left, en);
+    case JOB_REGISTRY_SELECT_AND:
+      return job_registry_select_eval(sel, node->left, en) &&
+             job_registry_select_eval(sel, node->right, en);
+    case JOB_REGISTRY_SELECT_OR:
+      return job_registry_select_eval(sel, node->left, en) ||
+             job_registry_select_eval(sel, node->right, en);
+    default:
+      break;
+   }
+
+  if (node->sval != NULL)
+   {
+    sval = (node->attr == JOB_REGISTRY_SELECT_BATCH_ID) ? en->batch_id
+                                                         : en->blah_id;
+    switch (node->op)
+     {
+      case JOB_REGISTRY_SELECT_EQ:   return strcasecmp(sval, node->sval) == 0;
+      case JOB_REGISTRY_SELECT_NE:   return strcasecmp(sval, node->sval) != 0;
+      case JOB_REGISTRY_SELECT_IS:   return strcmp(sval, node->sval) == 0;
+      case JOB_REGISTRY_SELECT_ISNT: return strcmp(sval, node->sval) != 0;
+      default:                       return FALSE;
+     }
+   }
+
+  /* Same values as in the classad printout */
+  switch (node->attr)
+   {
+    case JOB_REGISTRY_SELECT_STATUS:    ival = en->status; break;
+    case JOB_REGISTRY_SELECT_CDATE:     ival = (unsigned int)en->cdate; break;
+    case JOB_REGISTRY_SELECT_MDATE:     ival = (unsigned int)en->mdate; break;
+    case JOB_REGISTRY_SELECT_UDATE:     ival = (unsigned int)en->udate; break;
+    case JOB_REGISTRY_SELECT_SUBMITTER: ival = (int)en->submitter; break;
+    default: return FALSE;
+   }
+  cmp = (ival > node->ival) - (ival < node->ival);
+
+  switch (node->op)
+   {
+    case JOB_REGISTRY_SELECT_EQ:
+    case JOB_REGISTRY_SELECT_IS:   return cmp == 0;
+    case JOB_REGISTRY_SELECT_NE:
+    case JOB_REGISTRY_SELECT_ISNT: return cmp != 0;
+    case JOB_REGISTRY_SELECT_LT:   return cmp < 0;
+    case JOB_REGISTRY_SELECT_LE:   return cmp <= 0;
+    case JOB_REGISTRY_SELECT_GT:   return cmp > 0;
+    case JOB_REGISTRY_SELECT_GE:   return cmp >= 0;
+    default:                       return FALSE;
+   }
+}
+
+/*
+ * job_registry_select_match
+ *
+ * Evaluate a compiled selection expression on a registry entry.
+ *
+ * @param sel Compiled expression returned by job_registry_select_compile.
+ * @param en Registry entry.
+ *
+ * @return TRUE if the entry is selected, FALSE otherwise.
+ */
+
+int
+job_registry_select_match(const job_registry_select *sel,
+                          const job_registry_entry *en)
+{
+  return job_registry_select_eval(sel, sel->root, en);
+}
+
+/*
+ * job_registry_select_free
+ *
+ * Free a compiled selection expression.
+ *
+ * @param sel Compiled expression returned by job_registry_select_compile.
+ */
+
+void
+job_registry_select_free(job_registry_select *sel)
+{
+  int i;
+
+  if (sel == NULL) return;
+  for (i = 0; i < sel->n_nodes; i++)
+    if (sel->nodes[i].sval != NULL) free(sel->nodes[i].sval);
+  if (sel->nodes != NULL) free(sel->nodes);
+  free(sel);
+}
@@ -21,6 +21,24 @@
  *  11-Mar-2010 Added JOB_REGISTRY_UNLINK_FAIL return code.
  *              Added job_registry_check_index_key_uniqueness.
  *  21-Jul-2011 Added job_registry_need_update function.
+ *  17-Oct-2026 Added persistent handle mode with in-memory hash index.
+ *              Added copy-free access to the mapped registry.
+ *              Added job_registry_sort_merge for incremental resync.
+ *              Index is now sorted on (ID, recnum) by radix sort.
+ *              Added front-coded compact index mode.
+ *              Added secondary hash indexes on persistent handles.
+ *              Added subject hash cache and posting lists.
+ *              Added job_registry_update_batch.
+ *              Added seqlock file for lock-free record reads.
+ *              Added job_registry_purge_online.
+ *              Added segment summary file and
+ *              job_registry_get_next_mapped_since.
+ *              Added change journal (job_registry_changes_since).
+ *              Added job_registry_wait_change.
+ *              Added NPU spool file, merged in bulk.
+ *              Added job_registry_entry_format_classad.
+ *              Added compiled selection expressions
+ *              (job_registry_select_compile).
  *
  *  Description:
  *    Prototypes of functions defined in job_registry.c
@@ -54,6 +72,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <sys/types.h>
 #include "blahpd.h"
 
 #define JOB_REGISTRY_MMAP_UPDATE_TIMEOUT 300
@@ -128,6 +147,28 @@ typedef struct job_registry_index_s
    job_registry_recnum_t recnum;
  } job_registry_index;
 
+/* Front-coded index: see job_registry_compact */
+typedef struct job_registry_compact_index_s
+ {
+   uint32_t n_entries;
+   uint32_t n_blocks;
+   uint32_t arena_len;
+   uint32_t *block_offsets;
+   job_registry_recnum_t *recnums;
+   char *arena;
+ } job_registry_compact_index;
+
+typedef struct job_registry_compact_iterator_s
+ {
+   uint32_t n;
+   uint32_t pos;
+   job_registry_recnum_t recnum;
+   char id[JOBID_MAX_LEN];
+ } job_registry_compact_iterator;
+
+#define JOB_REGISTRY_COMPACT_BLOCK 16
+#define JOB_REGISTRY_COMPACT_MIN_DELTA 1024
+
 typedef enum job_registry_index_mode_e
  {
    NO_INDEX,
@@ -140,6 +181,119 @@ typedef enum job_registry_index_mode_e
    BY_USER_PREFIX_MMAP
  } job_registry_index_mode;
 
+/* Keys that can be hash-indexed at the same time in persistent mode: */
+/* blah_id, batch_id, user_prefix (see job_registry_persist_index). */
+#define JOB_REGISTRY_N_HASH_KEYS 3
+/* hash_keys bit for subject hash posting lists */
+#define JOB_REGISTRY_SUBJECT_KEY_BIT (1 << JOB_REGISTRY_N_HASH_KEYS)
+
+/* First and last record with a given subject hash */
+typedef struct job_registry_subject_slot_s
+ {
+   job_registry_recnum_t first;
+   job_registry_recnum_t last;
+ } job_registry_subject_slot;
+
+/* In-memory copy of the subjectlist and npusubjectlist files */
+typedef struct job_registry_subject_cache_s
+ {
+   char **lines;      /* "hash subject" lines, hash NUL-terminated */
+   int n_lines;
+   int n_alloc;
+   uint32_t *table;   /* Open addressing: line index + 1 */
+   uint32_t table_size;
+   ino_t list_ino;
+   off_t list_offset;
+   ino_t npulist_ino;
+   off_t npulist_offset;
+ } job_registry_subject_cache;
+
+/* Shared header of the <registry>.seqlock file. 'seq' is odd while */
+/* a writer is rewriting registry records (see job_registry_get). */
+#define JOB_REGISTRY_SEQLOCK_MAGIC   0x4c515342
+#define JOB_REGISTRY_SEQLOCK_VERSION 1
+#define JOB_REGISTRY_SEQLOCK_RETRIES 8
+#define JOB_REGISTRY_SCAN_BATCH      64 /* Records copied at once by mapped scans */
+
+typedef struct job_registry_seqlock_s
+ {
+   uint32_t magic;
+   uint32_t version;
+   volatile uint64_t seq;
+ } job_registry_seqlock;
+
+/* Summary of the registry in segments of JOB_REGISTRY_SEGMENT_RECORDS */
+/* records (<registry>.segments): the header is followed by the most */
+/* recent mdate of each segment. */
+#define JOB_REGISTRY_SEGMENT_MAGIC   0x53474553
+#define JOB_REGISTRY_SEGMENT_VERSION 1
+#define JOB_REGISTRY_SEGMENT_RECORDS 1024
+
+typedef struct job_registry_segment_header_s
+ {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t segment_records;
+   job_registry_recnum_t firstrec;
+   uint64_t registry_ino;
+ } job_registry_segment_header;
+
+/* Journal of record changes (<registry>.changes), appended by writers. */
+/* It is restarted, with a new generation, when the registry file is */
+/* replaced or when it reaches JOB_REGISTRY_CHANGES_MAX entries. */
+#define JOB_REGISTRY_CHANGES_MAGIC   0x47484352
+#define JOB_REGISTRY_CHANGES_VERSION 1
+#define JOB_REGISTRY_CHANGES_MAX     65536
+#define JOB_REGISTRY_CHANGES_CHUNK   512 /* Entries per read */
+
+typedef struct job_registry_changes_header_s
+ {
+   uint32_t magic;
+   uint32_t version;
+   job_registry_recnum_t firstrec;
+   uint32_t reserved;
+   uint64_t registry_ino;
+   uint64_t generation;
+ } job_registry_changes_header;
+
+typedef struct job_registry_change_s
+ {
+   job_registry_recnum_t recnum;
+   uint32_t reserved;
+   int64_t mdate;
+ } job_registry_change;
+
+/* Changes reported by job_registry_wait_change */
+#define JOB_REGISTRY_WATCH_UPDATE    0x1 /* Records rewritten in place */
+#define JOB_REGISTRY_WATCH_APPEND    0x2 /* Records appended */
+#define JOB_REGISTRY_WATCH_REPLACE   0x4 /* Registry file replaced (purge) */
+#define JOB_REGISTRY_WATCH_NPU       0x8 /* New non-privileged updates */
+#define JOB_REGISTRY_WATCH_ANY       0xf
+#define JOB_REGISTRY_WATCH_POLL_MS   250 /* Fallback polling interval */
+
+/* Spool of non-privileged appends (<registry>.npuspool). Entries are */
+/* appended after the header and merged in bulk by privileged handles, */
+/* so the spool size tells whether anything is pending. */
+#define JOB_REGISTRY_NPU_SPOOL_MAGIC   0x4c4f5053
+#define JOB_REGISTRY_NPU_SPOOL_VERSION 1
+#define JOB_REGISTRY_NPU_MERGE_CHUNK   256 /* Entries per append */
+
+typedef struct job_registry_npu_spool_header_s
+ {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t reclen;
+   uint32_t reserved;
+   int64_t npudir_scanned; /* No NPU files were left in npudir at this time */
+ } job_registry_npu_spool_header;
+
+/* Position of a job_registry_changes_since reader. Zero it to start. */
+typedef struct job_registry_changes_cursor_s
+ {
+   uint64_t generation;
+   off_t offset;
+ } job_registry_changes_cursor;
+
 typedef struct job_registry_handle_s
  {
    uint32_t firstrec;
@@ -151,6 +305,8 @@ typedef struct job_registry_handle_s
    char *proxydir;
    char *subjectlist;
    char *npusubjectlist;
+   char *npuspool;
+   int npuspool_fd;
    job_registry_index *entries;
    int n_entries;
    int n_alloc;
@@ -159,15 +315,72 @@ typedef struct job_registry_handle_s
    int mmap_fd;
    off_t index_mmap_length;
    char *mmappableindex;
+   /* Persistent handle mode (see job_registry_persist) */
+   int persist_fd;
+   char *data_map;
+   off_t data_map_length;
+   ino_t data_map_ino;
+   job_registry_recnum_t data_map_firstrec;
+   job_registry_recnum_t *hash_index[JOB_REGISTRY_N_HASH_KEYS];
+   uint32_t hash_size;
+   uint32_t hash_used[JOB_REGISTRY_N_HASH_KEYS];
+   uint32_t hash_keys; /* Bitmask of hash-indexed keys */
+   job_registry_subject_slot *subject_slots;
+   job_registry_recnum_t *subject_chain; /* Next record, by file offset */
+   uint32_t subject_chain_alloc;
+   job_registry_subject_cache *subject_cache;
+   char *seqfile;
+   job_registry_seqlock *seqlock;
+   int seqlock_writable;
+   int seqlock_trusted; /* All writers can bump the counter */
+   char *segfile;
+   int segment_fd;
+   time_t *segment_mdate; /* Loaded by job_registry_get_next_mapped_since */
+   uint32_t n_segments;
+   char *changesfile;
+   int changes_fd;
+   job_registry_recnum_t *changed; /* Filled by job_registry_changes_since */
+   uint32_t n_changed;
+   uint32_t n_changed_alloc;
+   job_registry_entry *scan_buf; /* Copies returned by mapped scans */
+   job_registry_recnum_t scan_buf_first;
+   uint32_t scan_buf_n;
+   /* Change notification (see job_registry_wait_change) */
+   int watch_fd; /* inotify descriptor, or -1 when polling */
+   int watch_npu_wd;
+   int watch_setup;
+   ino_t watch_ino;
+   off_t watch_size;
+   time_t watch_mtime;
+   time_t watch_npu_mtime;
+   off_t watch_npu_size;
+   uint64_t watch_seq;
+   /* Compact index mode (see job_registry_compact) */
+   job_registry_compact_index *compact;
  } job_registry_handle;
 
-typedef enum job_registry_sort_state_e
+typedef struct job_registry_sort_key_s
  {
-   UNSORTED,
-   LEFT_BOUND,
-   RIGHT_BOUND,
-   SORTED
- } job_registry_sort_state;
+   uint64_t prefix;
+   uint32_t pos;
+ } job_registry_sort_key;
+
+#define JOB_REGISTRY_SORT_INSERTION_THRESHOLD 32
+
+/* In-place updates applied together by job_registry_update_batch */
+typedef struct job_registry_batch_item_s
+ {
+   job_registry_entry entry;  /* New values in, registry contents out */
+   job_registry_update_bitmask_t upbits;
+   int result;                /* As returned by job_registry_update_op */
+ } job_registry_batch_item;
+
+typedef struct job_registry_batch_s
+ {
+   job_registry_batch_item *items;
+   int n_items;
+   int n_alloc;
+ } job_registry_batch;
 
 typedef struct job_registry_split_id_s
  {
@@ -182,6 +395,90 @@ typedef struct job_registry_hash_store_s
    int n_data;
  } job_registry_hash_store;
 
+/* Counters and timings of a job_registry_purge_online call */
+#define JOB_REGISTRY_PURGE_MAX_PASSES 4
+#define JOB_REGISTRY_PURGE_CHUNK      256 /* Records per write */
+
+typedef struct job_registry_purge_stats_s
+ {
+   uint32_t n_scanned;
+   uint32_t n_purged;
+   uint32_t n_refreshed; /* Copied again after being updated meanwhile */
+   uint32_t n_locked;    /* Copied while holding the write lock */
+   int n_passes;
+   double copy_seconds;  /* Whole purge */
+   double pause_seconds; /* Write lock held */
+ } job_registry_purge_stats;
+
+typedef struct job_registry_purge_work_s
+ {
+   const job_registry_entry *recs; /* Mapped registry being purged */
+   int rfd;
+   job_registry_recnum_t n_mapped;
+   job_registry_recnum_t n_copied; /* Registry records seen so far */
+   job_registry_recnum_t *old_pos; /* Position in registry of each copy */
+   job_registry_recnum_t n_out;
+   job_registry_recnum_t n_alloc;
+   job_registry_recnum_t new_first;
+   int nfd;
+   job_registry_entry *buf;
+   job_registry_hash_store hst;
+   time_t *seg_mdate; /* Segment summary of the new registry file */
+   uint32_t n_seg_alloc;
+   job_registry_recnum_t *purged_pos; /* Purged records with a proxy */
+   job_registry_recnum_t n_purged_pos;
+   job_registry_recnum_t n_purged_alloc;
+   job_registry_purge_stats st;
+ } job_registry_purge_work;
+
+/* Selection expressions compiled by job_registry_select_compile */
+typedef enum job_registry_select_op_e
+ {
+   JOB_REGISTRY_SELECT_TRUE,
+   JOB_REGISTRY_SELECT_FALSE,
+   JOB_REGISTRY_SELECT_NOT,
+   JOB_REGISTRY_SELECT_AND,
+   JOB_REGISTRY_SELECT_OR,
+   JOB_REGISTRY_SELECT_EQ,   /* == (case-insensitive on strings) */
+   JOB_REGISTRY_SELECT_NE,   /* != */
+   JOB_REGISTRY_SELECT_IS,   /* =?=, is (case-sensitive) */
+   JOB_REGISTRY_SELECT_ISNT, /* =!=, isnt */
+   JOB_REGISTRY_SELECT_LT,
+   JOB_REGISTRY_SELECT_LE,
+   JOB_REGISTRY_SELECT_GT,
+   JOB_REGISTRY_SELECT_GE
+ } job_registry_select_op;
+
+typedef enum job_registry_select_attr_e
+ {
+   JOB_REGISTRY_SELECT_BATCH_ID,
+   JOB_REGISTRY_SELECT_BLAH_ID,
+   JOB_REGISTRY_SELECT_STATUS,
+   JOB_REGISTRY_SELECT_CDATE,
+   JOB_REGISTRY_SELECT_MDATE,
+   JOB_REGISTRY_SELECT_UDATE,
+   JOB_REGISTRY_SELECT_SUBMITTER
+ } job_registry_select_attr;
+
+typedef struct job_registry_select_node_s
+ {
+   job_registry_select_op op;
+   job_registry_select_attr attr; /* Comparisons only */
+   int left, right;               /* Operand nodes of NOT, AND, OR */
+   long long ival;
+   char *sval;                    /* NULL when comparing integers */
+ } job_registry_select_node;
+
+#define JOB_REGISTRY_SELECT_MAX_NODES 256
+
+typedef struct job_registry_select_s
+ {
+   job_registry_select_node *nodes;
+   int n_nodes;
+   int n_alloc;
+   int root;
+ } job_registry_select;
+
 #define JOB_REGISTRY_BINFO_ONLY       3
 #define JOB_REGISTRY_UNCHANGED        2
 #define JOB_REGISTRY_CHANGED          1
@@ -212,10 +509,12 @@ typedef struct job_registry_hash_store_s
 #define JOB_REGISTRY_BIND_FAIL       -24 
 #define JOB_REGISTRY_CONNECT_FAIL    -25 
 #define JOB_REGISTRY_TTL_FAIL        -26 
+#define JOB_REGISTRY_CHANGES_RESET   -27 
 
 #define JOB_REGISTRY_TEST_FILE "/tmp/test_reg.bjr"
 #define JOB_REGISTRY_REGISTRY_NAME "registry"
 #define JOB_REGISTRY_ALLOC_CHUNK     20
+#define JOB_REGISTRY_HASH_MIN_SIZE   1024
 
 char *jobregistry_construct_path(const char *format, const char *path,
                                  unsigned int num);
@@ -223,6 +522,8 @@ size_t job_registry_probe_next_record(FILE *fd, job_registry_entry *en);
 int job_registry_update_reg(const job_registry_handle *rha, const char *old_path);
 int job_registry_purge(const char *path, time_t oldest_creation_date,
                        int force_rewrite);
+int job_registry_purge_online(const char *path, time_t oldest_creation_date,
+                              job_registry_purge_stats *stats);
 job_registry_handle *job_registry_init(const char *path, 
                                        job_registry_index_mode mode);
 void job_registry_destroy(job_registry_handle *rhandle);
@@ -230,6 +531,14 @@ job_registry_recnum_t job_registry_firstrec(job_registry_handle *rhandle, FILE *
 int job_registry_resync_mmap(job_registry_handle *rhandle, FILE *fd);
 int job_registry_resync(job_registry_handle *rhandle, FILE *fd);
 int job_registry_sort(job_registry_handle *rhandle);
+int job_registry_sort_entries(job_registry_index *entries, int n_entries);
+int job_registry_sort_merge(job_registry_handle *rhandle, int n_sorted);
+int job_registry_compact(job_registry_handle *rhandle);
+int job_registry_compact_merge(job_registry_handle *rhandle);
+void job_registry_compact_free(job_registry_compact_index *ci);
+job_registry_recnum_t job_registry_compact_lookup(const job_registry_compact_index *ci,
+                                                  const char *id);
+size_t job_registry_index_memory(const job_registry_handle *rhandle);
 job_registry_recnum_t job_registry_get_recnum(const job_registry_handle *rha,
                                               const char *id);
 job_registry_recnum_t job_registry_lookup(job_registry_handle *rhandle,
@@ -271,20 +580,72 @@ int job_registry_update_op(job_registry_handle *rhandle,
                         job_registry_entry *entry,
                         int use_recn, FILE *fd,
                         job_registry_update_bitmask_t upbits);
+int job_registry_batch_push(job_registry_batch *batch,
+                            const job_registry_entry *entry,
+                            job_registry_recnum_t recn,
+                            job_registry_update_bitmask_t upbits);
+int job_registry_update_batch(job_registry_handle *rhandle,
+                              job_registry_batch *batch);
+void job_registry_batch_clear(job_registry_batch *batch);
+void job_registry_batch_free(job_registry_batch *batch);
 int job_registry_need_update(const job_registry_entry *olde,
                              const job_registry_entry *newe,
                              job_registry_update_bitmask_t upbits);
 job_registry_entry *job_registry_get(job_registry_handle *rhandle,
                                      const char *id);
+int job_registry_persist(job_registry_handle *rhandle);
+int job_registry_persist_revalidate(job_registry_handle *rhandle);
+int job_registry_persist_index(job_registry_handle *rhandle,
+                               job_registry_index_mode key);
+job_registry_recnum_t job_registry_hash_lookup(const job_registry_handle *rha,
+                                               const char *id);
+job_registry_recnum_t job_registry_hash_lookup_by(const job_registry_handle *rha,
+                                                  job_registry_index_mode key,
+                                                  const char *id);
+job_registry_entry *job_registry_persist_get(job_registry_handle *rhandle,
+                                             const char *id);
+job_registry_entry *job_registry_persist_get_by(job_registry_handle *rhandle,
+                                                job_registry_index_mode key,
+                                                const char *id);
+job_registry_entry *job_registry_get_by(job_registry_handle *rhandle,
+                                        job_registry_index_mode key,
+                                        const char *id);
+const job_registry_entry *job_registry_get_next_mapped(
+                                     job_registry_handle *rhandle,
+                                     job_registry_recnum_t *cursor);
+const job_registry_entry *job_registry_get_next_mapped_since(
+                                     job_registry_handle *rhandle,
+                                     job_registry_recnum_t *cursor,
+                                     time_t since);
+int job_registry_changes_since(job_registry_handle *rhandle,
+                               job_registry_changes_cursor *cursor,
+                               time_t until);
+const job_registry_entry *job_registry_get_next_changed(
+                                     job_registry_handle *rhandle,
+                                     job_registry_recnum_t *cursor);
+int job_registry_watch(job_registry_handle *rhandle);
+int job_registry_wait_change(job_registry_handle *rhandle, int mask,
+                             int timeout_ms);
+const job_registry_entry *job_registry_lookup_mapped(
+                                     job_registry_handle *rhandle,
+                                     const char *id);
+const job_registry_entry *job_registry_lookup_mapped_by(
+                                     job_registry_handle *rhandle,
+                                     job_registry_index_mode key,
+                                     const char *id);
 FILE *job_registry_open(job_registry_handle *rhandle, const char *mode);
 int job_registry_rdlock(const job_registry_handle *rhandle, FILE *sfd);
 int job_registry_wrlock(const job_registry_handle *rhandle, FILE *sfd);
 int job_registry_unlock(FILE *sfd);
+int job_registry_unlock_fd(int fd);
 job_registry_entry *job_registry_get_next(const job_registry_handle *rhandle,
                                           FILE *fd);
 int job_registry_seek_next(FILE *fd, job_registry_entry *result);
 char *job_registry_entry_as_classad(const job_registry_handle *rha,
                                     const job_registry_entry *entry);
+int job_registry_entry_format_classad(const job_registry_handle *rha,
+                                      const job_registry_entry *entry,
+                                      char **buf, size_t *buf_size);
 job_registry_split_id *job_registry_split_blah_id(const char *bid);
 void job_registry_free_split_id(job_registry_split_id *spid);
 int job_registry_set_proxy(const job_registry_handle *rha,
@@ -304,6 +665,11 @@ char *job_registry_lookup_subject_hash(const job_registry_handle *rha,
 job_registry_entry *job_registry_get_next_hash_match(
                                  const job_registry_handle *rha,
                                  FILE *fd, const char *hash);
+int job_registry_persist_subjects(job_registry_handle *rhandle);
+const job_registry_entry *job_registry_get_next_subject_match(
+                                 job_registry_handle *rhandle,
+                                 const char *hash,
+                                 job_registry_recnum_t *cursor);
 int job_registry_store_hash(job_registry_hash_store *hst,
                             const char *hash);
 int job_registry_lookup_hash(const job_registry_hash_store *hst,
@@ -313,6 +679,10 @@ int job_registry_purge_subject_hash_list(const job_registry_handle *rha,
                                          const job_registry_hash_store *hst);
 int job_registry_check_index_key_uniqueness(const job_registry_handle *rha,
                                             char **first_duplicate_id);
+job_registry_select *job_registry_select_compile(const char *expr);
+int job_registry_select_match(const job_registry_select *sel,
+                              const job_registry_entry *en);
+void job_registry_select_free(job_registry_select *sel);
 
 
 #ifndef TRUE
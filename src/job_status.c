@@ -6,6 +6,8 @@
 #
 #
 #  Revision history:
+#   17 Oct 2026 - Concurrent and recent executions of the same status
+#                 script share a single run.
 #
 #  Description:
 #
@@ -33,6 +35,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -51,6 +55,7 @@
 extern char *blah_script_location;
 extern job_registry_handle *blah_jr_handle;
 extern pthread_mutex_t blah_jr_lock;
+extern int blah_status_cache_ttl;
 
 #define TSF_DEBUG
 
@@ -69,6 +74,184 @@ unlink_proxy_symlink(job_registry_entry *en, classad_context *cad, const job_reg
 	return;
 }
 
+classad_context
+registry_entry_to_classad(const job_registry_handle *rha, const job_registry_entry *en)
+{
+	/* Same attributes as job_registry_entry_as_classad, inserted */
+	/* directly with no text formatting and parsing */
+	classad_context cad = NULL;
+	char *proxypath;
+	int ret;
+
+	if (classad_put_string_attribute(&cad, "BatchJobId", en->batch_id) != C_CLASSAD_NO_ERROR ||
+	    classad_put_int_attribute(&cad, "JobStatus", en->status) != C_CLASSAD_NO_ERROR ||
+	    classad_put_string_attribute(&cad, "BlahJobId", en->blah_id) != C_CLASSAD_NO_ERROR ||
+	    classad_put_int_attribute(&cad, "CreateTime", (int)en->cdate) != C_CLASSAD_NO_ERROR ||
+	    classad_put_int_attribute(&cad, "ModifiedTime", (int)en->mdate) != C_CLASSAD_NO_ERROR ||
+	    classad_put_int_attribute(&cad, "UserTime", (int)en->udate) != C_CLASSAD_NO_ERROR ||
+	    classad_put_int_attribute(&cad, "SubmitterUid", (int)en->submitter) != C_CLASSAD_NO_ERROR)
+		goto fail;
+
+	if (en->wn_addr[0] != '\000' &&
+	    classad_put_string_attribute(&cad, "WorkerNode", en->wn_addr) != C_CLASSAD_NO_ERROR)
+		goto fail;
+	if (en->proxy_link[0] != '\000' &&
+	    (proxypath = job_registry_get_proxy(rha, en)) != NULL)
+	{
+		ret = classad_put_string_attribute(&cad, "X509UserProxy", proxypath);
+		free(proxypath);
+		if (ret != C_CLASSAD_NO_ERROR) goto fail;
+	}
+	if (en->status == COMPLETED &&
+	    classad_put_int_attribute(&cad, "ExitCode", en->exitcode) != C_CLASSAD_NO_ERROR)
+		goto fail;
+	if (en->exitreason[0] != '\000' &&
+	    classad_put_string_attribute(&cad, "ExitReason", en->exitreason) != C_CLASSAD_NO_ERROR)
+		goto fail;
+	if (en->user_prefix[0] != '\000' &&
+	    classad_put_string_attribute(&cad, "UserPrefix", en->user_prefix) != C_CLASSAD_NO_ERROR)
+		goto fail;
+
+	return cad;
+
+fail:
+	if (cad != NULL) classad_free(cad);
+	return NULL;
+}
+
+/* Status script executions in progress, or completed less than */
+/* blah_status_cache_ttl seconds ago. Identical requests (same command */
+/* line and mapped credentials) share the output of a single run. */
+typedef struct status_flight_s
+{
+	char *key;
+	int   done;
+	int   refs;          /* requests waiting for or copying the result */
+	time_t expires;      /* when done, the result is shared until then */
+	int   exec_result;   /* execute_cmd() return value and errno */
+	int   exec_errno;
+	int   exit_code;
+	char *output;
+	char *error;
+	struct status_flight_s *next;
+} status_flight_t;
+
+static status_flight_t *status_flights = NULL;
+static pthread_mutex_t status_flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t status_flight_done = PTHREAD_COND_INITIALIZER;
+
+/* Drop the completed, unused and expired executions */
+/* Called with status_flight_lock held */
+static void
+status_flight_purge(time_t now)
+{
+	status_flight_t **f = &status_flights;
+	status_flight_t *dead;
+
+	while (*f != NULL)
+	{
+		if ((*f)->done && (*f)->refs == 0 && (*f)->expires <= now)
+		{
+			dead = *f;
+			*f = dead->next;
+			free(dead->key);
+			free(dead->output);
+			free(dead->error);
+			free(dead);
+		}
+		else
+			f = &((*f)->next);
+	}
+}
+
+/* Same as execute_cmd(), but wait for and copy the result of an */
+/* identical execution in progress or recently completed, if any. */
+static int
+execute_status_cmd(exec_cmd_t *cmd)
+{
+	status_flight_t *f;
+	char *key;
+	time_t now;
+	int result, saved_errno;
+
+	key = make_message("%s\n%d\n%s", cmd->command, (int)cmd->delegation_type,
+	                   (cmd->delegation_cred ? cmd->delegation_cred : ""));
+	if (key == NULL) return(execute_cmd(cmd));
+
+	now = time(NULL);
+	pthread_mutex_lock(&status_flight_lock);
+	status_flight_purge(now);
+	for (f = status_flights; f != NULL; f = f->next)
+		if ((!f->done || f->expires > now) && strcmp(f->key, key) == 0) break;
+
+	if (f != NULL)
+	{
+		free(key);
+		f->refs++;
+		while (!f->done)
+			pthread_cond_wait(&status_flight_done, &status_flight_lock);
+		result = f->exec_result;
+		saved_errno = f->exec_errno;
+		if (result == 0)
+		{
+			cmd->output = strdup(f->output);
+			cmd->error = strdup(f->error);
+			cmd->exit_code = f->exit_code;
+			if (cmd->output == NULL || cmd->error == NULL)
+			{
+				recycle_cmd(cmd);
+				result = -1;
+				saved_errno = ENOMEM;
+			}
+		}
+		f->refs--;
+		status_flight_purge(time(NULL));
+		pthread_mutex_unlock(&status_flight_lock);
+		errno = saved_errno;
+		return(result);
+	}
+
+	if ((f = (status_flight_t *)calloc(1, sizeof(status_flight_t))) == NULL)
+	{
+		pthread_mutex_unlock(&status_flight_lock);
+		free(key);
+		return(execute_cmd(cmd));
+	}
+	f->key = key;
+	f->refs = 1;
+	f->next = status_flights;
+	status_flights = f;
+	pthread_mutex_unlock(&status_flight_lock);
+
+	result = execute_cmd(cmd);
+	saved_errno = errno;
+
+	pthread_mutex_lock(&status_flight_lock);
+	f->exec_result = result;
+	f->exec_errno = saved_errno;
+	if (result == 0)
+	{
+		f->exit_code = cmd->exit_code;
+		if ((f->output = strdup(cmd->output)) == NULL ||
+		    (f->error = strdup(cmd->error)) == NULL)
+		{
+			f->exec_result = -1;
+			f->exec_errno = ENOMEM;
+		}
+	}
+	/* Only successful runs are kept after completion */
+	if (f->exec_result == 0 && f->exit_code == 0 && blah_status_cache_ttl > 0)
+		f->expires = time(NULL) + blah_status_cache_ttl;
+	f->done = TRUE;
+	f->refs--;
+	pthread_cond_broadcast(&status_flight_done);
+	status_flight_purge(time(NULL));
+	pthread_mutex_unlock(&status_flight_lock);
+
+	errno = saved_errno;
+	return(result);
+}
+
 int
 get_status(const char *jobDesc, classad_context *cad, char **deleg_parameters, char error_str[][ERROR_MAX_LEN], int get_workernode, int *job_nr)
 {
@@ -77,7 +260,6 @@ get_status(const char *jobDesc, classad_context *cad, char **deleg_parameters, c
 	job_registry_split_id *spid;
 	int  i, lc = 0;
 	classad_context tmpcad;
-	char *cadstr;
 	int res_length;
 	char *begin_res;
 	char *end_res;
@@ -93,23 +275,18 @@ get_status(const char *jobDesc, classad_context *cad, char **deleg_parameters, c
 		if ((ren = job_registry_get(blah_jr_handle, jobDesc)) != NULL)
 		{
 			if (!get_workernode) ren->wn_addr[0]='\000';
-			cadstr = job_registry_entry_as_classad(blah_jr_handle, ren);                       
-			if (cadstr != NULL)
+			tmpcad = registry_entry_to_classad(blah_jr_handle, ren);
+			if (tmpcad != NULL)
 			{
-				tmpcad = classad_parse(cadstr);
-				free(cadstr);
-				if (tmpcad != NULL)
-				{
-					/* Undo the proxy symlink in the job registry for completed jobs. */
-					/* This saves a few inodes. */
-					unlink_proxy_symlink(ren, tmpcad, blah_jr_handle);					
-					*job_nr = 1;
-					strncpy(error_str[0], "No Error", ERROR_MAX_LEN);
-					cad[0] = tmpcad;
-	 				pthread_mutex_unlock(&blah_jr_lock);
-					free(ren);
-					return 0;
-				}
+				/* Undo the proxy symlink in the job registry for completed jobs. */
+				/* This saves a few inodes. */
+				unlink_proxy_symlink(ren, tmpcad, blah_jr_handle);					
+				*job_nr = 1;
+				strncpy(error_str[0], "No Error", ERROR_MAX_LEN);
+				cad[0] = tmpcad;
+	 			pthread_mutex_unlock(&blah_jr_lock);
+				free(ren);
+				return 0;
 			}
 			free(ren);
 		}
@@ -147,7 +324,7 @@ get_status(const char *jobDesc, classad_context *cad, char **deleg_parameters, c
 		exec_command.delegation_cred = deleg_parameters[MEXEC_PARAM_DELEGCRED];
 	}
 
-	retcode = execute_cmd(&exec_command);
+	retcode = execute_status_cmd(&exec_command);
 
 	if (retcode != 0) 
 	{
@@ -30,5 +30,6 @@
 */
 
 /* job_status functions prototypes */
+classad_context registry_entry_to_classad(const job_registry_handle *rha, const job_registry_entry *en);
 int get_status(const char *jobId, classad_context *cad, char **environment, char error_str[][ERROR_MAX_LEN], int get_workernode,int *job_nr );
 
@@ -7,6 +7,7 @@
 #
 #  Revision history:
 #    10 Mar 2009 - Original release
+#    17 Oct 2026 - Commands started by the executor helpers (execpool.c)
 #
 #  Description:
 #    Executes a command, enabling optional "sudo-like" mechanism (like glexec or sudo itself).
@@ -48,6 +49,7 @@
 #include "config.h"
 #include "blah_utils.h"
 #include "mapped_exec.h"
+#include "execpool.h"
 
 extern config_handle *blah_config_handle;
 extern char **environ;
@@ -83,8 +85,9 @@ read_data(const int fdpipe, char **buffer)
 }
 
 static int
-merciful_kill(pid_t pid, exec_cmd_t *cmd)
+merciful_kill(exec_pool_child_t *child, exec_cmd_t *cmd)
 {
+	pid_t pid = child->pid;
 	int graceful_timeout = 20; /* Default value - overridden by config */
 	config_entry *config_timeout;
 	int tmp_timeout;
@@ -113,7 +116,7 @@ merciful_kill(pid_t pid, exec_cmd_t *cmd)
 	}
 
 	/* verify that child is dead */
-	for(tsl = 0; (waitpid(pid, &status, WNOHANG) == 0) &&
+	for(tsl = 0; (exec_pool_wait(child, &status, WNOHANG) == 0) &&
 	              tsl < graceful_timeout; tsl++)
 	{
 		/* still alive, allow a few seconds 
@@ -133,7 +136,7 @@ merciful_kill(pid_t pid, exec_cmd_t *cmd)
 		}
 	}
 
-	if (tsl >= graceful_timeout && (waitpid(pid, &status, WNOHANG) == 0))
+	if (tsl >= graceful_timeout && (exec_pool_wait(child, &status, WNOHANG) == 0))
 	{
 		if (cmd->delegation_type == MEXEC_NO_MAPPING)
 			kill_status = kill(-pid, SIGKILL);
@@ -148,7 +151,7 @@ merciful_kill(pid_t pid, exec_cmd_t *cmd)
 
 		if (kill_status == 0)
 		{
-			waitpid(pid, &status, 0);
+			exec_pool_wait(child, &status, 0);
 		}
 	}
 
@@ -268,7 +271,7 @@ execute_cmd(exec_cmd_t *cmd)
 	int fdpipe_stderr[2];
 	struct pollfd pipe_poll[2];
 	int poll_timeout = 30000; /* 30 seconds by default */
-	pid_t pid, process_group;
+	exec_pool_child_t child;
 	int child_running, status, exitcode;
 	char *killed_format = "%s <blah> killed by signal %s %d.\n";
 	char *killed_for_timeout = "%s <blah> execute_cmd: %d seconds timeout expired, killing child process.\n";
@@ -367,7 +370,7 @@ execute_cmd(exec_cmd_t *cmd)
 			if (cmd->special_cmd == MEXEC_PROXY_COMMAND)
 			{
 				/* Open the file to pass it to the child */
-				proxy_fd = open(cmd->source_proxy, O_RDONLY);
+				proxy_fd = open(cmd->source_proxy, O_RDONLY | O_CLOEXEC);
 				if (proxy_fd == -1)
 				{
 					BLAHDBG("execute_cmd: cannot open source proxy <%s>\n", cmd->source_proxy);
@@ -438,74 +441,26 @@ execute_cmd(exec_cmd_t *cmd)
 	BLAHDBG("execute_cmd: will execute the command <%s>\n", command);
 
 	/* Create the pipes to read the child streams */ 
-	if (pipe(fdpipe_stdout) == -1)
+	if (exec_pool_pipe(fdpipe_stdout) == -1)
 	{
 		perror("pipe() for stdout");
 		return(-1);       
 	}
-	if (pipe(fdpipe_stderr) == -1)
+	if (exec_pool_pipe(fdpipe_stderr) == -1)
 	{
 		perror("pipe() for stderr");
 		return(-1);       
 	}
 
-	/* Let's fork! */
-	switch(pid = fork())
+	/* Let's fork! The command is forked by one of the executor */
+	/* helpers if available, rather than by this (large, */
+	/* multithreaded) process. */
+	switch(exec_pool_spawn(args.we_wordv, cmd_env, proxy_fd, fdpipe_stdout[1], fdpipe_stderr[1], &child))
 	{
 		case -1:
 			perror("fork");
 			return(-1);
 
-		case 0: /* Child process */
-			/* CAUTION: fork was invoked from within a thread!
-			 * Do NOT use any fork-unsafe function! */
-
-			/* Set up process group so that the resulting process tree can be signaled. */
-			if (((process_group = setsid()) == -1) ||
-			     (process_group != getpid()))
-			{
-				fprintf(stderr,"Error: setsid() returns %d. getpid returns %d: ", process_group, getpid());
-				perror("");
-				exit(1);       
-			}
-
-			/* Connect stdin to the proxy file if opened */
-			if (proxy_fd != -1)
-			{
-				if (dup2(proxy_fd, STDIN_FILENO) == -1)
-				{
-					perror("dup2() stdin");
-					exit(1);       
-				}
-				BLAHDBG("%s\n", "Proxy fd dupped on stdin. Setting umask to 0777");
-				umask(077);
-			}
-
-			/* Connect stdout & stderr to the pipes */
-			if (dup2(fdpipe_stdout[1], STDOUT_FILENO) == -1)
-			{
-				perror("dup2() stdout");
-				exit(1);       
-			}
-			if (dup2(fdpipe_stderr[1], STDERR_FILENO) == -1)
-			{
-				perror("dup2() stderr");
-				exit(1);       
-			}
-
-			/* Close unused pipes */
-			close(fdpipe_stdout[0]);
-			close(fdpipe_stdout[1]);
-			close(fdpipe_stderr[0]);
-			close(fdpipe_stderr[1]);
-
-			/* Execute the command */
-			execve(args.we_wordv[0], args.we_wordv, cmd_env);
-
-			/* If we are still here, execve failed */
-			fprintf(stderr, "%s: %s", args.we_wordv[0], strerror(errno));
-			exit(errno);
-
 		default: /* Parent process */
 			/* Close unused pipes */
 			close(fdpipe_stdout[1]);
@@ -559,7 +514,7 @@ execute_cmd(exec_cmd_t *cmd)
 				case -1: /* poll error */
 					if (errno == EINTR) continue; /*poll() was interrupted by a signal. */
 					perror("execute_cmd: poll()");
-					status = merciful_kill(pid, &kill_command);
+					status = merciful_kill(&child, &kill_command);
 					child_running = 0;
 					break;
 
@@ -575,7 +530,7 @@ execute_cmd(exec_cmd_t *cmd)
 						/* if memory low, print message directly on stderr */
 						fprintf(stderr, killed_for_timeout, cmd->error, poll_timeout/1000);
 					/* kill the child process */
-					status = merciful_kill(pid, &kill_command);
+					status = merciful_kill(&child, &kill_command);
 					child_running = 0;
 					break;
 
@@ -607,7 +562,7 @@ execute_cmd(exec_cmd_t *cmd)
 								fprintf(stderr, killed_for_poll_signal, cmd->error, pipe_poll[0].revents, pipe_poll[1].revents);
 						}
 						/* kill the child process */
-						status = merciful_kill(pid, &kill_command);
+						status = merciful_kill(&child, &kill_command);
 						child_running = 0;
 						break;
 					}
@@ -616,6 +571,7 @@ execute_cmd(exec_cmd_t *cmd)
 
 			close(fdpipe_stdout[0]);
 			close(fdpipe_stderr[0]);
+			exec_pool_release(&child);
 
 			if (WIFEXITED(status))
 			{
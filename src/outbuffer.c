@@ -0,0 +1,316 @@
+/*
+#  File:     outbuffer.c
+#
+#
+#  Revision history:
+#   17 Oct 2026 - Original release
+#
+#  Description:
+#   Buffer the replies to a file descriptor, so that the replies to
+#   pipelined commands are written with a single writev() call.
+#   Partial writes are resumed, and a non-blocking descriptor is
+#   waited for when not ready (EAGAIN).
+#
+#
+#  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
+#
+#    See http://www.eu-egee.org/partners/ for details on the copyright
+#    holders.
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+#
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "outbuffer.h"
+
+static int out_fd = -1;                             /* Destination of the replies */
+static struct iovec out_iov[OUTBUF_MAX_PENDING];    /* Pending replies */
+static char *out_alloc[OUTBUF_MAX_PENDING];         /* Replies to free, or NULL */
+static int out_first = 0;                           /* First pending reply */
+static int out_pending = 0;                         /* Number of pending replies */
+static size_t out_pending_size = 0;                 /* Bytes still to be written */
+static out_buffer_stats_t out_stats;
+
+
+/* Initialise static data and structures
+ * */
+int
+out_buffer_init(const int fd)
+{
+	out_fd = fd;
+	out_first = out_pending = 0;
+	out_pending_size = 0;
+	memset(&out_stats, 0, sizeof(out_stats));
+	return(OUTBUF_OK);
+}
+
+
+/* Return the file descriptor the replies are written to
+ * */
+int
+out_buffer_fd(void)
+{
+	return(out_fd);
+}
+
+
+/* Release the replies written so far
+ * */
+static void
+out_buffer_release(int n)
+{
+	int i;
+
+	for (i = out_first; i < out_first + n; i++)
+		if (out_alloc[i] != NULL) free(out_alloc[i]);
+	out_first += n;
+	out_pending -= n;
+	if (out_pending == 0) out_first = 0;
+}
+
+
+/* Write all the pending replies
+ * */
+int
+out_buffer_flush(void)
+{
+	ssize_t written;
+	struct pollfd pfd;
+	int n_done;
+
+	if (out_fd < 0) return(OUTBUF_ERROR_NOBUFFER);
+
+	while (out_pending > 0)
+	{
+		written = writev(out_fd, out_iov + out_first, out_pending);
+		out_stats.syscalls++;
+		if (written < 0)
+		{
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				/* Wait for the descriptor to drain */
+				pfd.fd = out_fd;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, -1) >= 0 || errno == EINTR) continue;
+			}
+			/* Drop the replies that cannot be sent */
+			out_buffer_release(out_pending);
+			out_pending_size = 0;
+			return(OUTBUF_ERROR_WRITE);
+		}
+		out_stats.bytes += written;
+		out_pending_size -= written;
+
+		/* Skip the replies written completely, */
+		/* and the written part of the next one */
+		for (n_done = 0; n_done < out_pending && (size_t)written >= out_iov[out_first + n_done].iov_len; n_done++)
+			written -= out_iov[out_first + n_done].iov_len;
+		out_buffer_release(n_done);
+		if (out_pending > 0)
+		{
+			out_iov[out_first].iov_base = (char *)out_iov[out_first].iov_base + written;
+			out_iov[out_first].iov_len -= written;
+		}
+	}
+	return(OUTBUF_OK);
+}
+
+
+/* Queue a reply of len bytes, to be written at the next flush
+ * If to_free is set, the reply is freed once written, otherwise
+ * it must stay valid until then
+ * The pending replies are flushed when there are too many of them
+ * */
+int
+out_buffer_queue(char *reply, const size_t len, const int to_free)
+{
+	int retcod = OUTBUF_OK;
+
+	if (out_fd < 0) return(OUTBUF_ERROR_NOBUFFER);
+
+	if (out_first + out_pending >= OUTBUF_MAX_PENDING)
+		retcod = out_buffer_flush();
+
+	out_iov[out_first + out_pending].iov_base = reply;
+	out_iov[out_first + out_pending].iov_len = len;
+	out_alloc[out_first + out_pending] = to_free ? reply : NULL;
+	out_pending++;
+	out_pending_size += len;
+	out_stats.replies++;
+
+	if (out_pending_size >= OUTBUF_MAX_PENDING_SIZE && retcod == OUTBUF_OK)
+		retcod = out_buffer_flush();
+	return(retcod);
+}
+
+
+/* Get the counters of the buffer
+ * */
+void
+out_buffer_get_stats(out_buffer_stats_t *stats)
+{
+	*stats = out_stats;
+}
+
+
+#ifdef OUTBUF_DEBUG
+/* ------ TEST CODE HERE -------
+#
+#  Description:
+#   Write batches of replies to a non-blocking pipe, read slowly
+#   by a child process, so that partial writes and EAGAIN occur.
+#   The child checks that the replies are received unchanged and
+#   in order. The number of writev() calls is compared with the
+#   number of replies.
+#
+#   Compile with -DOUTBUF_DEBUG option, e.g.
+#   $ gcc -o test_outbuffer -DOUTBUF_DEBUG outbuffer.c
+#
+*/
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <getopt.h>
+
+/* Reply number n: one in 1000 is much longer than the pipe buffer */
+static size_t
+make_reply(char *buf, size_t size, int n)
+{
+	size_t len;
+
+	len = snprintf(buf, size, "%d 0 No\\ error%s", n, (n % 1000 == 0) ? " " : "");
+	if (n % 1000 == 0)
+		while (len < size - 3) buf[len++] = 'a' + n % 26;
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+	buf[len] = '\000';
+	return(len);
+}
+
+/* Read the replies slowly, and compare them with the expected ones
+ * */
+static int
+receive_replies(int rfd, int n_replies)
+{
+	char expected[200000];
+	char *got;
+	size_t len, done;
+	ssize_t n;
+	int i;
+
+	if ((got = (char *)malloc(sizeof(expected))) == NULL) return(1);
+	for (i = 0; i < n_replies; i++)
+	{
+		len = make_reply(expected, (i % 1000 == 0) ? sizeof(expected) : 64, i);
+		for (done = 0; done < len; done += n)
+		{
+			if ((n = read(rfd, got + done, (len - done < 4096) ? len - done : 4096)) <= 0) return(1);
+			if (i % 500 == 0) usleep(1000);
+		}
+		if (memcmp(got, expected, len) != 0)
+		{
+			fprintf(stderr, "Reply %d differs\n", i);
+			return(1);
+		}
+	}
+	free(got);
+	return(read(rfd, expected, 1) != 0);
+}
+
+/* Print usage
+ * */
+void
+usage(const char *cmd)
+{
+	printf("Usage: %s [-h] [-n <replies>] [-b <batch>]\n", cmd);
+	printf("  -h             print this help and exit\n");
+	printf("  -n <replies>   number of replies (default = 10000)\n");
+	printf("  -b <batch>     replies queued before each flush (default = 20)\n\n");
+	return;
+}
+
+int
+main(int argc, char **argv)
+{
+	int pfd[2];
+	pid_t pid;
+	int n_replies = 10000, batch = 20;
+	int i, opt, status, res;
+	char *reply;
+	size_t len;
+	out_buffer_stats_t stats;
+
+	while ((opt = getopt(argc, argv, "hn:b:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': n_replies = atoi(optarg); break;
+		case 'b': batch = atoi(optarg); break;
+		default: usage(argv[0]); exit(opt == 'h' ? 0 : 1);
+		}
+	}
+
+	res = pipe(pfd);
+	assert(res == 0);
+	switch (pid = fork())
+	{
+	case -1:
+		perror("fork()");
+		exit(1);
+	case 0:
+		close(pfd[1]);
+		_exit(receive_replies(pfd[0], n_replies));
+	}
+	close(pfd[0]);
+	res = fcntl(pfd[1], F_SETFL, O_NONBLOCK);
+	assert(res == 0);
+
+	out_buffer_init(pfd[1]);
+	for (i = 0; i < n_replies; i++)
+	{
+		len = (i % 1000 == 0) ? 200000 : 64;
+		reply = (char *)malloc(len);
+		assert(reply != NULL);
+		len = make_reply(reply, len, i);
+		res = out_buffer_queue(reply, len, 1);
+		assert(res == OUTBUF_OK);
+		if (i % batch == batch - 1)
+		{
+			res = out_buffer_flush();
+			assert(res == OUTBUF_OK);
+		}
+	}
+	res = out_buffer_flush();
+	assert(res == OUTBUF_OK);
+	close(pfd[1]);
+
+	res = waitpid(pid, &status, 0);
+	assert(res == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	out_buffer_get_stats(&stats);
+	printf("%lu replies, %lu bytes written with %lu writev() calls.\n",
+	       stats.replies, stats.bytes, stats.syscalls);
+	return(0);
+}
+#endif /* OUTBUF_DEBUG */
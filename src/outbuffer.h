@@ -0,0 +1,58 @@
+/*
+#  File:     outbuffer.h
+#
+#
+#  Revision history:
+#   17 Oct 2026 - Original release
+#
+#  Description:
+#   Buffer the replies to a file descriptor, writing them with writev()
+#
+#
+#  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
+#
+#    See http://www.eu-egee.org/partners/ for details on the copyright
+#    holders.
+#
+#    Licensed under the Apache License, Version 2.0 (the "License");
+#    you may not use this file except in compliance with the License.
+#    You may obtain a copy of the License at
+#
+#        http://www.apache.org/licenses/LICENSE-2.0
+#
+#    Unless required by applicable law or agreed to in writing, software
+#    distributed under the License is distributed on an "AS IS" BASIS,
+#    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#    See the License for the specific language governing permissions and
+#    limitations under the License.
+#
+*/
+
+#ifndef OUTBUFFER_INCLUDED
+#define OUTBUFFER_INCLUDED
+
+#include <stddef.h>
+
+#define OUTBUF_OK               0
+#define OUTBUF_ERROR_NOBUFFER   1
+#define OUTBUF_ERROR_WRITE      2
+
+/* Replies pending before an implicit flush */
+#define OUTBUF_MAX_PENDING      64
+#define OUTBUF_MAX_PENDING_SIZE 65536
+
+typedef struct out_buffer_stats_s {
+	unsigned long replies;   /* Replies queued */
+	unsigned long bytes;     /* Bytes written */
+	unsigned long syscalls;  /* writev() calls */
+} out_buffer_stats_t;
+
+/* Exported functions */
+/* The buffer is not thread safe: callers must serialize the access */
+int out_buffer_init(const int fd);
+int out_buffer_queue(char *reply, const size_t len, const int to_free);
+int out_buffer_flush(void);
+int out_buffer_fd(void);
+void out_buffer_get_stats(out_buffer_stats_t *stats);
+
+#endif /* ifndef OUTBUFFER_INCLUDED */
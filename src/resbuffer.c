@@ -10,6 +10,9 @@
 #   31 Mar 2008 - Switched from linked list to single string buffer
 #                 Dropped support for persistent (file) buffer
 #                 Async mode handled internally (no longer in server.c)
+#   17 Oct 2026 - Switched to a list of fixed size chunks, written out
+#                 with writev() with no copy of the whole buffer
+#                 Wait on EAGAIN, and keep the unsent lines on write errors
 #
 #  Description:
 #   Mantain the result line buffer
@@ -36,18 +39,38 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/uio.h>
 
 #include "blahpd.h"
 #include "resbuffer.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+/* The result lines are stored in a list of chunks of ALLOC_CHUNKS
+ * bytes (or more, for longer lines), each line preceded by line_sep
+ * */
+typedef struct resbuffer_chunk_s {
+	struct resbuffer_chunk_s *next;
+	size_t size;
+	size_t len;
+	int num_lines;
+	char *data;
+} resbuffer_chunk;
+
 /* These are global variables as
  * they have to be shared among all threads
  * */
-static char* resbuffer_result_string = NULL; /* the result lines */
+static resbuffer_chunk *resbuffer_head = NULL; /* the result lines */
+static resbuffer_chunk *resbuffer_tail = NULL;
 static int   resbuffer_num_lines = 0;        /* the number of the result lines */
-static int   resbuffer_current_bufsize = 0;  /* the currently allocated buffer size */
-static int   resbuffer_current_ressize = 0;  /* the current length of the results */
+static size_t resbuffer_current_ressize = 0; /* the current length of the results */
 static int   resbuffer_async_mode = 0;       /* current async mode (0 = off) */ 
 static int   resbuffer_async_notify = 0;     /* set to 1 if a new result has been enqueued */
                                              /* since the last buffer flush                */
@@ -85,16 +108,52 @@ set_async_mode(int mode)
 }
 
 
+static resbuffer_chunk *
+new_chunk(size_t min_size)
+/* Allocate an empty chunk
+ * */
+{
+	resbuffer_chunk *chunk;
+	size_t size = (min_size > ALLOC_CHUNKS) ? min_size : ALLOC_CHUNKS;
+
+	if ((chunk = (resbuffer_chunk *)malloc(sizeof(resbuffer_chunk) + size)) == NULL)
+	{
+		fprintf(stderr, "Out of memory! Cannot allocate result buffer\n");
+		exit(MALLOC_ERROR);
+	}
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->len = 0;
+	chunk->num_lines = 0;
+	chunk->data = (char *)(chunk + 1);
+	return(chunk);
+}
+
+
+static void
+free_chunks(resbuffer_chunk *chunk)
+{
+	resbuffer_chunk *next;
+
+	for (; chunk != NULL; chunk = next)
+	{
+		next = chunk->next;
+		free(chunk);
+	}
+}
+
+
 int
 push_result(const char *res)
 /* Push a new result line into result buffer
- * allocate memory in chunks, in order to reduce the number of realloc
+ * Only the copy of the line is done with the lock held: chunks
+ * are allocated before acquiring it
  * Return 1 if the "R" (async notification) has to be printed out, 0 otherwise
  * */
 {
-	int reslen;
-	int required_bytes;
-	int required_chunks;
+	size_t reslen;
+	resbuffer_chunk *chunk = NULL;
+	char *dest;
 	int async_notify = 0;
 
 	reslen = strlen(res) + sizeof(line_sep) - 1;
@@ -103,19 +162,25 @@ push_result(const char *res)
 	pthread_mutex_lock(&resbuffer_lock);
 
 	/* Add the new entry */
-	if ((required_bytes = (reslen + resbuffer_current_ressize - resbuffer_current_bufsize)) > 0)
+	while (resbuffer_tail == NULL || resbuffer_tail->size - resbuffer_tail->len < reslen)
 	{
-		required_chunks = required_bytes / ALLOC_CHUNKS + 1;
-		resbuffer_result_string = (char *)realloc(resbuffer_result_string, resbuffer_current_bufsize + ALLOC_CHUNKS * required_chunks);
-		if (resbuffer_result_string == NULL)
+		if (chunk != NULL)
 		{
-			fprintf(stderr, "Out of memory! Cannot allocate result buffer\n");
-			exit(MALLOC_ERROR);
+			if (resbuffer_tail != NULL) resbuffer_tail->next = chunk;
+			else                        resbuffer_head = chunk;
+			resbuffer_tail = chunk;
+			chunk = NULL;
+			break;
 		}
-		resbuffer_current_bufsize += (ALLOC_CHUNKS * required_chunks);
+		pthread_mutex_unlock(&resbuffer_lock);
+		chunk = new_chunk(reslen);
+		pthread_mutex_lock(&resbuffer_lock);
 	}
-	memcpy(resbuffer_result_string + resbuffer_current_ressize, line_sep, sizeof(line_sep) - 1);
-	strcpy(resbuffer_result_string + resbuffer_current_ressize + sizeof(line_sep) - 1, res);
+	dest = resbuffer_tail->data + resbuffer_tail->len;
+	memcpy(dest, line_sep, sizeof(line_sep) - 1);
+	memcpy(dest + sizeof(line_sep) - 1, res, reslen - (sizeof(line_sep) - 1));
+	resbuffer_tail->len += reslen;
+	resbuffer_tail->num_lines++;
 	
 	resbuffer_current_ressize += reslen;
 
@@ -130,10 +195,71 @@ push_result(const char *res)
 
 	/* Release lock */
 	pthread_mutex_unlock(&resbuffer_lock);
+
+	/* Another thread added a chunk meanwhile */
+	if (chunk != NULL) free(chunk);
 	return(async_notify);
 }
 
 
+static resbuffer_chunk *
+take_lines(int *num_lines, size_t *ressize)
+/* Detach all the result lines and flush the buffer
+ * */
+{
+	resbuffer_chunk *lines;
+
+	/* Acquire lock */
+	pthread_mutex_lock(&resbuffer_lock);
+
+	lines = resbuffer_head;
+	*num_lines = resbuffer_num_lines;
+	*ressize = resbuffer_current_ressize;
+	if (lines != NULL)
+	{
+		resbuffer_head = resbuffer_tail = NULL;
+		resbuffer_num_lines = 0;
+		resbuffer_current_ressize = 0;
+		resbuffer_async_notify = resbuffer_async_mode;
+	}
+
+	/* Release lock */
+	pthread_mutex_unlock(&resbuffer_lock);
+	return(lines);
+}
+
+
+static void
+put_back_lines(resbuffer_chunk *lines)
+/* Put back detached result lines in front of the buffer
+ * */
+{
+	resbuffer_chunk *last = NULL, *chunk;
+	int num_lines = 0;
+	size_t ressize = 0;
+
+	if (lines == NULL) return;
+	for (chunk = lines; chunk != NULL; chunk = chunk->next)
+	{
+		num_lines += chunk->num_lines;
+		ressize += chunk->len;
+		last = chunk;
+	}
+
+	/* Acquire lock */
+	pthread_mutex_lock(&resbuffer_lock);
+
+	last->next = resbuffer_head;
+	resbuffer_head = lines;
+	if (resbuffer_tail == NULL) resbuffer_tail = last;
+	resbuffer_num_lines += num_lines;
+	resbuffer_current_ressize += ressize;
+
+	/* Release lock */
+	pthread_mutex_unlock(&resbuffer_lock);
+}
+
+
 char *
 get_lines(void)
 /* Return the number n of result lines and the
@@ -149,33 +275,456 @@ get_lines(void)
  * */
 {
 	char *res_lines = NULL;
-	char *reallocated;
+	resbuffer_chunk *lines, *chunk;
+	int num_lines;
+	size_t ressize, pos;
 
-	/* Acquire lock */
-	pthread_mutex_lock(&resbuffer_lock);
+	lines = take_lines(&num_lines, &ressize);
 
 	/* Allocate the result string */
-	res_lines = (char *)malloc(resbuffer_current_ressize + 16);
+	res_lines = (char *)malloc(ressize + 16);
 	if (res_lines == NULL)
 	{
 		fprintf(stderr, "Out of memory! Cannot allocate result buffer\n");
 		exit(MALLOC_ERROR);
 	}
 
-	sprintf(res_lines, "S %d", resbuffer_num_lines);
-	if (resbuffer_result_string)
+	pos = sprintf(res_lines, "S %d", num_lines);
+	for (chunk = lines; chunk != NULL; chunk = chunk->next)
 	{
-		strcat(res_lines, resbuffer_result_string);
-		free(resbuffer_result_string);
-		resbuffer_result_string = NULL;
-		resbuffer_num_lines = 0;
-		resbuffer_current_ressize = 0;
-		resbuffer_current_bufsize = 0;
-		resbuffer_async_notify = resbuffer_async_mode;
+		memcpy(res_lines + pos, chunk->data, chunk->len);
+		pos += chunk->len;
 	}
+	res_lines[pos] = '\000';
 
-	/* Release lock */
-	pthread_mutex_unlock(&resbuffer_lock);
+	free_chunks(lines);
 	return(res_lines);
 }
 
+
+static void
+drop_sent_lines(resbuffer_chunk *chunk, size_t sent)
+/* Only the first sent bytes of the chunk were written: remove
+ * the lines written completely or in part, and keep the lines
+ * not started for the next reply
+ * */
+{
+	size_t sep_len = sizeof(line_sep) - 1;
+	size_t pos;
+
+	/* The first line not started is the first separator at or after sent */
+	for (pos = sent; pos + sep_len <= chunk->len; pos++)
+		if (memcmp(chunk->data + pos, line_sep, sep_len) == 0) break;
+	if (pos + sep_len > chunk->len) pos = chunk->len;
+
+	memmove(chunk->data, chunk->data + pos, chunk->len - pos);
+	chunk->len -= pos;
+	chunk->num_lines = 0;
+	for (pos = 0; pos + sep_len <= chunk->len; pos++)
+	{
+		if (memcmp(chunk->data + pos, line_sep, sep_len) == 0)
+		{
+			chunk->num_lines++;
+			pos += sep_len - 1;
+		}
+	}
+}
+
+
+int
+write_lines(int fd)
+/* Write to fd the reply to the RESULTS command: the same
+ * lines as get_lines(), followed by line_sep, written straight
+ * from the buffer chunks
+ * Finally flush the buffer
+ * If fd is not ready (EAGAIN), wait for it. On write errors the
+ * lines not started are put back in the buffer, while a line
+ * written in part is lost with the rest of the broken reply
+ * Return 0 on success, -1 on write error
+ * */
+{
+	char header[16];
+	struct iovec iov[IOV_MAX];
+	resbuffer_chunk *iov_chunk[IOV_MAX]; /* The chunk in each iov, if any */
+	resbuffer_chunk *lines, *chunk, *unsent, *next;
+	struct pollfd pfd;
+	int num_lines, first = 0, n_iov;
+	int trailer_queued = 0;
+	size_t ressize;
+	ssize_t written;
+	int retcod = 0;
+
+	lines = take_lines(&num_lines, &ressize);
+	snprintf(header, sizeof(header), "S %d", num_lines);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = strlen(header);
+	iov_chunk[0] = NULL;
+	n_iov = 1;
+	chunk = unsent = lines;
+	for (;;)
+	{
+		/* Fill the vector with the next chunks, then the trailer */
+		if (first > 0)
+		{
+			memmove(iov, iov + first, n_iov * sizeof(struct iovec));
+			memmove(iov_chunk, iov_chunk + first, n_iov * sizeof(resbuffer_chunk *));
+			first = 0;
+		}
+		for (; chunk != NULL && n_iov < IOV_MAX; chunk = chunk->next)
+		{
+			iov[n_iov].iov_base = chunk->data;
+			iov[n_iov].iov_len = chunk->len;
+			iov_chunk[n_iov] = chunk;
+			n_iov++;
+		}
+		if (chunk == NULL && !trailer_queued && n_iov < IOV_MAX)
+		{
+			iov[n_iov].iov_base = (void *)line_sep;
+			iov[n_iov].iov_len = sizeof(line_sep) - 1;
+			iov_chunk[n_iov] = NULL;
+			n_iov++;
+			trailer_queued = 1;
+		}
+		if (n_iov == 0) break;
+
+		if ((written = writev(fd, iov, n_iov)) < 0)
+		{
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				/* Wait for the descriptor to drain */
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, -1) >= 0 || errno == EINTR) continue;
+			}
+			retcod = -1;
+			break;
+		}
+
+		/* Skip what was written */
+		while (n_iov > 0 && (size_t)written >= iov[first].iov_len)
+		{
+			if (iov_chunk[first] != NULL) unsent = iov_chunk[first]->next;
+			written -= iov[first].iov_len;
+			first++;
+			n_iov--;
+		}
+		if (n_iov > 0)
+		{
+			iov[first].iov_base = (char *)iov[first].iov_base + written;
+			iov[first].iov_len -= written;
+		}
+	}
+
+	/* Trim the chunk written in part, so that its lines are not */
+	/* repeated after the next header */
+	if (retcod < 0 && n_iov > 0 && iov_chunk[first] != NULL &&
+	    iov[first].iov_base != (void *)iov_chunk[first]->data)
+	{
+		drop_sent_lines(unsent, (char *)iov[first].iov_base - unsent->data);
+		if (unsent->num_lines == 0) unsent = unsent->next;
+	}
+
+	/* Free the chunks sent completely, and keep the others */
+	/* (only left on write errors) for the next RESULTS command */
+	for (chunk = lines; chunk != unsent; chunk = next)
+	{
+		next = chunk->next;
+		free(chunk);
+	}
+	put_back_lines(unsent);
+	return(retcod);
+}
+
+
+#ifdef RESBUFFER_DEBUG
+/* ------ TEST CODE HERE -------
+#
+#  Description:
+#   Push result lines from several threads while the buffer is
+#   being written out, and check that every line is written once,
+#   in order for each thread. Also check that write_lines() and
+#   get_lines() give the same output, and measure the longest
+#   push_result() call. Finally write to a non-blocking pipe read
+#   slowly (EAGAIN) and to a pipe with no reader (EPIPE), where the
+#   lines must be kept for the next reply, and to a file over its
+#   size limit, where only the lines not started must be kept.
+#
+#   Compile with -DRESBUFFER_DEBUG option, e.g.
+#   $ gcc -o test_resbuffer -DRESBUFFER_DEBUG resbuffer.c -lpthread
+#
+*/
+
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define TEST_THREADS 4
+
+static int test_lines = 10000;
+static int test_done = 0;
+static double test_max_push = 0;
+static pthread_mutex_t test_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return(tv.tv_sec + tv.tv_usec / 1000000.);
+}
+
+void *
+pusher(void *arg)
+{
+	char line[128];
+	double start, elapsed;
+	int i;
+
+	for (i = 0; i < test_lines; i++)
+	{
+		snprintf(line, sizeof(line), "%ld.%d 0 No\\ error 2 [\\ BatchJobId=\"%d\";\\ JobStatus=2;\\ ]",
+		         (long)arg, i, i);
+		start = now();
+		push_result(line);
+		elapsed = now() - start;
+		pthread_mutex_lock(&test_lock);
+		if (elapsed > test_max_push) test_max_push = elapsed;
+		pthread_mutex_unlock(&test_lock);
+	}
+	pthread_mutex_lock(&test_lock);
+	test_done++;
+	pthread_mutex_unlock(&test_lock);
+	return(NULL);
+}
+
+static int
+pushers_done(void)
+{
+	int done;
+
+	pthread_mutex_lock(&test_lock);
+	done = (test_done == TEST_THREADS);
+	pthread_mutex_unlock(&test_lock);
+	return(done);
+}
+
+/* Print usage
+ * */
+void
+usage(const char *cmd)
+{
+	printf("Usage: %s [-h] [-n <lines>]\n", cmd);
+	printf("  -h             print this help and exit\n");
+	printf("  -n <lines>     number of lines pushed by each thread (default = 10000)\n\n");
+	return;
+}
+
+int
+main(int argc, char *argv[])
+{
+	pthread_t tid[TEST_THREADS];
+	long t;
+	int opt, fd, n_lines = 0, n_writes = 0, line_t, line_i;
+	int next_line[TEST_THREADS] = { 0 };
+	char tmpl[32];
+	char *out = NULL, *lines, *written;
+	size_t out_size = 0;
+	FILE *fp;
+	int pfd[2], status, res;
+	pid_t pid;
+	char line[64], buf[512];
+	ssize_t got;
+	size_t total;
+	char *sep;
+	int n_started, n_kept;
+	struct rlimit fsize, limit;
+
+	while ((opt = getopt(argc, argv, "hn:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n': test_lines = atoi(optarg); break;
+		default: usage(argv[0]); exit(opt == 'h' ? 0 : 1);
+		}
+	}
+
+	strcpy(tmpl, "/tmp/test_resbufferXXXXXX");
+	fd = mkstemp(tmpl);
+	assert(fd >= 0);
+	unlink(tmpl);
+
+	/* Write out the results while they are being pushed */
+	for (t = 0; t < TEST_THREADS; t++)
+	{
+		res = pthread_create(&tid[t], NULL, pusher, (void *)t);
+		assert(res == 0);
+	}
+	while (!pushers_done())
+	{
+		res = write_lines(fd);
+		assert(res == 0);
+		n_writes++;
+	}
+	for (t = 0; t < TEST_THREADS; t++)
+		pthread_join(tid[t], NULL);
+	res = write_lines(fd);
+	assert(res == 0);
+	n_writes++;
+
+	/* Every line must be there once, in order */
+	fp = fdopen(fd, "r");
+	assert(fp != NULL);
+	rewind(fp);
+	while (getdelim(&out, &out_size, '\n', fp) > 0)
+	{
+		if (strncmp(out, "S ", 2) == 0) continue;
+		res = sscanf(out, "%d.%d ", &line_t, &line_i);
+		assert(res == 2);
+		assert(line_t >= 0 && line_t < TEST_THREADS);
+		assert(line_i == next_line[line_t]);
+		next_line[line_t]++;
+		n_lines++;
+	}
+	fclose(fp);
+	free(out);
+	assert(n_lines == TEST_THREADS * test_lines);
+
+	/* Same reply from write_lines() and get_lines() */
+	strcpy(tmpl, "/tmp/test_resbufferXXXXXX");
+	fd = mkstemp(tmpl);
+	assert(fd >= 0);
+	unlink(tmpl);
+	for (t = 0; t < 3; t++) push_result("a\\ line");
+	res = write_lines(fd);
+	assert(res == 0);
+	for (t = 0; t < 3; t++) push_result("a\\ line");
+	lines = get_lines();
+	written = (char *)calloc(strlen(lines) + 3, 1);
+	got = pread(fd, written, strlen(lines) + 2, 0);
+	assert(got == (ssize_t)strlen(lines) + 2);
+	assert(strncmp(written, lines, strlen(lines)) == 0);
+	assert(strcmp(written + strlen(lines), line_sep) == 0);
+	close(fd);
+	free(written);
+	free(lines);
+	lines = get_lines();
+	assert(strcmp(lines, "S 0") == 0);
+	free(lines);
+
+	/* Non-blocking pipe, drained slowly by a child */
+	for (t = 0; t < test_lines; t++)
+	{
+		snprintf(line, sizeof(line), "%ld 0 No\\ error", t);
+		push_result(line);
+	}
+	lines = get_lines();
+	for (t = 0; t < test_lines; t++)
+	{
+		snprintf(line, sizeof(line), "%ld 0 No\\ error", t);
+		push_result(line);
+	}
+	res = pipe(pfd);
+	assert(res == 0);
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0)
+	{
+		close(pfd[1]);
+		total = 0;
+		while ((got = read(pfd[0], buf, sizeof(buf))) > 0)
+		{
+			total += got;
+			usleep(100);
+		}
+		_exit(total == strlen(lines) + strlen(line_sep) ? 0 : 1);
+	}
+	close(pfd[0]);
+	res = fcntl(pfd[1], F_SETFL, O_NONBLOCK);
+	assert(res == 0);
+	res = write_lines(pfd[1]);
+	assert(res == 0);
+	close(pfd[1]);
+	res = waitpid(pid, &status, 0);
+	assert(res == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	/* Write error: the lines are kept for the next reply */
+	signal(SIGPIPE, SIG_IGN);
+	for (t = 0; t < test_lines; t++)
+	{
+		snprintf(line, sizeof(line), "%ld 0 No\\ error", t);
+		push_result(line);
+	}
+	res = pipe(pfd);
+	assert(res == 0);
+	close(pfd[0]);
+	res = write_lines(pfd[1]);
+	assert(res == -1);
+	close(pfd[1]);
+	written = get_lines();
+	assert(strcmp(written, lines) == 0);
+	free(written);
+	free(lines);
+
+	/* Partial write (file size limit): the lines started are dropped */
+	signal(SIGXFSZ, SIG_IGN);
+	for (t = 0; t < test_lines; t++)
+	{
+		snprintf(line, sizeof(line), "%ld 0 No\\ error", t);
+		push_result(line);
+	}
+	strcpy(tmpl, "/tmp/test_resbufferXXXXXX");
+	fd = mkstemp(tmpl);
+	assert(fd >= 0);
+	unlink(tmpl);
+	res = getrlimit(RLIMIT_FSIZE, &fsize);
+	assert(res == 0);
+	limit = fsize;
+	limit.rlim_cur = test_lines * 7 + 5;
+	res = setrlimit(RLIMIT_FSIZE, &limit);
+	assert(res == 0);
+	res = write_lines(fd);
+	assert(res == -1);
+	res = setrlimit(RLIMIT_FSIZE, &fsize);
+	assert(res == 0);
+
+	/* Each line sent is preceded by line_sep */
+	total = lseek(fd, 0, SEEK_END);
+	written = (char *)calloc(total + 1, 1);
+	got = pread(fd, written, total, 0);
+	assert(got == (ssize_t)total);
+	close(fd);
+	n_started = 0;
+	for (sep = strstr(written, line_sep); sep != NULL; sep = strstr(sep + 1, line_sep))
+		n_started++;
+	if (total > 0 && written[total - 1] == line_sep[0]) n_started++;
+	free(written);
+
+	written = get_lines();
+	res = sscanf(written, "S %d", &n_kept);
+	assert(res == 1);
+	assert(n_kept == test_lines - n_started);
+	line_i = test_lines - n_kept;
+	for (sep = strstr(written, line_sep); sep != NULL; sep = strstr(sep + 1, line_sep))
+	{
+		res = sscanf(sep + strlen(line_sep), "%d ", &line_t);
+		assert(res == 1);
+		assert(line_t == line_i);
+		line_i++;
+	}
+	assert(line_i == test_lines);
+	free(written);
+
+	printf("%d lines pushed by %d threads, written in %d replies.\n",
+	       n_lines, TEST_THREADS, n_writes);
+	printf("Longest push_result(): %g s.\n", test_max_push);
+	return(0);
+}
+#endif /* RESBUFFER_DEBUG */
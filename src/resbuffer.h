@@ -10,6 +10,7 @@
 #   31 Mar 2008 - Switched from linked list to single string buffer
 #                 Dropped support for persistent (file) buffer
 #                 Async mode handled internally (no longer in server.c)
+#   17 Oct 2026 - Added write_lines()
 #
 #  Description:
 #   Mantain the result line buffer
@@ -43,4 +44,5 @@
 int init_resbuffer(void);
 int push_result(const char* s);
 char* get_lines(void);
+int write_lines(int fd);
 
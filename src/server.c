@@ -35,6 +35,19 @@
 #                                      moved to mapped_exec.h.
 #   15 Sep 2011 - (prelz@mi.infn.it). Optionally pass any submit attribute
 #                                     to local configuration script.
+#   17 Oct 2026 - Build BLAH_JOB_STATUS_ALL results in linear time,
+#                 releasing the registry lock in batches. Optionally
+#                 split them into several result lines.
+#                 Cache compiled selection expressions.
+#                 Serve threaded commands with a fixed pool of workers,
+#                 shared fairly among mapped users.
+#                 Optional cache of status script results.
+#                 RESULTS written straight from the result buffer.
+#                 Replies to pipelined commands written together.
+#                 Configurable limits for the input buffer and for the
+#                 length of a command.
+#                 LRMS scripts started by a pool of executor helper
+#                 processes.
 #                                      
 #
 #  Description:
@@ -83,6 +96,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sched.h>
 
 #include "globus_gsi_credential.h"
 #include "globus_gsi_proxy.h"
@@ -94,10 +108,13 @@
 #include "commands.h"
 #include "job_status.h"
 #include "resbuffer.h"
+#include "outbuffer.h"
+#include "execpool.h"
 #include "mapped_exec.h"
 #include "proxy_hashcontainer.h"
 #include "blah_utils.h"
 #include "cmdbuffer.h"
+#include "cmdpool.h"
 
 #define COMMAND_PREFIX "-c"
 #define JOBID_REGEXP            "(^|\n)BLAHP_JOBID_PREFIX([^\n]*)"
@@ -108,6 +125,8 @@
 #define MAX_TEMP_ARRAY_SIZE              1000
 #define MAX_PENDING_COMMANDS             500
 #define DEFAULT_TEMP_DIR                 "/tmp"
+#define STATUS_ALL_BATCH_ENTRIES         256
+#define STATUS_SELECT_CACHE_SIZE         16
  
 #define NO_QUOTE     0
 #define SINGLE_QUOTE 1
@@ -173,11 +192,11 @@ static int exit_program = 0;
 static pthread_mutex_t send_lock  = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t bfork_lock  = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t blah_jr_lock  = PTHREAD_MUTEX_INITIALIZER;
-pthread_attr_t cmd_threads_attr;
 
 sem_t sem_total_commands;
 
 char *blah_script_location;
+int blah_status_cache_ttl = 0;
 char *blah_version;
 static char lrmslist[MAX_LRMS_NUMBER][MAX_LRMS_NAME_SIZE];
 static int  lrms_counter = 0;
@@ -195,6 +214,7 @@ static char *mapping_parameter[MEXEC_PARAM_COUNT];
 
 static char **submit_attributes_to_pass = NULL;
 static int pass_all_submit_attributes = FALSE;
+static size_t status_all_max_result_size = 0; /* 0: single result line */
 
 /* Check on good health of our managed children
  **/
@@ -284,29 +304,27 @@ check_on_children(struct blah_managed_child *children, const int count)
 void
 free_args(char **arg_array)
 {
-	char **arg_ptr;
-	
-	if (arg_array)
-	{
-		for (arg_ptr = arg_array; (*arg_ptr) != NULL; arg_ptr++)
-			free(*arg_ptr);
-		free(arg_array);
-	}
+	/* The arguments are allocated together with the array */
+	/* (see cmd_buffer_tokenize) */
+	if (arg_array) free(arg_array);
 }	
 /* Main server function 
  * */
 int
 serveConnection(int cli_socket, char* cli_ip_addr)
 {
-	char *input_buffer;
 	int get_cmd_res;
 	char *reply;
+	int reply_sent;
+	out_buffer_stats_t out_stats;
+	exec_pool_stats_t exec_stats;
+	config_entry *exec_helpers_conf;
+	int exec_helpers = EXECPOOL_DEFAULT_HELPERS;
 	char *result;
 	char *cmd_result;
 	fd_set readfs;
 	int exitcode = 0;
 	int reply_len;
-	pthread_t task_tid;
 	int i, argc;
 	char **argv;
 	command_t *command;
@@ -322,7 +340,25 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 	char *child_exe_conf, *child_pid_conf;
         config_entry *child_config_exe, *child_config_pid;
 	int max_threaded_cmds = MAX_PENDING_COMMANDS;
+	int max_queued_cmds = 0; /* Only limited by max_threaded_cmds */
 	config_entry *max_threaded_conf;
+	const char *cmd_pool_workers_conf[CMDPOOL_NUM_QUEUES] = {
+		"blah_status_cmd_workers",
+		"blah_control_cmd_workers",
+		"blah_submit_cmd_workers" };
+	const char *cmd_pool_per_user_conf[CMDPOOL_NUM_QUEUES] = {
+		"blah_status_cmd_max_per_user",
+		"blah_control_cmd_max_per_user",
+		"blah_submit_cmd_max_per_user" };
+	int pool_workers[CMDPOOL_NUM_QUEUES];
+	int pool_max_queued[CMDPOOL_NUM_QUEUES];
+	int pool_max_per_user[CMDPOOL_NUM_QUEUES];
+	int pool_res;
+	config_entry *pool_conf;
+	config_entry *status_all_max_conf;
+	config_entry *status_cache_ttl_conf;
+	config_entry *cmd_size_conf;
+	size_t max_cmd_buffer = 0, max_cmd_size = 0; /* cmdbuffer defaults */
 	int n_threads_value;
 	char *final_results;
 	struct stat tmp_stat;
@@ -358,6 +394,22 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 	blah_accounting_log_umask = config_get("blah_accounting_log_umask",blah_config_handle);
 	max_threaded_conf = config_get("blah_max_threaded_cmds",blah_config_handle);
 	if (max_threaded_conf != NULL) max_threaded_cmds = atoi(max_threaded_conf->value);
+	max_threaded_conf = config_get("blah_max_queued_cmds",blah_config_handle);
+	if (max_threaded_conf != NULL) max_queued_cmds = atoi(max_threaded_conf->value);
+	status_all_max_conf = config_get("blah_status_all_max_result_size",blah_config_handle);
+	if (status_all_max_conf != NULL && atoi(status_all_max_conf->value) > 0)
+		status_all_max_result_size = atoi(status_all_max_conf->value);
+
+	status_cache_ttl_conf = config_get("blah_status_cache_ttl",blah_config_handle);
+	if (status_cache_ttl_conf != NULL && atoi(status_cache_ttl_conf->value) > 0)
+		blah_status_cache_ttl = atoi(status_cache_ttl_conf->value);
+
+	cmd_size_conf = config_get("blah_command_buffer_max_size",blah_config_handle);
+	if (cmd_size_conf != NULL && atol(cmd_size_conf->value) > 0)
+		max_cmd_buffer = atol(cmd_size_conf->value);
+	cmd_size_conf = config_get("blah_max_command_size",blah_config_handle);
+	if (cmd_size_conf != NULL && atol(cmd_size_conf->value) > 0)
+		max_cmd_size = atol(cmd_size_conf->value);
 
 	for (i = 0; i < MEXEC_PARAM_COUNT; i++)
 		mapping_parameter[i] = NULL;
@@ -365,6 +417,7 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 	init_resbuffer();
 	if (cli_socket == 0) server_socket = 1;
 	else                 server_socket = cli_socket;
+	out_buffer_init(server_socket);
 
 	/* Get values from environment */
 	if ((result = getenv("GLITE_LOCATION")) == NULL)
@@ -376,6 +429,21 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 		tmp_dir  = DEFAULT_TEMP_DIR;
 	}
 
+	/* Commands not fitting in the input buffer are spilled to tmp_dir */
+	if (cmd_buffer_set_limits(max_cmd_buffer, max_cmd_size, tmp_dir) != CMDBUF_OK)
+	{
+		perror("Cannot set input buffer limits");
+		exit(MALLOC_ERROR);
+	}
+
+	/* The executor helpers must be forked while this process is still */
+	/* single-threaded and small, i.e. before loading the job registry */
+	exec_helpers_conf = config_get("blah_exec_helpers",blah_config_handle);
+	if (exec_helpers_conf != NULL && strlen(exec_helpers_conf->value) > 0)
+		exec_helpers = atoi(exec_helpers_conf->value);
+	if (exec_pool_init(exec_helpers) != EXECPOOL_OK)
+		fprintf(stderr, "Cannot start all the executor helpers, commands will be forked directly.\n");
+
 /* In the Condor build of the blahp, we can find all the libraries we need
  * via the RUNPATH. Setting LD_LIBRARY_PATH can muck up the command line
  * tools for the local batch system.
@@ -498,6 +566,16 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 		blah_jr_handle = job_registry_init(jre->value, jr_mode);
 		if (blah_jr_handle != NULL)
 		{
+			/* Keep the registry open and hash-indexed, so that */
+			/* status lookups are served from memory. Failure */
+			/* just leaves the handle in file-based mode. */
+			job_registry_persist(blah_jr_handle);
+
+			/* Optionally keep the sorted index front-coded, */
+			/* to save memory on large registries. */
+			if (config_test_boolean(config_get("job_registry_compact_index", blah_config_handle)))
+				job_registry_compact(blah_jr_handle);
+
 			/* Enable BLAH_JOB_STATUS_ALL/SELECT commands */
                         /* (served by the same function) */
 			/* FIXME: should check/assert for success */
@@ -562,23 +640,43 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 
 	if (blah_children_count>0) check_on_children(blah_children, blah_children_count);
 
-	pthread_attr_init(&cmd_threads_attr);
-	pthread_attr_setdetachstate(&cmd_threads_attr, PTHREAD_CREATE_DETACHED);
-
 	sem_init(&sem_total_commands, 0, max_threaded_cmds);
+
+	/* Threaded commands are served by a fixed pool of workers, */
+	/* with one queue per kind of command. Within a queue, the */
+	/* workers are shared fairly among the mapped users. */
+	for (i = 0; i < CMDPOOL_NUM_QUEUES; i++)
+	{
+		pool_conf = config_get(cmd_pool_workers_conf[i],blah_config_handle);
+		pool_workers[i] = (pool_conf != NULL) ? atoi(pool_conf->value) : 0;
+		pool_max_queued[i] = max_queued_cmds;
+		pool_conf = config_get(cmd_pool_per_user_conf[i],blah_config_handle);
+		pool_max_per_user[i] = (pool_conf != NULL) ? atoi(pool_conf->value) : 0;
+	}
+	if (cmd_pool_init(pool_workers, pool_max_queued, pool_max_per_user) != CMDPOOL_OK)
+	{
+		perror("Cannot start command worker threads");
+		exit(1);
+	}
 	
-	write(server_socket, blah_version, strlen(blah_version));
-	write(server_socket, "\r\n", 2);
+	out_buffer_queue(blah_version, strlen(blah_version), FALSE);
+	out_buffer_queue("\r\n", 2, FALSE);
+	out_buffer_flush();
 	while(!exit_program)
 	{
-		get_cmd_res = cmd_buffer_get_command(&input_buffer);
+		/* The proxy parameters are copied after the arguments, */
+		/* for the threaded commands */
+		get_cmd_res = cmd_buffer_get_args(&argc, &argv, mapping_parameter,
+		                  (current_mapping_mode != MEXEC_NO_MAPPING) ? MEXEC_PARAM_COUNT : 0);
 		if (get_cmd_res == CMDBUF_TIMEOUT)
 		{
 			if (blah_children_count>0) check_on_children(blah_children, blah_children_count);
 		}
 		else if (get_cmd_res == CMDBUF_OK)
 		{
-			if (parse_command(input_buffer, &argc, &argv) == 0)
+			reply = NULL;
+			reply_sent = FALSE;
+			if (argc > 0)
 				command = find_command(argv[0]);
 			else
 				command = NULL;
@@ -596,15 +694,6 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 				{
 					if (command->threaded)
 					{	
-						/* Add the proxy parameters as last arguments */
-						if (current_mapping_mode != MEXEC_NO_MAPPING) 
-						{
-							argv = (char **)realloc(argv, (argc + MEXEC_PARAM_COUNT + 1) * sizeof(char *));
-							for (i = 0; i < MEXEC_PARAM_COUNT; i++) 
-								argv[argc + i] = strdup(mapping_parameter[i]);
-							argv[argc + MEXEC_PARAM_COUNT] = NULL;
-						}
-
 						if (sem_trywait(&sem_total_commands))
 						{
 							if (errno == EAGAIN)
@@ -614,10 +703,18 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 								perror("sem_trywait()");
 								exit(1);
 							}
+							free_args(argv);
 						}
-						else if (pthread_create(&task_tid, &cmd_threads_attr, command->cmd_handler, (void *)argv))
+						else if ((pool_res = cmd_pool_submit(command->queue,
+						              (current_mapping_mode != MEXEC_NO_MAPPING) ? mapping_parameter[MEXEC_PARAM_DELEGCRED] : NULL,
+						              command->cmd_handler, (void *)argv)) != CMDPOOL_OK)
 						{
-							reply = make_message("F Cannot\\ start\\ thread\r\n");
+							sem_post(&sem_total_commands);
+							if (pool_res == CMDPOOL_QUEUE_FULL)
+								reply = make_message("F Threads\\ limit\\ reached\r\n");
+							else
+								reply = make_message("F Cannot\\ start\\ thread\r\n");
+							free_args(argv);
 						}
 						else
 						{
@@ -625,6 +722,17 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 						}
 						/* free argv in threaded function */
 					}
+					else if (command->cmd_handler == cmd_results)
+					{
+						/* The result lines are written straight */
+						/* from the result buffer */
+						pthread_mutex_lock(&send_lock);
+						out_buffer_flush();
+						write_lines(server_socket);
+						pthread_mutex_unlock(&send_lock);
+						reply_sent = TRUE;
+						free_args(argv);
+					}
 					else
 					{
 						cmd_result = (char *)command->cmd_handler(argv);
@@ -640,18 +748,25 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 				free_args(argv);
 			}
 
+			/* The replies to pipelined commands are written together, */
+			/* once no other command is waiting in the input buffer */
 			pthread_mutex_lock(&send_lock);
 			if (reply)
-			{
-				write(server_socket, reply, strlen(reply));
-				free(reply);
-			}
-			else
+				out_buffer_queue(reply, strlen(reply), TRUE);
+			else if (!reply_sent)
 				/* WARNING: the command here could have been actually executed */
-				write(server_socket, "F Cannot\\ allocate\\ return\\ line\r\n", 34);
+				out_buffer_queue("F Cannot\\ allocate\\ return\\ line\r\n", 34, FALSE);
+			if (!cmd_buffer_has_command()) out_buffer_flush();
+			pthread_mutex_unlock(&send_lock);
+
+		}
+		else if (get_cmd_res == CMDBUF_ERROR_TOOLONG)
+		{
+			/* The command was discarded, the connection is still usable */
+			pthread_mutex_lock(&send_lock);
+			out_buffer_queue("E Command\\ too\\ long\r\n", 22, FALSE);
+			if (!cmd_buffer_has_command()) out_buffer_flush();
 			pthread_mutex_unlock(&send_lock);
-			
-			free(input_buffer);
 		}
 		else /* cmd_buffer_get_command() returned an error */
 		{
@@ -689,6 +804,20 @@ serveConnection(int cli_socket, char* cli_ip_addr)
 
 	}
 
+	pthread_mutex_lock(&send_lock);
+	out_buffer_flush();
+	out_buffer_get_stats(&out_stats);
+	pthread_mutex_unlock(&send_lock);
+	fprintf(stderr, "%lu replies written in %lu bytes with %lu system calls\n",
+	        out_stats.replies, out_stats.bytes, out_stats.syscalls);
+	exec_pool_get_stats(&exec_stats);
+	fprintf(stderr, "%lu commands started by the executor helpers, %lu forked directly, "
+	        "%g ms average start time, %g s average run time\n",
+	        exec_stats.helper_spawns, exec_stats.direct_forks,
+	        (exec_stats.helper_spawns + exec_stats.direct_forks) ?
+	          exec_stats.spawn_secs * 1000 / (exec_stats.helper_spawns + exec_stats.direct_forks) : 0.,
+	        exec_stats.completed ? exec_stats.run_secs / exec_stats.completed : 0.);
+
 	if (cli_socket != 0) 
 	{
 		shutdown(cli_socket, SHUT_RDWR);
@@ -1654,108 +1783,293 @@ cmd_status_job(void *args)
 	return;
 }
 
+/* Result line of BLAH_JOB_STATUS_ALL/SELECT, built in place. */
+/* 'head' bytes are reserved at the start of the buffer for the */
+/* "<reqId> 0 No\ error [" prefix, which is only written when */
+/* the line is complete (see status_all_line_close). */
+struct status_all_line {
+	char *buf;
+	size_t head;
+	size_t len;
+	size_t size;
+	int n_ads;
+};
+
+static int
+status_all_line_reserve(struct status_all_line *line, size_t extra)
+{
+	size_t new_size;
+	char *new_buf;
+
+	if (line->len + extra <= line->size) return 0;
+
+	new_size = (line->size > 0) ? line->size : 4096;
+	while (new_size < line->len + extra) new_size *= 2;
+	new_buf = realloc(line->buf, new_size);
+	if (new_buf == NULL) return -1;
+	line->buf = new_buf;
+	line->size = new_size;
+	return 0;
+}
+
+static int
+status_all_line_start(struct status_all_line *line, const char *reqId)
+{
+	/* Room for "<reqId>.<part> 0 No\ error [" */
+	line->head = strlen(reqId) + 32;
+	line->len = line->head;
+	line->n_ads = 0;
+	return status_all_line_reserve(line, 2);
+}
+
+static int
+status_all_line_add(struct status_all_line *line, const char *cad)
+{
+	/* Worst case: ';' + every character escaped + "]\0" */
+	if (status_all_line_reserve(line, strlen(cad) * 2 + 3) < 0) return -1;
+
+	if (line->n_ads > 0) line->buf[line->len++] = ';';
+	line->len += escape_spaces_to(line->buf + line->len, cad);
+	line->n_ads++;
+	return 0;
+}
+
+/* Terminates the line and writes its prefix. A 'part' >= 0 */
+/* marks a partial result (<reqId>.<part>), the final result */
+/* line carries the plain <reqId>. Returns the start of the line. */
+static char *
+status_all_line_close(struct status_all_line *line, const char *reqId, int part)
+{
+	char prefix[64];
+	size_t plen;
+	char *start;
+
+	line->buf[line->len] = ']';
+	line->buf[line->len + 1] = '\000';
+
+	if (part >= 0)
+		snprintf(prefix, sizeof(prefix), ".%d 0 No\\ error [", part);
+	else
+		snprintf(prefix, sizeof(prefix), " 0 No\\ error [");
+	plen = strlen(prefix);
+	start = line->buf + line->head - plen - strlen(reqId);
+	memcpy(start, reqId, strlen(reqId));
+	memcpy(start + strlen(reqId), prefix, plen);
+	return start;
+}
+
+/* Map position of the record following 'next_recnum - 1', after */
+/* the registry mapping was replaced (e.g. by a purge) while */
+/* the registry lock was released. */
+static job_registry_recnum_t
+status_all_resume_cursor(const job_registry_handle *rha,
+                         job_registry_recnum_t next_recnum)
+{
+	job_registry_recnum_t cursor;
+
+	JOB_REGISTRY_GET_REC_OFFSET(cursor, next_recnum, rha->data_map_firstrec)
+	/* All records up to next_recnum were purged: start from the first one */
+	if ((off_t)cursor*sizeof(job_registry_entry) > rha->data_map_length) cursor = 0;
+	return cursor;
+}
+
+/* Compiled BLAH_JOB_STATUS_SELECT expressions, most recently used */
+/* first. Entries are reference counted, as they can be evicted while */
+/* still in use by another command thread. */
+struct status_select {
+	char *expr;
+	job_registry_select *fast; /* NULL when outside the supported subset */
+	classad_expr_tree tree;    /* Used when 'fast' is NULL. Evaluation */
+	                           /* needs blah_jr_lock, as it sets the */
+	                           /* tree parent scope. */
+	int refs;
+};
+
+static struct status_select *status_select_cache[STATUS_SELECT_CACHE_SIZE];
+static int status_select_cache_used = 0;
+static pthread_mutex_t status_select_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+status_select_free(struct status_select *sel)
+{
+	if (sel->fast != NULL) job_registry_select_free(sel->fast);
+	if (sel->tree != NULL) classad_free_tree(sel->tree);
+	free(sel->expr);
+	free(sel);
+}
+
+static void
+status_select_release(struct status_select *sel)
+{
+	int unused;
+
+	pthread_mutex_lock(&status_select_lock);
+	unused = (--(sel->refs) == 0);
+	pthread_mutex_unlock(&status_select_lock);
+	if (unused) status_select_free(sel);
+}
+
+/* Look up 'expr' in the cache of compiled expressions, compiling it */
+/* if needed. The result has to be released with status_select_release. */
+static struct status_select *
+status_select_get(const char *expr)
+{
+	struct status_select *sel, *evicted = NULL;
+	int i;
+
+	pthread_mutex_lock(&status_select_lock);
+	for (i = 0; i < status_select_cache_used; i++)
+	{
+		sel = status_select_cache[i];
+		if (strcmp(sel->expr, expr) == 0)
+		{
+			memmove(status_select_cache + 1, status_select_cache, i * sizeof(sel));
+			status_select_cache[0] = sel;
+			sel->refs++;
+			pthread_mutex_unlock(&status_select_lock);
+			return sel;
+		}
+	}
+	pthread_mutex_unlock(&status_select_lock);
+
+	if ((sel = calloc(1, sizeof(struct status_select))) == NULL) return NULL;
+	if ((sel->expr = strdup(expr)) == NULL)
+	{
+		free(sel);
+		return NULL;
+	}
+	/* Invalid expressions select everything (tree == NULL) */
+	if ((sel->fast = job_registry_select_compile(expr)) == NULL)
+	{
+		if (errno == ENOMEM)
+		{
+			status_select_free(sel);
+			return NULL;
+		}
+		sel->tree = classad_parse_expr(expr);
+	}
+	sel->refs = 2; /* Caller and cache */
+
+	pthread_mutex_lock(&status_select_lock);
+	if (status_select_cache_used == STATUS_SELECT_CACHE_SIZE)
+	{
+		evicted = status_select_cache[--status_select_cache_used];
+		if (--(evicted->refs) > 0) evicted = NULL;
+	}
+	memmove(status_select_cache + 1, status_select_cache, status_select_cache_used * sizeof(sel));
+	status_select_cache[0] = sel;
+	status_select_cache_used++;
+	pthread_mutex_unlock(&status_select_lock);
+
+	if (evicted != NULL) status_select_free(evicted);
+	return sel;
+}
+
 void*
 cmd_status_job_all(void *args)
 {
 	char *resultLine=NULL;
-	char *str_cad=NULL;
-	char *en_cad, *new_str_cad;
-	int  str_cad_app, str_cad_len=0;
-	char *esc_str_cad, *esc_errstr;
+	char *en_cad=NULL;
+	size_t en_cad_size=0;
+	char *esc_errstr;
 	char **argv = (char **)args;
 	char *reqId = argv[1];
 	char *selectad = argv[2]; /* May be NULL */
-	classad_expr_tree selecttr = NULL;
-	int jobStatus, n_jobs=0;
-	FILE *fd;
-	job_registry_entry *en;
+	struct status_select *sel = NULL;
+	struct status_all_line line = {NULL, 0, 0, 0, 0};
+	int n_parts=0, n_batch, line_full=FALSE;
+	job_registry_recnum_t cursor = 0;
+	job_registry_recnum_t next_recnum = 0;
+	job_registry_recnum_t map_firstrec;
+	ino_t map_ino;
+	const job_registry_entry *en = NULL;
 	int select_ret, select_result;
 
 	if (blah_children_count>0) check_on_children(blah_children, blah_children_count);
 
+	if (status_all_line_start(&line, reqId) < 0) goto out_of_memory;
+	if (selectad != NULL && (sel = status_select_get(selectad)) == NULL) goto out_of_memory;
+
 	/* File locking will not protect threads in the same */
 	/* process. */
 	pthread_mutex_lock(&blah_jr_lock);
 
-	fd = job_registry_open(blah_jr_handle, "r");
-	if (fd == NULL)
+	if (job_registry_persist(blah_jr_handle) < 0)
 	{
-	  	/* Report error opening registry. */
+	  	/* Report error mapping registry. */
 		esc_errstr = escape_spaces(strerror(errno));
 		resultLine = make_message("%s 1 Cannot\\ open\\ BLAH\\ job\\ registry:\\ %s N/A", reqId, esc_errstr);
 		if (BLAH_DYN_ALLOCATED(esc_errstr)) free(esc_errstr);
+		pthread_mutex_unlock(&blah_jr_lock);
 		goto wrap_up;
 	}
-	if (job_registry_rdlock(blah_jr_handle, fd) < 0)
-	{
-	  	/* Report error locking registry. */
-		esc_errstr = escape_spaces(strerror(errno));
-		resultLine = make_message("%s 1 Cannot\\ lock\\ BLAH\\ job\\ registry:\\ %s N/A", reqId, esc_errstr);
-		if (BLAH_DYN_ALLOCATED(esc_errstr)) free(esc_errstr);
-		goto wrap_up;
-	}
-
-	if (selectad != NULL)
-	{
-		selecttr = classad_parse_expr(selectad);
-	}
 
-	while ((en = job_registry_get_next(blah_jr_handle, fd)) != NULL)
+	/* The registry lock is released every STATUS_ALL_BATCH_ENTRIES */
+	/* entries, and whenever a partial result line is ready to be sent. */
+	for (;;)
 	{
-		en_cad = job_registry_entry_as_classad(blah_jr_handle, en);
-		if (en_cad != NULL)
+		for (n_batch = 0; n_batch < STATUS_ALL_BATCH_ENTRIES && !line_full; n_batch++)
 		{
-			if (selecttr != NULL)
+			if ((en = job_registry_get_next_mapped(blah_jr_handle, &cursor)) == NULL) break;
+			next_recnum = en->recnum + 1;
+
+			/* Common selections are evaluated with no formatting */
+			if (sel != NULL && sel->fast != NULL &&
+			    !job_registry_select_match(sel->fast, en))
+				continue;
+
+			/* Entries are formatted into the same buffer */
+			if (job_registry_entry_format_classad(blah_jr_handle, en, &en_cad, &en_cad_size) < 0)
+				continue;
+			if (sel != NULL && sel->tree != NULL)
 			{
-				select_ret = classad_evaluate_boolean_expr(en_cad,selecttr,&select_result);
+				select_ret = classad_evaluate_boolean_expr(en_cad,sel->tree,&select_result);
 				if ((select_ret == C_CLASSAD_NO_ERROR && !select_result) ||
 				     select_ret != C_CLASSAD_NO_ERROR)
 				{
-					free(en_cad);
-					free(en);
 					continue;
 				}
 			}
-			str_cad_app = str_cad_len;
-			str_cad_len += (strlen(en_cad)+1);
-			new_str_cad = realloc(str_cad,str_cad_len);
-			if (new_str_cad == NULL)
+			if (status_all_line_add(&line, en_cad) < 0)
 			{
-				free(str_cad);
-				free(en_cad);
-				free(en);
-				resultLine = make_message("%s 1 Out\\ of\\ memory\\ servicing\\ status_all\\ request N/A", reqId);
-				goto wrap_up;
-			}
-			str_cad = new_str_cad;
-			if (str_cad_app > 0)
-			{
-				strcat(str_cad,";"); 
-			} else {
-				str_cad[0] = '\000';
+				pthread_mutex_unlock(&blah_jr_lock);
+				goto out_of_memory;
 			}
-			strcat(str_cad, en_cad);
-			n_jobs++;
-			free(en_cad);
+			if (status_all_max_result_size > 0 &&
+			    line.len - line.head >= status_all_max_result_size)
+				line_full = TRUE;
 		}
-		free(en);
-	}
-	if (str_cad != NULL)
-	{
-		esc_str_cad = escape_spaces(str_cad);
-		if (esc_str_cad != NULL)
-			resultLine = make_message("%s 0 No\\ error [%s]", reqId, esc_str_cad);
-		else resultLine = make_message("%s 1 Out\\ of\\ memory\\ servicing\\ status_all\\ request N/A", reqId);
-		free(str_cad);
-		if (BLAH_DYN_ALLOCATED(esc_str_cad)) free(esc_str_cad);
-	} else {
-		resultLine = make_message("%s 0 No\\ error []", reqId);
+		if (en == NULL && !line_full) break;
+
+		map_ino = blah_jr_handle->data_map_ino;
+		map_firstrec = blah_jr_handle->data_map_firstrec;
+		pthread_mutex_unlock(&blah_jr_lock);
+
+		if (line_full)
+		{
+			enqueue_result(status_all_line_close(&line, reqId, n_parts++));
+			status_all_line_start(&line, reqId);
+			line_full = FALSE;
+		}
+		else sched_yield();
+
+		pthread_mutex_lock(&blah_jr_lock);
+		if (blah_jr_handle->data_map_ino != map_ino ||
+		    blah_jr_handle->data_map_firstrec != map_firstrec)
+			cursor = status_all_resume_cursor(blah_jr_handle, next_recnum);
 	}
+	pthread_mutex_unlock(&blah_jr_lock);
+
+	enqueue_result(status_all_line_close(&line, reqId, -1));
+	goto wrap_up;
+
+out_of_memory:
+	resultLine = make_message("%s 1 Out\\ of\\ memory\\ servicing\\ status_all\\ request N/A", reqId);
 
 wrap_up:
-	if (selecttr != NULL) classad_free_tree(selecttr);
-	if (fd != NULL) fclose(fd);
-	pthread_mutex_unlock(&blah_jr_lock);
+	if (sel != NULL) status_select_release(sel);
+	if (en_cad != NULL) free(en_cad);
+	if (line.buf != NULL) free(line.buf);
 
 	/* Free up all arguments */
 	free_args(argv);
@@ -1983,7 +2297,9 @@ cmd_renew_proxy(void *args)
 	char *old_proxy = NULL;
 	int old_proxy_len;
 	
-	int i, jobStatus, retcod, count;
+	int i, jobStatus, retcod, count, new_argc;
+	char *new_args[CMD_RENEW_PROXY_ARGS + MEXEC_PARAM_COUNT + 2];
+	char **new_argv;
 	char *error_string = NULL;
 	char *proxyFileNameNew = NULL;
 	int use_glexec, use_mapping;
@@ -2054,17 +2370,16 @@ cmd_renew_proxy(void *args)
 				if (workernode != NULL && strcmp(workernode, ""))
 				{
 					/* Add the worker node argument to argv and invoke cmd_send_proxy_to_worker_node */
-					for(count = CMD_RENEW_PROXY_ARGS + 1; argv[count]; count++);
-					argv = (char **)realloc(argv, sizeof(char *) * (count + 2));
-					if (argv != NULL)
+					/* (the arguments are rebuilt, as argv is a single allocation) */
+					for(count = 0; argv[count] && count < CMD_RENEW_PROXY_ARGS + 1 + MEXEC_PARAM_COUNT; count++)
+						new_args[count < CMD_RENEW_PROXY_ARGS + 1 ? count : count + 1] = argv[count];
+					new_args[CMD_RENEW_PROXY_ARGS + 1] = workernode;
+					if (cmd_buffer_tokenize("", 0, new_args, count + 1, &new_argc, &new_argv) == CMDBUF_OK)
 					{
-						/* Make room for the workernode argument at i==CMD_RENEW_PROXY_ARGS+1. */
-						argv[count+1] = 0;
-						for(i = count; i > (CMD_RENEW_PROXY_ARGS+1); i--) argv[i] = argv[i-1];
-						/* workernode will be freed inside cmd_send_proxy_to_worker_node */
-						/* also the semaphore will be released there */
-						argv[CMD_RENEW_PROXY_ARGS+1] = workernode;
-						cmd_send_proxy_to_worker_node((void *)argv);
+						free(workernode);
+						free_args(argv);
+						/* the semaphore will be released in cmd_send_proxy_to_worker_node */
+						cmd_send_proxy_to_worker_node((void *)new_argv);
 						if (old_proxy != NULL) free(old_proxy);
 						return;
 					}
@@ -2481,7 +2796,8 @@ enqueue_result(char *res)
 	if (push_result(res))
 	{
 		pthread_mutex_lock(&send_lock);
-		write(server_socket, "R\r\n", 3);
+		out_buffer_queue("R\r\n", 3, FALSE);
+		out_buffer_flush();
 		pthread_mutex_unlock(&send_lock);
 	}
 }
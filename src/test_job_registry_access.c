@@ -9,6 +9,7 @@
  *  14-Nov-2007 Original release
  *  27-Feb-2008 Added test of job_registry_split_blah_id.
  *   8-Oct-2010 Added test for mmap index mode.
+ *  17-Oct-2026 Added test for persistent handle mode.
  *
  *  Description:
  *   Access test for job registries created by test_job_registry_create.
@@ -57,12 +58,18 @@ main(int argc, char *argv[])
   float elapsed_secs;
   int i;
   job_registry_index_mode test_mode = BY_BLAH_ID;
+  int test_persist = FALSE;
 
   if (argc > 1 && (strncmp(argv[1],"-m",2) == 0))
    {
     test_mode = BY_BLAH_ID_MMAP;
     if (argc > 2) test_registry_file = argv[2];
    }
+  else if (argc > 1 && (strncmp(argv[1],"-p",2) == 0))
+   {
+    test_persist = TRUE;
+    if (argc > 2) test_registry_file = argv[2];
+   }
   else if (argc > 1) test_registry_file = argv[1];
 
   srand(time(0));
@@ -78,6 +85,14 @@ main(int argc, char *argv[])
     return 1;
    }
 
+  if (test_persist && job_registry_persist(rha) < 0)
+   {
+    fprintf(stderr,"%s: error switching job registry to persistent mode: ",argv[0]);
+    perror("");
+    job_registry_destroy(rha);
+    return 1;
+   }
+
   if (rha->n_entries <= 0)
    {
     fprintf(stderr,"%s: job registry %s has %d entries. Little to do.\n",
@@ -0,0 +1,228 @@
+/*
+ *  File :     test_job_registry_classad.c
+ *
+ *
+ *  Revision history :
+ *  17-Oct-2026 Original release
+ *
+ *  Description:
+ *   Allocation count and speed comparison of the previous
+ *   job_registry_entry_as_classad implementation and of
+ *   job_registry_entry_format_classad with a reused buffer, on
+ *   registries created by test_job_registry_create.
+ *   The classads produced by the two are also compared.
+ *
+ *  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
+ *
+ *    See http://www.eu-egee.org/partners/ for details on the copyright
+ *    holders.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "job_registry.h"
+
+/* Allocations are counted by wrapping the glibc allocator. */
+
+static unsigned long n_allocs = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) { n_allocs++; return __libc_malloc(size); }
+void *calloc(size_t nmemb, size_t size) { n_allocs++; return __libc_calloc(nmemb, size); }
+void *realloc(void *ptr, size_t size) { n_allocs++; return __libc_realloc(ptr, size); }
+#endif
+
+/* Previous implementation of job_registry_entry_as_classad, kept for comparison. */
+
+#define LEGACY_APPEND_ATTRIBUTE(format,attribute) \
+    fmt_extra = (format); \
+    esiz = snprintf(NULL, 0, fmt_extra, (attribute)) + 1; \
+    new_extra_attrs = (char *)realloc(extra_attrs, extra_attrs_size + esiz); \
+    if (new_extra_attrs == NULL) \
+     { \
+      if (extra_attrs != NULL) free(extra_attrs); \
+      return NULL; \
+     } \
+    need_to_free_extra_attrs = TRUE; \
+    extra_attrs = new_extra_attrs; \
+    snprintf(extra_attrs+extra_attrs_size, esiz, fmt_extra, (attribute)); \
+    extra_attrs_size += (esiz-1);
+
+static char *
+legacy_entry_as_classad(const job_registry_handle *rha,
+                        const job_registry_entry *entry)
+{
+  char *fmt_base = "[ BatchJobId=\"%s\"; JobStatus=%d; BlahJobId=\"%s\"; "
+                   "CreateTime=%u; ModifiedTime=%u; UserTime=%u; "
+                   "SubmitterUid=%d; %s]";
+  char *result, *fmt_extra, *extra_attrs=NULL, *new_extra_attrs;
+  int extra_attrs_size = 0;
+  int need_to_free_extra_attrs = FALSE;
+  int esiz,fsiz;
+  char *proxypath;
+
+  if (entry->wn_addr[0] != '\0')
+   {
+    LEGACY_APPEND_ATTRIBUTE("WorkerNode=\"%s\"; ",entry->wn_addr);
+   }
+  if (entry->proxy_link[0] != '\0')
+   {
+    proxypath = job_registry_get_proxy(rha, entry);
+    if (proxypath != NULL)
+     {
+      LEGACY_APPEND_ATTRIBUTE("X509UserProxy=\"%s\"; ",proxypath);
+      free(proxypath);
+     }
+   }
+  if (entry->status == COMPLETED)
+   {
+    LEGACY_APPEND_ATTRIBUTE("ExitCode=%d; ",entry->exitcode);
+   }
+  if (entry->exitreason[0] != '\0')
+   {
+    LEGACY_APPEND_ATTRIBUTE("ExitReason=\"%s\"; ",entry->exitreason);
+   }
+  if (entry->user_prefix[0] != '\0')
+   {
+    LEGACY_APPEND_ATTRIBUTE("UserPrefix=\"%s\"; ",entry->user_prefix);
+   }
+
+  if (extra_attrs == NULL)
+   {
+    extra_attrs = "";
+    need_to_free_extra_attrs = FALSE;
+   }
+
+  fsiz = snprintf(NULL, 0, fmt_base,
+                  entry->batch_id, entry->status, entry->blah_id,
+                  entry->cdate, entry->mdate, entry->udate, entry->submitter,
+                  extra_attrs) + 1;
+
+  result = (char *)malloc(fsiz);
+  if (result)
+    snprintf(result, fsiz, fmt_base,
+             entry->batch_id, entry->status, entry->blah_id,
+             entry->cdate, entry->mdate, entry->udate, entry->submitter,
+             extra_attrs);
+
+  if (need_to_free_extra_attrs) free(extra_attrs);
+
+  return result;
+}
+
+static float
+elapsed_since(struct timeval *tm_start)
+{
+  struct timeval tm_end;
+
+  gettimeofday(&tm_end, NULL);
+  return (tm_end.tv_sec - tm_start->tv_sec) +
+         (float)(tm_end.tv_usec - tm_start->tv_usec)/1000000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *test_registry_file = JOB_REGISTRY_TEST_FILE;
+  job_registry_handle *rha;
+  job_registry_recnum_t cursor;
+  const job_registry_entry *en;
+  char *cad, *buf = NULL;
+  size_t buf_size = 0;
+  int n_entries = 0;
+  unsigned long legacy_allocs, new_allocs;
+  float legacy_secs, new_secs;
+  struct timeval tm_start;
+
+  if (argc > 1) test_registry_file = argv[1];
+
+  rha=job_registry_init(test_registry_file, BY_BATCH_ID);
+  if (rha == NULL)
+   {
+    fprintf(stderr,"%s: error initialising job registry: ",argv[0]);
+    perror("");
+    return 1;
+   }
+
+  /* Check that the classads match */
+  cursor = 0;
+  while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL)
+   {
+    cad = legacy_entry_as_classad(rha, en);
+    if (cad == NULL ||
+        job_registry_entry_format_classad(rha, en, &buf, &buf_size) < 0 ||
+        strcmp(cad, buf) != 0)
+     {
+      fprintf(stderr,"%s: classads of record %u differ:\n%s\n%s\n", argv[0],
+              en->recnum, (cad != NULL) ? cad : "(NULL)",
+              (buf != NULL) ? buf : "(NULL)");
+      job_registry_destroy(rha);
+      return 1;
+     }
+    free(cad);
+    n_entries++;
+   }
+
+  if (n_entries <= 0)
+   {
+    fprintf(stderr,"%s: job registry %s has no entries. Little to do.\n",
+            argv[0], test_registry_file);
+    job_registry_destroy(rha);
+    return 1;
+   }
+
+  cursor = 0;
+  n_allocs = 0;
+  gettimeofday(&tm_start, NULL);
+  while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL)
+   {
+    cad = legacy_entry_as_classad(rha, en);
+    free(cad);
+   }
+  legacy_secs = elapsed_since(&tm_start);
+  legacy_allocs = n_allocs;
+
+  cursor = 0;
+  n_allocs = 0;
+  gettimeofday(&tm_start, NULL);
+  while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL)
+   {
+    job_registry_entry_format_classad(rha, en, &buf, &buf_size);
+   }
+  new_secs = elapsed_since(&tm_start);
+  new_allocs = n_allocs;
+
+#ifdef __GLIBC__
+  printf("%s: %d entries. Previous formatter: %.2f allocations/entry, %g entries/s.\n",
+         argv[0], n_entries, (float)legacy_allocs/n_entries, n_entries/legacy_secs);
+  printf("%s: %d entries. Reused buffer: %.2f allocations/entry, %g entries/s.\n",
+         argv[0], n_entries, (float)new_allocs/n_entries, n_entries/new_secs);
+#else
+  printf("%s: %d entries. Previous formatter: %g entries/s. Reused buffer: %g entries/s.\n",
+         argv[0], n_entries, n_entries/legacy_secs, n_entries/new_secs);
+#endif
+
+  free(buf);
+  job_registry_destroy(rha);
+  return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ *  File :     test_job_registry_compact.c
+ *
+ *
+ *  Revision history :
+ *  17-Oct-2026 Original release
+ *
+ *  Description:
+ *   Memory and lookup latency comparison of the regular and compact
+ *   (front-coded) index modes, on registries created by
+ *   test_job_registry_create.
+ *
+ *  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
+ *
+ *    See http://www.eu-egee.org/partners/ for details on the copyright
+ *    holders.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "job_registry.h"
+
+#define N_LOOKUPS_PER_ENTRY 10
+
+static float
+time_lookups(job_registry_handle *rha, job_registry_index *keys,
+             int n_keys, int *picks, int n_picks,
+             job_registry_recnum_t *results)
+{
+  struct timeval tm_start, tm_end;
+  int i;
+
+  gettimeofday(&tm_start, NULL);
+  for (i=0; i<n_picks; i++)
+    results[i] = job_registry_get_recnum(rha, keys[picks[i]].id);
+  gettimeofday(&tm_end, NULL);
+
+  return (tm_end.tv_sec - tm_start.tv_sec) +
+         (float)(tm_end.tv_usec - tm_start.tv_usec)/1000000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *test_registry_file = JOB_REGISTRY_TEST_FILE;
+  job_registry_index_mode test_mode = BY_BLAH_ID;
+  job_registry_handle *rha;
+  job_registry_index *keys;
+  job_registry_recnum_t *plain_results, *compact_results;
+  int *picks;
+  int n_keys, n_picks, i;
+  size_t plain_mem, compact_mem;
+  float plain_secs, compact_secs;
+
+  if (argc > 1 && (strncmp(argv[1],"-m",2) == 0))
+   {
+    test_mode = BY_BLAH_ID_MMAP;
+    if (argc > 2) test_registry_file = argv[2];
+   }
+  else if (argc > 1) test_registry_file = argv[1];
+
+  srand(time(0));
+
+  rha=job_registry_init(test_registry_file, test_mode);
+
+  if (rha == NULL)
+   {
+    fprintf(stderr,"%s: error initialising job registry: ",argv[0]);
+    perror("");
+    return 1;
+   }
+
+  if (rha->n_entries <= 0)
+   {
+    fprintf(stderr,"%s: job registry %s has %d entries. Little to do.\n",
+            argv[0], test_registry_file, rha->n_entries);
+    job_registry_destroy(rha);
+    return 1;
+   }
+
+  n_keys = rha->n_entries;
+  n_picks = n_keys * N_LOOKUPS_PER_ENTRY;
+  keys = (job_registry_index *)malloc(n_keys*sizeof(job_registry_index));
+  picks = (int *)malloc(n_picks*sizeof(int));
+  plain_results = (job_registry_recnum_t *)malloc(n_picks*sizeof(job_registry_recnum_t));
+  compact_results = (job_registry_recnum_t *)malloc(n_picks*sizeof(job_registry_recnum_t));
+  if (keys == NULL || picks == NULL || plain_results == NULL ||
+      compact_results == NULL)
+   {
+    fprintf(stderr,"%s: Out of memory.\n", argv[0]);
+    job_registry_destroy(rha);
+    return 1;
+   }
+  memcpy(keys, rha->entries, n_keys*sizeof(job_registry_index));
+  for (i=0; i<n_picks; i++) picks[i] = rand()%n_keys;
+
+  plain_mem = job_registry_index_memory(rha);
+  plain_secs = time_lookups(rha, keys, n_keys, picks, n_picks, plain_results);
+
+  if (job_registry_compact(rha) < 0)
+   {
+    fprintf(stderr,"%s: error switching to compact index: ",argv[0]);
+    perror("");
+    job_registry_destroy(rha);
+    return 1;
+   }
+
+  compact_mem = job_registry_index_memory(rha);
+  compact_secs = time_lookups(rha, keys, n_keys, picks, n_picks, compact_results);
+
+  for (i=0; i<n_picks; i++)
+   {
+    if (plain_results[i] == 0 || compact_results[i] != plain_results[i])
+     {
+      fprintf(stderr,"%s: lookup of %s returns %u (compact) and %u (regular index).\n",
+              argv[0], keys[picks[i]].id, compact_results[i], plain_results[i]);
+      job_registry_destroy(rha);
+      return 1;
+     }
+   }
+
+  printf("%s: %d entries. Regular index: %lu bytes, %g lookups/s.\n",
+         argv[0], n_keys, (unsigned long)plain_mem, n_picks/plain_secs);
+  printf("%s: %d entries. Compact index: %lu bytes (%.1f%%), %g lookups/s.\n",
+         argv[0], n_keys, (unsigned long)compact_mem,
+         100.*compact_mem/plain_mem, n_picks/compact_secs);
+
+  free(keys);
+  free(picks);
+  free(plain_results);
+  free(compact_results);
+  job_registry_destroy(rha);
+  return 0;
+}
@@ -7,6 +7,9 @@
  *
  *  Revision history :
  *  15-Nov-2007 Original release
+ *  17-Oct-2026 Optional third argument selects job_registry_purge_online.
+ *  18-Oct-2026 Third argument 'fail-rename' checks that proxies survive
+ *              an online purge whose final rename fails.
  *
  *  Description:
  *   Collect contents statistics from a test job registry.
@@ -31,9 +34,119 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include "job_registry.h"
 
+static int fail_renames = FALSE;
+
+/* Replaces the libc rename for job_registry.c, to have it fail on demand */
+int
+rename(const char *oldpath, const char *newpath)
+{
+  if (fail_renames)
+   {
+    errno = EIO;
+    return -1;
+   }
+  return renameat(AT_FDCWD, oldpath, AT_FDCWD, newpath);
+}
+
+/*
+ * Run an online purge whose final rename fails, and check that the
+ * registry and the proxies of the records it would purge are untouched.
+ */
+
+static int
+test_failed_rename(const char *argv0, const char *registry_file,
+                   time_t old_date)
+{
+  job_registry_handle *rha;
+  job_registry_entry *en;
+  job_registry_purge_stats pst;
+  FILE *fd;
+  char **proxies = NULL;
+  int n_proxies = 0, n_before, n_after, i;
+  int ret, failed = FALSE;
+
+  rha = job_registry_init(registry_file, NO_INDEX);
+  if (rha == NULL)
+   {
+    fprintf(stderr,"%s: error initialising job registry %s: ",argv0,registry_file);
+    perror("");
+    return 1;
+   }
+  n_before = rha->lastrec - rha->firstrec + 1;
+
+  fd = job_registry_open(rha, "r");
+  if (fd == NULL || job_registry_rdlock(rha, fd) < 0)
+   {
+    fprintf(stderr,"%s: Error opening registry %s: ",argv0,registry_file);
+    perror("");
+    return 1;
+   }
+  while ((en = job_registry_get_next(rha, fd)) != NULL)
+   {
+    if (en->cdate < old_date && en->proxy_link[0] != '\000')
+     {
+      proxies = (char **)realloc(proxies, (n_proxies+1)*sizeof(char *));
+      if (proxies == NULL) return 1;
+      proxies[n_proxies] = (char *)malloc(strlen(rha->proxydir) +
+                                          strlen(en->proxy_link) + 2);
+      if (proxies[n_proxies] == NULL) return 1;
+      sprintf(proxies[n_proxies++], "%s/%s", rha->proxydir, en->proxy_link);
+     }
+    free(en);
+   }
+  fclose(fd);
+  job_registry_destroy(rha);
+
+  if (n_proxies == 0)
+   {
+    fprintf(stderr,"%s: no proxies to purge in %s.\n",argv0,registry_file);
+    return 1;
+   }
+
+  fail_renames = TRUE;
+  ret = job_registry_purge_online(registry_file, old_date, &pst);
+  fail_renames = FALSE;
+  if (ret != JOB_REGISTRY_RENAME_FAIL)
+   {
+    fprintf(stderr,"%s: job_registry_purge_online returns %d, expected %d.\n",
+            argv0, ret, JOB_REGISTRY_RENAME_FAIL);
+    failed = TRUE;
+   }
+
+  for (i=0; i<n_proxies; i++)
+   {
+    if (access(proxies[i], F_OK) < 0)
+     {
+      fprintf(stderr,"%s: proxy %s was removed.\n",argv0,proxies[i]);
+      failed = TRUE;
+     }
+    free(proxies[i]);
+   }
+  free(proxies);
+
+  rha = job_registry_init(registry_file, NO_INDEX);
+  if (rha == NULL) return 1;
+  n_after = rha->lastrec - rha->firstrec + 1;
+  job_registry_destroy(rha);
+  if (n_after != n_before)
+   {
+    fprintf(stderr,"%s: registry has %d entries, expected %d.\n",
+            argv0, n_after, n_before);
+    failed = TRUE;
+   }
+
+  if (failed) return 1;
+  printf("%s: failed rename left %d entries and %d proxies in place.\n",
+         argv0, n_after, n_proxies);
+  return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -44,12 +157,32 @@ main(int argc, char *argv[])
   time_t last_cdate;
   int count[10];
   FILE *fd;
+  job_registry_purge_stats pst;
   int ret;
   int i;
 
   if (argc > 1) test_registry_file = argv[1];
 
-  if (argc > 2) 
+  if (argc > 3 && strcmp(argv[3], "fail-rename") == 0)
+   {
+    return test_failed_rename(argv[0], test_registry_file, atol(argv[2]));
+   }
+  else if (argc > 3)
+   {
+    old_date = atol(argv[2]);
+    if ((ret=job_registry_purge_online(test_registry_file, old_date, &pst)) < 0)
+     {
+      fprintf(stderr,"%s: job_registry_purge_online returns %d: ",argv[0],ret);
+      perror("");
+      return 1;
+     }
+    printf("%s: %u records scanned, %u purged, %u refreshed, %u copied under lock in %d passes.\n",
+           argv[0], pst.n_scanned, pst.n_purged, pst.n_refreshed,
+           pst.n_locked, pst.n_passes);
+    printf("%s: purge took %g s, write lock held for %g s.\n",
+           argv[0], pst.copy_seconds, pst.pause_seconds);
+   }
+  else if (argc > 2) 
    {
     old_date = atol(argv[2]);
     if (job_registry_purge(test_registry_file, old_date, FALSE) < 0)
@@ -0,0 +1,359 @@
+/*
+ *  File :     test_job_registry_select.c
+ *
+ *
+ *  Revision history :
+ *  17-Oct-2026 Original release
+ *  17-Oct-2026 Check compiled selections against the classad library,
+ *              and the classad fallback for unsupported expressions.
+ *
+ *  Description:
+ *   Correctness check and benchmark of selection expressions compiled
+ *   by job_registry_select_compile, on registries created by
+ *   test_job_registry_create. Matches are compared with equivalent
+ *   C predicates and with the classad library evaluating the same
+ *   expression on the same records, as cmd_status_job_all does.
+ *   Expressions that cannot be compiled are evaluated by the classad
+ *   library alone (or select everything when they cannot be parsed).
+ *   Evaluation speed of both paths is reported.
+ *
+ *  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
+ *
+ *    See http://www.eu-egee.org/partners/ for details on the copyright
+ *    holders.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "job_registry.h"
+#include "classad_c_helper.h"
+
+#define N_TEST_SELECTS 8
+
+/* Outside the subset handled by job_registry_select_compile */
+static const char *unsupported_selects[] =
+ {
+  "JobStatus == \"2\"",
+  "MY.JobStatus == 2",
+  "ModifiedTime > CurrentTime - 60",
+  "WorkerNode == \"wn01\"",
+  "BatchJobId < \"a\"",
+  "JobStatus == 2.0",
+  "!JobStatus == 2",
+  "JobStatus == 2 == true",
+  "JobStatus == 010",
+  "BlahJobId == \"a\\\"b\"",
+  "(JobStatus == 2",
+  "JobStatus == 2 &&",
+  "member(JobStatus, {1, 2})",
+  NULL
+ };
+
+/* Unsupported, but valid for the classad library. Their selections */
+/* are checked by expected_fallback_match. */
+#define N_TEST_FALLBACKS 3
+static const char *fallback_selects[N_TEST_FALLBACKS] =
+ {
+  "JobStatus == 2.0",
+  "member(JobStatus, {1, 2})",
+  "WorkerNode == \"wn01\""
+ };
+
+/* Unsupported, and not even parsed by the classad library: */
+/* cmd_status_job_all selects everything. */
+static const char *invalid_selects[] =
+ {
+  "(JobStatus == 2",
+  "JobStatus == 2 &&",
+  NULL
+ };
+
+static char batch_id[JOBID_MAX_LEN];
+static char batch_id_upper[JOBID_MAX_LEN];
+static unsigned int mdate_from, mdate_to;
+static int submitter;
+
+static int
+expected_match(int test, const job_registry_entry *en)
+{
+  unsigned int mdate = (unsigned int)en->mdate;
+
+  switch (test)
+   {
+    case 0: return en->status == 2;
+    case 1: return en->status == 2 || en->status == 1;
+    case 2: return mdate >= mdate_from && mdate < mdate_to;
+    case 3: return en->status != 4 && (int)en->submitter == submitter;
+    case 4: return strcasecmp(en->batch_id, batch_id_upper) == 0;
+    case 5: return strcmp(en->batch_id, batch_id_upper) == 0;
+    case 6: return !(en->status == 3) && (5 > en->status);
+    case 7: return !(mdate_from <= mdate) || en->status >= 4;
+   }
+  return FALSE;
+}
+
+static int
+expected_fallback_match(int test, const job_registry_entry *en)
+{
+  switch (test)
+   {
+    case 0: return en->status == 2;
+    case 1: return en->status == 1 || en->status == 2;
+    case 2: return strcasecmp(en->wn_addr, "wn01") == 0;
+   }
+  return FALSE;
+}
+
+/* Selection by the classad library, as in cmd_status_job_all: */
+/* evaluation errors don't select the entry. */
+static int
+classad_match(job_registry_handle *rha, classad_expr_tree tree,
+              const job_registry_entry *en, char **buf, size_t *buf_size)
+{
+  int result;
+
+  if (job_registry_entry_format_classad(rha, en, buf, buf_size) < 0) return -1;
+  if (classad_evaluate_boolean_expr(*buf, tree, &result) != C_CLASSAD_NO_ERROR)
+    return FALSE;
+  return (result != 0);
+}
+
+static float
+elapsed_since(struct timeval *tm_start)
+{
+  struct timeval tm_end;
+
+  gettimeofday(&tm_end, NULL);
+  return (tm_end.tv_sec - tm_start->tv_sec) +
+         (float)(tm_end.tv_usec - tm_start->tv_usec)/1000000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *test_registry_file = JOB_REGISTRY_TEST_FILE;
+  char selects[N_TEST_SELECTS][2*JOBID_MAX_LEN];
+  job_registry_handle *rha;
+  job_registry_select *sel;
+  classad_expr_tree tree;
+  job_registry_recnum_t cursor;
+  const job_registry_entry *en;
+  char *buf = NULL;
+  size_t buf_size = 0;
+  int n_entries = 0, n_matches, t, i, ret;
+  float fast_secs, classad_secs, format_secs;
+  struct timeval tm_start;
+
+  if (argc > 1) test_registry_file = argv[1];
+
+  for (i = 0; unsupported_selects[i] != NULL; i++)
+   {
+    if ((sel = job_registry_select_compile(unsupported_selects[i])) != NULL ||
+        errno != EINVAL)
+     {
+      fprintf(stderr,"%s: '%s' should not be compiled.\n", argv[0],
+              unsupported_selects[i]);
+      job_registry_select_free(sel);
+      return 1;
+     }
+   }
+
+  for (i = 0; invalid_selects[i] != NULL; i++)
+   {
+    if ((tree = classad_parse_expr(invalid_selects[i])) != NULL)
+     {
+      fprintf(stderr,"%s: '%s' should not be parsed.\n", argv[0],
+              invalid_selects[i]);
+      classad_free_tree(tree);
+      return 1;
+     }
+   }
+
+  rha=job_registry_init(test_registry_file, BY_BATCH_ID);
+  if (rha == NULL)
+   {
+    fprintf(stderr,"%s: error initialising job registry: ",argv[0]);
+    perror("");
+    return 1;
+   }
+
+  /* Pick test values from the registry */
+  cursor = 0;
+  while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL)
+   {
+    if (n_entries == 0)
+     {
+      mdate_from = mdate_to = (unsigned int)en->mdate;
+      submitter = (int)en->submitter;
+     }
+    if ((unsigned int)en->mdate < mdate_from) mdate_from = (unsigned int)en->mdate;
+    if ((unsigned int)en->mdate > mdate_to) mdate_to = (unsigned int)en->mdate;
+    if (batch_id[0] == '\000' && strpbrk(en->batch_id, "\"\\") == NULL)
+     {
+      JOB_REGISTRY_ASSIGN_ENTRY(batch_id, en->batch_id);
+     }
+    n_entries++;
+   }
+
+  if (n_entries <= 0)
+   {
+    fprintf(stderr,"%s: job registry %s has no entries. Little to do.\n",
+            argv[0], test_registry_file);
+    job_registry_destroy(rha);
+    return 1;
+   }
+
+  mdate_from += (mdate_to - mdate_from)/4;
+  mdate_to -= (mdate_to - mdate_from)/4;
+  for (i = 0; batch_id[i] != '\000'; i++)
+    batch_id_upper[i] = toupper((unsigned char)batch_id[i]);
+
+  snprintf(selects[0], sizeof(selects[0]), "JobStatus == 2");
+  snprintf(selects[1], sizeof(selects[1]), "JobStatus==2||JobStatus==1");
+  snprintf(selects[2], sizeof(selects[2]),
+           "ModifiedTime >= %u && ModifiedTime < %u", mdate_from, mdate_to);
+  snprintf(selects[3], sizeof(selects[3]),
+           "(jobstatus != 4) && SubmitterUid =?= %d", submitter);
+  snprintf(selects[4], sizeof(selects[4]), "BatchJobId == \"%s\"", batch_id_upper);
+  snprintf(selects[5], sizeof(selects[5]), "BatchJobId is \"%s\"", batch_id_upper);
+  snprintf(selects[6], sizeof(selects[6]), "!(JobStatus == 3) && 5 > JobStatus && true");
+  snprintf(selects[7], sizeof(selects[7]),
+           "!(%u <= ModifiedTime) || (JobStatus >= 4)", mdate_from);
+
+  for (t = 0; t < N_TEST_SELECTS; t++)
+   {
+    if ((sel = job_registry_select_compile(selects[t])) == NULL)
+     {
+      fprintf(stderr,"%s: cannot compile '%s': ", argv[0], selects[t]);
+      perror("");
+      job_registry_destroy(rha);
+      return 1;
+     }
+
+    n_matches = 0;
+    cursor = 0;
+    gettimeofday(&tm_start, NULL);
+    while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL)
+     {
+      if (job_registry_select_match(sel, en) != expected_match(t, en))
+       {
+        fprintf(stderr,"%s: '%s' gives the wrong result on record %u.\n",
+                argv[0], selects[t], en->recnum);
+        job_registry_select_free(sel);
+        job_registry_destroy(rha);
+        return 1;
+       }
+      if (job_registry_select_match(sel, en)) n_matches++;
+     }
+    fast_secs = elapsed_since(&tm_start);
+
+    /* Same selection by the classad library */
+    if ((tree = classad_parse_expr(selects[t])) == NULL)
+     {
+      fprintf(stderr,"%s: classad library cannot parse '%s'.\n", argv[0],
+              selects[t]);
+      job_registry_select_free(sel);
+      job_registry_destroy(rha);
+      return 1;
+     }
+    cursor = 0;
+    gettimeofday(&tm_start, NULL);
+    while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL)
+     {
+      if ((ret = classad_match(rha, tree, en, &buf, &buf_size)) < 0 ||
+          ret != job_registry_select_match(sel, en))
+       {
+        fprintf(stderr,"%s: '%s' is not evaluated as by the classad library on record %u.\n",
+                argv[0], selects[t], en->recnum);
+        classad_free_tree(tree);
+        job_registry_select_free(sel);
+        job_registry_destroy(rha);
+        return 1;
+       }
+     }
+    classad_secs = elapsed_since(&tm_start);
+    classad_free_tree(tree);
+    job_registry_select_free(sel);
+
+    printf("%s: '%s' selects %d of %d entries, %g entries/s (classad library: %g entries/s).\n",
+           argv[0], selects[t], n_matches, n_entries, n_entries/fast_secs,
+           n_entries/classad_secs);
+   }
+
+  /* Unsupported expressions: classad library only */
+  for (t = 0; t < N_TEST_FALLBACKS; t++)
+   {
+    if ((sel = job_registry_select_compile(fallback_selects[t])) != NULL ||
+        errno != EINVAL)
+     {
+      fprintf(stderr,"%s: '%s' should not be compiled.\n", argv[0],
+              fallback_selects[t]);
+      job_registry_select_free(sel);
+      job_registry_destroy(rha);
+      return 1;
+     }
+    if ((tree = classad_parse_expr(fallback_selects[t])) == NULL)
+     {
+      fprintf(stderr,"%s: classad library cannot parse '%s'.\n", argv[0],
+              fallback_selects[t]);
+      job_registry_destroy(rha);
+      return 1;
+     }
+
+    n_matches = 0;
+    cursor = 0;
+    gettimeofday(&tm_start, NULL);
+    while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL)
+     {
+      if ((ret = classad_match(rha, tree, en, &buf, &buf_size)) < 0 ||
+          ret != expected_fallback_match(t, en))
+       {
+        fprintf(stderr,"%s: '%s' gives the wrong result on record %u.\n",
+                argv[0], fallback_selects[t], en->recnum);
+        classad_free_tree(tree);
+        job_registry_destroy(rha);
+        return 1;
+       }
+      if (ret) n_matches++;
+     }
+    classad_secs = elapsed_since(&tm_start);
+    classad_free_tree(tree);
+
+    printf("%s: '%s' (classad library) selects %d of %d entries, %g entries/s.\n",
+           argv[0], fallback_selects[t], n_matches, n_entries,
+           n_entries/classad_secs);
+   }
+
+  /* Cost of formatting each entry for the classad library, */
+  /* before any evaluation takes place. */
+  cursor = 0;
+  gettimeofday(&tm_start, NULL);
+  while ((en = job_registry_get_next_mapped(rha, &cursor)) != NULL)
+    job_registry_entry_format_classad(rha, en, &buf, &buf_size);
+  format_secs = elapsed_since(&tm_start);
+
+  printf("%s: classad formatting alone: %g entries/s.\n",
+         argv[0], n_entries/format_secs);
+
+  free(buf);
+  job_registry_destroy(rha);
+  return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ *  File :     test_job_registry_sort.c
+ *
+ *
+ *  Revision history :
+ *  17-Oct-2026 Original release
+ *
+ *  Description:
+ *   Correctness check and benchmark of the job registry index sort
+ *   (job_registry_sort_entries) against the previous non-recursive
+ *   quicksort implementation. Synthetic index arrays are used, so
+ *   no registry file is needed.
+ *
+ *  Copyright (c) Members of the EGEE Collaboration. 2007-2010.
+ *
+ *    See http://www.eu-egee.org/partners/ for details on the copyright
+ *    holders.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "job_registry.h"
+
+/* Previous implementation of job_registry_sort, kept for comparison. */
+
+typedef enum legacy_sort_state_e
+ {
+   UNSORTED,
+   LEFT_BOUND,
+   RIGHT_BOUND,
+   SORTED
+ } legacy_sort_state;
+
+static int
+legacy_quicksort(job_registry_index *entries, int n_entries)
+{
+  legacy_sort_state *sst;
+  job_registry_index swap;
+  int i,k,kp,left,right = 0,size,median;
+  char median_id[JOBID_MAX_LEN];
+  int n_sorted;
+
+  if (n_entries <= 1) return JOB_REGISTRY_SUCCESS;
+
+  sst = (legacy_sort_state *)malloc(n_entries *
+              sizeof(legacy_sort_state));
+  if (sst == NULL)
+   {
+    errno = ENOMEM;
+    return JOB_REGISTRY_MALLOC_FAIL;
+   }
+
+  sst[0] = LEFT_BOUND;
+  for (i=1;i<(n_entries - 1);i++) sst[i] = UNSORTED;
+  sst[n_entries - 1] = RIGHT_BOUND;
+
+  for (n_sorted = 0; n_sorted < n_entries; )
+   {
+    for (left=0; left<n_entries; left=right+1)
+     {
+      if (sst[left] == SORTED)
+       {
+        right = left;
+        continue;
+       }
+      else if (sst[left] == LEFT_BOUND)
+       {
+        for (right = left+1; right<n_entries; right++)
+         {
+          if (sst[right] == RIGHT_BOUND) break;
+          else sst[right] = UNSORTED;
+         }
+        size = (right - left + 1);
+        median = rand()%size + left;
+        JOB_REGISTRY_ASSIGN_ENTRY(median_id, entries[median].id);
+        for (i = left, k = right; ; i++,k--)
+         {
+          while (strcmp(entries[i].id,median_id) < 0) i++;
+          while (strcmp(entries[k].id,median_id) > 0) k--;
+          if (i>=k) break;
+
+          swap = entries[i];
+          entries[i] = entries[k];
+          entries[k] = swap;
+         }
+        if (k >= left)
+         {
+          if (sst[k] == LEFT_BOUND)  sst[k] = SORTED, n_sorted++;
+          else                       sst[k] = RIGHT_BOUND;
+         }
+        kp = k+1;
+        if ((kp) <= right)
+         {
+          if (sst[kp] == RIGHT_BOUND) sst[kp] = SORTED, n_sorted++;
+          else                        sst[kp] = LEFT_BOUND;
+         }
+       }
+     }
+   }
+  free(sst);
+  return JOB_REGISTRY_SUCCESS;
+}
+
+static void
+fill_test_index(job_registry_index *entries, int n_entries)
+{
+  int i, dup;
+
+  for (i=0; i<n_entries; i++)
+   {
+    /* Roughly one entry in 16 re-uses an earlier ID (resubmission). */
+    if (i > 0 && (rand()%16) == 0)
+     {
+      dup = rand()%i;
+      memcpy(entries[i].id, entries[dup].id, sizeof(entries[i].id));
+     }
+    else
+     {
+      snprintf(entries[i].id, sizeof(entries[i].id),
+               "pbs/%04d%02d%02d/cream_%09d", 2000+rand()%30,
+               1+rand()%12, 1+rand()%28, rand()%1000000000);
+     }
+    entries[i].recnum = i+1;
+   }
+}
+
+static float
+elapsed_since(struct timeval *tm_start)
+{
+  struct timeval tm_end;
+
+  gettimeofday(&tm_end, NULL);
+  return (tm_end.tv_sec - tm_start->tv_sec) +
+         (float)(tm_end.tv_usec - tm_start->tv_usec)/1000000;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int default_sizes[] = { 10000, 100000, 1000000 };
+  int n_sizes, n_entries, s, i, cmp;
+  job_registry_index *orig, *work;
+  job_registry_handle rh;
+  job_registry_recnum_t found, expected;
+  struct timeval tm_start;
+  float legacy_secs, new_secs;
+
+  n_sizes = (argc > 1) ? argc-1 : (int)(sizeof(default_sizes)/sizeof(int));
+
+  srand(time(0));
+
+  for (s=0; s<n_sizes; s++)
+   {
+    n_entries = (argc > 1) ? atoi(argv[s+1]) : default_sizes[s];
+    if (n_entries <= 0) continue;
+
+    orig = (job_registry_index *)malloc(n_entries*sizeof(job_registry_index));
+    work = (job_registry_index *)malloc(n_entries*sizeof(job_registry_index));
+    if (orig == NULL || work == NULL)
+     {
+      fprintf(stderr,"%s: Out of memory allocating %d index entries.\n",
+              argv[0], n_entries);
+      return 1;
+     }
+    fill_test_index(orig, n_entries);
+
+    memcpy(work, orig, n_entries*sizeof(job_registry_index));
+    gettimeofday(&tm_start, NULL);
+    legacy_quicksort(work, n_entries);
+    legacy_secs = elapsed_since(&tm_start);
+
+    memcpy(work, orig, n_entries*sizeof(job_registry_index));
+    gettimeofday(&tm_start, NULL);
+    if (job_registry_sort_entries(work, n_entries) < 0)
+     {
+      fprintf(stderr,"%s: job_registry_sort_entries failed: ", argv[0]);
+      perror("");
+      return 1;
+     }
+    new_secs = elapsed_since(&tm_start);
+
+    /* Check (ID, recnum) ordering */
+    for (i=1; i<n_entries; i++)
+     {
+      cmp = strcmp(work[i-1].id, work[i].id);
+      if (cmp > 0 || (cmp == 0 && work[i-1].recnum >= work[i].recnum))
+       {
+        fprintf(stderr,"%s: entry #%d (%s,%u) should not be before #%d (%s,%u).\n",
+                argv[0], i-1, work[i-1].id, work[i-1].recnum,
+                i, work[i].id, work[i].recnum);
+        return 1;
+       }
+     }
+
+    /* Lookups must find the most recent record of each ID */
+    memset(&rh, 0, sizeof(rh));
+    rh.entries = work;
+    rh.n_entries = n_entries;
+    for (i=0; i<n_entries; i++)
+     {
+      expected = work[i].recnum;
+      if (i+1 < n_entries && strcmp(work[i].id, work[i+1].id) == 0) continue;
+      found = job_registry_get_recnum(&rh, work[i].id);
+      if (found != expected)
+       {
+        fprintf(stderr,"%s: lookup of %s returned recnum %u instead of %u.\n",
+                argv[0], work[i].id, found, expected);
+        return 1;
+       }
+     }
+
+    printf("%s: %d entries: quicksort %g s, radix sort %g s (%.2fx).\n",
+           argv[0], n_entries, legacy_secs, new_secs,
+           (new_secs > 0) ? legacy_secs/new_secs : 0.);
+
+    free(orig);
+    free(work);
+   }
+  return 0;
+}